@@ -20,9 +20,11 @@
  * <http://www.gnu.org/licenses/>.
  */
 
-#include <ipset/ipset.h>
+#include <libcork/core.h>
 #include <ctype.h>
 
+#include "ip_lpm.h"
+#include "acl_snapshot.h"
 #include "rule.h"
 #include "ssrutils.h"
 #include "cache.h"
@@ -33,22 +35,25 @@
  * white list: you can connect directly
  * black list: you have to connect via proxy, or which has been blocked
  */
-static struct ip_set white_list_ipv4;
-static struct ip_set white_list_ipv6;
+static struct ip_lpm *white_list_ipv4;
+static struct ip_lpm *white_list_ipv6;
 
-static struct ip_set black_list_ipv4;
-static struct ip_set black_list_ipv6;
+static struct ip_lpm *black_list_ipv4;
+static struct ip_lpm *black_list_ipv6;
 
-static struct cork_dllist black_list_rules;
-static struct cork_dllist white_list_rules;
+static struct rule_set black_list_rules;
+static struct rule_set white_list_rules;
 
 static int acl_mode = BLACK_LIST;
 
 static struct cache *block_list;
 
-static struct ip_set outbound_block_list_ipv4;
-static struct ip_set outbound_block_list_ipv6;
-static struct cork_dllist outbound_block_list_rules;
+static struct ip_lpm *outbound_block_list_ipv4;
+static struct ip_lpm *outbound_block_list_ipv6;
+static struct rule_set outbound_block_list_rules;
+
+/* Holds the tables of an ACL loaded from a snapshot. */
+static struct acl_snapshot *mapped_snapshot;
 
 #ifdef __linux__
 
@@ -365,31 +370,81 @@ trimwhitespace(char *str)
     return str;
 }
 
+static void
+load_snapshot_rules(struct rule_set *rules, const struct acl_snapshot_list *list)
+{
+    const char *pattern = list->patterns;
+    const char *end     = list->patterns + list->patterns_size;
+
+    for (; pattern < end; pattern += strlen(pattern) + 1) {
+        rule_t *rule = new_rule();
+        accept_rule_arg(rule, pattern);
+        init_rule(rule);
+        add_rule(rules, rule);
+    }
+}
+
+/*
+ * The IP tables are used where they are mapped, only the domain rules
+ * are built again.
+ */
+static int
+init_acl_snapshot(const char *path)
+{
+    struct ip_lpm **lists_ipv4[] = { &black_list_ipv4, &white_list_ipv4, &outbound_block_list_ipv4 };
+    struct ip_lpm **lists_ipv6[] = { &black_list_ipv6, &white_list_ipv6, &outbound_block_list_ipv6 };
+    struct rule_set *lists_rules[] = { &black_list_rules, &white_list_rules, &outbound_block_list_rules };
+    struct acl_snapshot_contents contents;
+    int i;
+
+    mapped_snapshot = acl_snapshot_map(path, &contents);
+    if (mapped_snapshot == NULL) {
+        LOGE("Invalid acl snapshot, rebuild it from the acl file.");
+        return -1;
+    }
+
+    for (i = 0; i < acl_snapshot_list_count; i++) {
+        const struct acl_snapshot_list *list = &contents.lists[i];
+        *lists_ipv4[i] = ip_lpm_create_view(32, list->ipv4_slots, list->ipv4_count);
+        *lists_ipv6[i] = ip_lpm_create_view(128, list->ipv6_slots, list->ipv6_count);
+        if (*lists_ipv4[i] == NULL || *lists_ipv6[i] == NULL) {
+            LOGE("Invalid acl snapshot, rebuild it from the acl file.");
+            free_acl();
+            return -1;
+        }
+        load_snapshot_rules(lists_rules[i], list);
+    }
+    acl_mode = contents.acl_mode;
+
+    return 0;
+}
+
 int
 init_acl(const char *path)
 {
-    struct ip_set *list_ipv4;
-    struct ip_set *list_ipv6;
-    struct cork_dllist *rules;
+    struct ip_lpm *list_ipv4;
+    struct ip_lpm *list_ipv6;
+    struct rule_set *rules;
     FILE *f;
     char buf[257];
 
-    // initialize ipset
-    ipset_init_library();
+    rule_set_init(&black_list_rules);
+    rule_set_init(&white_list_rules);
+    rule_set_init(&outbound_block_list_rules);
 
-    ipset_init(&white_list_ipv4);
-    ipset_init(&white_list_ipv6);
-    ipset_init(&black_list_ipv4);
-    ipset_init(&black_list_ipv6);
-    ipset_init(&outbound_block_list_ipv4);
-    ipset_init(&outbound_block_list_ipv6);
+    if (acl_snapshot_probe(path)) {
+        return init_acl_snapshot(path);
+    }
 
-    cork_dllist_init(&black_list_rules);
-    cork_dllist_init(&white_list_rules);
-    cork_dllist_init(&outbound_block_list_rules);
+    white_list_ipv4 = ip_lpm_create(32);
+    white_list_ipv6 = ip_lpm_create(128);
+    black_list_ipv4 = ip_lpm_create(32);
+    black_list_ipv6 = ip_lpm_create(128);
+    outbound_block_list_ipv4 = ip_lpm_create(32);
+    outbound_block_list_ipv6 = ip_lpm_create(128);
 
-    list_ipv4  = &black_list_ipv4;
-    list_ipv6  = &black_list_ipv6;
+    list_ipv4  = black_list_ipv4;
+    list_ipv6  = black_list_ipv6;
     rules = &black_list_rules;
 
     f = fopen(path, "r");
@@ -424,20 +479,20 @@ init_acl(const char *path)
             }
 
             if (strcmp(line, "[outbound_block_list]") == 0) {
-                list_ipv4 = &outbound_block_list_ipv4;
-                list_ipv6 = &outbound_block_list_ipv6;
+                list_ipv4 = outbound_block_list_ipv4;
+                list_ipv6 = outbound_block_list_ipv6;
                 rules     = &outbound_block_list_rules;
                 continue;
             } else if (strcmp(line, "[white_list]") == 0
                        || strcmp(line, "[proxy_list]") == 0) {
-                list_ipv4 = &black_list_ipv4;
-                list_ipv6 = &black_list_ipv6;
+                list_ipv4 = black_list_ipv4;
+                list_ipv6 = black_list_ipv6;
                 rules     = &black_list_rules;
                 continue;
             } else if (strcmp(line, "[black_list]") == 0
                        || strcmp(line, "[bypass_list]") == 0) {
-                list_ipv4 = &white_list_ipv4;
-                list_ipv6 = &white_list_ipv6;
+                list_ipv4 = white_list_ipv4;
+                list_ipv6 = white_list_ipv6;
                 rules     = &white_list_rules;
                 continue;
             } else if (strcmp(line, "[reject_all]") == 0
@@ -457,17 +512,9 @@ init_acl(const char *path)
             err = cork_ip_init(&addr, host);
             if (!err) {
                 if (addr.version == 4) {
-                    if (cidr >= 0) {
-                        ipset_ipv4_add_network(list_ipv4, &(addr.ip.v4), cidr);
-                    } else {
-                        ipset_ipv4_add(list_ipv4, &(addr.ip.v4));
-                    }
+                    ip_lpm_assign(list_ipv4, addr.ip.v4._.u8, cidr >= 0 ? cidr : 32, true);
                 } else if (addr.version == 6) {
-                    if (cidr >= 0) {
-                        ipset_ipv6_add_network(list_ipv6, &(addr.ip.v6), cidr);
-                    } else {
-                        ipset_ipv6_add(list_ipv6, &(addr.ip.v6));
-                    }
+                    ip_lpm_assign(list_ipv6, addr.ip.v6._.u8, cidr >= 0 ? cidr : 128, true);
                 }
             } else {
                 rule_t *rule = new_rule();
@@ -483,25 +530,74 @@ init_acl(const char *path)
 }
 
 void
-free_rules(struct cork_dllist *rules)
+free_acl(void)
 {
-    struct cork_dllist_item *iter;
-    while ((iter = cork_dllist_head(rules)) != NULL) {
-        rule_t *rule = cork_container_of(iter, rule_t, entries);
-        remove_rule(rule);
+    ip_lpm_destroy(black_list_ipv4);
+    ip_lpm_destroy(black_list_ipv6);
+    ip_lpm_destroy(white_list_ipv4);
+    ip_lpm_destroy(white_list_ipv6);
+    ip_lpm_destroy(outbound_block_list_ipv4);
+    ip_lpm_destroy(outbound_block_list_ipv6);
+    black_list_ipv4 = black_list_ipv6 = NULL;
+    white_list_ipv4 = white_list_ipv6 = NULL;
+    outbound_block_list_ipv4 = outbound_block_list_ipv6 = NULL;
+
+    acl_snapshot_unmap(mapped_snapshot);
+    mapped_snapshot = NULL;
+
+    rule_set_free(&black_list_rules);
+    rule_set_free(&white_list_rules);
+    rule_set_free(&outbound_block_list_rules);
+}
+
+static size_t
+collect_patterns(struct rule_set *rules, char **patterns)
+{
+    struct cork_dllist_item *curr;
+    size_t size = 0;
+
+    *patterns = NULL;
+    for (curr = cork_dllist_start(&rules->rules);
+         !cork_dllist_is_end(&rules->rules, curr); curr = curr->next) {
+        rule_t *rule = cork_container_of(curr, rule_t, entries);
+        size_t len   = strlen(rule->pattern) + 1;
+        *patterns = realloc(*patterns, size + len);
+        memcpy(*patterns + size, rule->pattern, len);
+        size += len;
     }
+    return size;
 }
 
-void
-free_acl(void)
+int
+save_acl_snapshot(const char *path)
 {
-    ipset_done(&black_list_ipv4);
-    ipset_done(&black_list_ipv6);
-    ipset_done(&white_list_ipv4);
-    ipset_done(&white_list_ipv6);
+    struct ip_lpm *lists_ipv4[] = { black_list_ipv4, white_list_ipv4, outbound_block_list_ipv4 };
+    struct ip_lpm *lists_ipv6[] = { black_list_ipv6, white_list_ipv6, outbound_block_list_ipv6 };
+    struct rule_set *lists_rules[] = { &black_list_rules, &white_list_rules, &outbound_block_list_rules };
+    struct acl_snapshot_contents contents;
+    char *patterns[acl_snapshot_list_count];
+    int i, ret;
+
+    if (black_list_ipv4 == NULL) {
+        return -1;
+    }
+
+    memset(&contents, 0, sizeof(contents));
+    contents.acl_mode = acl_mode;
+    for (i = 0; i < acl_snapshot_list_count; i++) {
+        struct acl_snapshot_list *list = &contents.lists[i];
+        list->ipv4_slots    = ip_lpm_slots(lists_ipv4[i], &list->ipv4_count);
+        list->ipv6_slots    = ip_lpm_slots(lists_ipv6[i], &list->ipv6_count);
+        list->patterns_size = collect_patterns(lists_rules[i], &patterns[i]);
+        list->patterns      = patterns[i];
+    }
+
+    ret = acl_snapshot_write(path, &contents);
 
-    free_rules(&black_list_rules);
-    free_rules(&white_list_rules);
+    for (i = 0; i < acl_snapshot_list_count; i++) {
+        free(patterns[i]);
+    }
+    return ret;
 }
 
 int
@@ -532,14 +628,14 @@ acl_match_host(const char *host)
     }
 
     if (addr.version == 4) {
-        if (ipset_contains_ipv4(&black_list_ipv4, &(addr.ip.v4)))
+        if (ip_lpm_contains(black_list_ipv4, addr.ip.v4._.u8))
             ret = 1;
-        else if (ipset_contains_ipv4(&white_list_ipv4, &(addr.ip.v4)))
+        else if (ip_lpm_contains(white_list_ipv4, addr.ip.v4._.u8))
             ret = -1;
     } else if (addr.version == 6) {
-        if (ipset_contains_ipv6(&black_list_ipv6, &(addr.ip.v6)))
+        if (ip_lpm_contains(black_list_ipv6, addr.ip.v6._.u8))
             ret = 1;
-        else if (ipset_contains_ipv6(&white_list_ipv6, &(addr.ip.v6)))
+        else if (ip_lpm_contains(white_list_ipv6, addr.ip.v6._.u8))
             ret = -1;
     }
 
@@ -556,9 +652,9 @@ acl_add_ip(const char *ip)
     }
 
     if (addr.version == 4) {
-        ipset_ipv4_add(&black_list_ipv4, &(addr.ip.v4));
+        ip_lpm_assign(black_list_ipv4, addr.ip.v4._.u8, 32, true);
     } else if (addr.version == 6) {
-        ipset_ipv6_add(&black_list_ipv6, &(addr.ip.v6));
+        ip_lpm_assign(black_list_ipv6, addr.ip.v6._.u8, 128, true);
     }
 
     return 0;
@@ -574,9 +670,9 @@ acl_remove_ip(const char *ip)
     }
 
     if (addr.version == 4) {
-        ipset_ipv4_remove(&black_list_ipv4, &(addr.ip.v4));
+        ip_lpm_assign(black_list_ipv4, addr.ip.v4._.u8, 32, false);
     } else if (addr.version == 6) {
-        ipset_ipv6_remove(&black_list_ipv6, &(addr.ip.v6));
+        ip_lpm_assign(black_list_ipv6, addr.ip.v6._.u8, 128, false);
     }
 
     return 0;
@@ -601,10 +697,10 @@ outbound_block_match_host(const char *host)
     }
 
     if (addr.version == 4) {
-        if (ipset_contains_ipv4(&outbound_block_list_ipv4, &(addr.ip.v4)))
+        if (ip_lpm_contains(outbound_block_list_ipv4, addr.ip.v4._.u8))
             ret = 1;
     } else if (addr.version == 6) {
-        if (ipset_contains_ipv6(&outbound_block_list_ipv6, &(addr.ip.v6)))
+        if (ip_lpm_contains(outbound_block_list_ipv6, addr.ip.v6._.u8))
             ret = 1;
     }
 
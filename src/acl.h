@@ -32,8 +32,10 @@
 #define BAD        2
 #define MALFORMED  1
 
+/* |path| is an ACL file or a snapshot of one from ssr-acl-compile. */
 int init_acl(const char *path);
 void free_acl(void);
+int save_acl_snapshot(const char *path);
 void clear_block_list(void);
 
 int acl_match_host(const char *ip);
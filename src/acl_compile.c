@@ -0,0 +1,48 @@
+/*
+ * acl_compile.c - Compile an ACL file into a snapshot init_acl maps in place
+ *
+ *     ssr-acl-compile <acl file> <snapshot>
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <uv.h>
+
+#include "ssrutils.h"
+#include "acl.h"
+
+int
+main(int argc, char **argv)
+{
+    uint64_t start;
+
+    if (argc != 3 || strcmp(argv[1], argv[2]) == 0) {
+        fprintf(stderr, "usage: %s <acl file> <snapshot>\n", argv[0]);
+        return 1;
+    }
+
+    start = uv_hrtime();
+    if (init_acl(argv[1]) != 0) {
+        LOGE("can't load %s", argv[1]);
+        return 1;
+    }
+    LOGI("%s loaded in %.1f ms", argv[1], (double)(uv_hrtime() - start) / 1e6);
+
+    if (save_acl_snapshot(argv[2]) != 0) {
+        LOGE("can't write %s", argv[2]);
+        free_acl();
+        return 1;
+    }
+    free_acl();
+
+    // read it back the way the daemons will.
+    start = uv_hrtime();
+    if (init_acl(argv[2]) != 0) {
+        LOGE("%s doesn't load back", argv[2]);
+        return 1;
+    }
+    LOGI("%s loaded in %.1f ms", argv[2], (double)(uv_hrtime() - start) / 1e6);
+    free_acl();
+
+    return 0;
+}
@@ -0,0 +1,220 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32)
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "acl_snapshot.h"
+
+/* The \r\n catches a copy that went through a text-mode transfer. */
+#define ACL_SNAPSHOT_MAGIC      "SSRACL\r\n"
+#define ACL_SNAPSHOT_BYTE_ORDER 0x01020304
+#define ACL_SNAPSHOT_ALIGN      64
+/* IPv4 slots, IPv6 slots and patterns of each list. */
+#define ACL_SNAPSHOT_SECTIONS   (acl_snapshot_list_count * 3)
+
+struct acl_snapshot_header {
+    char magic[8];
+    uint32_t byte_order;
+    uint32_t version;
+    int32_t acl_mode;
+    uint32_t section_count;
+    struct {
+        uint64_t offset;
+        uint64_t size;
+    } sections[ACL_SNAPSHOT_SECTIONS];
+};
+
+struct acl_snapshot {
+    void *base;
+    size_t size;
+};
+
+bool acl_snapshot_probe(const char *path) {
+    char magic[sizeof(ACL_SNAPSHOT_MAGIC) - 1];
+    bool result = false;
+    FILE *f = fopen(path, "rb");
+    if (f) {
+        result = fread(magic, 1, sizeof(magic), f) == sizeof(magic)
+            && memcmp(magic, ACL_SNAPSHOT_MAGIC, sizeof(magic)) == 0;
+        fclose(f);
+    }
+    return result;
+}
+
+static bool map_file(const char *path, struct acl_snapshot *snapshot) {
+#if defined(_WIN32)
+    // no mmap, the file is read in whole instead.
+    bool result = false;
+    long size;
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        return false;
+    }
+    if (fseek(f, 0, SEEK_END) == 0 && (size = ftell(f)) > 0 && fseek(f, 0, SEEK_SET) == 0) {
+        snapshot->base = malloc((size_t)size);
+        snapshot->size = (size_t)size;
+        result = fread(snapshot->base, 1, snapshot->size, f) == snapshot->size;
+    }
+    fclose(f);
+    return result;
+#else
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        return false;
+    }
+    snapshot->size = (size_t)st.st_size;
+    snapshot->base = mmap(NULL, snapshot->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (snapshot->base == MAP_FAILED) {
+        snapshot->base = NULL;
+        return false;
+    }
+    return true;
+#endif
+}
+
+void acl_snapshot_unmap(struct acl_snapshot *snapshot) {
+    if (snapshot == NULL) {
+        return;
+    }
+    if (snapshot->base) {
+#if defined(_WIN32)
+        free(snapshot->base);
+#else
+        munmap(snapshot->base, snapshot->size);
+#endif
+    }
+    free(snapshot);
+}
+
+struct acl_snapshot * acl_snapshot_map(const char *path, struct acl_snapshot_contents *contents) {
+    struct acl_snapshot *snapshot = (struct acl_snapshot *) calloc(1, sizeof(*snapshot));
+    const struct acl_snapshot_header *header;
+    const uint8_t *base;
+    size_t i;
+
+    if (map_file(path, snapshot) == false || snapshot->size < sizeof(*header)) {
+        acl_snapshot_unmap(snapshot);
+        return NULL;
+    }
+    base = (const uint8_t *) snapshot->base;
+    header = (const struct acl_snapshot_header *) base;
+    if (memcmp(header->magic, ACL_SNAPSHOT_MAGIC, sizeof(header->magic)) != 0
+        || header->byte_order != ACL_SNAPSHOT_BYTE_ORDER
+        || header->version != ACL_SNAPSHOT_VERSION
+        || header->section_count != ACL_SNAPSHOT_SECTIONS) {
+        acl_snapshot_unmap(snapshot);
+        return NULL;
+    }
+    for (i = 0; i < ACL_SNAPSHOT_SECTIONS; ++i) {
+        uint64_t offset = header->sections[i].offset;
+        uint64_t size = header->sections[i].size;
+        if (offset % ACL_SNAPSHOT_ALIGN != 0 || offset > snapshot->size || size > snapshot->size - offset) {
+            acl_snapshot_unmap(snapshot);
+            return NULL;
+        }
+    }
+
+    memset(contents, 0, sizeof(*contents));
+    contents->acl_mode = header->acl_mode;
+    for (i = 0; i < acl_snapshot_list_count; ++i) {
+        struct acl_snapshot_list *list = contents->lists + i;
+        list->ipv4_slots = (const uint32_t *)(base + header->sections[i * 3].offset);
+        list->ipv4_count = (size_t)header->sections[i * 3].size / sizeof(uint32_t);
+        list->ipv6_slots = (const uint32_t *)(base + header->sections[i * 3 + 1].offset);
+        list->ipv6_count = (size_t)header->sections[i * 3 + 1].size / sizeof(uint32_t);
+        list->patterns = (const char *)(base + header->sections[i * 3 + 2].offset);
+        list->patterns_size = (size_t)header->sections[i * 3 + 2].size;
+        if (list->patterns_size && list->patterns[list->patterns_size - 1] != '\0') {
+            acl_snapshot_unmap(snapshot);
+            return NULL;
+        }
+    }
+    return snapshot;
+}
+
+static bool write_section(FILE *f, uint64_t *offset, const void *data, size_t size) {
+    static const uint8_t zeros[ACL_SNAPSHOT_ALIGN] = { 0 };
+    size_t pad = (size_t)((ACL_SNAPSHOT_ALIGN - *offset % ACL_SNAPSHOT_ALIGN) % ACL_SNAPSHOT_ALIGN);
+    if (fwrite(zeros, 1, pad, f) != pad || (size && fwrite(data, 1, size, f) != size)) {
+        return false;
+    }
+    *offset += pad + size;
+    return true;
+}
+
+int acl_snapshot_write(const char *path, const struct acl_snapshot_contents *contents) {
+    struct acl_snapshot_header header;
+    const void *data[ACL_SNAPSHOT_SECTIONS];
+    uint64_t offset;
+    size_t i;
+    bool written = true;
+    char *tmp_path;
+    FILE *f;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, ACL_SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.byte_order = ACL_SNAPSHOT_BYTE_ORDER;
+    header.version = ACL_SNAPSHOT_VERSION;
+    header.acl_mode = contents->acl_mode;
+    header.section_count = ACL_SNAPSHOT_SECTIONS;
+
+    offset = sizeof(header);
+    for (i = 0; i < acl_snapshot_list_count; ++i) {
+        const struct acl_snapshot_list *list = contents->lists + i;
+        data[i * 3] = list->ipv4_slots;
+        header.sections[i * 3].size = list->ipv4_count * sizeof(uint32_t);
+        data[i * 3 + 1] = list->ipv6_slots;
+        header.sections[i * 3 + 1].size = list->ipv6_count * sizeof(uint32_t);
+        data[i * 3 + 2] = list->patterns;
+        header.sections[i * 3 + 2].size = list->patterns_size;
+    }
+    for (i = 0; i < ACL_SNAPSHOT_SECTIONS; ++i) {
+        offset += (ACL_SNAPSHOT_ALIGN - offset % ACL_SNAPSHOT_ALIGN) % ACL_SNAPSHOT_ALIGN;
+        header.sections[i].offset = offset;
+        offset += header.sections[i].size;
+    }
+
+    tmp_path = (char *) malloc(strlen(path) + 5);
+    sprintf(tmp_path, "%s.tmp", path);
+    f = fopen(tmp_path, "wb");
+    if (f == NULL) {
+        free(tmp_path);
+        return -1;
+    }
+    offset = 0;
+    written = write_section(f, &offset, &header, sizeof(header));
+    for (i = 0; i < ACL_SNAPSHOT_SECTIONS && written; ++i) {
+        written = write_section(f, &offset, data[i], (size_t)header.sections[i].size);
+    }
+    written = written && fflush(f) == 0;
+#if !defined(_WIN32)
+    written = written && fsync(fileno(f)) == 0;
+#endif
+    written = (fclose(f) == 0) && written;
+#if defined(_WIN32)
+    if (written) {
+        remove(path);  /* rename doesn't replace here */
+    }
+#endif
+    if (written == false || rename(tmp_path, path) != 0) {
+        remove(tmp_path);
+        free(tmp_path);
+        return -1;
+    }
+    free(tmp_path);
+    return 0;
+}
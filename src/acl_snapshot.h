@@ -0,0 +1,52 @@
+#ifndef __ACL_SNAPSHOT_H__
+#define __ACL_SNAPSHOT_H__ 1
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/* An ACL file compiled ahead of time: the IP tables laid out as ip_lpm
+ * keeps them in memory, and the domain rules of each list as their
+ * patterns. The file is mapped read-only, so the tables are used in place
+ * and shared by every process that maps it. It is only read back on the
+ * machine kind that wrote it, nothing is swapped.
+ */
+#define ACL_SNAPSHOT_VERSION 2
+
+enum acl_snapshot_list_id {
+    acl_snapshot_black_list,
+    acl_snapshot_white_list,
+    acl_snapshot_outbound_block_list,
+    acl_snapshot_list_count,
+};
+
+struct acl_snapshot_list {
+    const uint32_t *ipv4_slots;
+    size_t ipv4_count;
+    const uint32_t *ipv6_slots;
+    size_t ipv6_count;
+    const char *patterns;  /* NUL-terminated, one after another */
+    size_t patterns_size;
+};
+
+struct acl_snapshot_contents {
+    int acl_mode;
+    struct acl_snapshot_list lists[acl_snapshot_list_count];
+};
+
+struct acl_snapshot;
+
+/* true if the file at |path| starts like a snapshot. */
+bool acl_snapshot_probe(const char *path);
+/* NULL if the file can't be mapped or isn't a snapshot of this version.
+ * |contents| points into the mapping until acl_snapshot_unmap.
+ */
+struct acl_snapshot * acl_snapshot_map(const char *path, struct acl_snapshot_contents *contents);
+void acl_snapshot_unmap(struct acl_snapshot *snapshot);
+
+/* Written next to |path| and renamed over it, so a process that has the
+ * old file mapped keeps reading the old one whole. 0 on success.
+ */
+int acl_snapshot_write(const char *path, const struct acl_snapshot_contents *contents);
+
+#endif // __ACL_SNAPSHOT_H__
@@ -0,0 +1,128 @@
+/* Lookups in the IP part of an ACL file, libipset against ip_lpm.
+ *
+ *     acl-bench acl/chn.acl [lookups]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <uv.h>
+#include <libcork/core.h>
+#include <ipset/ipset.h>
+
+#include "ip_lpm.h"
+
+#define BENCH_DEFAULT_LOOKUPS 4000000
+
+static size_t load_networks(const char *path, struct ip_set *set, struct ip_lpm *lpm,
+                            struct cork_ipv4 **networks)
+{
+    char line[257];
+    size_t count = 0, capacity = 0;
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        return 0;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        struct cork_ip addr;
+        unsigned int cidr = 32;
+        char *slash;
+        line[strcspn(line, " \t\r\n#")] = '\0';
+        if ((slash = strchr(line, '/')) != NULL) {
+            *slash = '\0';
+            cidr = (unsigned int) atoi(slash + 1);
+        }
+        if (line[0] == '\0' || cork_ip_init(&addr, line) != 0 || addr.version != 4) {
+            continue;
+        }
+        ipset_ipv4_add_network(set, &addr.ip.v4, cidr);
+        ip_lpm_assign(lpm, addr.ip.v4._.u8, cidr, true);
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 1024;
+            *networks = (struct cork_ipv4 *) realloc(*networks, capacity * sizeof(**networks));
+        }
+        (*networks)[count++] = addr.ip.v4;
+    }
+    fclose(f);
+    return count;
+}
+
+static void report(const char *name, uint64_t start, size_t lookups, size_t hits) {
+    double ns = (double)(uv_hrtime() - start) / (double)lookups;
+    printf("%-16s %8.1f ns/lookup  %zu hits\n", name, ns, hits);
+}
+
+int main(int argc, char **argv) {
+    struct ip_set set;
+    struct ip_lpm *lpm;
+    struct cork_ipv4 *networks = NULL;
+    size_t count, lookups, n, hits;
+    uint8_t *addrs;
+    bool *results;
+    uint64_t start;
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <acl file> [lookups]\n", argv[0]);
+        return 1;
+    }
+    lookups = (argc > 2) ? (size_t) strtoul(argv[2], NULL, 10) : BENCH_DEFAULT_LOOKUPS;
+
+    ipset_init_library();
+    ipset_init(&set);
+    lpm = ip_lpm_create(32);
+    count = load_networks(argv[1], &set, lpm, &networks);
+    if (count == 0) {
+        fprintf(stderr, "no IPv4 networks in %s\n", argv[1]);
+        return 1;
+    }
+    printf("%zu networks, ipset %zu bytes, ip_lpm %zu bytes\n",
+           count, ipset_memory_size(&set), ip_lpm_memory(lpm));
+
+    // half the addresses inside a listed network, half anywhere.
+    srand(1);
+    addrs = (uint8_t *) malloc(lookups * 4);
+    results = (bool *) malloc(lookups * sizeof(bool));
+    for (n = 0; n < lookups; ++n) {
+        uint8_t *addr = addrs + n * 4;
+        if (n & 1) {
+            memcpy(addr, networks[(size_t)rand() % count]._.u8, 4);
+            addr[3] = (uint8_t) rand();
+        } else {
+            uint32_t r = ((uint32_t)rand() << 16) ^ (uint32_t)rand();
+            memcpy(addr, &r, 4);
+        }
+    }
+
+    start = uv_hrtime();
+    for (n = 0, hits = 0; n < lookups; ++n) {
+        hits += ipset_contains_ipv4(&set, (struct cork_ipv4 *)(addrs + n * 4)) ? 1 : 0;
+    }
+    report("ipset", start, lookups, hits);
+
+    start = uv_hrtime();
+    for (n = 0, hits = 0; n < lookups; ++n) {
+        hits += ip_lpm_contains(lpm, addrs + n * 4) ? 1 : 0;
+    }
+    report("ip_lpm", start, lookups, hits);
+
+    start = uv_hrtime();
+    ip_lpm_contains_batch(lpm, addrs, lookups, results);
+    for (n = 0, hits = 0; n < lookups; ++n) {
+        hits += results[n] ? 1 : 0;
+    }
+    report("ip_lpm batch", start, lookups, hits);
+
+    for (n = 0; n < lookups; ++n) {
+        bool expected = ipset_contains_ipv4(&set, (struct cork_ipv4 *)(addrs + n * 4));
+        if (results[n] != expected || ip_lpm_contains(lpm, addrs + n * 4) != expected) {
+            fprintf(stderr, "mismatch at lookup %zu\n", n);
+            return 1;
+        }
+    }
+
+    free(results);
+    free(addrs);
+    free(networks);
+    ip_lpm_destroy(lpm);
+    ipset_done(&set);
+    return 0;
+}
@@ -0,0 +1,64 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "ssr_cipher_names.h"
+#include "bench_names.h"
+
+#define BENCH_NAME_GEN(code, name, text, ...) text,
+const char * const bench_all_methods[] = { SS_CIPHER_MAP(BENCH_NAME_GEN) NULL };
+const char * const bench_all_protocols[] = { SSR_PROTOCOL_MAP(BENCH_NAME_GEN) NULL };
+const char * const bench_all_obfs[] = { SSR_OBFS_MAP(BENCH_NAME_GEN) NULL };
+#undef BENCH_NAME_GEN
+
+static char ** names_append(char **names, size_t *count, const char *name) {
+    names = (char **) realloc(names, (*count + 2) * sizeof(char *));
+    names[(*count)++] = strdup(name);
+    names[*count] = NULL;
+    return names;
+}
+
+bool cipher_supported(const char *name) {
+    static const char *unsupported[] = { "cast5-cfb", "des-cfb", "idea-cfb", "rc2-cfb", "seed-cfb", NULL };
+    size_t n;
+    for (n = 0; unsupported[n]; ++n) {
+        if (strcmp(unsupported[n], name) == 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+char ** names_parse(const char *text, const char * const *all) {
+    char **names = NULL;
+    size_t count = 0;
+    if (strcmp(text, "all") == 0) {
+        for (; *all; ++all) {
+            if (cipher_supported(*all)) {
+                names = names_append(names, &count, *all);
+            }
+        }
+        return names;
+    }
+    while (*text) {
+        char name[BENCH_NAME_MAX];
+        size_t len = strcspn(text, ",");
+        if (len && len < sizeof(name)) {
+            memcpy(name, text, len);
+            name[len] = '\0';
+            names = names_append(names, &count, name);
+        }
+        text += len;
+        if (*text == ',') {
+            ++text;
+        }
+    }
+    return names;
+}
+
+void names_free(char **names) {
+    char **iter;
+    for (iter = names; iter && *iter; ++iter) {
+        free(*iter);
+    }
+    free(names);
+}
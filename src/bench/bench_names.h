@@ -0,0 +1,21 @@
+#ifndef __BENCH_NAMES_H__
+#define __BENCH_NAMES_H__ 1
+
+#include <stdbool.h>
+
+#define BENCH_NAME_MAX   32
+
+/* Every method, protocol and obfs name the tree knows, NULL terminated. */
+extern const char * const bench_all_methods[];
+extern const char * const bench_all_protocols[];
+extern const char * const bench_all_obfs[];
+
+/* False for the methods left out of the mbedTLS build, see encrypt.c. */
+bool cipher_supported(const char *name);
+
+/* A comma separated list, or "all" for every supported name in |all|.
+ * The result is NULL terminated, or NULL when the list is empty. */
+char ** names_parse(const char *text, const char * const *all);
+void names_free(char **names);
+
+#endif // __BENCH_NAMES_H__
@@ -0,0 +1,403 @@
+/* The protocol and obfs plugins of ssr_executive.c in memory, no sockets.
+ *
+ *     pipeline-bench [options]
+ *
+ * For each protocol and obfs combination it runs the handshake of client.c
+ * and server.c many times over, then pushes chunks through
+ * tunnel_cipher_client_encrypt into tunnel_cipher_server_decrypt (up) and
+ * through tunnel_cipher_server_encrypt into tunnel_cipher_client_decrypt
+ * (down). Per direction it reports MB/s, the bytes of overhead per byte of
+ * payload, and, where the linker can wrap them, the malloc, calloc and
+ * realloc calls per chunk.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <uv.h>
+
+#include "ssr_executive.h"
+#include "ssr_cipher_names.h"
+#include "bench_names.h"
+#include "ssrbuffer.h"
+#include "obfs.h"
+#include "obfsutil.h"
+
+#define BENCH_PASSWORD   "pipeline-bench"
+#define BENCH_TCP_MSS    1452  /* as ssr-client assumes */
+#define BENCH_CHUNK_MAX  (16 * 1024)
+
+#if defined(PIPELINE_BENCH_COUNT_MALLOC)
+/* Linked with -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc, so every call
+ * in the objects and static libraries of this program comes through here.
+ */
+static size_t malloc_calls;
+
+void * __real_malloc(size_t size);
+void * __real_calloc(size_t count, size_t size);
+void * __real_realloc(void *ptr, size_t size);
+
+void * __wrap_malloc(size_t size) {
+    ++malloc_calls;
+    return __real_malloc(size);
+}
+
+void * __wrap_calloc(size_t count, size_t size) {
+    ++malloc_calls;
+    return __real_calloc(count, size);
+}
+
+void * __wrap_realloc(void *ptr, size_t size) {
+    ++malloc_calls;
+    return __real_realloc(ptr, size);
+}
+
+#define BENCH_MALLOC_CALLS() malloc_calls
+#else
+#define BENCH_MALLOC_CALLS() ((size_t)0)
+#endif
+
+/* What a SOCKS5 client would ask for: example.com:80. */
+static const uint8_t bench_target[] = {
+    0x03, 11, 'e', 'x', 'a', 'm', 'p', 'l', 'e', '.', 'c', 'o', 'm', 0x00, 0x50,
+};
+
+struct bench_options {
+    char **methods;
+    char **protocols;
+    char **obfs;
+    size_t chunk_size;
+    size_t chunks;
+    size_t handshakes;
+};
+
+struct bench_direction {
+    uint64_t ns;
+    uint64_t wire;  /* bytes after the pipeline */
+    size_t mallocs;
+};
+
+struct bench_result {
+    const char *error;  /* NULL if every step went through */
+    uint64_t handshake_ns;  /* per handshake, tunnel_cipher_create to the first payload */
+    uint64_t handshake_wire;  /* bytes both ways, the target address included */
+    size_t handshake_mallocs;
+    struct bench_direction up;
+    struct bench_direction down;
+};
+
+struct bench_pipeline {
+    struct tunnel_cipher_ctx *client;
+    struct tunnel_cipher_ctx *server;
+};
+
+static void head_len_set(struct tunnel_cipher_ctx *tc, const struct buffer_t *init_pkg) {
+    struct obfs_t *protocol = tc->protocol;
+    struct obfs_t *obfs = tc->obfs;
+    struct server_info_t *info;
+    info = protocol ? protocol->get_server_info(protocol) : (obfs ? obfs->get_server_info(obfs) : NULL);
+    if (info) {
+        info->head_len = (int) get_s5_head_size(init_pkg->buffer, init_pkg->len, 30);
+    }
+}
+
+static void pipeline_release(struct bench_pipeline *p) {
+    tunnel_cipher_release(p->client);
+    tunnel_cipher_release(p->server);
+    p->client = p->server = NULL;
+}
+
+/* The exchange of do_ssr_auth_sent and do_ssr_receipt_for_feedback in
+ * client.c against do_init_package and do_client_feedback in server.c.
+ * NULL on success, else the step that failed.
+ */
+static const char * pipeline_handshake(struct bench_pipeline *p, struct server_env_t *client_env,
+                                       struct server_env_t *server_env, uint64_t *wire)
+{
+    struct buffer_t *pkg = buffer_create_from(bench_target, sizeof(bench_target));
+    struct buffer_t *result = NULL;
+    struct buffer_t *receipt = NULL;
+    struct buffer_t *confirm = NULL;
+    struct buffer_t *feedback = NULL;
+    const char *error = NULL;
+
+    p->client = tunnel_cipher_create(client_env, BENCH_TCP_MSS);
+    p->server = tunnel_cipher_create(server_env, BENCH_TCP_MSS);
+    head_len_set(p->client, pkg);
+    do {
+        if (tunnel_cipher_client_encrypt(p->client, pkg) != ssr_ok) {
+            error = "client encrypt of the init package";
+            break;
+        }
+        *wire += pkg->len;
+        result = tunnel_cipher_server_decrypt(p->server, pkg, &receipt, &confirm);
+        if (receipt) {
+            *wire += receipt->len;
+            if (tunnel_cipher_client_decrypt(p->client, receipt, &feedback) != ssr_ok || feedback == NULL) {
+                error = "client decrypt of the receipt";
+                break;
+            }
+            *wire += feedback->len;
+            buffer_release(result);
+            buffer_release(receipt); receipt = NULL;
+            result = tunnel_cipher_server_decrypt(p->server, feedback, &receipt, &confirm);
+            if (receipt) {
+                error = "a second receipt";
+                break;
+            }
+        }
+        if (result == NULL || result->len != sizeof(bench_target)
+            || memcmp(result->buffer, bench_target, sizeof(bench_target)) != 0)
+        {
+            error = "server decrypt of the init package";
+            break;
+        }
+        pre_parse_header(result);
+        head_len_set(p->server, result);
+        if (confirm) {
+            struct buffer_t *more = NULL;
+            *wire += confirm->len;
+            if (tunnel_cipher_client_decrypt(p->client, confirm, &more) != ssr_ok || confirm->len != 0) {
+                error = "client decrypt of the confirm";
+            }
+            buffer_release(more);
+        }
+    } while (0);
+
+    buffer_release(pkg);
+    buffer_release(result);
+    buffer_release(receipt);
+    buffer_release(confirm);
+    buffer_release(feedback);
+    return error;
+}
+
+static const char * pipeline_up(struct bench_pipeline *p, const uint8_t *payload, size_t size,
+                                size_t chunks, struct bench_direction *d)
+{
+    size_t mallocs = BENCH_MALLOC_CALLS();
+    uint64_t start = uv_hrtime();
+    size_t n;
+    for (n = 0; n < chunks; ++n) {
+        // a fresh buffer for each read, as tunnel_extract_data does.
+        struct buffer_t *buf = buffer_create_from(payload, size);
+        struct buffer_t *result;
+        if (tunnel_cipher_client_encrypt(p->client, buf) != ssr_ok) {
+            buffer_release(buf);
+            return "client encrypt";
+        }
+        d->wire += buf->len;
+        result = tunnel_cipher_server_decrypt(p->server, buf, NULL, NULL);
+        buffer_release(buf);
+        if (result == NULL || result->len != size || memcmp(result->buffer, payload, size) != 0) {
+            buffer_release(result);
+            return "server decrypt";
+        }
+        buffer_release(result);
+    }
+    d->ns = uv_hrtime() - start;
+    d->mallocs = BENCH_MALLOC_CALLS() - mallocs;
+    return NULL;
+}
+
+static const char * pipeline_down(struct bench_pipeline *p, const uint8_t *payload, size_t size,
+                                  size_t chunks, struct bench_direction *d)
+{
+    size_t mallocs = BENCH_MALLOC_CALLS();
+    uint64_t start = uv_hrtime();
+    size_t n;
+    for (n = 0; n < chunks; ++n) {
+        BUFFER_CONSTANT_INSTANCE(plain, payload, size);
+        struct buffer_t *feedback = NULL;
+        struct buffer_t *buf = tunnel_cipher_server_encrypt(p->server, plain);
+        bool ok;
+        if (buf == NULL) {
+            return "server encrypt";
+        }
+        d->wire += buf->len;
+        ok = tunnel_cipher_client_decrypt(p->client, buf, &feedback) == ssr_ok
+            && buf->len == size && memcmp(buf->buffer, payload, size) == 0;
+        buffer_release(feedback);
+        buffer_release(buf);
+        if (ok == false) {
+            return "client decrypt";
+        }
+    }
+    d->ns = uv_hrtime() - start;
+    d->mallocs = BENCH_MALLOC_CALLS() - mallocs;
+    return NULL;
+}
+
+static void bench_run(const struct bench_options *options, const char *method, const char *protocol,
+                      const char *obfs, const uint8_t *payload, struct bench_result *r)
+{
+    struct server_config *client_config = config_create();
+    struct server_config *server_config;
+    struct server_env_t *client_env;
+    struct server_env_t *server_env;
+    struct bench_pipeline p = { NULL, NULL };
+    size_t mallocs;
+    uint64_t start;
+    size_t n;
+
+    memset(r, 0, sizeof(*r));
+    string_safe_assign(&client_config->remote_host, "127.0.0.1");
+    client_config->remote_port = 8388;
+    string_safe_assign(&client_config->password, BENCH_PASSWORD);
+    string_safe_assign(&client_config->method, method);
+    string_safe_assign(&client_config->protocol, protocol);
+    string_safe_assign(&client_config->obfs, obfs);
+    server_config = config_clone(client_config);
+    config_change_for_server(server_config);
+
+    client_env = ssr_cipher_env_create(client_config, NULL);
+    server_env = ssr_cipher_env_create(server_config, NULL);
+
+    mallocs = BENCH_MALLOC_CALLS();
+    start = uv_hrtime();
+    for (n = 0; n < options->handshakes && r->error == NULL; ++n) {
+        r->error = pipeline_handshake(&p, client_env, server_env, &r->handshake_wire);
+        pipeline_release(&p);
+    }
+    r->handshake_ns = (uv_hrtime() - start) / options->handshakes;
+    r->handshake_mallocs = (BENCH_MALLOC_CALLS() - mallocs) / options->handshakes;
+    r->handshake_wire /= options->handshakes;
+
+    if (r->error == NULL) {
+        uint64_t wire = 0;
+        r->error = pipeline_handshake(&p, client_env, server_env, &wire);
+    }
+    if (r->error == NULL) {
+        r->error = pipeline_up(&p, payload, options->chunk_size, options->chunks, &r->up);
+    }
+    if (r->error == NULL) {
+        r->error = pipeline_down(&p, payload, options->chunk_size, options->chunks, &r->down);
+    }
+    pipeline_release(&p);
+
+    ssr_cipher_env_release(client_env);
+    ssr_cipher_env_release(server_env);
+    config_release(client_config);
+    config_release(server_config);
+}
+
+static void report(const struct bench_options *options, const char *method, const char *protocol,
+                   const char *obfs, const struct bench_result *r)
+{
+    double payload = (double)options->chunk_size * (double)options->chunks;
+    printf("%-14s %-16s %-20s ", method, protocol, obfs);
+    if (r->error) {
+        printf("failed: %s\n", r->error);
+        return;
+    }
+    printf("%8.1f %6llu %8.1f %8.1f %7.4f %7.4f",
+        (double)r->handshake_ns / 1000.0, (unsigned long long)r->handshake_wire,
+        payload * 1000.0 / (double)(r->up.ns ? r->up.ns : 1),
+        payload * 1000.0 / (double)(r->down.ns ? r->down.ns : 1),
+        ((double)r->up.wire - payload) / payload,
+        ((double)r->down.wire - payload) / payload);
+#if defined(PIPELINE_BENCH_COUNT_MALLOC)
+    printf(" %6zu %6.2f %6.2f", r->handshake_mallocs,
+        (double)r->up.mallocs / (double)options->chunks,
+        (double)r->down.mallocs / (double)options->chunks);
+#endif
+    printf("\n");
+}
+
+static void usage(const char *program) {
+    printf("Usage: %s [options]\n\n"
+        "  -m <methods>    comma separated or all, default " DEFAULT_METHOD "\n"
+        "  -p <protocols>  comma separated or all, default all\n"
+        "  -O <obfs>       comma separated or all, default plain,http_simple,http_post,tls1.2_ticket_auth\n"
+        "  -s <bytes>      chunk size, at most %d, default 1400\n"
+        "  -n <count>      chunks each way, default 20000\n"
+        "  -H <count>      handshakes, default 1000\n",
+        program, BENCH_CHUNK_MAX);
+}
+
+static bool options_parse(int argc, char **argv, struct bench_options *options) {
+    const char *methods = DEFAULT_METHOD;
+    const char *protocols = "all";
+    const char *obfs = "plain,http_simple,http_post,tls1.2_ticket_auth";
+    int n;
+
+    memset(options, 0, sizeof(*options));
+    options->chunk_size = 1400;
+    options->chunks = 20000;
+    options->handshakes = 1000;
+
+    for (n = 1; n < argc; ++n) {
+        const char *arg = argv[n];
+        const char *value = (n + 1 < argc) ? argv[n + 1] : NULL;
+        if (arg[0] != '-' || arg[1] == '\0' || arg[2] != '\0' || value == NULL) {
+            return false;
+        }
+        ++n;
+        switch (arg[1]) {
+        case 'm': methods = value; break;
+        case 'p': protocols = value; break;
+        case 'O': obfs = value; break;
+        case 's': options->chunk_size = (size_t) atoi(value); break;
+        case 'n': options->chunks = (size_t) atoi(value); break;
+        case 'H': options->handshakes = (size_t) atoi(value); break;
+        default: return false;
+        }
+    }
+    if (options->chunk_size == 0 || options->chunk_size > BENCH_CHUNK_MAX
+        || options->chunks == 0 || options->handshakes == 0)
+    {
+        return false;
+    }
+    options->methods = names_parse(methods, bench_all_methods);
+    options->protocols = names_parse(protocols, bench_all_protocols);
+    options->obfs = names_parse(obfs, bench_all_obfs);
+    return options->methods && options->protocols && options->obfs;
+}
+
+int main(int argc, char **argv) {
+    struct bench_options options;
+    uint8_t *payload;
+    char **method, **protocol, **obfs;
+    size_t n;
+
+    if (options_parse(argc, argv, &options) == false) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    payload = (uint8_t *) malloc(options.chunk_size);
+    srand(1);
+    for (n = 0; n < options.chunk_size; ++n) {
+        payload[n] = (uint8_t) rand();
+    }
+
+    printf("%zu chunks of %zu bytes each way, %zu handshakes\n\n",
+        options.chunks, options.chunk_size, options.handshakes);
+    printf("%-14s %-16s %-20s %8s %6s %8s %8s %7s %7s", "method", "protocol", "obfs",
+        "hs us", "hs B", "up MB/s", "dn MB/s", "up ovh", "dn ovh");
+#if defined(PIPELINE_BENCH_COUNT_MALLOC)
+    printf(" %6s %6s %6s", "hs mal", "up mal", "dn mal");
+#endif
+    printf("\n");
+
+    for (method = options.methods; *method; ++method) {
+        for (protocol = options.protocols; *protocol; ++protocol) {
+            for (obfs = options.obfs; *obfs; ++obfs) {
+                struct bench_result r;
+                bench_run(&options, *method, *protocol, *obfs, payload, &r);
+                report(&options, *method, *protocol, *obfs, &r);
+                fflush(stdout);
+            }
+        }
+    }
+
+#if !defined(PIPELINE_BENCH_COUNT_MALLOC)
+    printf("\nmalloc calls aren't counted, the linker can't wrap them here.\n");
+#endif
+
+    free(payload);
+    names_free(options.methods);
+    names_free(options.protocols);
+    names_free(options.obfs);
+    return 0;
+}
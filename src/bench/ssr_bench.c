@@ -0,0 +1,1071 @@
+/* ssr-client and ssr-server on loopback, measured end to end.
+ *
+ *     ssr-bench [options]
+ *
+ * Starts both as child processes for each method, protocol and obfs
+ * combination and drives them through SOCKS5 from this process, which also
+ * plays the target: an echo, a sink and a source server on 127.0.0.1. Per
+ * combination it measures upload and download throughput, connections per
+ * second, round-trip latency and the resident memory an idle tunnel costs
+ * each of them, and prints all of it as JSON.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <uv.h>
+#if !defined(_WIN32)
+#include <sys/resource.h>
+#endif
+
+#include "bench_names.h"
+
+#define BENCH_BLOCK          (64 * 1024)
+#define BENCH_READY_TIMEOUT  5000  /* ms for the children to start answering */
+#define BENCH_STOP_TIMEOUT   2000  /* ms from SIGTERM to SIGKILL */
+#define BENCH_PASSWORD       "ssr-bench"
+
+#if defined(_WIN32)
+#define BENCH_EXE ".exe"
+#else
+#define BENCH_EXE ""
+#endif
+
+struct bench_options {
+    const char *bin_dir;
+    const char *output;
+    const char *label;
+    const char *tls_cert;
+    const char *tls_key;
+    char **methods;
+    char **protocols;
+    char **obfs;
+    unsigned int seconds;
+    unsigned int connections;
+    unsigned int idle_tunnels;
+    size_t message_size;
+    unsigned short port_base;
+    bool verbose;
+};
+
+struct bench_result {
+    char method[BENCH_NAME_MAX];
+    char protocol[BENCH_NAME_MAX];
+    char obfs[BENCH_NAME_MAX];
+    bool tls;
+    const char *error;  /* NULL if it ran */
+    double upload_mbps;
+    double download_mbps;
+    double connections_per_second;
+    uint64_t round_trips;
+    uint64_t latency_us[3];  /* p50, p99, p999 */
+    uint64_t failures;  /* connections that broke off */
+    uint64_t idle_tunnels;  /* held open while the memory was sampled */
+    double rss_per_tunnel[2];  /* bytes, ssr-server and ssr-client, < 0 if not known */
+};
+
+/* The target servers, for the life of the process. */
+
+enum target_kind {
+    target_echo,
+    target_sink,
+    target_source,
+};
+
+struct target {
+    uv_tcp_t tcp;
+    enum target_kind kind;
+    unsigned short port;
+};
+
+struct target_conn {
+    uv_tcp_t tcp;
+    enum target_kind kind;
+    bool closing;
+};
+
+static struct target targets[3];
+static uint64_t sink_bytes;
+static char block[BENCH_BLOCK];
+
+static void target_conn_close_done_cb(uv_handle_t *handle) {
+    free(handle->data);
+}
+
+static void target_conn_close(struct target_conn *conn) {
+    if (conn->closing == false) {
+        conn->closing = true;
+        uv_close((uv_handle_t *)&conn->tcp, target_conn_close_done_cb);
+    }
+}
+
+static void target_alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+    static char scratch[BENCH_BLOCK];
+    struct target_conn *conn = (struct target_conn *)handle->data;
+    if (conn->kind == target_echo) {
+        buf->base = (char *) malloc(suggested_size);
+        buf->len = buf->base ? suggested_size : 0;
+    } else {
+        *buf = uv_buf_init(scratch, sizeof(scratch));
+    }
+}
+
+static void echo_write_done_cb(uv_write_t *req, int status) {
+    free(req);
+    (void)status;
+}
+
+static void target_read_cb(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
+    struct target_conn *conn = (struct target_conn *)stream->data;
+    bool owned = (conn->kind == target_echo);
+    if (nread < 0) {
+        target_conn_close(conn);
+    } else if (nread > 0 && conn->kind == target_echo) {
+        // the request and its data in one allocation.
+        uv_write_t *req = (uv_write_t *) realloc(buf->base, sizeof(uv_write_t) + (size_t)nread);
+        uv_buf_t data;
+        memmove((char *)(req + 1), req, (size_t)nread);
+        data = uv_buf_init((char *)(req + 1), (unsigned int)nread);
+        owned = false;
+        if (uv_write(req, stream, &data, 1, echo_write_done_cb) != 0) {
+            free(req);
+            target_conn_close(conn);
+        }
+    } else if (nread > 0) {
+        sink_bytes += (uint64_t)nread;
+    }
+    if (owned) {
+        free(buf->base);
+    }
+}
+
+static void source_write_done_cb(uv_write_t *req, int status);
+
+static void source_write(struct target_conn *conn) {
+    uv_write_t *req = (uv_write_t *) malloc(sizeof(*req));
+    uv_buf_t data = uv_buf_init(block, sizeof(block));
+    req->data = conn;
+    if (uv_write(req, (uv_stream_t *)&conn->tcp, &data, 1, source_write_done_cb) != 0) {
+        free(req);
+        target_conn_close(conn);
+    }
+}
+
+static void source_write_done_cb(uv_write_t *req, int status) {
+    struct target_conn *conn = (struct target_conn *)req->data;
+    free(req);
+    if (status == 0 && conn->closing == false) {
+        source_write(conn);
+    }
+}
+
+static void target_listen_cb(uv_stream_t *server, int status) {
+    struct target *target = (struct target *)server->data;
+    struct target_conn *conn;
+    if (status != 0) {
+        return;
+    }
+    conn = (struct target_conn *) calloc(1, sizeof(*conn));
+    conn->kind = target->kind;
+    uv_tcp_init(server->loop, &conn->tcp);
+    conn->tcp.data = conn;
+    if (uv_accept(server, (uv_stream_t *)&conn->tcp) != 0) {
+        target_conn_close(conn);
+        return;
+    }
+    uv_tcp_nodelay(&conn->tcp, 1);
+    uv_read_start((uv_stream_t *)&conn->tcp, target_alloc_cb, target_read_cb);
+    if (conn->kind == target_source) {
+        source_write(conn);
+    }
+}
+
+static bool targets_start(uv_loop_t *loop) {
+    size_t n;
+    for (n = 0; n < sizeof(targets) / sizeof(targets[0]); ++n) {
+        struct target *target = targets + n;
+        struct sockaddr_in addr;
+        struct sockaddr_in bound;
+        int len = sizeof(bound);
+        target->kind = (enum target_kind) n;
+        uv_tcp_init(loop, &target->tcp);
+        target->tcp.data = target;
+        uv_ip4_addr("127.0.0.1", 0, &addr);
+        if (uv_tcp_bind(&target->tcp, (const struct sockaddr *)&addr, 0) != 0
+            || uv_listen((uv_stream_t *)&target->tcp, 512, target_listen_cb) != 0
+            || uv_tcp_getsockname(&target->tcp, (struct sockaddr *)&bound, &len) != 0) {
+            return false;
+        }
+        target->port = ntohs(bound.sin_port);
+    }
+    return true;
+}
+
+/* The load generator: SOCKS5 clients of ssr-client. */
+
+enum load_mode {
+    load_probe,     /* one round trip, to see the pair is up */
+    load_upload,    /* blocks to the sink */
+    load_download,  /* blocks from the source */
+    load_connect,   /* a new connection for each one byte round trip */
+    load_round_trip,  /* message_size round trips on one connection */
+    load_idle,      /* one round trip on each connection, then hold them all */
+};
+
+enum worker_state {
+    worker_connecting,
+    worker_greeting,  /* sent the methods, wait for the choice */
+    worker_request,   /* sent CONNECT, wait for the reply */
+    worker_running,
+};
+
+struct load;
+
+struct worker {
+    uv_tcp_t tcp;
+    uv_connect_t connect_req;
+    uv_write_t write_req;
+    struct load *load;
+    enum worker_state state;
+    uint8_t request[10];  /* the CONNECT, kept until it is written */
+    uint8_t reply[262];
+    size_t reply_len;
+    size_t received;  /* of the message in flight */
+    uint64_t sent_at;
+    bool open;
+    bool succeeded;
+};
+
+struct load {
+    uv_loop_t *loop;
+    enum load_mode mode;
+    struct sockaddr_in socks;
+    unsigned short target_port;
+    size_t message_size;
+    struct worker *workers;
+    size_t worker_count;
+    size_t open;
+    bool stopping;
+    uv_timer_t timer;
+    uint64_t started;
+    uint64_t completed;  /* connections or round trips */
+    uint64_t bytes;
+    uint64_t failures;
+    uint64_t *latencies;  /* microseconds */
+    size_t latency_count;
+    size_t latency_capacity;
+    void (*settled)(struct load *load);  /* load_idle: every connection is up */
+    void *data;
+};
+
+static char *message;
+
+static void worker_start(struct worker *worker);
+static void worker_payload(struct worker *worker, const uint8_t *data, size_t len);
+
+static void worker_close_done_cb(uv_handle_t *handle) {
+    struct worker *worker = (struct worker *)handle->data;
+    struct load *load = worker->load;
+    load->open--;
+    if (worker->succeeded == false && load->stopping == false) {
+        load->failures++;
+    }
+    if (load->mode == load_connect && load->stopping == false) {
+        worker_start(worker);
+    }
+}
+
+static void worker_close(struct worker *worker) {
+    if (worker->open) {
+        worker->open = false;
+        uv_close((uv_handle_t *)&worker->tcp, worker_close_done_cb);
+    }
+}
+
+static void worker_write_done_cb(uv_write_t *req, int status);
+
+static void worker_send(struct worker *worker, const void *data, size_t len) {
+    uv_buf_t buf = uv_buf_init((char *)data, (unsigned int)len);
+    worker->write_req.data = worker;
+    if (uv_write(&worker->write_req, (uv_stream_t *)&worker->tcp, &buf, 1, worker_write_done_cb) != 0) {
+        worker_close(worker);
+    }
+}
+
+static void worker_send_message(struct worker *worker) {
+    struct load *load = worker->load;
+    switch (load->mode) {
+    case load_upload:
+        worker_send(worker, block, sizeof(block));
+        break;
+    case load_probe:
+    case load_connect:
+    case load_idle:
+        worker->received = 0;
+        worker_send(worker, message, 1);
+        break;
+    case load_round_trip:
+        worker->received = 0;
+        worker->sent_at = uv_hrtime();
+        worker_send(worker, message, load->message_size);
+        break;
+    default:
+        break;
+    }
+}
+
+static void worker_write_done_cb(uv_write_t *req, int status) {
+    struct worker *worker = (struct worker *)req->data;
+    if (status != 0 || worker->open == false) {
+        worker_close(worker);
+        return;
+    }
+    if (worker->state == worker_running && worker->load->mode == load_upload
+        && worker->load->stopping == false)
+    {
+        worker_send(worker, block, sizeof(block));
+    }
+}
+
+static void worker_alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+    static char scratch[BENCH_BLOCK];
+    *buf = uv_buf_init(scratch, sizeof(scratch));
+    (void)handle;
+    (void)suggested_size;
+}
+
+/* Bytes of the SOCKS5 reply in |reply|, 0 while it is still incomplete. */
+static size_t socks5_reply_size(const uint8_t *reply, size_t len) {
+    size_t size;
+    if (len < 5) {
+        return 0;
+    }
+    switch (reply[3]) {
+    case 1: size = 4 + 4 + 2; break;
+    case 4: size = 4 + 16 + 2; break;
+    case 3: size = 4 + 1 + reply[4] + 2; break;
+    default: return (size_t)-1;
+    }
+    return (len >= size) ? size : 0;
+}
+
+static void worker_read_cb(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
+    struct worker *worker = (struct worker *)stream->data;
+    const uint8_t *data = (const uint8_t *)buf->base;
+    size_t len = (nread > 0) ? (size_t)nread : 0;
+
+    if (nread < 0) {
+        worker_close(worker);
+        return;
+    }
+    if (worker->state == worker_greeting || worker->state == worker_request) {
+        size_t room = sizeof(worker->reply) - worker->reply_len;
+        size_t take = (len < room) ? len : room;
+        memcpy(worker->reply + worker->reply_len, data, take);
+        worker->reply_len += take;
+        data += take;
+        len -= take;
+    }
+    if (worker->state == worker_greeting && worker->reply_len >= 2) {
+        static const uint8_t request[8] = { 5, 1, 0, 1, 127, 0, 0, 1 };
+        if (worker->reply[0] != 5 || worker->reply[1] != 0) {
+            worker_close(worker);
+            return;
+        }
+        memcpy(worker->request, request, sizeof(request));
+        worker->request[8] = (uint8_t)(worker->load->target_port >> 8);
+        worker->request[9] = (uint8_t)(worker->load->target_port & 0xff);
+        memmove(worker->reply, worker->reply + 2, worker->reply_len - 2);
+        worker->reply_len -= 2;
+        worker->state = worker_request;
+        worker_send(worker, worker->request, sizeof(worker->request));
+    }
+    if (worker->state == worker_request) {
+        size_t size = socks5_reply_size(worker->reply, worker->reply_len);
+        if (size == (size_t)-1 || (size && worker->reply[1] != 0)) {
+            worker_close(worker);
+            return;
+        }
+        if (size == 0) {
+            return;
+        }
+        worker->state = worker_running;
+        // whatever came after the reply is payload already.
+        worker_payload(worker, worker->reply + size, worker->reply_len - size);
+        if (worker->open) {
+            worker_send_message(worker);
+        }
+    }
+    if (worker->state == worker_running && len) {
+        worker_payload(worker, data, len);
+    }
+}
+
+static void worker_payload(struct worker *worker, const uint8_t *data, size_t len) {
+    struct load *load = worker->load;
+    (void)data;
+    if (len == 0 || load->stopping) {
+        return;
+    }
+    switch (load->mode) {
+    case load_download:
+        load->bytes += len;
+        break;
+    case load_probe:
+    case load_connect:
+        load->completed++;
+        worker->succeeded = true;
+        worker_close(worker);
+        break;
+    case load_idle:
+        if (worker->succeeded == false) {
+            load->completed++;
+            worker->succeeded = true;
+        }
+        break;
+    case load_round_trip:
+        worker->received += len;
+        if (worker->received >= load->message_size) {
+            if (load->latency_count == load->latency_capacity) {
+                load->latency_capacity = load->latency_capacity ? load->latency_capacity * 2 : 4096;
+                load->latencies = (uint64_t *) realloc(load->latencies, load->latency_capacity * sizeof(uint64_t));
+            }
+            load->latencies[load->latency_count++] = (uv_hrtime() - worker->sent_at) / 1000;
+            load->completed++;
+            worker->succeeded = true;
+            worker_send_message(worker);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+static void worker_connect_done_cb(uv_connect_t *req, int status) {
+    struct worker *worker = (struct worker *)req->data;
+    static const uint8_t greeting[3] = { 5, 1, 0 };
+    if (status != 0 || worker->open == false) {
+        worker_close(worker);
+        return;
+    }
+    worker->state = worker_greeting;
+    uv_read_start((uv_stream_t *)&worker->tcp, worker_alloc_cb, worker_read_cb);
+    worker_send(worker, greeting, sizeof(greeting));
+}
+
+static void worker_start(struct worker *worker) {
+    struct load *load = worker->load;
+    memset(worker, 0, sizeof(*worker));
+    worker->load = load;
+    uv_tcp_init(load->loop, &worker->tcp);
+    uv_tcp_nodelay(&worker->tcp, 1);
+    worker->tcp.data = worker;
+    worker->connect_req.data = worker;
+    worker->open = true;
+    load->open++;
+    if (uv_tcp_connect(&worker->connect_req, &worker->tcp, (const struct sockaddr *)&load->socks,
+        worker_connect_done_cb) != 0)
+    {
+        worker_close(worker);
+    }
+}
+
+static void load_stop_cb(uv_timer_t *timer) {
+    struct load *load = (struct load *)timer->data;
+    size_t n;
+    load->stopping = true;
+    for (n = 0; n < load->worker_count; ++n) {
+        worker_close(load->workers + n);
+    }
+}
+
+/* Runs |load| for |ms| milliseconds, or for a probe until it is answered,
+ * or for idle connections until each has made its round trip or failed.
+ */
+static void load_run(struct load *load, uint64_t ms) {
+    size_t n;
+    load->workers = (struct worker *) calloc(load->worker_count, sizeof(struct worker));
+    uv_timer_init(load->loop, &load->timer);
+    load->timer.data = load;
+    load->started = uv_hrtime();
+    for (n = 0; n < load->worker_count; ++n) {
+        load->workers[n].load = load;
+        worker_start(load->workers + n);
+    }
+    uv_timer_start(&load->timer, load_stop_cb, ms, 0);
+    while (load->open || load->stopping == false) {
+        if (load->mode == load_probe && load->open == 0) {
+            break;
+        }
+        if (load->mode == load_idle && load->stopping == false
+            && load->completed + load->failures >= load->worker_count)
+        {
+            if (load->settled) {
+                load->settled(load);
+            }
+            load_stop_cb(&load->timer);
+        }
+        uv_run(load->loop, UV_RUN_ONCE);
+    }
+    load->stopping = true;
+    uv_close((uv_handle_t *)&load->timer, NULL);
+    uv_run(load->loop, UV_RUN_NOWAIT);
+    free(load->workers);
+    load->workers = NULL;
+}
+
+static double load_elapsed(const struct load *load) {
+    return (double)(uv_hrtime() - load->started) / 1e9;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void bench_sleep_cb(uv_timer_t *timer) {
+    (void)timer;
+}
+
+/* Lets the loop run for |ms| milliseconds. */
+static void bench_sleep(uv_loop_t *loop, uint64_t ms) {
+    uv_timer_t timer;
+    uv_timer_init(loop, &timer);
+    uv_timer_start(&timer, bench_sleep_cb, ms, 0);
+    while (uv_is_active((uv_handle_t *)&timer)) {
+        uv_run(loop, UV_RUN_ONCE);
+    }
+    uv_close((uv_handle_t *)&timer, NULL);
+    uv_run(loop, UV_RUN_NOWAIT);
+}
+
+/* The pair under test. */
+
+struct child {
+    uv_process_t process;
+    bool running;
+};
+
+static void child_exit_cb(uv_process_t *process, int64_t exit_status, int term_signal) {
+    struct child *child = (struct child *)process->data;
+    child->running = false;
+    uv_close((uv_handle_t *)process, NULL);
+    (void)exit_status;
+    (void)term_signal;
+}
+
+static bool child_spawn(uv_loop_t *loop, struct child *child, const char *file, const char *config, bool verbose) {
+    uv_process_options_t options;
+    uv_stdio_container_t stdio[3];
+    char *args[4];
+    size_t n;
+
+    memset(&options, 0, sizeof(options));
+    for (n = 0; n < 3; ++n) {
+        stdio[n].flags = (verbose && n) ? UV_INHERIT_FD : UV_IGNORE;
+        stdio[n].data.fd = (int)n;
+    }
+    args[0] = (char *)file;
+    args[1] = "-c";
+    args[2] = (char *)config;
+    args[3] = NULL;
+    options.file = file;
+    options.args = args;
+    options.exit_cb = child_exit_cb;
+    options.stdio = stdio;
+    options.stdio_count = 3;
+    child->process.data = child;
+    if (uv_spawn(loop, &child->process, &options) != 0) {
+        return false;
+    }
+    child->running = true;
+    return true;
+}
+
+static void child_stop(uv_loop_t *loop, struct child *child) {
+    uint64_t deadline = uv_hrtime() + (uint64_t)BENCH_STOP_TIMEOUT * 1000000;
+    if (child->running == false) {
+        return;
+    }
+    uv_process_kill(&child->process, SIGTERM);
+    while (child->running && uv_hrtime() < deadline) {
+        bench_sleep(loop, 10);
+    }
+    if (child->running) {
+        uv_process_kill(&child->process, SIGKILL);
+        while (child->running) {
+            uv_run(loop, UV_RUN_ONCE);
+        }
+    }
+    uv_run(loop, UV_RUN_NOWAIT);
+}
+
+/* |s| with what JSON needs escaped escaped, to be freed. */
+static char * json_escape(const char *s) {
+    char *out = (char *) malloc(strlen(s) * 6 + 1);
+    char *p = out;
+    for (; *s; ++s) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') {
+            *p++ = '\\';
+            *p++ = (char)c;
+        } else if (c < 0x20) {
+            p += sprintf(p, "\\u%04x", c);
+        } else {
+            *p++ = (char)c;
+        }
+    }
+    *p = '\0';
+    return out;
+}
+
+static bool write_file(const char *path, const char *text) {
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        return false;
+    }
+    fputs(text, f);
+    return fclose(f) == 0;
+}
+
+static bool write_configs(const struct bench_options *options, const struct bench_result *result,
+    const char *server_path, const char *client_path)
+{
+    char common[2048];
+    char text[4096];
+    char tls[1024] = "";
+    unsigned short server_port = options->port_base;
+    unsigned short client_port = (unsigned short)(options->port_base + 1);
+
+    if (result->tls) {
+        char *cert = json_escape(options->tls_cert);
+        char *key = json_escape(options->tls_key);
+        snprintf(tls, sizeof(tls),
+            "    \"over_tls_enable\": true,\n"
+            "    \"over_tls_settings\": { \"server_domain\": \"localhost\", \"path\": \"/ssr-bench/\",\n"
+            "        \"cert_file\": \"%s\", \"key_file\": \"%s\" },\n",
+            cert, key);
+        free(cert);
+        free(key);
+    }
+    snprintf(common, sizeof(common),
+        "    \"password\": \"" BENCH_PASSWORD "\",\n"
+        "    \"method\": \"%s\",\n"
+        "    \"protocol\": \"%s\",\n"
+        "    \"protocol_param\": \"\",\n"
+        "    \"obfs\": \"%s\",\n"
+        "    \"obfs_param\": \"\",\n"
+        "%s"
+        "    \"timeout\": 60\n",
+        result->method, result->protocol, result->obfs, tls);
+
+    // ssr-server listens on "server" and "server_port", as in the README.
+    snprintf(text, sizeof(text), "{\n    \"server\": \"127.0.0.1\",\n    \"server_port\": %u,\n%s}\n",
+        server_port, common);
+    if (write_file(server_path, text) == false) {
+        return false;
+    }
+    snprintf(text, sizeof(text),
+        "{\n    \"server\": \"127.0.0.1\",\n    \"server_port\": %u,\n"
+        "    \"local_address\": \"127.0.0.1\",\n    \"local_port\": %u,\n%s}\n",
+        server_port, client_port, common);
+    return write_file(client_path, text);
+}
+
+static void load_init(struct load *load, uv_loop_t *loop, const struct bench_options *options,
+    enum load_mode mode, enum target_kind target)
+{
+    memset(load, 0, sizeof(*load));
+    load->loop = loop;
+    load->mode = mode;
+    load->message_size = options->message_size;
+    load->worker_count = (mode == load_probe) ? 1 : options->connections;
+    if (mode == load_idle) {
+        load->worker_count = options->idle_tunnels;
+    }
+    load->target_port = targets[target].port;
+    uv_ip4_addr("127.0.0.1", options->port_base + 1, &load->socks);
+}
+
+/* Waits for a round trip through the pair to work. */
+static bool pair_ready(uv_loop_t *loop, const struct bench_options *options, struct child *server, struct child *client) {
+    uint64_t deadline = uv_hrtime() + (uint64_t)BENCH_READY_TIMEOUT * 1000000;
+    while (uv_hrtime() < deadline && server->running && client->running) {
+        struct load probe;
+        load_init(&probe, loop, options, load_probe, target_echo);
+        load_run(&probe, 1000);
+        free(probe.latencies);
+        if (probe.completed) {
+            return true;
+        }
+        bench_sleep(loop, 100);
+    }
+    return false;
+}
+
+/* Resident memory of process |pid| in bytes, 0 where it can't be told. */
+static uint64_t process_rss(int pid) {
+    uint64_t kb = 0;
+#if defined(__linux__)
+    char path[64], line[256];
+    FILE *f;
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    if ((f = fopen(path, "r")) == NULL) {
+        return 0;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        unsigned long long value;
+        if (sscanf(line, "VmRSS: %llu kB", &value) == 1) {
+            kb = value;
+            break;
+        }
+    }
+    fclose(f);
+#else
+    (void)pid;
+#endif
+    return kb * 1024;
+}
+
+struct idle_sample {
+    const struct child *children[2];  /* ssr-server, ssr-client */
+    uint64_t rss[2];
+};
+
+static void idle_sample_take(struct idle_sample *sample) {
+    size_t n;
+    for (n = 0; n < 2; ++n) {
+        sample->rss[n] = process_rss(sample->children[n]->process.pid);
+    }
+}
+
+static void idle_settled(struct load *load) {
+    idle_sample_take((struct idle_sample *)load->data);
+}
+
+/* What one tunnel held open and idle adds to the resident memory of each. */
+static void measure_idle(uv_loop_t *loop, const struct bench_options *options,
+    const struct child *server, const struct child *client, struct bench_result *result)
+{
+    struct idle_sample before = { { server, client }, { 0, 0 } };
+    struct idle_sample after = before;
+    struct load load;
+    size_t n;
+
+    load_init(&load, loop, options, load_idle, target_echo);
+    load.settled = idle_settled;
+    load.data = &after;
+    idle_sample_take(&before);
+    load_run(&load, (uint64_t)options->seconds * 1000 + BENCH_READY_TIMEOUT);
+    result->idle_tunnels = load.completed;
+    result->failures += load.failures;
+    for (n = 0; n < 2; ++n) {
+        result->rss_per_tunnel[n] = -1;
+        if (load.completed && before.rss[n] && after.rss[n]) {
+            result->rss_per_tunnel[n] = ((double)after.rss[n] - (double)before.rss[n]) / (double)load.completed;
+        }
+    }
+}
+
+static void bench_one(uv_loop_t *loop, const struct bench_options *options, const char *dir, struct bench_result *result) {
+    char server_config[1024], client_config[1024], server_bin[1024], client_bin[1024];
+    struct child server = { 0 }, client = { 0 };
+    uint64_t ms = (uint64_t)options->seconds * 1000;
+    struct load load;
+
+    snprintf(server_config, sizeof(server_config), "%s/server.json", dir);
+    snprintf(client_config, sizeof(client_config), "%s/client.json", dir);
+    snprintf(server_bin, sizeof(server_bin), "%s/ssr-server" BENCH_EXE, options->bin_dir);
+    snprintf(client_bin, sizeof(client_bin), "%s/ssr-client" BENCH_EXE, options->bin_dir);
+
+    do {
+        if (write_configs(options, result, server_config, client_config) == false) {
+            result->error = "can't write the configuration";
+            break;
+        }
+        if (child_spawn(loop, &server, server_bin, server_config, options->verbose) == false
+            || child_spawn(loop, &client, client_bin, client_config, options->verbose) == false)
+        {
+            result->error = "can't start ssr-server or ssr-client";
+            break;
+        }
+        if (pair_ready(loop, options, &server, &client) == false) {
+            result->error = "no round trip through the pair";
+            break;
+        }
+
+        // first, before the loads below leave the allocators grown.
+        result->rss_per_tunnel[0] = result->rss_per_tunnel[1] = -1;
+        if (options->idle_tunnels) {
+            measure_idle(loop, options, &server, &client, result);
+        }
+
+        load_init(&load, loop, options, load_upload, target_sink);
+        sink_bytes = 0;
+        load_run(&load, ms);
+        result->upload_mbps = (double)sink_bytes * 8 / 1e6 / load_elapsed(&load);
+        result->failures += load.failures;
+
+        load_init(&load, loop, options, load_download, target_source);
+        load_run(&load, ms);
+        result->download_mbps = (double)load.bytes * 8 / 1e6 / load_elapsed(&load);
+        result->failures += load.failures;
+
+        load_init(&load, loop, options, load_connect, target_echo);
+        load_run(&load, ms);
+        result->connections_per_second = (double)load.completed / load_elapsed(&load);
+        result->failures += load.failures;
+
+        load_init(&load, loop, options, load_round_trip, target_echo);
+        load_run(&load, ms);
+        result->round_trips = load.latency_count;
+        if (load.latency_count) {
+            qsort(load.latencies, load.latency_count, sizeof(uint64_t), compare_u64);
+            result->latency_us[0] = load.latencies[load.latency_count * 500 / 1000];
+            result->latency_us[1] = load.latencies[load.latency_count * 990 / 1000];
+            result->latency_us[2] = load.latencies[load.latency_count * 999 / 1000];
+        }
+        result->failures += load.failures;
+        free(load.latencies);
+    } while (0);
+
+    child_stop(loop, &client);
+    child_stop(loop, &server);
+    remove(server_config);
+    remove(client_config);
+}
+
+/* Command line. */
+
+static void usage(const char *program) {
+    printf("Usage: %s [options]\n\n"
+        "  -b <dir>      where ssr-server and ssr-client are, default the directory of %s\n"
+        "  -m <methods>  comma separated, default all\n"
+        "  -p <protocols>  comma separated, default all\n"
+        "  -O <obfs>     comma separated, default all\n"
+        "  -t <seconds>  for each measurement, default 2\n"
+        "  -n <count>    concurrent connections, default 8\n"
+        "  -I <count>    idle tunnels to sample the memory with, 0 for none, default 256\n"
+        "  -s <bytes>    round trip message size, default 64\n"
+        "  -P <port>     ssr-server listens on it, ssr-client on the next, default 20180\n"
+        "  -C <file>     TLS certificate, with -K also runs each method over TLS\n"
+        "  -K <file>     TLS private key\n"
+        "  -l <label>    recorded in the output, e.g. the version under test\n"
+        "  -o <file>     write the JSON there instead of to stdout\n"
+        "  -v            show the output of ssr-server and ssr-client\n\n"
+        "The whole matrix takes a while; narrow it with -m, -p and -O.\n",
+        program, program);
+}
+
+static bool options_parse(int argc, char **argv, struct bench_options *options, char *bin_dir, size_t size) {
+    const char *methods = "all", *protocols = "all", *obfs = "all";
+    int n;
+    char *slash;
+
+    memset(options, 0, sizeof(*options));
+    options->seconds = 2;
+    options->connections = 8;
+    options->idle_tunnels = 256;
+    options->message_size = 64;
+    options->port_base = 20180;
+    options->label = "";
+
+    snprintf(bin_dir, size, "%s", argv[0]);
+    slash = strrchr(bin_dir, '/');
+#if defined(_WIN32)
+    if (strrchr(bin_dir, '\\') > slash) {
+        slash = strrchr(bin_dir, '\\');
+    }
+#endif
+    if (slash) {
+        *slash = '\0';
+    } else {
+        snprintf(bin_dir, size, ".");
+    }
+    options->bin_dir = bin_dir;
+
+    for (n = 1; n < argc; ++n) {
+        const char *arg = argv[n];
+        const char *value = (n + 1 < argc) ? argv[n + 1] : NULL;
+        if (strcmp(arg, "-v") == 0) {
+            options->verbose = true;
+            continue;
+        }
+        if (arg[0] != '-' || arg[1] == '\0' || arg[2] != '\0' || value == NULL) {
+            return false;
+        }
+        ++n;
+        switch (arg[1]) {
+        case 'b': options->bin_dir = value; break;
+        case 'm': methods = value; break;
+        case 'p': protocols = value; break;
+        case 'O': obfs = value; break;
+        case 't': options->seconds = (unsigned int) atoi(value); break;
+        case 'n': options->connections = (unsigned int) atoi(value); break;
+        case 'I': options->idle_tunnels = (unsigned int) atoi(value); break;
+        case 's': options->message_size = (size_t) atoi(value); break;
+        case 'P': options->port_base = (unsigned short) atoi(value); break;
+        case 'C': options->tls_cert = value; break;
+        case 'K': options->tls_key = value; break;
+        case 'l': options->label = value; break;
+        case 'o': options->output = value; break;
+        default: return false;
+        }
+    }
+    if (options->seconds == 0 || options->connections == 0
+        || options->message_size == 0 || options->message_size > BENCH_BLOCK)
+    {
+        return false;
+    }
+    options->methods = names_parse(methods, bench_all_methods);
+    options->protocols = names_parse(protocols, bench_all_protocols);
+    options->obfs = names_parse(obfs, bench_all_obfs);
+    return options->methods && options->protocols && options->obfs;
+}
+
+/* Output. */
+
+static void json_rss(FILE *f, double bytes) {
+    if (bytes < 0) {
+        fprintf(f, "null");
+    } else {
+        fprintf(f, "%.0f", bytes);
+    }
+}
+
+static void json_string(FILE *f, const char *s) {
+    char *escaped = json_escape(s);
+    fprintf(f, "\"%s\"", escaped);
+    free(escaped);
+}
+
+static void json_result(FILE *f, const struct bench_result *r, bool last) {
+    fprintf(f, "    {\"method\": ");
+    json_string(f, r->method);
+    fprintf(f, ", \"protocol\": ");
+    json_string(f, r->protocol);
+    fprintf(f, ", \"obfs\": ");
+    json_string(f, r->obfs);
+    fprintf(f, ", \"tls\": %s, ", r->tls ? "true" : "false");
+    if (r->error) {
+        fprintf(f, "\"error\": ");
+        json_string(f, r->error);
+        fprintf(f, "}%s\n", last ? "" : ",");
+        return;
+    }
+    fprintf(f, "\"idle_tunnels\": %llu, \"rss_per_tunnel\": {\"server\": ", (unsigned long long)r->idle_tunnels);
+    json_rss(f, r->rss_per_tunnel[0]);
+    fprintf(f, ", \"client\": ");
+    json_rss(f, r->rss_per_tunnel[1]);
+    fprintf(f, "}, ");
+    fprintf(f, "\"upload_mbps\": %.1f, \"download_mbps\": %.1f, \"connections_per_second\": %.1f, "
+        "\"round_trips\": %llu, \"latency_us\": {\"p50\": %llu, \"p99\": %llu, \"p999\": %llu}, "
+        "\"failures\": %llu}%s\n",
+        r->upload_mbps, r->download_mbps, r->connections_per_second,
+        (unsigned long long)r->round_trips, (unsigned long long)r->latency_us[0],
+        (unsigned long long)r->latency_us[1], (unsigned long long)r->latency_us[2],
+        (unsigned long long)r->failures, last ? "" : ",");
+}
+
+int main(int argc, char **argv) {
+    struct bench_options options;
+    struct bench_result *results = NULL;
+    size_t result_count = 0, result_capacity = 0, n;
+    char bin_dir[1024];
+    char dir[1024];
+    size_t tmp_len;
+    char **method, **protocol, **obfs;
+    uv_fs_t req;
+    uv_loop_t *loop = uv_default_loop();
+    FILE *out = stdout;
+    int pass;
+
+    if (options_parse(argc, argv, &options, bin_dir, sizeof(bin_dir)) == false) {
+        usage(argv[0]);
+        return 1;
+    }
+#if !defined(_WIN32)
+    {
+        // every idle tunnel takes two descriptors here and in each child.
+        struct rlimit limit;
+        if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+            limit.rlim_cur = limit.rlim_max;
+            setrlimit(RLIMIT_NOFILE, &limit);
+        }
+    }
+#endif
+    if (targets_start(loop) == false) {
+        fprintf(stderr, "can't listen on 127.0.0.1\n");
+        return 1;
+    }
+    // under $TMPDIR, or /tmp without it, not wherever we were started.
+    tmp_len = sizeof(dir);
+    if (uv_os_tmpdir(dir, &tmp_len) != 0) {
+        snprintf(dir, sizeof(dir), "/tmp");
+    }
+    snprintf(dir + strlen(dir), sizeof(dir) - strlen(dir), "/ssr-bench-XXXXXX");
+    if (uv_fs_mkdtemp(loop, &req, dir, NULL) != 0) {
+        fprintf(stderr, "can't make a temporary directory\n");
+        return 1;
+    }
+    snprintf(dir, sizeof(dir), "%s", req.path);
+    uv_fs_req_cleanup(&req);
+    message = (char *) calloc(1, options.message_size);
+    memset(block, 'x', sizeof(block));
+
+    // every combination plainly, then each method over TLS when it can be.
+    for (pass = 0; pass < 2; ++pass) {
+        if (pass == 1 && (options.tls_cert == NULL || options.tls_key == NULL)) {
+            break;
+        }
+        for (method = options.methods; *method; ++method) {
+            for (protocol = options.protocols; *protocol; ++protocol) {
+                for (obfs = options.obfs; *obfs; ++obfs) {
+                    struct bench_result *result;
+                    if (pass == 1 && (protocol != options.protocols || obfs != options.obfs)) {
+                        continue;  /* over TLS neither takes part */
+                    }
+                    if (result_count == result_capacity) {
+                        result_capacity = result_capacity ? result_capacity * 2 : 64;
+                        results = (struct bench_result *) realloc(results, result_capacity * sizeof(*results));
+                    }
+                    result = results + result_count++;
+                    memset(result, 0, sizeof(*result));
+                    snprintf(result->method, sizeof(result->method), "%s", *method);
+                    snprintf(result->protocol, sizeof(result->protocol), "%s", *protocol);
+                    snprintf(result->obfs, sizeof(result->obfs), "%s", *obfs);
+                    result->tls = (pass == 1);
+                    fprintf(stderr, "%s %s %s%s ...", *method, *protocol, *obfs, result->tls ? " tls" : "");
+                    bench_one(loop, &options, dir, result);
+                    fprintf(stderr, " %s\n", result->error ? result->error : "done");
+                }
+            }
+        }
+    }
+    uv_fs_rmdir(loop, &req, dir, NULL);
+    uv_fs_req_cleanup(&req);
+
+    if (options.output && (out = fopen(options.output, "w")) == NULL) {
+        fprintf(stderr, "can't write %s\n", options.output);
+        return 1;
+    }
+    fprintf(out, "{\n  \"label\": ");
+    json_string(out, options.label);
+    fprintf(out, ",\n  \"seconds\": %u,\n  \"connections\": %u,\n"
+        "  \"message_size\": %u,\n  \"results\": [\n",
+        options.seconds, options.connections, (unsigned int)options.message_size);
+    for (n = 0; n < result_count; ++n) {
+        json_result(out, results + n, n + 1 == result_count);
+    }
+    fprintf(out, "  ]\n}\n");
+    if (out != stdout) {
+        fclose(out);
+    }
+
+    names_free(options.methods);
+    names_free(options.protocols);
+    names_free(options.obfs);
+    free(results);
+    free(message);
+    return 0;
+}
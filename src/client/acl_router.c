@@ -0,0 +1,125 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <uv.h>
+
+#include "common.h"
+#include "dump_info.h"
+#include "sockaddr_universal.h"
+#include "cache.h"
+#include "acl.h"
+#include "acl_router.h"
+
+#define ACL_ROUTER_CACHE_SIZE 4096
+
+struct acl_router {
+    struct cache *routes;  /* enum acl_route by host, as a pointer */
+};
+
+/* The cache holds plain values, nothing to free. */
+static void route_free_cb(void *key, void *element) {
+    (void)key;
+    (void)element;
+}
+
+struct acl_router * acl_router_create(const char *path) {
+    struct acl_router *router;
+
+    if (init_acl(path) != 0) {
+        pr_err("can't load ACL file \"%s\"", path);
+        return NULL;
+    }
+    router = (struct acl_router *) calloc(1, sizeof(*router));
+    cache_create(&router->routes, ACL_ROUTER_CACHE_SIZE, route_free_cb);
+    return router;
+}
+
+void acl_router_destroy(struct acl_router *router) {
+    if (router == NULL) {
+        return;
+    }
+    cache_delete(router->routes, 0);
+    free_acl();
+    free(router);
+}
+
+static bool addr_to_text(const struct sockaddr *addr, char *ip, size_t size) {
+    if (addr->sa_family == AF_INET) {
+        return uv_ip4_name((const struct sockaddr_in *)addr, ip, size) == 0;
+    }
+    if (addr->sa_family == AF_INET6) {
+        return uv_ip6_name((const struct sockaddr_in6 *)addr, ip, size) == 0;
+    }
+    return false;
+}
+
+static bool host_is_ip(const char *host) {
+    union sockaddr_universal addr = { 0 };
+    return convert_universal_address(host, 0, &addr) == 0;
+}
+
+/* The rules of an address, and without a rule the mode of the whole list. */
+static enum acl_route route_of_ip(const char *ip) {
+    int match;
+    if (outbound_block_match_host(ip) == 1) {
+        return acl_route_block;
+    }
+    match = acl_match_host(ip);
+    if (match > 0) {
+        return acl_route_proxy;
+    }
+    if (match < 0) {
+        return acl_route_direct;
+    }
+    return (get_acl_mode() == BLACK_LIST) ? acl_route_direct : acl_route_proxy;
+}
+
+static enum acl_route route_cached(struct acl_router *router, const char *host) {
+    void *route = NULL;
+    cache_lookup(router->routes, (char *)host, strlen(host), &route);
+    return (enum acl_route)(uintptr_t)route;
+}
+
+static enum acl_route route_remember(struct acl_router *router, const char *host, enum acl_route route) {
+    cache_insert(router->routes, (char *)host, strlen(host), (void *)(uintptr_t)route);
+    return route;
+}
+
+enum acl_route acl_router_match_host(struct acl_router *router, const char *host) {
+    enum acl_route route = route_cached(router, host);
+    int match;
+
+    if (route != acl_route_unknown) {
+        return route;
+    }
+    if (host_is_ip(host)) {
+        return route_remember(router, host, route_of_ip(host));
+    }
+    if (outbound_block_match_host(host) == 1) {
+        return route_remember(router, host, acl_route_block);
+    }
+    match = acl_match_host(host);
+    if (match > 0) {
+        return route_remember(router, host, acl_route_proxy);
+    }
+    if (match < 0) {
+        return route_remember(router, host, acl_route_direct);
+    }
+    return acl_route_unknown;
+}
+
+enum acl_route acl_router_match_addr(struct acl_router *router, const char *host, const struct sockaddr *addr) {
+    char ip[INET6_ADDRSTRLEN + 1] = { 0 };
+    if (addr_to_text(addr, ip, sizeof(ip)) == false) {
+        return acl_route_proxy;
+    }
+    return route_remember(router, host, route_of_ip(ip));
+}
+
+bool acl_router_can_access(const struct acl_router *router, const struct sockaddr *addr) {
+    char ip[INET6_ADDRSTRLEN + 1] = { 0 };
+    if (router == NULL || addr_to_text(addr, ip, sizeof(ip)) == false) {
+        return true;
+    }
+    return outbound_block_match_host(ip) != 1;
+}
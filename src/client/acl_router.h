@@ -0,0 +1,32 @@
+#ifndef __ACL_ROUTER_H__
+#define __ACL_ROUTER_H__ 1
+
+#include <stdbool.h>
+
+struct sockaddr;
+
+enum acl_route {
+    acl_route_unknown,  /* a host name no rule names, its address decides */
+    acl_route_proxy,
+    acl_route_direct,
+    acl_route_block,
+};
+
+/* Which requests of ssr-client skip the SSR server, by the rules of an ACL
+ * file in the format ssr-local reads. Decisions are remembered per host, so
+ * the rules are only walked once for each.
+ */
+struct acl_router;
+
+/* NULL if the file can't be read. */
+struct acl_router * acl_router_create(const char *path);
+void acl_router_destroy(struct acl_router *router);
+
+/* |host| is a host name or an IP address in text form. */
+enum acl_route acl_router_match_host(struct acl_router *router, const char *host);
+/* For a host name that came back acl_route_unknown, by the address it resolved to. */
+enum acl_route acl_router_match_addr(struct acl_router *router, const char *host, const struct sockaddr *addr);
+/* false if |addr| is in the outbound block list. */
+bool acl_router_can_access(const struct acl_router *router, const struct sockaddr *addr);
+
+#endif // __ACL_ROUTER_H__
@@ -9,8 +9,13 @@
 #include "tunnel.h"
 #include "obfsutil.h"
 #include "tls_cli.h"
+#include "remote_resolver.h"
+#include "upstream_pool.h"
+#include "upstream_balancer.h"
+#include "acl_router.h"
 #include "ws_tls_basic.h"
 #include "http_parser_wrapper.h"
+#include "stats.h"
 
 /* A connection is modeled as an abstraction on top of two simple state
  * machines, one for reading and one for writing.  Either state machine
@@ -51,6 +56,11 @@ enum tunnel_stage {
     tunnel_stage_handshake_replied,        /* Start waiting for request data. */
     tunnel_stage_s5_request,        /* Wait for request data. */
     tunnel_stage_s5_udp_accoc,
+    tunnel_stage_s5_udp_assoc_held,     /* Keep the TCP side open for the UDP association. */
+    tunnel_stage_s5_optimistic_replied,     /* Replied success before connecting upstream. */
+    tunnel_stage_s5_first_data,     /* Wait briefly for the first client data. */
+    tunnel_stage_direct_resolve_done,   /* Wait for the lookup of a target the ACL may bypass. */
+    tunnel_stage_direct_connecting,     /* Connecting to the target itself, no SSR server. */
     tunnel_stage_tls_connecting,
     tunnel_stage_tls_websocket_upgrade,
     tunnel_stage_tls_streaming,
@@ -62,6 +72,32 @@ enum tunnel_stage {
     tunnel_stage_auth_completion_done,      /* Connected. Start piping data. */
     tunnel_stage_streaming,            /* Connected. Pipe data back and forth. */
     tunnel_stage_kill,             /* Tear down session. */
+    tunnel_stage_max,
+};
+
+#define STAGE_NAME(stage) [tunnel_stage_##stage] = #stage
+static const char * const stage_names[tunnel_stage_max] = {
+    STAGE_NAME(handshake),
+    STAGE_NAME(handshake_auth),
+    STAGE_NAME(handshake_replied),
+    STAGE_NAME(s5_request),
+    STAGE_NAME(s5_udp_accoc),
+    STAGE_NAME(s5_udp_assoc_held),
+    STAGE_NAME(s5_optimistic_replied),
+    STAGE_NAME(s5_first_data),
+    STAGE_NAME(direct_resolve_done),
+    STAGE_NAME(direct_connecting),
+    STAGE_NAME(tls_connecting),
+    STAGE_NAME(tls_websocket_upgrade),
+    STAGE_NAME(tls_streaming),
+    STAGE_NAME(resolve_ssr_server_host_done),
+    STAGE_NAME(connecting_ssr_server),
+    STAGE_NAME(ssr_auth_sent),
+    STAGE_NAME(ssr_waiting_feedback),
+    STAGE_NAME(ssr_receipt_of_feedback_sent),
+    STAGE_NAME(auth_completion_done),
+    STAGE_NAME(streaming),
+    STAGE_NAME(kill),
 };
 
 struct client_ctx {
@@ -71,6 +107,22 @@ struct client_ctx {
     s5_ctx *parser;  /* The SOCKS protocol parser. */
     enum tunnel_stage stage;
     char *sec_websocket_key;
+    size_t _recv_buffer_size;   /* read size of the incoming socket while streaming */
+    size_t remote_first;        /* cached server address this connection started with */
+    size_t remote_attempt;
+    bool s5_replied;            /* success sent to the SOCKS client ahead of the upstream */
+    struct upstream_node *node; /* the SSR server chosen for this connection */
+    uint64_t connect_start;     /* uv_hrtime() of the connect, 0 if not measured */
+    bool fast_open_unconfirmed; /* fast open connect the server has not answered yet */
+    enum acl_route route;       /* acl_route_direct skips the SSR server and the cipher */
+    uint64_t started;           /* uv_now() of the accept */
+    uint64_t bytes_up;          /* payload from the SOCKS client */
+    uint64_t bytes_down;
+    uint64_t swept_bytes;       /* bytes_up + bytes_down at the last shrink sweep */
+    bool established;           /* has reached streaming */
+    uint64_t accepted;          /* uv_hrtime() of the accept in microseconds, 0 if not timed */
+    enum tunnel_stage timed_stage;  /* the stage stage_since is of */
+    uint64_t stage_since;
 };
 
 static struct buffer_t * initial_package_create(const s5_ctx *parser);
@@ -79,21 +131,38 @@ static void do_handshake(struct tunnel_ctx *tunnel);
 static void do_handshake_auth(struct tunnel_ctx *tunnel);
 static void do_wait_s5_request(struct tunnel_ctx *tunnel);
 static void do_parse_s5_request(struct tunnel_ctx *tunnel);
+static void do_s5_wait_first_data(struct tunnel_ctx *tunnel);
+static void do_s5_first_data_received(struct tunnel_ctx *tunnel);
+static void do_route_request(struct tunnel_ctx *tunnel);
+static void do_direct_resolve_done(struct tunnel_ctx *tunnel);
+static void do_connect_direct(struct tunnel_ctx *tunnel);
+static void do_connect_direct_done(struct tunnel_ctx *tunnel);
+static void do_reject_request(struct tunnel_ctx *tunnel);
+static void do_use_ssr_server(struct tunnel_ctx *tunnel);
+static void do_resolve_ssr_server_host(struct tunnel_ctx *tunnel);
 static void do_resolve_ssr_server_host_aftercare(struct tunnel_ctx *tunnel);
 static void do_connect_ssr_server(struct tunnel_ctx *tunnel);
+static bool do_fast_open_failover(struct tunnel_ctx *tunnel);
 static void do_connect_ssr_server_done(struct tunnel_ctx *tunnel);
 static void do_ssr_auth_sent(struct tunnel_ctx *tunnel);
 static bool do_ssr_receipt_for_feedback(struct tunnel_ctx *tunnel);
+static void socks5_reply_success_write(struct tunnel_ctx *tunnel);
 static void do_socks5_reply_success(struct tunnel_ctx *tunnel);
 static void do_launch_streaming(struct tunnel_ctx *tunnel);
 static uint8_t* tunnel_extract_data(struct socket_ctx *socket, void*(*allocator)(size_t size), size_t *size);
 static void tunnel_dying(struct tunnel_ctx *tunnel, void *p);
+static void tunnel_stats_describe(struct tunnel_ctx *tunnel, struct stats_tunnel_info *info);
+static void tunnel_stage_clock(struct client_ctx *ctx);
+static void tunnel_enter_streaming(struct client_ctx *ctx, enum tunnel_stage stage);
 static void tunnel_timeout_expire_done(struct tunnel_ctx *tunnel, struct socket_ctx *socket);
 static void tunnel_outgoing_connected_done(struct tunnel_ctx *tunnel, struct socket_ctx *socket);
+static bool tunnel_outgoing_connect_failed(struct tunnel_ctx *tunnel, struct socket_ctx *socket);
 static void tunnel_read_done(struct tunnel_ctx *tunnel, struct socket_ctx *socket);
 static void tunnel_getaddrinfo_done(struct tunnel_ctx *tunnel, struct socket_ctx *socket);
 static void tunnel_write_done(struct tunnel_ctx *tunnel, struct socket_ctx *socket);
 static size_t tunnel_get_alloc_size(struct tunnel_ctx *tunnel, struct socket_ctx *socket, size_t suggested_size);
+static size_t _get_frame_size(struct client_ctx *ctx);
+static void _update_read_size(struct client_ctx *ctx, size_t last_read);
 static void tunnel_tls_do_launch_streaming(struct tunnel_ctx *tunnel);
 static void tunnel_tls_client_incoming_streaming(struct tunnel_ctx *tunnel, struct socket_ctx *socket);
 static void tunnel_tls_on_connection_established(struct tunnel_ctx *tunnel);
@@ -104,16 +173,31 @@ static bool can_auth_none(const uv_tcp_t *lx, const struct tunnel_ctx *cx);
 static bool can_auth_passwd(const uv_tcp_t *lx, const struct tunnel_ctx *cx);
 static bool can_access(const uv_tcp_t *lx, const struct tunnel_ctx *cx, const struct sockaddr *addr);
 
+const struct stats_provider client_stats_provider = {
+    stage_names, tunnel_stage_max, &tunnel_stats_describe,
+};
+
+/* Settings and state of the SSR server this connection goes to. */
+static struct server_env_t * _upstream_env(const struct client_ctx *ctx) {
+    return ctx->node ? upstream_node_env(ctx->node) : ctx->env;
+}
+
 static bool init_done_cb(struct tunnel_ctx *tunnel, void *p) {
     struct server_env_t *env = (struct server_env_t *)p;
 
     struct client_ctx *ctx = (struct client_ctx *) calloc(1, sizeof(struct client_ctx));
     ctx->env = env;
+    ctx->started = uv_now(tunnel->listener->loop);
     tunnel->data = ctx;
+    stats_tunnel_accepted(env->stats, ctx->started);
+    stats_stage_left(env->stats, tunnel_stage_max, &ctx->stage_since);
+    ctx->accepted = ctx->stage_since;
+    tunnel->outgoing->fast_open = env->config->fast_open;
 
     tunnel_add_dying_cb(tunnel, &tunnel_dying, ctx);
     tunnel->tunnel_timeout_expire_done = &tunnel_timeout_expire_done;
     tunnel->tunnel_outgoing_connected_done = &tunnel_outgoing_connected_done;
+    tunnel->tunnel_outgoing_connect_failed = &tunnel_outgoing_connect_failed;
     tunnel->tunnel_read_done = &tunnel_read_done;
     tunnel->tunnel_getaddrinfo_done = &tunnel_getaddrinfo_done;
     tunnel->tunnel_write_done = &tunnel_write_done;
@@ -149,6 +233,22 @@ void client_shutdown(struct server_env_t *env) {
     cstl_set_container_traverse(env->tunnel_set, &_do_shutdown_tunnel, NULL);
 }
 
+// a tunnel that moved nothing since the last sweep gives back its buffers.
+static void _do_shrink_tunnel(const void *obj, void *p) {
+    struct tunnel_ctx *tunnel = (struct tunnel_ctx *)obj;
+    struct client_ctx *ctx = (struct client_ctx *) tunnel->data;
+    uint64_t moved = ctx->bytes_up + ctx->bytes_down;
+    if (ctx->established && moved == ctx->swept_bytes) {
+        tunnel_cipher_shrink(ctx->cipher);
+    }
+    ctx->swept_bytes = moved;
+    (void)p;
+}
+
+void client_shrink_idle(struct server_env_t *env) {
+    cstl_set_container_traverse(env->tunnel_set, &_do_shrink_tunnel, NULL);
+}
+
 static struct buffer_t * initial_package_create(const s5_ctx *parser) {
     struct buffer_t *buffer = buffer_create(SSR_BUFF_SIZE);
 
@@ -219,7 +319,34 @@ static void do_next(struct tunnel_ctx *tunnel, struct socket_ctx *socket) {
     case tunnel_stage_s5_udp_accoc:
         ASSERT(incoming->wrstate == socket_done);
         incoming->wrstate = socket_stop;
-        tunnel_shutdown(tunnel);
+        if (ctx->env->config->udp == false) {
+            tunnel_shutdown(tunnel);
+            break;
+        }
+        // the association ends with this TCP connection, so just wait for it to close.
+        tunnel_enter_streaming(ctx, tunnel_stage_s5_udp_assoc_held);
+        socket_read(incoming, false);
+        break;
+    case tunnel_stage_s5_udp_assoc_held:
+        ASSERT(incoming->rdstate == socket_done);
+        incoming->rdstate = socket_stop;
+        socket_read(incoming, false);
+        break;
+    case tunnel_stage_s5_optimistic_replied:
+        ASSERT(incoming->wrstate == socket_done);
+        incoming->wrstate = socket_stop;
+        do_s5_wait_first_data(tunnel);
+        break;
+    case tunnel_stage_s5_first_data:
+        ASSERT(incoming->rdstate == socket_done);
+        incoming->rdstate = socket_stop;
+        do_s5_first_data_received(tunnel);
+        break;
+    case tunnel_stage_direct_resolve_done:
+        do_direct_resolve_done(tunnel);
+        break;
+    case tunnel_stage_direct_connecting:
+        do_connect_direct_done(tunnel);
         break;
     case tunnel_stage_resolve_ssr_server_host_done:
         do_resolve_ssr_server_host_aftercare(tunnel);
@@ -247,7 +374,7 @@ static void do_next(struct tunnel_ctx *tunnel, struct socket_ctx *socket) {
     case tunnel_stage_auth_completion_done:
         ASSERT(incoming->wrstate == socket_done);
         incoming->wrstate = socket_stop;
-        if (config->over_tls_enable) {
+        if (config->over_tls_enable && ctx->route != acl_route_direct) {
             tunnel_tls_do_launch_streaming(tunnel);
         } else {
             do_launch_streaming(tunnel);
@@ -265,6 +392,7 @@ static void do_next(struct tunnel_ctx *tunnel, struct socket_ctx *socket) {
     default:
         UNREACHABLE();
     }
+    tunnel_stage_clock(ctx);
 }
 
 static void do_handshake(struct tunnel_ctx *tunnel) {
@@ -405,10 +533,22 @@ static void do_parse_s5_request(struct tunnel_ctx *tunnel) {
     }
 
     if (parser->cmd == s5_cmd_udp_assoc) {
-        // UDP ASSOCIATE requests
+        // UDP ASSOCIATE requests, the relay listens on the address the client reached.
+        union sockaddr_universal local = { 0 };
+        int local_len = (int) sizeof(local);
+        char local_host[INET6_ADDRSTRLEN + 1] = { 0 };
+        const char *bind_host = config->listen_host;
         size_t len = incoming->buf->len;
-        uint8_t *buf = build_udp_assoc_package(config->udp, config->listen_host, config->listen_port,
+        uint8_t *buf;
+        if (uv_tcp_getsockname(&incoming->handle.tcp, &local.addr, &local_len) == 0) {
+            bind_host = universal_address_to_string(&local, local_host, sizeof(local_host));
+        }
+        buf = build_udp_assoc_package(config->udp, bind_host, get_socket_port(&incoming->handle.tcp),
             (uint8_t *)incoming->buf->base, &len);
+        if (buf == NULL) {
+            tunnel_shutdown(tunnel);
+            return;
+        }
         socket_write(incoming, buf, len);
         ctx->stage = tunnel_stage_s5_udp_accoc;
         return;
@@ -417,43 +557,266 @@ static void do_parse_s5_request(struct tunnel_ctx *tunnel) {
     ASSERT(parser->cmd == s5_cmd_tcp_connect);
 
     ctx->init_pkg = initial_package_create(parser);
-    ctx->cipher = tunnel_cipher_create(ctx->env, 1452);
+    if (env->router) {
+        do_route_request(tunnel);
+        return;
+    }
+    do_use_ssr_server(tunnel);
+}
 
-    {
-        struct obfs_t *protocol = ctx->cipher->protocol;
-        struct obfs_t *obfs = ctx->cipher->obfs;
-        struct server_info_t *info;
-        info = protocol ? protocol->get_server_info(protocol) : (obfs ? obfs->get_server_info(obfs) : NULL);
-        if (info) {
-            info->buffer_size = SSR_BUFF_SIZE;
-            info->head_len = (int) get_s5_head_size(ctx->init_pkg->buffer, ctx->init_pkg->len, 30);
-        }
+/* The target in text form, as the ACL rules are written. */
+static void s5_request_host(const s5_ctx *parser, char *host, size_t size) {
+    switch (parser->atyp) {
+    case s5_atyp_ipv4:
+        uv_inet_ntop(AF_INET, parser->daddr, host, size);
+        break;
+    case s5_atyp_ipv6:
+        uv_inet_ntop(AF_INET6, parser->daddr, host, size);
+        break;
+    case s5_atyp_host:
+        snprintf(host, size, "%s", (const char *)parser->daddr);
+        break;
+    default:
+        UNREACHABLE();
+    }
+}
+
+static void do_route_request(struct tunnel_ctx *tunnel) {
+    struct client_ctx *ctx = (struct client_ctx *) tunnel->data;
+    struct socket_ctx *outgoing = tunnel->outgoing;
+    s5_ctx *parser = ctx->parser;
+    char host[257] = { 0 };
+
+    s5_request_host(parser, host, sizeof(host));
+    ctx->route = acl_router_match_host(ctx->env->router, host);
+    if (ctx->route == acl_route_proxy) {
+        do_use_ssr_server(tunnel);
+        return;
+    }
+    if (ctx->route == acl_route_block) {
+        do_reject_request(tunnel);
+        return;
+    }
+
+    memset(&outgoing->addr, 0, sizeof(outgoing->addr));
+    switch (parser->atyp) {
+    case s5_atyp_ipv4:
+        outgoing->addr.addr4.sin_family = AF_INET;
+        memcpy(&outgoing->addr.addr4.sin_addr, parser->daddr, sizeof(struct in_addr));
+        outgoing->addr.addr4.sin_port = htons(parser->dport);
+        break;
+    case s5_atyp_ipv6:
+        outgoing->addr.addr6.sin6_family = AF_INET6;
+        memcpy(&outgoing->addr.addr6.sin6_addr, parser->daddr, sizeof(struct in6_addr));
+        outgoing->addr.addr6.sin6_port = htons(parser->dport);
+        break;
+    case s5_atyp_host:
+        // bypassed, or no rule names it and its address decides.
+        outgoing->addr.addr4.sin_port = htons(parser->dport);
+        socket_getaddrinfo(outgoing, host);
+        ctx->env->stats->dns_cache_misses++;
+        ctx->stage = tunnel_stage_direct_resolve_done;
+        return;
+    default:
+        UNREACHABLE();
+    }
+    do_connect_direct(tunnel);
+}
+
+static void do_direct_resolve_done(struct tunnel_ctx *tunnel) {
+    struct client_ctx *ctx = (struct client_ctx *) tunnel->data;
+    struct socket_ctx *incoming = tunnel->incoming;
+    struct socket_ctx *outgoing = tunnel->outgoing;
+    char host[257] = { 0 };
+
+    ASSERT(incoming->rdstate == socket_stop);
+    ASSERT(incoming->wrstate == socket_stop);
+    ASSERT(outgoing->rdstate == socket_stop);
+    ASSERT(outgoing->wrstate == socket_stop);
+
+    s5_request_host(ctx->parser, host, sizeof(host));
+    if (outgoing->result < 0) {
+        pr_err("lookup error for \"%s\": %s", host, uv_strerror((int)outgoing->result));
+        /* Send back a 'Host unreachable' reply. */
+        socket_write(incoming, "\5\4\0\1\0\0\0\0\0\0", 10);
+        ctx->stage = tunnel_stage_kill;
+        return;
+    }
+
+    if (ctx->route == acl_route_unknown) {
+        ctx->route = acl_router_match_addr(ctx->env->router, host, &outgoing->addr.addr);
+    }
+    switch (ctx->route) {
+    case acl_route_direct:
+        do_connect_direct(tunnel);
+        break;
+    case acl_route_block:
+        do_reject_request(tunnel);
+        break;
+    default:
+        do_use_ssr_server(tunnel);
+        break;
+    }
+}
+
+/* Plain TCP to the target, the data is passed on as it is. */
+static void do_connect_direct(struct tunnel_ctx *tunnel) {
+    struct client_ctx *ctx = (struct client_ctx *) tunnel->data;
+    struct socket_ctx *outgoing = tunnel->outgoing;
+    int err;
+
+    if (!can_access(tunnel->listener, tunnel, &outgoing->addr.addr)) {
+        do_reject_request(tunnel);
+        return;
+    }
+
+    // fast open would report success before the target has answered.
+    outgoing->fast_open = false;
+    err = socket_connect(outgoing);
+    if (err != 0) {
+        pr_err("connect error: %s", uv_strerror(err));
+        tunnel_shutdown(tunnel);
+        return;
+    }
+    ctx->stage = tunnel_stage_direct_connecting;
+}
+
+static void do_connect_direct_done(struct tunnel_ctx *tunnel) {
+    struct client_ctx *ctx = (struct client_ctx *) tunnel->data;
+    struct socket_ctx *incoming = tunnel->incoming;
+    struct socket_ctx *outgoing = tunnel->outgoing;
+
+    ASSERT(incoming->rdstate == socket_stop);
+    ASSERT(incoming->wrstate == socket_stop);
+    ASSERT(outgoing->rdstate == socket_stop);
+    ASSERT(outgoing->wrstate == socket_stop);
+
+    if (outgoing->result != 0) {
+        socket_dump_error_info("direct connection", outgoing);
+        /* Send a 'Connection refused' reply. */
+        socket_write(incoming, "\5\5\0\1\0\0\0\0\0\0", 10);
+        ctx->stage = tunnel_stage_kill;
+        return;
     }
+    ctx->stage = tunnel_stage_auth_completion_done;
+    socks5_reply_success_write(tunnel);
+}
+
+static void do_reject_request(struct tunnel_ctx *tunnel) {
+    struct client_ctx *ctx = (struct client_ctx *) tunnel->data;
+
+    pr_warn("connection not allowed by ruleset");
+    if (ctx->s5_replied) {
+        tunnel_shutdown(tunnel);
+        return;
+    }
+    /* Send a 'Connection not allowed by ruleset' reply. */
+    socket_write(tunnel->incoming, "\5\2\0\1\0\0\0\0\0\0", 10);
+    ctx->stage = tunnel_stage_kill;
+}
+
+static struct tunnel_cipher_ctx * _client_cipher_create(struct client_ctx *ctx) {
+    struct tunnel_cipher_ctx *cipher = tunnel_cipher_create(_upstream_env(ctx), 1452);
+    struct obfs_t *protocol = cipher->protocol;
+    struct obfs_t *obfs = cipher->obfs;
+    struct server_info_t *info;
+
+    cipher->stats = ctx->env->stats;  /* the listener's, not the server's */
+    info = protocol ? protocol->get_server_info(protocol) : (obfs ? obfs->get_server_info(obfs) : NULL);
+    if (info) {
+        info->head_len = (int) get_s5_head_size(ctx->init_pkg->buffer, ctx->init_pkg->len, 30);
+    }
+    return cipher;
+}
+
+static void do_use_ssr_server(struct tunnel_ctx *tunnel) {
+    struct client_ctx *ctx = (struct client_ctx *) tunnel->data;
+    struct server_env_t *env = ctx->env;
+    struct server_config *config = env->config;
+
+    ctx->route = acl_route_proxy;
+    ctx->node = upstream_balancer_pick(env->balancer);
+    ctx->cipher = _client_cipher_create(ctx);
 
     if (config->over_tls_enable) {
         ctx->stage = tunnel_stage_tls_connecting;
-        tls_client_launch(tunnel, config);
+        tls_client_launch(tunnel, _upstream_env(ctx)->config);
         return;
     }
-    else {
-        union sockaddr_universal remote_addr = { 0 };
-        if (convert_universal_address(config->remote_host, config->remote_port, &remote_addr) != 0) {
+
+    if (config->socks5_optimistic_reply) {
+        /* Answer now, so the client's first data can ride along with the init package. */
+        ctx->s5_replied = true;
+        socks5_reply_success_write(tunnel);
+        ctx->stage = tunnel_stage_s5_optimistic_replied;
+        return;
+    }
+
+    do_resolve_ssr_server_host(tunnel);
+}
+
+static void do_s5_wait_first_data(struct tunnel_ctx *tunnel) {
+    struct client_ctx *ctx = (struct client_ctx *) tunnel->data;
+    struct socket_ctx *incoming = tunnel->incoming;
+
+    ASSERT(incoming->rdstate == socket_stop);
+    ASSERT(incoming->wrstate == socket_stop);
+
+    if (incoming->result < 0) {
+        pr_err("write error: %s", uv_strerror((int)incoming->result));
+        tunnel_shutdown(tunnel);
+        return;
+    }
+
+    socket_read_within(incoming, ctx->env->config->first_data_wait);
+    ctx->stage = tunnel_stage_s5_first_data;
+}
+
+static void do_s5_first_data_received(struct tunnel_ctx *tunnel) {
+    struct client_ctx *ctx = (struct client_ctx *) tunnel->data;
+    struct socket_ctx *incoming = tunnel->incoming;
+
+    ASSERT(incoming->rdstate == socket_stop);
+    ASSERT(incoming->wrstate == socket_stop);
+
+    if (incoming->result > 0) {
+        buffer_concatenate(ctx->init_pkg, (uint8_t *)incoming->buf->base, (size_t)incoming->result);
+    }
+    /* Otherwise the client waits for the server to talk first, connect without data. */
+
+    do_resolve_ssr_server_host(tunnel);
+}
+
+static void do_resolve_ssr_server_host(struct tunnel_ctx *tunnel) {
+    struct socket_ctx *outgoing = tunnel->outgoing;
+    struct client_ctx *ctx = (struct client_ctx *) tunnel->data;
+    struct server_env_t *env = _upstream_env(ctx);
+    struct server_config *config = env->config;
+    union sockaddr_universal remote_addr = { 0 };
+
+    if (convert_universal_address(config->remote_host, config->remote_port, &remote_addr) != 0) {
+        ctx->remote_first = remote_resolver_first(env->resolver);
+        ctx->remote_attempt = 0;
+        if (remote_resolver_get(env->resolver, ctx->remote_first, 0, &remote_addr) == false) {
+            /* Startup lookup not finished or failed, resolve it ourselves. */
+            ctx->env->stats->dns_cache_misses++;
             socket_getaddrinfo(outgoing, config->remote_host);
             ctx->stage = tunnel_stage_resolve_ssr_server_host_done;
             return;
         }
+        ctx->env->stats->dns_cache_hits++;
+    }
 
-        outgoing->addr = remote_addr;
+    outgoing->addr = remote_addr;
 
-        do_connect_ssr_server(tunnel);
-    }
+    do_connect_ssr_server(tunnel);
 }
 
 static void do_resolve_ssr_server_host_aftercare(struct tunnel_ctx *tunnel) {
     struct socket_ctx *incoming = tunnel->incoming;
     struct socket_ctx *outgoing = tunnel->outgoing;
     struct client_ctx *ctx = (struct client_ctx *) tunnel->data;
-    struct server_env_t *env = ctx->env;
+    struct server_env_t *env = _upstream_env(ctx);
     struct server_config *config = env->config;
 
     ASSERT(incoming->rdstate == socket_stop);
@@ -466,6 +829,13 @@ static void do_resolve_ssr_server_host_aftercare(struct tunnel_ctx *tunnel) {
         pr_err("lookup error for \"%s\": %s",
             config->remote_host,
             uv_strerror((int)outgoing->result));
+        if (ctx->node) {
+            upstream_node_failed(ctx->node);
+        }
+        if (ctx->s5_replied) {
+            tunnel_shutdown(tunnel);
+            return;
+        }
         /* Send back a 'Host unreachable' reply. */
         socket_write(incoming, "\5\4\0\1\0\0\0\0\0\0", 10);
         ctx->stage = tunnel_stage_kill;
@@ -493,6 +863,7 @@ static void do_connect_ssr_server(struct tunnel_ctx *tunnel) {
     struct server_config *config = ctx->env->config;
     struct socket_ctx *incoming = tunnel->incoming;
     struct socket_ctx *outgoing = tunnel->outgoing;
+    struct socket_ctx *pooled;
     int err;
 
     ASSERT(incoming->rdstate == socket_stop);
@@ -501,13 +872,23 @@ static void do_connect_ssr_server(struct tunnel_ctx *tunnel) {
     ASSERT(outgoing->wrstate == socket_stop);
 
     if (!can_access(tunnel->listener, tunnel, &outgoing->addr.addr)) {
-        pr_warn("connection not allowed by ruleset");
-        /* Send a 'Connection not allowed by ruleset' reply. */
-        socket_write(incoming, "\5\2\0\1\0\0\0\0\0\0", 10);
-        ctx->stage = tunnel_stage_kill;
+        do_reject_request(tunnel);
+        return;
+    }
+
+    pooled = upstream_pool_take(_upstream_env(ctx)->pool);
+    if (pooled) {
+        /* Already connected, go straight on to sending the init package. */
+        tunnel_attach_outgoing(tunnel, pooled);
+        ctx->stage = tunnel_stage_connecting_ssr_server;
+        do_connect_ssr_server_done(tunnel);
         return;
     }
 
+    // with fast open the connect completes at once, nothing to measure,
+    // and a dead server only shows up as an error on the init package.
+    ctx->connect_start = outgoing->fast_open ? 0 : uv_hrtime();
+    ctx->fast_open_unconfirmed = outgoing->fast_open;
     err = socket_connect(outgoing);
     if (err != 0) {
         pr_err("connect error: %s", uv_strerror(err));
@@ -529,7 +910,12 @@ static void do_connect_ssr_server_done(struct tunnel_ctx *tunnel) {
     ASSERT(outgoing->wrstate == socket_stop);
 
     if (outgoing->result == 0) {
-        struct buffer_t *tmp = buffer_clone(ctx->init_pkg);
+        struct buffer_t *tmp;
+        if (ctx->node && ctx->connect_start) {
+            upstream_node_connected(ctx->node, (uv_hrtime() - ctx->connect_start) / 1000);
+            ctx->connect_start = 0;
+        }
+        tmp = buffer_clone(ctx->init_pkg);
         if (ssr_ok != tunnel_cipher_client_encrypt(ctx->cipher, tmp)) {
             buffer_release(tmp);
             tunnel_shutdown(tunnel);
@@ -542,6 +928,10 @@ static void do_connect_ssr_server_done(struct tunnel_ctx *tunnel) {
         return;
     } else {
         socket_dump_error_info("upstream connection", outgoing);
+        if (ctx->s5_replied) {
+            tunnel_shutdown(tunnel);
+            return;
+        }
         /* Send a 'Connection refused' reply. */
         socket_write(incoming, "\5\5\0\1\0\0\0\0\0\0", 10);
         ctx->stage = tunnel_stage_kill;
@@ -552,6 +942,27 @@ static void do_connect_ssr_server_done(struct tunnel_ctx *tunnel) {
     tunnel_shutdown(tunnel);
 }
 
+/*
+ * A fast open connect reports success before the server has answered, so
+ * a refused or unreachable server address fails the init package write, or
+ * the read of the obfs feedback, instead of the connect. Up to then only
+ * the init package has gone to the server, so it can be sent again, with a
+ * fresh cipher, to the next cached address. Errors once streaming has
+ * begun close the tunnel as usual. Pooled connections were made without
+ * fast open and never get here.
+ */
+static bool do_fast_open_failover(struct tunnel_ctx *tunnel) {
+    struct client_ctx *ctx = (struct client_ctx *) tunnel->data;
+
+    if (ctx->fast_open_unconfirmed == false) {
+        return false;
+    }
+    tunnel_cipher_release(ctx->cipher);
+    ctx->cipher = _client_cipher_create(ctx);
+    ctx->stage = tunnel_stage_connecting_ssr_server;
+    return tunnel_outgoing_connect_failed(tunnel, tunnel->outgoing);
+}
+
 static void do_ssr_auth_sent(struct tunnel_ctx *tunnel) {
     struct socket_ctx *incoming = tunnel->incoming;
     struct socket_ctx *outgoing = tunnel->outgoing;
@@ -564,7 +975,9 @@ static void do_ssr_auth_sent(struct tunnel_ctx *tunnel) {
 
     if (outgoing->result < 0) {
         pr_err("write error: %s", uv_strerror((int)outgoing->result));
-        tunnel_shutdown(tunnel);
+        if (do_fast_open_failover(tunnel) == false) {
+            tunnel_shutdown(tunnel);
+        }
         return;
     }
 
@@ -593,9 +1006,12 @@ static bool do_ssr_receipt_for_feedback(struct tunnel_ctx *tunnel) {
 
     if (outgoing->result < 0) {
         pr_err("read error: %s", uv_strerror((int)outgoing->result));
-        tunnel_shutdown(tunnel);
-        return done;
+        if (do_fast_open_failover(tunnel) == false) {
+            tunnel_shutdown(tunnel);
+        }
+        return true;
     }
+    ctx->fast_open_unconfirmed = false;
 
     buf = buffer_create_from((uint8_t *)outgoing->buf->base, (size_t)outgoing->result);
     error = tunnel_cipher_client_decrypt(cipher_ctx, buf, &feedback);
@@ -613,26 +1029,36 @@ static bool do_ssr_receipt_for_feedback(struct tunnel_ctx *tunnel) {
     return done;
 }
 
+static void socks5_reply_success_write(struct tunnel_ctx *tunnel) {
+    struct client_ctx *ctx = (struct client_ctx *) tunnel->data;
+    struct buffer_t *init_pkg = ctx->init_pkg;
+    uint8_t *buf;
+    buf = (uint8_t *)calloc(3 + init_pkg->len, sizeof(uint8_t));
+
+    buf[0] = 5;  // Version.
+    buf[1] = 0;  // Success.
+    buf[2] = 0;  // Reserved.
+    memcpy(buf + 3, init_pkg->buffer, init_pkg->len);
+    socket_write(tunnel->incoming, buf, 3 + init_pkg->len);
+    free(buf);
+}
+
 static void do_socks5_reply_success(struct tunnel_ctx *tunnel) {
     struct client_ctx *ctx = (struct client_ctx *) tunnel->data;
     struct socket_ctx *incoming = tunnel->incoming;
     struct socket_ctx *outgoing = tunnel->outgoing;
-    uint8_t *buf;
-    struct buffer_t *init_pkg = ctx->init_pkg;
-    buf = (uint8_t *)calloc(3 + init_pkg->len, sizeof(uint8_t));
 
     ASSERT(incoming->rdstate == socket_stop);
     ASSERT(incoming->wrstate == socket_stop);
     ASSERT(outgoing->rdstate == socket_stop);
     ASSERT(outgoing->wrstate == socket_stop);
 
-    buf[0] = 5;  // Version.
-    buf[1] = 0;  // Success.
-    buf[2] = 0;  // Reserved.
-    memcpy(buf + 3, init_pkg->buffer, init_pkg->len);
-    socket_write(incoming, buf, 3 + init_pkg->len);
-    free(buf);
     ctx->stage = tunnel_stage_auth_completion_done;
+    if (ctx->s5_replied) {
+        do_launch_streaming(tunnel);
+        return;
+    }
+    socks5_reply_success_write(tunnel);
 }
 
 static void do_launch_streaming(struct tunnel_ctx *tunnel) {
@@ -653,7 +1079,7 @@ static void do_launch_streaming(struct tunnel_ctx *tunnel) {
 
     socket_read(incoming, false);
     socket_read(outgoing, true);
-    ctx->stage = tunnel_stage_streaming;
+    tunnel_enter_streaming(ctx, tunnel_stage_streaming);
 }
 
 static uint8_t* tunnel_extract_data(struct socket_ctx *socket, void*(*allocator)(size_t size), size_t *size) {
@@ -672,7 +1098,14 @@ static uint8_t* tunnel_extract_data(struct socket_ctx *socket, void*(*allocator)
 
     buf = buffer_create_from((uint8_t *)socket->buf->base, (size_t)socket->result);
 
-    if (socket == tunnel->incoming) {
+    if (ctx->route == acl_route_direct) {
+        // bypassed by the ACL, nothing to encrypt.
+        if (socket == tunnel->incoming) {
+            _update_read_size(ctx, (size_t)socket->result);
+        }
+        error = ssr_ok;
+    } else if (socket == tunnel->incoming) {
+        _update_read_size(ctx, (size_t)socket->result);
         if (config->over_tls_enable) {
             error = tunnel_tls_cipher_client_encrypt(cipher_ctx, buf);
         } else {
@@ -692,6 +1125,16 @@ static uint8_t* tunnel_extract_data(struct socket_ctx *socket, void*(*allocator)
 
     if (error == ssr_ok) {
         size_t len = buf->len;
+        if (socket == tunnel->incoming) {
+            ctx->bytes_up += (uint64_t)socket->result;
+            ctx->env->stats->bytes_up += (uint64_t)socket->result;
+        } else {
+            if (ctx->bytes_down == 0) {
+                stats_first_byte(ctx->env->stats, ctx->accepted);
+            }
+            ctx->bytes_down += (uint64_t)len;
+            ctx->env->stats->bytes_down += (uint64_t)len;
+        }
         *size = len;
         result = (uint8_t *)allocator(len + 1);
         memcpy(result, buf->buffer, len);
@@ -709,6 +1152,10 @@ static void tunnel_dying(struct tunnel_ctx *tunnel, void *p) {
     ASSERT(ctx2 == ctx);
 
     cstl_set_container_remove(ctx->env->tunnel_set, tunnel);
+    if (ctx->established == false) {
+        ctx->env->stats->handshake_failures++;
+    }
+    upstream_node_release(ctx->node);
     if (ctx->cipher) {
         tunnel_cipher_release(ctx->cipher);
     }
@@ -718,6 +1165,41 @@ static void tunnel_dying(struct tunnel_ctx *tunnel, void *p) {
     free(ctx);
 }
 
+static void tunnel_stats_describe(struct tunnel_ctx *tunnel, struct stats_tunnel_info *info) {
+    struct client_ctx *ctx = (struct client_ctx *) tunnel->data;
+    info->stage = (size_t)ctx->stage;
+    info->started = ctx->started;
+    info->bytes_up = ctx->bytes_up;
+    info->bytes_down = ctx->bytes_down;
+    info->crypto_ns = ctx->cipher ? ctx->cipher->crypto_ns : 0;
+}
+
+/* Charges the time in the stage just left, if it changed. */
+static void tunnel_stage_clock(struct client_ctx *ctx) {
+    if (ctx->stage != ctx->timed_stage) {
+        stats_stage_left(ctx->env->stats, (size_t)ctx->timed_stage, &ctx->stage_since);
+        ctx->timed_stage = ctx->stage;
+    }
+}
+
+/* The UDP association held open counts as established too. */
+static void tunnel_enter_streaming(struct client_ctx *ctx, enum tunnel_stage stage) {
+    ctx->stage = stage;
+    ctx->established = true;
+    ctx->env->stats->tunnels_established++;
+    tunnel_stage_clock(ctx);
+
+    // only the handshake needs these.
+    buffer_release(ctx->init_pkg);
+    ctx->init_pkg = NULL;
+    free(ctx->parser);
+    ctx->parser = NULL;
+    if (ctx->sec_websocket_key) {
+        free(ctx->sec_websocket_key);
+        ctx->sec_websocket_key = NULL;
+    }
+}
+
 static void tunnel_timeout_expire_done(struct tunnel_ctx *tunnel, struct socket_ctx *socket) {
     (void)tunnel;
     (void)socket;
@@ -727,6 +1209,30 @@ static void tunnel_outgoing_connected_done(struct tunnel_ctx *tunnel, struct soc
     do_next(tunnel, socket);
 }
 
+/* Fail over to the next cached address of the SSR server, if any. */
+static bool tunnel_outgoing_connect_failed(struct tunnel_ctx *tunnel, struct socket_ctx *socket) {
+    struct client_ctx *ctx = (struct client_ctx *) tunnel->data;
+    struct remote_resolver *resolver = _upstream_env(ctx)->resolver;
+    union sockaddr_universal next = { 0 };
+    char addr[256] = { 0 };
+
+    if (socket != tunnel->outgoing || ctx->stage != tunnel_stage_connecting_ssr_server) {
+        return false;
+    }
+    remote_resolver_mark_failed(resolver, &socket->addr);
+    ctx->remote_attempt++;
+    if (remote_resolver_get(resolver, ctx->remote_first, ctx->remote_attempt, &next) == false) {
+        if (ctx->node) {
+            upstream_node_failed(ctx->node);
+        }
+        return false;
+    }
+    socket->addr = next;
+    pr_warn("trying next server address %s", universal_address_to_string(&next, addr, sizeof(addr)));
+    socket_reconnect(socket);
+    return true;
+}
+
 static void tunnel_read_done(struct tunnel_ctx *tunnel, struct socket_ctx *socket) {
     do_next(tunnel, socket);
 }
@@ -739,11 +1245,51 @@ static void tunnel_write_done(struct tunnel_ctx *tunnel, struct socket_ctx *sock
     do_next(tunnel, socket);
 }
 
+static size_t _get_frame_size(struct client_ctx *ctx) {
+    struct obfs_t *protocol = ctx->cipher ? ctx->cipher->protocol : NULL;
+    struct obfs_t *obfs = ctx->cipher ? ctx->cipher->obfs : NULL;
+    struct server_info_t *info;
+    info = protocol ? protocol->get_server_info(protocol) : (obfs ? obfs->get_server_info(obfs) : NULL);
+    if (info && info->tcp_mss > info->overhead) {
+        return (size_t)(info->tcp_mss - info->overhead);
+    }
+    return SSR_BUFF_SIZE;
+}
+
+/*
+ * Plain data from the application is read in whole protocol frames
+ * (tcp_mss - overhead, the unit_len of auth_chain). The size doubles while
+ * the reads come back full and falls back as soon as the traffic gets
+ * interactive, so small requests still go out as small packets.
+ */
+static void _update_read_size(struct client_ctx *ctx, size_t last_read) {
+    size_t frame_size = _get_frame_size(ctx);
+    size_t size = ctx->_recv_buffer_size;
+    if (last_read >= size) {
+        size = min(size * 2, (size_t)TCP_BUF_SIZE_MAX);
+    } else if (last_read < size / 2) {
+        size = max(size / 2, frame_size);
+    }
+    if (size > frame_size) {
+        size = (size / frame_size) * frame_size;
+    }
+    ctx->_recv_buffer_size = max(size, frame_size);
+}
+
 static size_t tunnel_get_alloc_size(struct tunnel_ctx *tunnel, struct socket_ctx *socket, size_t suggested_size) {
-    (void)tunnel;
-    (void)socket;
+    struct client_ctx *ctx = (struct client_ctx *) tunnel->data;
     (void)suggested_size;
-    return SSR_BUFF_SIZE;
+    if (ctx->stage != tunnel_stage_streaming && ctx->stage != tunnel_stage_tls_streaming) {
+        return SSR_BUFF_SIZE;
+    }
+    if (socket == tunnel->outgoing) {
+        // cipher text from the server, the protocol takes care of the framing.
+        return TCP_BUF_SIZE_MAX;
+    }
+    if (ctx->_recv_buffer_size == 0) {
+        ctx->_recv_buffer_size = _get_frame_size(ctx);
+    }
+    return ctx->_recv_buffer_size;
 }
 
 static void tunnel_tls_do_launch_streaming(struct tunnel_ctx *tunnel) {
@@ -761,7 +1307,7 @@ static void tunnel_tls_do_launch_streaming(struct tunnel_ctx *tunnel) {
         tls_client_shutdown(tunnel);
     } else {
         socket_read(incoming, true);
-        ctx->stage = tunnel_stage_tls_streaming;
+        tunnel_enter_streaming(ctx, tunnel_stage_tls_streaming);
     }
 }
 
@@ -803,7 +1349,7 @@ static void tunnel_tls_on_connection_established(struct tunnel_ctx *tunnel) {
     struct socket_ctx *incoming = tunnel->incoming;
     struct socket_ctx *outgoing = tunnel->outgoing;
     struct client_ctx *ctx = (struct client_ctx *) tunnel->data;
-    struct server_env_t *env = ctx->env;
+    struct server_env_t *env = _upstream_env(ctx);
     struct server_config *config = env->config;
 
     ASSERT(incoming->rdstate == socket_stop);
@@ -836,6 +1382,7 @@ static void tunnel_tls_on_connection_established(struct tunnel_ctx *tunnel) {
 
             tunnel->tunnel_tls_send_data(tunnel, buf, len);
             ctx->stage = tunnel_stage_tls_websocket_upgrade;
+            tunnel_stage_clock(ctx);
 
             free(buf);
         }
@@ -860,6 +1407,7 @@ static void tunnel_tls_on_data_received(struct tunnel_ctx *tunnel, const uint8_t
             tls_client_shutdown(tunnel);
         } else {
             do_socks5_reply_success(tunnel);
+            tunnel_stage_clock(ctx);
         }
         http_headers_destroy(hdrs);
         free(calc_val);
@@ -873,6 +1421,11 @@ static void tunnel_tls_on_data_received(struct tunnel_ctx *tunnel, const uint8_t
         assert(!feedback);
 
         socket_write(incoming, tmp->buffer, tmp->len);
+        if (ctx->bytes_down == 0) {
+            stats_first_byte(ctx->env->stats, ctx->accepted);
+        }
+        ctx->bytes_down += (uint64_t)tmp->len;
+        ctx->env->stats->bytes_down += (uint64_t)tmp->len;
 
         buffer_release(tmp);
         free(payload);
@@ -892,18 +1445,22 @@ static bool can_auth_passwd(const uv_tcp_t *lx, const struct tunnel_ctx *cx) {
 }
 
 static bool can_access(const uv_tcp_t *lx, const struct tunnel_ctx *cx, const struct sockaddr *addr) {
+    const struct client_ctx *ctx = (const struct client_ctx *) cx->data;
     const struct sockaddr_in6 *addr6;
     const struct sockaddr_in *addr4;
     const uint32_t *p;
     uint32_t a, b, c, d;
+    (void)lx;
+
+    if (ctx->env->router) {
+        return acl_router_can_access(ctx->env->router, addr);
+    }
 
 #if !defined(NDEBUG)
     return true;
 #endif
 
-    /* TODO(bnoordhuis) Implement proper access checks.  For now, just reject
-    * traffic to localhost.
-    */
+    /* Without an ACL, just reject traffic to localhost. */
     if (addr->sa_family == AF_INET) {
         addr4 = (const struct sockaddr_in *) addr;
         d = ntohl(addr4->sin_addr.s_addr);
@@ -42,10 +42,14 @@
 #include "obfs.h"
 
 struct server_env_t;
+struct stats_provider;
 
 /* client.c */
 void client_tunnel_initialize(uv_tcp_t *lx, unsigned int idle_timeout);
 void client_shutdown(struct server_env_t *env);
+/* Shrinks the tunnels that were idle since the last call. */
+void client_shrink_idle(struct server_env_t *env);
+extern const struct stats_provider client_stats_provider;
 
 /* getopt.c */
 #if !HAVE_UNISTD_H
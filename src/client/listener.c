@@ -28,6 +28,9 @@
 #include "ssr_executive.h"
 #include "ssr_client_api.h"
 #include "common.h"
+#include "upstream_balancer.h"
+#include "acl_router.h"
+#include "stats.h"
 #if UDP_RELAY_ENABLE
 #include "udprelay.h"
 #endif // UDP_RELAY_ENABLE
@@ -48,11 +51,13 @@ struct ssr_client_state {
 
     uv_signal_t *sigint_watcher;
     uv_signal_t *sigterm_watcher;
+    uv_timer_t *shrink_timer;
 
     bool shutting_down;
     
     int listener_count;
     struct listener_t *listeners;
+    struct stats_server *stats;
 
     void(*feedback_state)(struct ssr_client_state *state, void *p);
     void *ptr;
@@ -61,6 +66,7 @@ struct ssr_client_state {
 static void getaddrinfo_done_cb(uv_getaddrinfo_t *req, int status, struct addrinfo *addrs);
 static void listen_incoming_connection_cb(uv_stream_t *server, int status);
 static void signal_quit(uv_signal_t* handle, int signum);
+static void shrink_timer_cb(uv_timer_t *handle);
 
 int ssr_run_loop_begin(struct server_config *cf, void(*feedback_state)(struct ssr_client_state *state, void *p), void *p) {
     uv_loop_t * loop = NULL;
@@ -79,6 +85,15 @@ int ssr_run_loop_begin(struct server_config *cf, void(*feedback_state)(struct ss
     state->ptr = p;
 
     loop->data = state->env;
+    state->env->stats->started = uv_now(loop);
+
+    state->env->balancer = upstream_balancer_create(loop, state->env);
+    if (cf->acl) {
+        state->env->router = acl_router_create(cf->acl);
+    }
+    if (cf->stats_port) {
+        state->stats = stats_server_create(loop, cf->stats_port, state->env, &client_stats_provider);
+    }
 
     /* Resolve the address of the interface that we should bind to.
     * The getaddrinfo callback starts the server and everything else.
@@ -108,12 +123,18 @@ int ssr_run_loop_begin(struct server_config *cf, void(*feedback_state)(struct ss
     uv_signal_init(loop, state->sigterm_watcher);
     uv_signal_start(state->sigterm_watcher, signal_quit, SIGTERM);
 
+    state->shrink_timer = (uv_timer_t *) calloc(1, sizeof(uv_timer_t));
+    uv_timer_init(loop, state->shrink_timer);
+    uv_timer_start(state->shrink_timer, shrink_timer_cb, SSR_SHRINK_INTERVAL, SSR_SHRINK_INTERVAL);
+
     /* Start the event loop.  Control continues in getaddrinfo_done_cb(). */
     err = uv_run(loop, UV_RUN_DEFAULT);
     if (err != 0) {
         pr_err("uv_run: %s", uv_strerror(err));
     }
 
+    upstream_balancer_destroy(state->env->balancer);
+    acl_router_destroy(state->env->router);
     ssr_cipher_env_release(state->env);
 
     if (state->listeners) {
@@ -122,6 +143,7 @@ int ssr_run_loop_begin(struct server_config *cf, void(*feedback_state)(struct ss
 
     free(state->sigint_watcher);
     free(state->sigterm_watcher);
+    free(state->shrink_timer);
     
     free(state);
 
@@ -146,6 +168,7 @@ void ssr_run_loop_shutdown(struct ssr_client_state *state) {
 
     uv_signal_stop(state->sigint_watcher);
     uv_signal_stop(state->sigterm_watcher);
+    uv_timer_stop(state->shrink_timer);
 
     if (state->listeners && state->listener_count) {
         size_t n = 0;
@@ -167,6 +190,11 @@ void ssr_run_loop_shutdown(struct ssr_client_state *state) {
         }
     }
 
+    upstream_balancer_shutdown(state->env->balancer);
+
+    stats_server_shutdown(state->stats);
+    state->stats = NULL;
+
     client_shutdown(state->env);
 
     pr_info(" ");
@@ -296,7 +324,7 @@ static void getaddrinfo_done_cb(uv_getaddrinfo_t *req, int status, struct addrin
             listener->udp_server = udprelay_begin(loop,
                 cf->listen_host, port,
                 &remote_addr,
-                NULL, 0, cf->idle_timeout,
+                NULL, 0, cf->idle_timeout, cf->udp_max_associations,
                 state->env->cipher,
                 cf->protocol, cf->protocol_param);
         }
@@ -338,3 +366,8 @@ static void signal_quit(uv_signal_t* handle, int signum) {
         break;
     }
 }
+
+static void shrink_timer_cb(uv_timer_t *handle) {
+    struct server_env_t *env = (struct server_env_t *)handle->loop->data;
+    client_shrink_idle(env);
+}
@@ -81,10 +81,12 @@ int main(int argc, char **argv) {
             daemon_wrapper(argv[0], param);
         }
 
+        dump_info_async_start();
         print_remote_info(config);
 
         ssr_run_loop_begin(config, &feedback_state, NULL);
         g_state = NULL;
+        dump_info_async_stop();
 
         err = 0;
     } while(0);
@@ -0,0 +1,204 @@
+#include <stdlib.h>
+#include <string.h>
+#include <uv.h>
+
+#include "common.h"
+#include "dump_info.h"
+#include "sockaddr_universal.h"
+#include "remote_resolver.h"
+
+#define REMOTE_RESOLVER_ADDR_MAX    16
+/* getaddrinfo() doesn't tell the record TTL, so refresh on a fixed period. */
+#define REMOTE_RESOLVER_REFRESH     (5 * 60 * 1000)
+#define REMOTE_RESOLVER_RETRY       (10 * 1000)
+
+struct remote_resolver {
+    char *host;
+    uint16_t port;
+    uv_timer_t timer;
+    uv_getaddrinfo_t req;
+    bool resolving;
+    bool timer_closed;
+    bool shutting_down;
+
+    size_t count;
+    size_t preferred;
+    union sockaddr_universal addrs[REMOTE_RESOLVER_ADDR_MAX];
+};
+
+static void resolver_start(struct remote_resolver *resolver);
+static void resolver_done_cb(uv_getaddrinfo_t *req, int status, struct addrinfo *ai);
+static void resolver_timer_cb(uv_timer_t *handle);
+static void resolver_timer_close_done_cb(uv_handle_t *handle);
+static void resolver_try_free(struct remote_resolver *resolver);
+
+static bool address_equal(const union sockaddr_universal *a, const union sockaddr_universal *b) {
+    if (a->addr.sa_family != b->addr.sa_family) {
+        return false;
+    }
+    if (a->addr.sa_family == AF_INET) {
+        return a->addr4.sin_addr.s_addr == b->addr4.sin_addr.s_addr;
+    }
+    if (a->addr.sa_family == AF_INET6) {
+        return memcmp(&a->addr6.sin6_addr, &b->addr6.sin6_addr, sizeof(a->addr6.sin6_addr)) == 0;
+    }
+    return false;
+}
+
+struct remote_resolver * remote_resolver_create(uv_loop_t *loop, const char *host, uint16_t port) {
+    struct remote_resolver *resolver;
+    if (host == NULL || strlen(host) == 0) {
+        return NULL;
+    }
+    resolver = (struct remote_resolver *) calloc(1, sizeof(*resolver));
+    resolver->host = strdup(host);
+    resolver->port = port;
+    resolver->req.data = resolver;
+    VERIFY(0 == uv_timer_init(loop, &resolver->timer));
+    resolver->timer.data = resolver;
+    resolver_start(resolver);
+    return resolver;
+}
+
+void remote_resolver_shutdown(struct remote_resolver *resolver) {
+    if (resolver == NULL || resolver->shutting_down) {
+        return;
+    }
+    resolver->shutting_down = true;
+    if (resolver->resolving) {
+        uv_cancel((uv_req_t *)&resolver->req);
+    }
+    uv_timer_stop(&resolver->timer);
+    uv_close((uv_handle_t *)&resolver->timer, resolver_timer_close_done_cb);
+}
+
+size_t remote_resolver_count(const struct remote_resolver *resolver) {
+    return resolver ? resolver->count : 0;
+}
+
+size_t remote_resolver_first(const struct remote_resolver *resolver) {
+    return resolver ? resolver->preferred : 0;
+}
+
+bool remote_resolver_get(const struct remote_resolver *resolver, size_t first, size_t attempt, union sockaddr_universal *addr) {
+    if (resolver == NULL || attempt >= resolver->count) {
+        return false;
+    }
+    *addr = resolver->addrs[(first + attempt) % resolver->count];
+    return true;
+}
+
+void remote_resolver_mark_failed(struct remote_resolver *resolver, const union sockaddr_universal *addr) {
+    if (resolver == NULL || resolver->count < 2) {
+        return;
+    }
+    if (address_equal(&resolver->addrs[resolver->preferred], addr)) {
+        resolver->preferred = (resolver->preferred + 1) % resolver->count;
+    }
+}
+
+static void resolver_start(struct remote_resolver *resolver) {
+    struct addrinfo hints = { 0 };
+    int err;
+
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+
+    err = uv_getaddrinfo(resolver->timer.loop, &resolver->req, resolver_done_cb, resolver->host, NULL, &hints);
+    if (err != 0) {
+        pr_err("getaddrinfo(\"%s\"): %s", resolver->host, uv_strerror(err));
+        uv_timer_start(&resolver->timer, resolver_timer_cb, REMOTE_RESOLVER_RETRY, 0);
+        return;
+    }
+    resolver->resolving = true;
+}
+
+static void resolver_done_cb(uv_getaddrinfo_t *req, int status, struct addrinfo *ai) {
+    struct remote_resolver *resolver = (struct remote_resolver *) req->data;
+    union sockaddr_universal addrs[REMOTE_RESOLVER_ADDR_MAX];
+    union sockaddr_universal preferred = { 0 };
+    struct addrinfo *iter;
+    size_t count = 0, n;
+
+    resolver->resolving = false;
+
+    if (resolver->shutting_down) {
+        uv_freeaddrinfo(ai);
+        resolver_try_free(resolver);
+        return;
+    }
+
+    if (status < 0) {
+        // keep the stale addresses, they are still a better guess than nothing.
+        pr_err("lookup error for \"%s\": %s", resolver->host, uv_strerror(status));
+        uv_timer_start(&resolver->timer, resolver_timer_cb, REMOTE_RESOLVER_RETRY, 0);
+        return;
+    }
+
+    for (iter = ai; iter != NULL && count < REMOTE_RESOLVER_ADDR_MAX; iter = iter->ai_next) {
+        union sockaddr_universal tmp = { 0 };
+        bool dup = false;
+        if (iter->ai_family == AF_INET) {
+            tmp.addr4 = *(const struct sockaddr_in *) iter->ai_addr;
+            tmp.addr4.sin_port = htons(resolver->port);
+        } else if (iter->ai_family == AF_INET6) {
+            tmp.addr6 = *(const struct sockaddr_in6 *) iter->ai_addr;
+            tmp.addr6.sin6_port = htons(resolver->port);
+        } else {
+            continue;
+        }
+        for (n = 0; n < count; ++n) {
+            if (address_equal(&addrs[n], &tmp)) {
+                dup = true;
+                break;
+            }
+        }
+        if (dup == false) {
+            addrs[count++] = tmp;
+        }
+    }
+    uv_freeaddrinfo(ai);
+
+    if (count == 0) {
+        pr_err("%s has no IPv4/6 addresses", resolver->host);
+        uv_timer_start(&resolver->timer, resolver_timer_cb, REMOTE_RESOLVER_RETRY, 0);
+        return;
+    }
+
+    if (resolver->count) {
+        preferred = resolver->addrs[resolver->preferred];
+    }
+    memcpy(resolver->addrs, addrs, count * sizeof(addrs[0]));
+    resolver->count = count;
+    resolver->preferred = 0;
+    // stick to the address that has been working if it is still listed.
+    for (n = 0; n < count; ++n) {
+        if (address_equal(&addrs[n], &preferred)) {
+            resolver->preferred = n;
+            break;
+        }
+    }
+
+    uv_timer_start(&resolver->timer, resolver_timer_cb, REMOTE_RESOLVER_REFRESH, 0);
+}
+
+static void resolver_timer_cb(uv_timer_t *handle) {
+    struct remote_resolver *resolver = (struct remote_resolver *) handle->data;
+    if (resolver->shutting_down == false && resolver->resolving == false) {
+        resolver_start(resolver);
+    }
+}
+
+static void resolver_timer_close_done_cb(uv_handle_t *handle) {
+    struct remote_resolver *resolver = (struct remote_resolver *) handle->data;
+    resolver->timer_closed = true;
+    resolver_try_free(resolver);
+}
+
+static void resolver_try_free(struct remote_resolver *resolver) {
+    if (resolver->timer_closed && resolver->resolving == false) {
+        free(resolver->host);
+        free(resolver);
+    }
+}
@@ -0,0 +1,29 @@
+#ifndef __REMOTE_RESOLVER_H__
+#define __REMOTE_RESOLVER_H__ 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+struct uv_loop_s;
+union sockaddr_universal;
+
+/* Addresses of the SSR server host, resolved once at startup and refreshed
+ * in the background, so connections don't wait for a DNS lookup each.
+ */
+struct remote_resolver;
+
+struct remote_resolver * remote_resolver_create(struct uv_loop_s *loop, const char *host, uint16_t port);
+/* Stops refreshing; the object frees itself once its handles are closed. */
+void remote_resolver_shutdown(struct remote_resolver *resolver);
+
+size_t remote_resolver_count(const struct remote_resolver *resolver);
+/* Index of the address new connections should try first. */
+size_t remote_resolver_first(const struct remote_resolver *resolver);
+/* The |attempt|-th address counting from |first|. false when nothing has been
+ * resolved yet or every address has already been tried. */
+bool remote_resolver_get(const struct remote_resolver *resolver, size_t first, size_t attempt, union sockaddr_universal *addr);
+/* Move new connections on to the next address if |addr| is the preferred one. */
+void remote_resolver_mark_failed(struct remote_resolver *resolver, const union sockaddr_universal *addr);
+
+#endif // __REMOTE_RESOLVER_H__
@@ -0,0 +1,343 @@
+#include <stdlib.h>
+#include <string.h>
+#include <uv.h>
+
+#include "common.h"
+#include "dump_info.h"
+#include "ssr_executive.h"
+#include "sockaddr_universal.h"
+#include "remote_resolver.h"
+#include "upstream_pool.h"
+#include "upstream_balancer.h"
+
+#define BALANCER_PROBE_FIRST    1000
+#define BALANCER_PROBE_INTERVAL (10 * 1000)
+#define BALANCER_EJECT_FAILS    3
+#define BALANCER_EJECT_BASE     (10 * 1000)
+#define BALANCER_EJECT_MAX      (5 * 60 * 1000)
+
+enum balancer_policy {
+    balancer_policy_latency,
+    balancer_policy_least_conn,
+    balancer_policy_round_robin,
+};
+
+struct node_probe {
+    uv_tcp_t tcp;
+    uv_connect_t req;
+    struct upstream_node *node;  /* NULL once given up */
+    uint64_t start;  /* uv_hrtime() */
+    uint64_t deadline;  /* uv_now() */
+};
+
+struct upstream_node {
+    struct upstream_balancer *balancer;
+    struct server_env_t *env;
+    bool owns_env;
+    unsigned int weight;
+    int current_weight;
+    unsigned int active;
+    uint64_t srtt;  /* in us, smoothed like TCP's SRTT, 0 while unknown */
+    unsigned int fails;  /* in a row */
+    uint64_t ejected_until;  /* uv_now() */
+    struct node_probe *probe;
+};
+
+struct upstream_balancer {
+    enum balancer_policy policy;
+    uv_timer_t timer;
+    bool shutting_down;
+    size_t count;
+    struct upstream_node *nodes;
+};
+
+static void balancer_timer_cb(uv_timer_t *handle);
+static void probe_start(struct upstream_node *node);
+static void probe_abandon(struct node_probe *probe);
+static void probe_connect_done_cb(uv_connect_t *req, int status);
+static void probe_close_done_cb(uv_handle_t *handle);
+
+static enum balancer_policy balancer_policy_parse(const char *name) {
+    if (name == NULL || strcmp(name, "latency") == 0) {
+        return balancer_policy_latency;
+    }
+    if (strcmp(name, "least_conn") == 0) {
+        return balancer_policy_least_conn;
+    }
+    if (strcmp(name, "round_robin") == 0) {
+        return balancer_policy_round_robin;
+    }
+    pr_warn("unknown server_policy \"%s\", using \"latency\"", name);
+    return balancer_policy_latency;
+}
+
+static void node_init(struct upstream_node *node, uv_loop_t *loop, struct server_env_t *env) {
+    struct server_config *config = env->config;
+    node->env = env;
+    node->weight = config->weight ? config->weight : 1;
+
+    if (config->over_tls_enable == false) {
+        union sockaddr_universal remote_addr = { 0 };
+        if (convert_universal_address(config->remote_host, config->remote_port, &remote_addr) != 0) {
+            /* A host name, look it up now rather than once per connection. */
+            env->resolver = remote_resolver_create(loop, config->remote_host, config->remote_port);
+        }
+    }
+    env->pool = upstream_pool_create(loop, config, env->resolver);
+}
+
+struct upstream_balancer * upstream_balancer_create(uv_loop_t *loop, struct server_env_t *env) {
+    struct upstream_balancer *balancer;
+    struct server_config *config = env->config;
+    size_t n, more = obj_list_size(config->servers);
+
+    balancer = (struct upstream_balancer *) calloc(1, sizeof(*balancer));
+    balancer->policy = balancer_policy_parse(config->server_policy);
+    balancer->count = 1 + more;
+    balancer->nodes = (struct upstream_node *) calloc(balancer->count, sizeof(balancer->nodes[0]));
+
+    for (n = 0; n < balancer->count; ++n) {
+        struct upstream_node *node = balancer->nodes + n;
+        struct server_env_t *node_env = env;
+        node->balancer = balancer;
+        if (n > 0) {
+            struct server_config *cf = *((struct server_config **)obj_list_element_at(config->servers, n - 1));
+            node_env = ssr_cipher_env_create(cf, env->data);
+            node->owns_env = true;
+        }
+        node_init(node, loop, node_env);
+    }
+
+    VERIFY(0 == uv_timer_init(loop, &balancer->timer));
+    balancer->timer.data = balancer;
+    if (balancer->count > 1) {
+        uv_timer_start(&balancer->timer, balancer_timer_cb, BALANCER_PROBE_FIRST, BALANCER_PROBE_INTERVAL);
+    }
+    return balancer;
+}
+
+void upstream_balancer_shutdown(struct upstream_balancer *balancer) {
+    size_t n;
+    if (balancer == NULL || balancer->shutting_down) {
+        return;
+    }
+    balancer->shutting_down = true;
+    uv_timer_stop(&balancer->timer);
+    uv_close((uv_handle_t *)&balancer->timer, NULL);
+
+    for (n = 0; n < balancer->count; ++n) {
+        struct upstream_node *node = balancer->nodes + n;
+        if (node->probe) {
+            probe_abandon(node->probe);
+        }
+        upstream_pool_shutdown(node->env->pool);
+        node->env->pool = NULL;
+        remote_resolver_shutdown(node->env->resolver);
+        node->env->resolver = NULL;
+    }
+}
+
+void upstream_balancer_destroy(struct upstream_balancer *balancer) {
+    size_t n;
+    if (balancer == NULL) {
+        return;
+    }
+    for (n = 0; n < balancer->count; ++n) {
+        struct upstream_node *node = balancer->nodes + n;
+        if (node->owns_env) {
+            ssr_cipher_env_release(node->env);
+        }
+    }
+    free(balancer->nodes);
+    free(balancer);
+}
+
+static bool node_is_ejected(const struct upstream_node *node, uint64_t now) {
+    return node->ejected_until > now;
+}
+
+/* Connect time weighed by the load, so one fast server doesn't take everything,
+ * and doubled for each failure in a row. A server not measured yet is taken
+ * to be as fast as the fastest, so that it gets tried.
+ */
+static uint64_t node_latency_score(const struct upstream_node *node, uint64_t fastest) {
+    uint64_t srtt = node->srtt ? node->srtt : fastest;
+    return ((srtt + 1) * (node->active + 1)) << min(node->fails, 10);
+}
+
+struct upstream_node * upstream_balancer_pick(struct upstream_balancer *balancer) {
+    struct upstream_node *best = NULL;
+    uint64_t now, fastest = 0;
+    bool ignore_ejection = true;
+    int total_weight = 0;
+    size_t n;
+
+    if (balancer == NULL) {
+        return NULL;
+    }
+    if (balancer->count == 1) {
+        best = balancer->nodes;
+        best->active++;
+        return best;
+    }
+    now = uv_now(balancer->timer.loop);
+
+    // with every server ejected, it's still better to try one than to fail.
+    for (n = 0; n < balancer->count; ++n) {
+        struct upstream_node *node = balancer->nodes + n;
+        if (node_is_ejected(node, now) == false) {
+            ignore_ejection = false;
+        }
+        if (node->srtt && (fastest == 0 || node->srtt < fastest)) {
+            fastest = node->srtt;
+        }
+    }
+
+    for (n = 0; n < balancer->count; ++n) {
+        struct upstream_node *node = balancer->nodes + n;
+        if (ignore_ejection == false && node_is_ejected(node, now)) {
+            continue;
+        }
+        switch (balancer->policy) {
+        case balancer_policy_latency:
+            if (best == NULL || node_latency_score(node, fastest) < node_latency_score(best, fastest)) {
+                best = node;
+            }
+            break;
+        case balancer_policy_least_conn:
+            if (best == NULL || (uint64_t)node->active * best->weight < (uint64_t)best->active * node->weight) {
+                best = node;
+            }
+            break;
+        case balancer_policy_round_robin:
+            // smooth weighted round robin, as nginx does it.
+            node->current_weight += (int)node->weight;
+            total_weight += (int)node->weight;
+            if (best == NULL || node->current_weight > best->current_weight) {
+                best = node;
+            }
+            break;
+        default:
+            UNREACHABLE();
+        }
+    }
+    ASSERT(best);
+    if (balancer->policy == balancer_policy_round_robin) {
+        best->current_weight -= total_weight;
+    }
+    best->active++;
+    return best;
+}
+
+struct server_env_t * upstream_node_env(const struct upstream_node *node) {
+    return node->env;
+}
+
+void upstream_node_connected(struct upstream_node *node, uint64_t rtt_us) {
+    if (node->srtt == 0) {
+        node->srtt = rtt_us ? rtt_us : 1;
+    } else {
+        node->srtt = node->srtt - (node->srtt >> 3) + (rtt_us >> 3);
+    }
+    if (node->ejected_until) {
+        pr_info("server %s is back", node->env->config->remote_host);
+    }
+    node->fails = 0;
+    node->ejected_until = 0;
+}
+
+void upstream_node_failed(struct upstream_node *node) {
+    struct upstream_balancer *balancer = node->balancer;
+    uint64_t backoff;
+
+    node->fails++;
+    if (balancer->count == 1 || node->fails < BALANCER_EJECT_FAILS) {
+        return;
+    }
+    backoff = (uint64_t)BALANCER_EJECT_BASE << min(node->fails - BALANCER_EJECT_FAILS, 5);
+    backoff = min(backoff, BALANCER_EJECT_MAX);
+    if (node->ejected_until == 0) {
+        pr_warn("server %s failed %u times in a row, leaving it out", node->env->config->remote_host, node->fails);
+    }
+    node->ejected_until = uv_now(balancer->timer.loop) + backoff;
+}
+
+void upstream_node_release(struct upstream_node *node) {
+    if (node && node->active) {
+        node->active--;
+    }
+}
+
+static void balancer_timer_cb(uv_timer_t *handle) {
+    struct upstream_balancer *balancer = (struct upstream_balancer *) handle->data;
+    uint64_t now = uv_now(handle->loop);
+    size_t n;
+
+    for (n = 0; n < balancer->count; ++n) {
+        struct upstream_node *node = balancer->nodes + n;
+        if (node->probe && now >= node->probe->deadline) {
+            probe_abandon(node->probe);
+            upstream_node_failed(node);
+        }
+        if (node->probe == NULL) {
+            probe_start(node);
+        }
+    }
+}
+
+static void probe_start(struct upstream_node *node) {
+    struct server_config *config = node->env->config;
+    union sockaddr_universal addr = { 0 };
+    struct node_probe *probe;
+    uv_loop_t *loop = node->balancer->timer.loop;
+    int err;
+
+    if (convert_universal_address(config->remote_host, config->remote_port, &addr) != 0) {
+        struct remote_resolver *resolver = node->env->resolver;
+        if (remote_resolver_get(resolver, remote_resolver_first(resolver), 0, &addr) == false) {
+            return;
+        }
+    }
+
+    probe = (struct node_probe *) calloc(1, sizeof(*probe));
+    probe->node = node;
+    probe->start = uv_hrtime();
+    probe->deadline = uv_now(loop) + BALANCER_PROBE_INTERVAL;
+    probe->req.data = probe;
+    probe->tcp.data = probe;
+    VERIFY(0 == uv_tcp_init(loop, &probe->tcp));
+    err = uv_tcp_connect(&probe->req, &probe->tcp, &addr.addr, probe_connect_done_cb);
+    if (err != 0) {
+        uv_close((uv_handle_t *)&probe->tcp, probe_close_done_cb);
+        upstream_node_failed(node);
+        return;
+    }
+    node->probe = probe;
+}
+
+static void probe_abandon(struct node_probe *probe) {
+    probe->node->probe = NULL;
+    probe->node = NULL;
+    // the connect callback still runs, with UV_ECANCELED.
+    uv_close((uv_handle_t *)&probe->tcp, probe_close_done_cb);
+}
+
+static void probe_connect_done_cb(uv_connect_t *req, int status) {
+    struct node_probe *probe = (struct node_probe *) req->data;
+    struct upstream_node *node = probe->node;
+
+    if (node == NULL) {
+        return;
+    }
+    node->probe = NULL;
+    if (status == 0) {
+        upstream_node_connected(node, (uv_hrtime() - probe->start) / 1000);
+    } else {
+        upstream_node_failed(node);
+    }
+    uv_close((uv_handle_t *)&probe->tcp, probe_close_done_cb);
+}
+
+static void probe_close_done_cb(uv_handle_t *handle) {
+    free(handle->data);
+}
@@ -0,0 +1,33 @@
+#ifndef __UPSTREAM_BALANCER_H__
+#define __UPSTREAM_BALANCER_H__ 1
+
+#include <stdint.h>
+
+struct uv_loop_s;
+struct server_env_t;
+
+/* The SSR servers of ssr-client, the top level one and those listed in
+ * "servers". Each has its own server_env_t. Connect times are measured on
+ * real connections and by probing in the background, and servers that keep
+ * failing are left out for a while.
+ */
+struct upstream_balancer;
+struct upstream_node;
+
+/* |env| is the top level server, it stays owned by the caller. */
+struct upstream_balancer * upstream_balancer_create(struct uv_loop_s *loop, struct server_env_t *env);
+/* Stops probing and the per server address caches and pools. */
+void upstream_balancer_shutdown(struct upstream_balancer *balancer);
+/* After the loop has ended. */
+void upstream_balancer_destroy(struct upstream_balancer *balancer);
+
+/* Choose a server for a new connection by the configured policy. */
+struct upstream_node * upstream_balancer_pick(struct upstream_balancer *balancer);
+
+struct server_env_t * upstream_node_env(const struct upstream_node *node);
+void upstream_node_connected(struct upstream_node *node, uint64_t rtt_us);
+void upstream_node_failed(struct upstream_node *node);
+/* The connection that picked |node| is gone. */
+void upstream_node_release(struct upstream_node *node);
+
+#endif // __UPSTREAM_BALANCER_H__
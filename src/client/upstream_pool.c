@@ -0,0 +1,240 @@
+#include <stdlib.h>
+#include <string.h>
+#include <uv.h>
+
+#include "common.h"
+#include "dump_info.h"
+#include "ssr_executive.h"
+#include "sockaddr_universal.h"
+#include "tunnel.h"
+#include "remote_resolver.h"
+#include "upstream_pool.h"
+
+#define UPSTREAM_POOL_SIZE_MAX  64
+#define UPSTREAM_POOL_TICK      1000
+
+enum pool_slot_state {
+    pool_slot_empty,
+    pool_slot_connecting,
+    pool_slot_idle,
+};
+
+struct pool_slot {
+    struct upstream_pool *pool;
+    struct socket_ctx *socket;  /* NULL while a cancelled connect is winding down */
+    enum pool_slot_state state;
+    uint64_t idle_since;
+};
+
+struct upstream_pool {
+    struct remote_resolver *resolver; // __weak_ptr
+    union sockaddr_universal literal;
+    bool has_literal;
+    unsigned int idle_timeout;
+    unsigned int max_idle;
+    size_t size;
+    uv_timer_t timer;
+    bool timer_closed;
+    bool shutting_down;
+    size_t connecting;
+    char scratch[64];
+    struct pool_slot slots[UPSTREAM_POOL_SIZE_MAX];
+};
+
+static void pool_refill(struct upstream_pool *pool);
+static void pool_timer_cb(uv_timer_t *handle);
+static void pool_timer_close_done_cb(uv_handle_t *handle);
+static void pool_connect_done_cb(uv_connect_t *req, int status);
+static void pool_alloc_cb(uv_handle_t *handle, size_t size, uv_buf_t *buf);
+static void pool_read_done_cb(uv_stream_t *handle, ssize_t nread, const uv_buf_t *buf);
+static void pool_slot_drop(struct pool_slot *slot);
+static void pool_try_free(struct upstream_pool *pool);
+
+struct upstream_pool * upstream_pool_create(uv_loop_t *loop, const struct server_config *config, struct remote_resolver *resolver) {
+    struct upstream_pool *pool;
+    size_t n;
+
+    if (config->connection_pool_size == 0 || config->over_tls_enable) {
+        return NULL;
+    }
+    pool = (struct upstream_pool *) calloc(1, sizeof(*pool));
+    pool->resolver = resolver;
+    if (convert_universal_address(config->remote_host, config->remote_port, &pool->literal) == 0) {
+        pool->has_literal = true;
+    }
+    pool->idle_timeout = config->idle_timeout;
+    pool->max_idle = config->connection_pool_max_idle;
+    pool->size = config->connection_pool_size;
+    if (pool->size > UPSTREAM_POOL_SIZE_MAX) {
+        pool->size = UPSTREAM_POOL_SIZE_MAX;
+    }
+    for (n = 0; n < pool->size; ++n) {
+        pool->slots[n].pool = pool;
+    }
+    VERIFY(0 == uv_timer_init(loop, &pool->timer));
+    pool->timer.data = pool;
+    uv_timer_start(&pool->timer, pool_timer_cb, 0, UPSTREAM_POOL_TICK);
+    return pool;
+}
+
+void upstream_pool_shutdown(struct upstream_pool *pool) {
+    size_t n;
+    if (pool == NULL || pool->shutting_down) {
+        return;
+    }
+    pool->shutting_down = true;
+    for (n = 0; n < pool->size; ++n) {
+        struct pool_slot *slot = pool->slots + n;
+        if (slot->state == pool_slot_idle) {
+            pool_slot_drop(slot);
+        } else if (slot->state == pool_slot_connecting && slot->socket) {
+            // closing the handle cancels the connect, its callback still runs.
+            socket_detached_release(slot->socket);
+            slot->socket = NULL;
+        }
+    }
+    uv_timer_stop(&pool->timer);
+    uv_close((uv_handle_t *)&pool->timer, pool_timer_close_done_cb);
+}
+
+struct socket_ctx * upstream_pool_take(struct upstream_pool *pool) {
+    struct pool_slot *found = NULL;
+    struct socket_ctx *socket;
+    size_t n;
+
+    if (pool == NULL || pool->shutting_down) {
+        return NULL;
+    }
+    // the youngest connection is the least likely one to be dropped by the server.
+    for (n = 0; n < pool->size; ++n) {
+        struct pool_slot *slot = pool->slots + n;
+        if (slot->state == pool_slot_idle && (found == NULL || slot->idle_since > found->idle_since)) {
+            found = slot;
+        }
+    }
+    if (found == NULL) {
+        return NULL;
+    }
+    socket = found->socket;
+    uv_read_stop(&socket->handle.stream);
+    socket->handle.handle.data = NULL;
+    found->socket = NULL;
+    found->state = pool_slot_empty;
+
+    pool_refill(pool);
+    return socket;
+}
+
+static bool pool_address(struct upstream_pool *pool, union sockaddr_universal *addr) {
+    if (pool->has_literal) {
+        *addr = pool->literal;
+        return true;
+    }
+    return remote_resolver_get(pool->resolver, remote_resolver_first(pool->resolver), 0, addr);
+}
+
+static void pool_refill(struct upstream_pool *pool) {
+    union sockaddr_universal addr = { 0 };
+    size_t n;
+
+    if (pool->shutting_down || pool_address(pool, &addr) == false) {
+        return;
+    }
+    for (n = 0; n < pool->size; ++n) {
+        struct pool_slot *slot = pool->slots + n;
+        struct socket_ctx *socket;
+        int err;
+        if (slot->state != pool_slot_empty) {
+            continue;
+        }
+        socket = socket_detached_create(pool->timer.loop, pool->idle_timeout);
+        socket->addr = addr;
+        socket->t.connect_req.data = slot;
+        err = uv_tcp_connect(&socket->t.connect_req, &socket->handle.tcp, &socket->addr.addr, pool_connect_done_cb);
+        if (err != 0) {
+            pr_err("connection pool: connect error: %s", uv_strerror(err));
+            socket_detached_release(socket);
+            break;
+        }
+        slot->socket = socket;
+        slot->state = pool_slot_connecting;
+        pool->connecting++;
+    }
+}
+
+static void pool_timer_cb(uv_timer_t *handle) {
+    struct upstream_pool *pool = (struct upstream_pool *) handle->data;
+    uint64_t now = uv_now(handle->loop);
+    size_t n;
+
+    for (n = 0; n < pool->size; ++n) {
+        struct pool_slot *slot = pool->slots + n;
+        if (slot->state == pool_slot_idle && now - slot->idle_since >= pool->max_idle) {
+            pool_slot_drop(slot);
+        }
+    }
+    pool_refill(pool);
+}
+
+static void pool_timer_close_done_cb(uv_handle_t *handle) {
+    struct upstream_pool *pool = (struct upstream_pool *) handle->data;
+    pool->timer_closed = true;
+    pool_try_free(pool);
+}
+
+static void pool_connect_done_cb(uv_connect_t *req, int status) {
+    struct pool_slot *slot = (struct pool_slot *) req->data;
+    struct upstream_pool *pool = slot->pool;
+
+    pool->connecting--;
+
+    if (slot->socket == NULL) {
+        // released by upstream_pool_shutdown().
+        slot->state = pool_slot_empty;
+        pool_try_free(pool);
+        return;
+    }
+
+    if (status < 0) {
+        // retried on the next tick, not right away, the server may be down.
+        socket_detached_release(slot->socket);
+        slot->socket = NULL;
+        slot->state = pool_slot_empty;
+        return;
+    }
+
+    slot->state = pool_slot_idle;
+    slot->idle_since = uv_now(req->handle->loop);
+    slot->socket->handle.handle.data = slot;
+    // the server never talks first, so any read result means the connection is gone.
+    VERIFY(0 == uv_read_start(&slot->socket->handle.stream, pool_alloc_cb, pool_read_done_cb));
+}
+
+static void pool_alloc_cb(uv_handle_t *handle, size_t size, uv_buf_t *buf) {
+    struct pool_slot *slot = (struct pool_slot *) handle->data;
+    *buf = uv_buf_init(slot->pool->scratch, sizeof(slot->pool->scratch));
+    (void)size;
+}
+
+static void pool_read_done_cb(uv_stream_t *handle, ssize_t nread, const uv_buf_t *buf) {
+    struct pool_slot *slot = (struct pool_slot *) handle->data;
+    (void)buf;
+    if (nread == 0) {
+        return;
+    }
+    pool_slot_drop(slot);
+}
+
+static void pool_slot_drop(struct pool_slot *slot) {
+    ASSERT(slot->state == pool_slot_idle);
+    uv_read_stop(&slot->socket->handle.stream);
+    socket_detached_release(slot->socket);
+    slot->socket = NULL;
+    slot->state = pool_slot_empty;
+}
+
+static void pool_try_free(struct upstream_pool *pool) {
+    if (pool->shutting_down && pool->timer_closed && pool->connecting == 0) {
+        free(pool);
+    }
+}
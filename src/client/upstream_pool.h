@@ -0,0 +1,27 @@
+#ifndef __UPSTREAM_POOL_H__
+#define __UPSTREAM_POOL_H__ 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct uv_loop_s;
+struct server_config;
+struct remote_resolver;
+struct socket_ctx;
+
+/* Idle TCP connections to the SSR server, opened ahead of time so a new
+ * SOCKS request doesn't pay for the TCP handshake. Connections are closed
+ * after max_idle, well before the server would drop them, and refilled
+ * in the background.
+ */
+struct upstream_pool;
+
+/* NULL if the pool is disabled by the configuration. */
+struct upstream_pool * upstream_pool_create(struct uv_loop_s *loop, const struct server_config *config, struct remote_resolver *resolver);
+/* Closes the idle connections; the object frees itself once they are gone. */
+void upstream_pool_shutdown(struct upstream_pool *pool);
+
+/* A connected socket for tunnel_attach_outgoing(), NULL if none is ready. */
+struct socket_ctx * upstream_pool_take(struct upstream_pool *pool);
+
+#endif // __UPSTREAM_POOL_H__
@@ -24,6 +24,27 @@ bool json_iter_extract_object(const char *key, const struct json_object_iter *it
     return result;
 }
 
+bool json_iter_extract_array(const char *key, const struct json_object_iter *iter, const struct json_object **value) {
+    bool result = false;
+    do {
+        struct json_object *val;
+        if (key == NULL || iter == NULL || value == NULL) {
+            break;
+        }
+        *value = NULL;
+        if (strcmp(iter->key, key) != 0) {
+            break;
+        }
+        val = iter->val;
+        if (json_type_array != json_object_get_type(val)) {
+            break;
+        }
+        *value = val;
+        result = true;
+    } while (0);
+    return result;
+}
+
 bool json_iter_extract_string(const char *key, const struct json_object_iter *iter, const char **value) {
     bool result = false;
     do {
@@ -88,11 +109,116 @@ bool json_iter_extract_bool(const char *key, const struct json_object_iter *iter
     return result;
 }
 
+/*
+ * "users": { "1001": "password", "1002": { "password": "...", "protocol_param": "..." } }
+ */
+static void parse_config_users(const struct json_object *users, struct server_config *config) {
+    struct json_object_iter iter = { NULL };
+    json_object_object_foreachC(users, iter) {
+        const char *password = NULL;
+        const char *protocol_param = NULL;
+        const struct json_object *obj_obj = NULL;
+        char *end = NULL;
+        unsigned long uid = strtoul(iter.key, &end, 10);
+        if (end == iter.key || *end != '\0' || uid > UINT32_MAX) {
+            continue;
+        }
+        if (json_iter_extract_string(iter.key, &iter, &password) == false &&
+            json_iter_extract_object(iter.key, &iter, &obj_obj))
+        {
+            struct json_object_iter iter2 = { NULL };
+            json_object_object_foreachC(obj_obj, iter2) {
+                const char *obj_str2 = NULL;
+                if (json_iter_extract_string("password", &iter2, &obj_str2)) {
+                    password = obj_str2;
+                    continue;
+                }
+                if (json_iter_extract_string("protocol_param", &iter2, &obj_str2)) {
+                    protocol_param = obj_str2;
+                    continue;
+                }
+            }
+        }
+        config_add_user(config, (uint32_t)uid, password, protocol_param);
+    }
+}
+
+/*
+ * Settings of one server, at the top level or in an entry of "servers".
+ */
+static bool parse_server_settings(const struct json_object_iter *iter, struct server_config *config) {
+    int obj_int = 0;
+    const char *obj_str = NULL;
+    if (json_iter_extract_string("server", iter, &obj_str)) {
+        string_safe_assign(&config->remote_host, obj_str);
+        return true;
+    }
+    if (json_iter_extract_int("server_port", iter, &obj_int)) {
+        config->remote_port = obj_int;
+        return true;
+    }
+    if (json_iter_extract_string("password", iter, &obj_str)) {
+        string_safe_assign(&config->password, obj_str);
+        return true;
+    }
+    if (json_iter_extract_string("method", iter, &obj_str)) {
+        string_safe_assign(&config->method, obj_str);
+        return true;
+    }
+    if (json_iter_extract_string("protocol", iter, &obj_str)) {
+        if (obj_str && strcmp(obj_str, "verify_sha1") == 0) {
+            // LOGI("The verify_sha1 protocol is deprecate! Fallback to origin protocol.");
+            obj_str = NULL;
+        }
+        string_safe_assign(&config->protocol, obj_str);
+        return true;
+    }
+    if (json_iter_extract_string("protocol_param", iter, &obj_str)) {
+        string_safe_assign(&config->protocol_param, obj_str);
+        return true;
+    }
+    if (json_iter_extract_string("obfs", iter, &obj_str)) {
+        string_safe_assign(&config->obfs, obj_str);
+        return true;
+    }
+    if (json_iter_extract_string("obfs_param", iter, &obj_str)) {
+        string_safe_assign(&config->obfs_param, obj_str);
+        return true;
+    }
+    if (json_iter_extract_int("weight", iter, &obj_int)) {
+        config->weight = (obj_int > 0) ? (unsigned int) obj_int : 1;
+        return true;
+    }
+    return false;
+}
+
+/*
+ * "servers": [ { "server": "...", "server_port": 443, "weight": 2, ... }, ... ]
+ * Settings an entry leaves out are taken from the top level.
+ */
+static void parse_config_servers(const struct json_object *servers, struct server_config *config) {
+    size_t n, count = json_object_array_length((struct json_object *)servers);
+    for (n = 0; n < count; ++n) {
+        struct json_object *item = json_object_array_get_idx((struct json_object *)servers, n);
+        struct json_object_iter iter = { NULL };
+        struct server_config *server;
+        if (json_type_object != json_object_get_type(item)) {
+            continue;
+        }
+        server = config_clone(config);
+        json_object_object_foreachC(item, iter) {
+            parse_server_settings(&iter, server);
+        }
+        config_add_server(config, server);
+    }
+}
+
 bool parse_config_file(const char *file, struct server_config *config) {
     bool result = false;
     json_object *jso = NULL;
     do {
         struct json_object_iter iter = { NULL };
+        const struct json_object *servers = NULL;
 
         jso = json_object_from_file(file);
         if (jso == NULL) {
@@ -111,40 +237,18 @@ bool parse_config_file(const char *file, struct server_config *config) {
                 config->listen_port = obj_int;
                 continue;
             }
-            if (json_iter_extract_string("server", &iter, &obj_str)) {
-                string_safe_assign(&config->remote_host, obj_str);
+            if (parse_server_settings(&iter, config)) {
                 continue;
             }
-            if (json_iter_extract_int("server_port", &iter, &obj_int)) {
-                config->remote_port = obj_int;
+            if (json_iter_extract_array("servers", &iter, &servers)) {
                 continue;
             }
-            if (json_iter_extract_string("password", &iter, &obj_str)) {
-                string_safe_assign(&config->password, obj_str);
+            if (json_iter_extract_string("server_policy", &iter, &obj_str)) {
+                string_safe_assign(&config->server_policy, obj_str);
                 continue;
             }
-            if (json_iter_extract_string("method", &iter, &obj_str)) {
-                string_safe_assign(&config->method, obj_str);
-                continue;
-            }
-            if (json_iter_extract_string("protocol", &iter, &obj_str)) {
-                if (obj_str && strcmp(obj_str, "verify_sha1") == 0) {
-                    // LOGI("The verify_sha1 protocol is deprecate! Fallback to origin protocol.");
-                    obj_str = NULL;
-                }
-                string_safe_assign(&config->protocol, obj_str);
-                continue;
-            }
-            if (json_iter_extract_string("protocol_param", &iter, &obj_str)) {
-                string_safe_assign(&config->protocol_param, obj_str);
-                continue;
-            }
-            if (json_iter_extract_string("obfs", &iter, &obj_str)) {
-                string_safe_assign(&config->obfs, obj_str);
-                continue;
-            }
-            if (json_iter_extract_string("obfs_param", &iter, &obj_str)) {
-                string_safe_assign(&config->obfs_param, obj_str);
+            if (json_iter_extract_string("acl", &iter, &obj_str)) {
+                string_safe_assign(&config->acl, obj_str);
                 continue;
             }
             if (json_iter_extract_bool("over_tls_enable", &iter, &obj_bool)) {
@@ -155,6 +259,8 @@ bool parse_config_file(const char *file, struct server_config *config) {
                 struct json_object_iter iter2 = { NULL };
                 json_object_object_foreachC(obj_obj, iter2) {
                     const char *obj_str2 = NULL;
+                    int obj_int2 = 0;
+                    bool obj_bool2 = false;
                     if (json_iter_extract_string("server_domain", &iter2, &obj_str2)) {
                         string_safe_assign(&config->over_tls_server_domain, obj_str2);
                         continue;
@@ -167,17 +273,84 @@ bool parse_config_file(const char *file, struct server_config *config) {
                         string_safe_assign(&config->over_tls_root_cert_file, obj_str2);
                         continue;
                     }
+                    if (json_iter_extract_string("cert_file", &iter2, &obj_str2)) {
+                        string_safe_assign(&config->over_tls_cert_file, obj_str2);
+                        continue;
+                    }
+                    if (json_iter_extract_string("key_file", &iter2, &obj_str2)) {
+                        string_safe_assign(&config->over_tls_key_file, obj_str2);
+                        continue;
+                    }
+                    if (json_iter_extract_string("alpn", &iter2, &obj_str2)) {
+                        string_safe_assign(&config->over_tls_alpn, obj_str2);
+                        continue;
+                    }
+                    if (json_iter_extract_bool("session_tickets", &iter2, &obj_bool2)) {
+                        config->over_tls_session_tickets = obj_bool2;
+                        continue;
+                    }
+                    if (json_iter_extract_int("record_size", &iter2, &obj_int2)) {
+                        config->over_tls_record_size = (unsigned int) obj_int2;
+                        continue;
+                    }
                 }
                 continue;
             }
+            if (json_iter_extract_object("users", &iter, &obj_obj)) {
+                parse_config_users(obj_obj, config);
+                continue;
+            }
             if (json_iter_extract_int("timeout", &iter, &obj_int)) {
                 config->idle_timeout = obj_int * MILLISECONDS_PER_SECOND;
                 continue;
             }
+            if (json_iter_extract_object("connection_pool", &iter, &obj_obj)) {
+                struct json_object_iter iter2 = { NULL };
+                json_object_object_foreachC(obj_obj, iter2) {
+                    int obj_int2 = 0;
+                    if (json_iter_extract_int("size", &iter2, &obj_int2)) {
+                        config->connection_pool_size = (unsigned int) obj_int2;
+                        continue;
+                    }
+                    if (json_iter_extract_int("max_idle", &iter2, &obj_int2)) {
+                        config->connection_pool_max_idle = (unsigned int) obj_int2 * MILLISECONDS_PER_SECOND;
+                        continue;
+                    }
+                }
+                continue;
+            }
+            if (json_iter_extract_bool("socks5_optimistic_reply", &iter, &obj_bool)) {
+                config->socks5_optimistic_reply = obj_bool;
+                continue;
+            }
+            if (json_iter_extract_int("first_data_wait", &iter, &obj_int)) {
+                config->first_data_wait = (unsigned int) obj_int;
+                continue;
+            }
+            if (json_iter_extract_bool("fast_open", &iter, &obj_bool)) {
+                config->fast_open = obj_bool;
+                continue;
+            }
+            if (json_iter_extract_int("fast_open_qlen", &iter, &obj_int)) {
+                config->fast_open_qlen = (unsigned int) obj_int;
+                continue;
+            }
             if (json_iter_extract_bool("udp", &iter, &obj_bool)) {
                 config->udp = obj_bool;
                 continue;
             }
+            if (json_iter_extract_int("udp_max_associations", &iter, &obj_int)) {
+                config->udp_max_associations = (unsigned int) obj_int;
+                continue;
+            }
+            if (json_iter_extract_int("stats_port", &iter, &obj_int)) {
+                config->stats_port = (unsigned short) obj_int;
+                continue;
+            }
+        }
+        if (servers) {
+            // after the loop, so that entries inherit every top level setting.
+            parse_config_servers(servers, config);
         }
         result = true;
     } while (0);
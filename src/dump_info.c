@@ -2,6 +2,8 @@
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <uv.h>
 
 #include "dump_info.h"
 #include "text_in_color.h"
@@ -42,37 +44,39 @@ typedef enum dump_level {
     dump_level_max,
 } dump_level;
 
-static void pr_do(FILE *stream, dump_level level, const char *fmt, va_list ap);
+#define DUMP_LINE_MAX        1024
+#define DUMP_RING_SLOTS      128  /* lines waiting for the writer, a power of two */
+#define DUMP_RATE_KEYS       64
+#define DUMP_RATE_PROBES     8
+#define DUMP_RATE_PER_SECOND 20  /* lines of one format a second, the rest are only counted */
+
+static void pr_do(dump_level level, const char *fmt, va_list ap);
 
 void pr_info(const char *fmt, ...) {
     va_list ap;
     va_start(ap, fmt);
-    pr_do(stdout, dump_level_info, fmt, ap);
+    pr_do(dump_level_info, fmt, ap);
     va_end(ap);
 }
 
 void pr_warn(const char *fmt, ...) {
     va_list ap;
     va_start(ap, fmt);
-    pr_do(stderr, dump_level_warn, fmt, ap);
+    pr_do(dump_level_warn, fmt, ap);
     va_end(ap);
 }
 
 void pr_err(const char *fmt, ...) {
     va_list ap;
     va_start(ap, fmt);
-    pr_do(stderr, dump_level_error, fmt, ap);
+    pr_do(dump_level_error, fmt, ap);
     va_end(ap);
 }
 
-static void pr_do(FILE *stream, dump_level level, const char *fmt, va_list ap) {
-    static const int size = 1024;
-    char *fmtbuf = (char *) calloc(size, sizeof(fmtbuf[0]));
-    char *p;
+static void dump_write(dump_level level, const char *text) {
+    char line[DUMP_LINE_MAX * 2];
     const char *label = NULL;
     enum text_color color = text_color_white;
-    vsnprintf(fmtbuf, size, fmt, ap);
-    p = (char *) calloc(size * 2, sizeof(*p));
 
 #define DUMP_LEVEL_ENUM(item, info_text, txt_color) case (item): label = (info_text); color=txt_color; break;
     switch (level) {
@@ -82,13 +86,307 @@ static void pr_do(FILE *stream, dump_level level, const char *fmt, va_list ap) {
 #undef DUMP_LEVEL_ENUM
 
     if (info_callback) {
-        sprintf(p, "%s:%s: %s\n", get_app_name(), label, fmtbuf);
-        info_callback(p, info_callback_p);
+        snprintf(line, sizeof(line), "%s:%s: %s\n", get_app_name(), label, text);
+        info_callback(line, info_callback_p);
     } else {
+        FILE *stream = (level == dump_level_info) ? stdout : stderr;
         fprintf(stream, "%s:%s: ", get_app_name(), label);
-        sprintf(p, "%s\n", fmtbuf);
-        print_text_in_color(stream, p, color);
+        snprintf(line, sizeof(line), "%s\n", text);
+        print_text_in_color(stream, line, color);
+    }
+}
+
+#if defined(__GNUC__)
+
+/* Rate limit, by the format string, which stands for the call site. The
+ * counters are atomics, any thread may log.
+ */
+struct dump_rate {
+    const char *fmt;  /* claimed once and kept */
+    dump_level level;
+    uint64_t window;  /* the second, then the lines in it, swapped as one */
+    uint32_t suppressed;  /* not reported yet */
+    uint32_t reported;  /* second of the last report */
+};
+
+static struct dump_rate dump_rates[DUMP_RATE_KEYS];
+static size_t dump_suppressed_total;
+static size_t dump_dropped_total;
+static uint32_t dump_dropped_pending;
+
+static uint32_t dump_second(void) {
+    return (uint32_t)(uv_hrtime() / 1000000000);
+}
+
+static struct dump_rate * dump_rate_find(const char *fmt) {
+    size_t index = (size_t)(((uintptr_t)fmt >> 3) % DUMP_RATE_KEYS);
+    size_t n;
+    for (n = 0; n < DUMP_RATE_PROBES; ++n) {
+        struct dump_rate *rate = &dump_rates[(index + n) % DUMP_RATE_KEYS];
+        const char *key = __atomic_load_n(&rate->fmt, __ATOMIC_ACQUIRE);
+        if (key == NULL) {
+            __atomic_compare_exchange_n(&rate->fmt, &key, fmt, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+            if (key == NULL) {
+                return rate;  /* claimed it */
+            }
+        }
+        if (key == fmt) {
+            return rate;
+        }
+    }
+    return NULL;  /* too many formats, the rest go unlimited */
+}
+
+/* Whether one more line of |fmt| fits in this second; |take| counts it in.
+ * A line that doesn't fit is counted as suppressed.
+ */
+static bool dump_rate_allows(const char *fmt, dump_level level, bool take) {
+    struct dump_rate *rate = dump_rate_find(fmt);
+    uint32_t second = dump_second();
+    uint64_t window;
+    if (rate == NULL) {
+        return true;
+    }
+    window = __atomic_load_n(&rate->window, __ATOMIC_RELAXED);
+    for (;;) {
+        // a new second starts the count over in the same swap that counts the line.
+        uint32_t count = ((uint32_t)(window >> 32) == second) ? (uint32_t)window : 0;
+        if (count >= DUMP_RATE_PER_SECOND) {
+            __atomic_add_fetch(&rate->suppressed, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&dump_suppressed_total, 1, __ATOMIC_RELAXED);
+            return false;
+        }
+        if (take == false) {
+            return true;
+        }
+        if (__atomic_compare_exchange_n(&rate->window, &window, ((uint64_t)second << 32) | (count + 1),
+                                        true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        {
+            break;
+        }
+    }
+    __atomic_store_n(&rate->level, level, __ATOMIC_RELAXED);
+    return true;
+}
+
+/* Tells what was held back, at most once a second for each format. */
+static void dump_rate_report(void) {
+    char text[DUMP_LINE_MAX];
+    uint32_t second = dump_second();
+    uint32_t count;
+    size_t n;
+
+    if (__atomic_load_n(&dump_dropped_pending, __ATOMIC_RELAXED)
+        && (count = __atomic_exchange_n(&dump_dropped_pending, 0, __ATOMIC_RELAXED)) != 0)
+    {
+        snprintf(text, sizeof(text), "%u log lines dropped, the writer fell behind", count);
+        dump_write(dump_level_warn, text);
+    }
+    for (n = 0; n < DUMP_RATE_KEYS; ++n) {
+        struct dump_rate *rate = &dump_rates[n];
+        if (__atomic_load_n(&rate->suppressed, __ATOMIC_RELAXED) == 0
+            || __atomic_load_n(&rate->reported, __ATOMIC_RELAXED) == second)
+        {
+            continue;
+        }
+        __atomic_store_n(&rate->reported, second, __ATOMIC_RELAXED);
+        count = __atomic_exchange_n(&rate->suppressed, 0, __ATOMIC_RELAXED);
+        if (count) {
+            snprintf(text, sizeof(text), "%u more lines like \"%s\" suppressed", count, rate->fmt);
+            dump_write(__atomic_load_n(&rate->level, __ATOMIC_RELAXED), text);
+        }
+    }
+}
+
+/* Lines for the writer thread, a bounded queue after Dmitry Vyukov's: the
+ * loggers claim a slot with one compare and swap and format into it, and
+ * only wake the writer, under its lock, when it is asleep.
+ */
+struct dump_slot {
+    size_t sequence;
+    dump_level level;
+    char text[DUMP_LINE_MAX];
+};
+
+struct dump_writer {
+    struct dump_slot *slots;
+    size_t head;  /* next slot to claim */
+    size_t tail;  /* next slot to write, the writer's own */
+    int sleeping;
+    int stopping;
+    uv_thread_t thread;
+    uv_mutex_t mutex;
+    uv_cond_t wake;
+};
+
+static struct dump_writer *dump_writer;
+static size_t dump_in_flight;  /* pr_do calls that may still use dump_writer */
+
+static bool dump_enqueue(struct dump_writer *w, dump_level level, const char *fmt, va_list ap) {
+    size_t pos = __atomic_load_n(&w->head, __ATOMIC_RELAXED);
+    struct dump_slot *slot;
+    for (;;) {
+        intptr_t diff;
+        slot = &w->slots[pos & (DUMP_RING_SLOTS - 1)];
+        diff = (intptr_t)__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - (intptr_t)pos;
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&w->head, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return false;  /* full */
+        } else {
+            pos = __atomic_load_n(&w->head, __ATOMIC_RELAXED);
+        }
+    }
+    slot->level = level;
+    vsnprintf(slot->text, sizeof(slot->text), fmt, ap);
+    __atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_SEQ_CST);
+
+    if (__atomic_exchange_n(&w->sleeping, 0, __ATOMIC_SEQ_CST)) {
+        uv_mutex_lock(&w->mutex);
+        uv_cond_signal(&w->wake);
+        uv_mutex_unlock(&w->mutex);
+    }
+    return true;
+}
+
+static void dump_writer_run(void *arg) {
+    struct dump_writer *w = (struct dump_writer *) arg;
+    for (;;) {
+        struct dump_slot *slot = &w->slots[w->tail & (DUMP_RING_SLOTS - 1)];
+        if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) == w->tail + 1) {
+            dump_write(slot->level, slot->text);
+            __atomic_store_n(&slot->sequence, w->tail + DUMP_RING_SLOTS, __ATOMIC_RELEASE);
+            w->tail++;
+            continue;
+        }
+        dump_rate_report();
+        if (__atomic_load_n(&w->stopping, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+        // asleep until a line comes, or a second on for the reports.
+        uv_mutex_lock(&w->mutex);
+        __atomic_store_n(&w->sleeping, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&slot->sequence, __ATOMIC_SEQ_CST) != w->tail + 1
+            && __atomic_load_n(&w->stopping, __ATOMIC_SEQ_CST) == 0)
+        {
+            uv_cond_timedwait(&w->wake, &w->mutex, 1000000000);
+        }
+        __atomic_store_n(&w->sleeping, 0, __ATOMIC_SEQ_CST);
+        uv_mutex_unlock(&w->mutex);
+    }
+    fflush(stdout);
+}
+
+bool dump_info_async_start(void) {
+    struct dump_writer *w;
+    size_t n;
+    if (dump_writer) {
+        return true;
+    }
+    w = (struct dump_writer *) calloc(1, sizeof(*w));
+    w->slots = (struct dump_slot *) calloc(DUMP_RING_SLOTS, sizeof(w->slots[0]));
+    for (n = 0; n < DUMP_RING_SLOTS; ++n) {
+        w->slots[n].sequence = n;
+    }
+    uv_mutex_init(&w->mutex);
+    uv_cond_init(&w->wake);
+    if (uv_thread_create(&w->thread, dump_writer_run, w) != 0) {
+        uv_cond_destroy(&w->wake);
+        uv_mutex_destroy(&w->mutex);
+        free(w->slots);
+        free(w);
+        return false;
+    }
+    __atomic_store_n(&dump_writer, w, __ATOMIC_RELEASE);
+    return true;
+}
+
+void dump_info_async_stop(void) {
+    struct dump_writer *w = __atomic_exchange_n(&dump_writer, NULL, __ATOMIC_SEQ_CST);
+    if (w == NULL) {
+        return;
     }
-    free(p);
-    free(fmtbuf);
+    // new lines go out in place now; wait out those that still hold |w|,
+    // each only for as long as it takes to fill a slot.
+    while (__atomic_load_n(&dump_in_flight, __ATOMIC_SEQ_CST) != 0) {
+    }
+    __atomic_store_n(&w->stopping, 1, __ATOMIC_SEQ_CST);
+    uv_mutex_lock(&w->mutex);
+    uv_cond_signal(&w->wake);
+    uv_mutex_unlock(&w->mutex);
+    uv_thread_join(&w->thread);
+
+    uv_cond_destroy(&w->wake);
+    uv_mutex_destroy(&w->mutex);
+    free(w->slots);
+    free(w);
 }
+
+bool pr_suppressed(const char *fmt) {
+    return dump_rate_allows(fmt, dump_level_info, false) == false;
+}
+
+void dump_info_counters(size_t *suppressed, size_t *dropped) {
+    *suppressed = __atomic_load_n(&dump_suppressed_total, __ATOMIC_RELAXED);
+    *dropped = __atomic_load_n(&dump_dropped_total, __ATOMIC_RELAXED);
+}
+
+static void pr_do(dump_level level, const char *fmt, va_list ap) {
+    char text[DUMP_LINE_MAX];
+    struct dump_writer *writer;
+
+    // checked before anything is formatted, a flood costs little more than this.
+    if (dump_rate_allows(fmt, level, true) == false) {
+        if (__atomic_load_n(&dump_writer, __ATOMIC_ACQUIRE) == NULL) {
+            dump_rate_report();
+        }
+        return;
+    }
+    // counted in before the writer is read, so dump_info_async_stop can't
+    // free it under us.
+    __atomic_add_fetch(&dump_in_flight, 1, __ATOMIC_SEQ_CST);
+    writer = __atomic_load_n(&dump_writer, __ATOMIC_SEQ_CST);
+    if (writer) {
+        if (dump_enqueue(writer, level, fmt, ap) == false) {
+            __atomic_add_fetch(&dump_dropped_pending, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&dump_dropped_total, 1, __ATOMIC_RELAXED);
+        }
+        __atomic_sub_fetch(&dump_in_flight, 1, __ATOMIC_RELEASE);
+        return;
+    }
+    __atomic_sub_fetch(&dump_in_flight, 1, __ATOMIC_RELEASE);
+    dump_rate_report();
+    vsnprintf(text, sizeof(text), fmt, ap);
+    dump_write(level, text);
+}
+
+#else
+
+// no atomics to build the queue and the rate limit on, lines go out in place.
+
+bool dump_info_async_start(void) {
+    return false;
+}
+
+void dump_info_async_stop(void) {
+}
+
+bool pr_suppressed(const char *fmt) {
+    (void)fmt;
+    return false;
+}
+
+void dump_info_counters(size_t *suppressed, size_t *dropped) {
+    *suppressed = 0;
+    *dropped = 0;
+}
+
+static void pr_do(dump_level level, const char *fmt, va_list ap) {
+    char text[DUMP_LINE_MAX];
+    vsnprintf(text, sizeof(text), fmt, ap);
+    dump_write(level, text);
+}
+
+#endif // defined(__GNUC__)
@@ -1,6 +1,9 @@
 #if !defined(__dump_info_h__)
 #define __dump_info_h__ 1
 
+#include <stdbool.h>
+#include <stddef.h>
+
 void set_app_name(const char *name);
 const char *get_app_name(void);
 void set_dump_info_callback(void(*callback)(const char *info, void *p), void *p);
@@ -14,6 +17,24 @@ void pr_info(const char *fmt, ...) ATTRIBUTE_FORMAT_PRINTF(1, 2);
 void pr_warn(const char *fmt, ...) ATTRIBUTE_FORMAT_PRINTF(1, 2);
 void pr_err(const char *fmt, ...) ATTRIBUTE_FORMAT_PRINTF(1, 2);
 
+/* Each format is held to a few lines a second, the rest are counted and
+ * told in one line later. True, and counted, if a line of |fmt| would be
+ * held back now, so the caller can skip building its arguments.
+ */
+bool pr_suppressed(const char *fmt);
+/* Lines held back by the rate limit, and lines lost to a full queue. */
+void dump_info_counters(size_t *suppressed, size_t *dropped);
+
+/* Hands the lines to a thread of their own to write, so a flood of them
+ * can't stall the loop; the callback is then called on that thread. False
+ * if it can't be done here.
+ */
+bool dump_info_async_start(void);
+/* Writes out what is queued, then the lines go out in place again.
+ * Other threads may go on logging while it runs.
+ */
+void dump_info_async_stop(void);
+
 #if !defined(NDEBUG)
 #define PRINT_INFO(format, ...) \
     do { pr_info("%s : %d\t" format, __FILE__, __LINE__, ## __VA_ARGS__); } while (0)
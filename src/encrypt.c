@@ -668,6 +668,81 @@ ss_md5_hmac_with_key(uint8_t auth[MD5_BYTES], const struct buffer_t *msg, const
     return 0;
 }
 
+struct md5_hmac_ctx {
+#if defined(USE_CRYPTO_OPENSSL)
+    HMAC_CTX *hmac;
+#elif defined(USE_CRYPTO_MBEDTLS)
+    mbedtls_md_context_t md;
+#endif
+};
+
+struct md5_hmac_ctx *
+ss_md5_hmac_ctx_create(const uint8_t *key, size_t key_len)
+{
+    struct md5_hmac_ctx *ctx = (struct md5_hmac_ctx *) calloc(1, sizeof(*ctx));
+#if defined(USE_CRYPTO_OPENSSL)
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+    ctx->hmac = HMAC_CTX_new();
+#else
+    ctx->hmac = (HMAC_CTX *) calloc(1, sizeof(HMAC_CTX));
+    HMAC_CTX_init(ctx->hmac);
+#endif
+    if (HMAC_Init_ex(ctx->hmac, key, (int)key_len, EVP_md5(), NULL) != 1) {
+        ss_md5_hmac_ctx_release(ctx);
+        return NULL;
+    }
+#elif defined(USE_CRYPTO_MBEDTLS)
+    mbedtls_md_init(&ctx->md);
+    if (mbedtls_md_setup(&ctx->md, mbedtls_md_info_from_type(MBEDTLS_MD_MD5), 1) != 0 ||
+        mbedtls_md_hmac_starts(&ctx->md, key, key_len) != 0)
+    {
+        ss_md5_hmac_ctx_release(ctx);
+        return NULL;
+    }
+#endif
+    return ctx;
+}
+
+void
+ss_md5_hmac_ctx_release(struct md5_hmac_ctx *ctx)
+{
+    if (ctx == NULL) {
+        return;
+    }
+#if defined(USE_CRYPTO_OPENSSL)
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+    HMAC_CTX_free(ctx->hmac);
+#else
+    HMAC_CTX_cleanup(ctx->hmac);
+    free(ctx->hmac);
+#endif
+#elif defined(USE_CRYPTO_MBEDTLS)
+    mbedtls_md_free(&ctx->md);
+#endif
+    free(ctx);
+}
+
+/* Same as ss_md5_hmac_with_key() but reuses the keyed state, so neither
+ * the key schedule nor the digest context are set up again. */
+size_t
+ss_md5_hmac_with_ctx(uint8_t auth[MD5_BYTES], const struct buffer_t *msg, struct md5_hmac_ctx *ctx)
+{
+    uint8_t hash[MD5_BYTES];
+#if defined(USE_CRYPTO_OPENSSL)
+    unsigned int len = MD5_BYTES;
+    HMAC_Init_ex(ctx->hmac, NULL, 0, NULL, NULL);
+    HMAC_Update(ctx->hmac, (unsigned char *)msg->buffer, (size_t)msg->len);
+    HMAC_Final(ctx->hmac, (unsigned char *)hash, &len);
+#elif defined(USE_CRYPTO_MBEDTLS)
+    mbedtls_md_hmac_reset(&ctx->md);
+    mbedtls_md_hmac_update(&ctx->md, (uint8_t *)msg->buffer, msg->len);
+    mbedtls_md_hmac_finish(&ctx->md, (uint8_t *)hash);
+#endif
+    memcpy(auth, hash, MD5_BYTES);
+
+    return 0;
+}
+
 size_t
 ss_md5_hash_func(uint8_t *auth, const uint8_t *msg, size_t msg_len)
 {
@@ -749,8 +824,9 @@ ss_encrypt_all(struct cipher_env_t *env, struct buffer_t *plain, size_t capacity
     enum ss_cipher_type method = env->enc_method;
     if (method > ss_cipher_table) {
         size_t iv_len;
+        size_t len;
         int err;
-        struct buffer_t *cipher;
+        uint8_t *payload;
         struct cipher_ctx_t cipher_ctx;
         uint8_t iv[MAX_IV_LENGTH];
 
@@ -759,42 +835,39 @@ ss_encrypt_all(struct cipher_env_t *env, struct buffer_t *plain, size_t capacity
         iv_len = (size_t) env->enc_iv_len;
         err = 1;
 
-        cipher = buffer_create(max(iv_len + plain->len, capacity));
-        cipher->len = plain->len;
+#ifdef SHOW_DUMP
+        dump("PLAIN", plain->buffer, (int)plain->len);
+#endif
+
+        // in place, these are all stream ciphers.
+        len = plain->len;
+        buffer_realloc(plain, max(iv_len + len, capacity));
+        payload = plain->buffer + iv_len;
+        memmove(payload, plain->buffer, len);
 
         rand_bytes(iv, iv_len);
         cipher_context_set_iv(env, &cipher_ctx, iv, iv_len, 1);
-        memcpy(cipher->buffer, iv, iv_len);
+        memcpy(plain->buffer, iv, iv_len);
 
         if (method >= ss_cipher_salsa20) {
-            crypto_stream_xor_ic((uint8_t *)(cipher->buffer + iv_len),
-                                 (const uint8_t *)plain->buffer, (uint64_t)(plain->len),
+            crypto_stream_xor_ic(payload, (const uint8_t *)payload, (uint64_t)len,
                                  (const uint8_t *)iv,
                                  0, env->enc_key, method);
         } else {
-            err = cipher_context_update(&cipher_ctx, (uint8_t *)(cipher->buffer + iv_len),
-                                        &cipher->len, (const uint8_t *)plain->buffer,
-                                        plain->len);
+            err = cipher_context_update(&cipher_ctx, payload, &len, (const uint8_t *)payload, len);
         }
 
+        cipher_context_release(env, &cipher_ctx);
+
         if (!err) {
-            cipher_context_release(env, &cipher_ctx);
-            buffer_release(cipher);
             return -1;
         }
 
 #ifdef SHOW_DUMP
-        dump("PLAIN", plain->buffer, (int)plain->len);
-        dump("CIPHER", cipher->buffer + iv_len, (int)cipher->len);
+        dump("CIPHER", payload, (int)len);
 #endif
 
-        cipher_context_release(env, &cipher_ctx);
-
-        buffer_realloc(plain, max(iv_len + cipher->len, capacity));
-        memcpy(plain->buffer, cipher->buffer, iv_len + cipher->len);
-        plain->len = iv_len + cipher->len;
-
-        buffer_release(cipher);
+        plain->len = iv_len + len;
         return 0;
     } else {
         if (env->enc_method == ss_cipher_table) {
@@ -893,8 +966,9 @@ ss_decrypt_all(struct cipher_env_t *env, struct buffer_t *cipher, size_t capacit
     if (method > ss_cipher_table) {
         size_t iv_len = (size_t)env->enc_iv_len;
         int ret       = 1;
+        size_t len;
+        uint8_t *payload;
         struct cipher_ctx_t cipher_ctx;
-        struct buffer_t *plain;
         uint8_t iv[MAX_IV_LENGTH];
 
         if (cipher->len <= iv_len) {
@@ -903,41 +977,37 @@ ss_decrypt_all(struct cipher_env_t *env, struct buffer_t *cipher, size_t capacit
 
         cipher_context_init(env, &cipher_ctx, 0);
 
-        plain = buffer_create(max(cipher->len, capacity));
-        plain->len = cipher->len - iv_len;
+        payload = cipher->buffer + iv_len;
+        len = cipher->len - iv_len;
+
+#ifdef SHOW_DUMP
+        dump("CIPHER", payload, (int)len);
+#endif
 
         memcpy(iv, cipher->buffer, iv_len);
         cipher_context_set_iv(env, &cipher_ctx, iv, iv_len, 0);
 
+        // in place, then moved over the IV.
         if (method >= ss_cipher_salsa20) {
-            crypto_stream_xor_ic((uint8_t *)plain->buffer,
-                                 (const uint8_t *)(cipher->buffer + iv_len),
-                                 (uint64_t)(cipher->len - iv_len),
+            crypto_stream_xor_ic(payload, (const uint8_t *)payload, (uint64_t)len,
                                  (const uint8_t *)iv, 0, env->enc_key, method);
         } else {
-            ret = cipher_context_update(&cipher_ctx, (uint8_t *)plain->buffer, &plain->len,
-                                        (const uint8_t *)(cipher->buffer + iv_len),
-                                        cipher->len - iv_len);
+            ret = cipher_context_update(&cipher_ctx, payload, &len, (const uint8_t *)payload, len);
         }
 
+        cipher_context_release(env, &cipher_ctx);
+
         if (!ret) {
-            cipher_context_release(env, &cipher_ctx);
-            buffer_release(plain);
             return -1;
         }
 
 #ifdef SHOW_DUMP
-        dump("PLAIN", plain->buffer, (int)plain->len);
-        dump("CIPHER", cipher->buffer + iv_len, (int)(cipher->len - iv_len));
+        dump("PLAIN", payload, (int)len);
 #endif
 
-        cipher_context_release(env, &cipher_ctx);
-
-        buffer_realloc(cipher, max(plain->len, capacity));
-        memcpy(cipher->buffer, plain->buffer, plain->len);
-        cipher->len = plain->len;
-
-        buffer_release(plain);
+        memmove(cipher->buffer, payload, len);
+        cipher->len = len;
+        buffer_realloc(cipher, capacity);
         return 0;
     } else {
         if (method == ss_cipher_table) {
@@ -0,0 +1,272 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "ip_lpm.h"
+
+#define LPM_ROOT_SLOTS  65536  /* the first 16 bits */
+#define LPM_NODE_SLOTS  256    /* 8 bits on each level after */
+#define LPM_BATCH       16
+
+#if defined(__GNUC__)
+#define LPM_PREFETCH(p) __builtin_prefetch(p)
+#else
+#define LPM_PREFETCH(p) ((void)(p))
+#endif
+
+/* A slot is a miss, a hit for every address under it, or a node below. */
+#define LPM_MISS        0
+#define LPM_HIT         1
+#define LPM_IS_NODE(v)  ((v) > LPM_HIT)
+#define LPM_NODE(lpm, v) ((lpm)->slots + LPM_ROOT_SLOTS + (size_t)((v) - 2) * LPM_NODE_SLOTS)
+
+struct ip_lpm {
+    unsigned int address_bits;
+    uint32_t *slots;  /* the root, then the nodes one after another; NULL while empty */
+    size_t node_count;
+    size_t node_capacity;
+    uint32_t free_node;  /* first node no slot points to any more, 0 if none */
+    bool borrowed;  /* slots belong to the caller of ip_lpm_create_view */
+};
+
+struct ip_lpm * ip_lpm_create(unsigned int address_bits) {
+    struct ip_lpm *lpm = (struct ip_lpm *) calloc(1, sizeof(*lpm));
+    lpm->address_bits = address_bits;
+    return lpm;
+}
+
+void ip_lpm_destroy(struct ip_lpm *lpm) {
+    if (lpm == NULL) {
+        return;
+    }
+    if (lpm->borrowed == false) {
+        free(lpm->slots);
+    }
+    free(lpm);
+}
+
+static uint32_t lpm_node_new(struct ip_lpm *lpm, uint32_t fill) {
+    uint32_t *node;
+    uint32_t v;
+    size_t n;
+    if (lpm->free_node) {
+        v = lpm->free_node;
+        node = LPM_NODE(lpm, v);
+        lpm->free_node = node[0];
+    } else {
+        if (lpm->node_count == lpm->node_capacity) {
+            lpm->node_capacity = lpm->node_capacity ? lpm->node_capacity * 2 : 64;
+            lpm->slots = (uint32_t *) realloc(lpm->slots,
+                (LPM_ROOT_SLOTS + lpm->node_capacity * LPM_NODE_SLOTS) * sizeof(uint32_t));
+        }
+        v = (uint32_t)(lpm->node_count++ + 2);
+        node = LPM_NODE(lpm, v);
+    }
+    for (n = 0; n < LPM_NODE_SLOTS; ++n) {
+        node[n] = fill;
+    }
+    return v;
+}
+
+/* A node a shorter network has just covered, and the nodes under it, go
+ * on the free list for lpm_node_new, linked through their first slot.
+ */
+static void lpm_node_free(struct ip_lpm *lpm, uint32_t v) {
+    uint32_t *node = LPM_NODE(lpm, v);
+    size_t n;
+    for (n = 0; n < LPM_NODE_SLOTS; ++n) {
+        if (LPM_IS_NODE(node[n])) {
+            lpm_node_free(lpm, node[n]);
+        }
+        node[n] = LPM_MISS;
+    }
+    node[0] = lpm->free_node;
+    lpm->free_node = v;
+}
+
+void ip_lpm_assign(struct ip_lpm *lpm, const uint8_t *addr, unsigned int prefix_len, bool member) {
+    uint32_t value = member ? LPM_HIT : LPM_MISS;
+    size_t base = 0;  /* of the node in slots */
+    unsigned int depth = 16;  /* bits walked once this level is done */
+    unsigned int index = ((unsigned int)addr[0] << 8) | addr[1];
+
+    if (prefix_len > lpm->address_bits) {
+        prefix_len = lpm->address_bits;
+    }
+    if (lpm->slots == NULL) {
+        if (member == false) {
+            return;
+        }
+        lpm->slots = (uint32_t *) calloc(LPM_ROOT_SLOTS, sizeof(uint32_t));
+    }
+    if (lpm->borrowed) {
+        size_t size = ip_lpm_memory(lpm);
+        uint32_t *slots = (uint32_t *) malloc(size);
+        memcpy(slots, lpm->slots, size);
+        lpm->slots = slots;
+        lpm->borrowed = false;
+    }
+    for (;;) {
+        uint32_t v;
+        if (prefix_len <= depth) {
+            // the network covers a run of slots on this level.
+            unsigned int span = 1u << (depth - prefix_len);
+            unsigned int first = index & ~(span - 1);
+            unsigned int n;
+            for (n = first; n < first + span; ++n) {
+                if (LPM_IS_NODE(lpm->slots[base + n])) {
+                    lpm_node_free(lpm, lpm->slots[base + n]);
+                }
+                lpm->slots[base + n] = value;
+            }
+            return;
+        }
+        v = lpm->slots[base + index];
+        if (LPM_IS_NODE(v) == false) {
+            if (v == value) {
+                return;  /* already all in or all out */
+            }
+            v = lpm_node_new(lpm, v);
+            lpm->slots[base + index] = v;
+        }
+        base = LPM_ROOT_SLOTS + (size_t)(v - 2) * LPM_NODE_SLOTS;
+        index = addr[depth / 8];
+        depth += 8;
+    }
+}
+
+bool ip_lpm_contains(const struct ip_lpm *lpm, const uint8_t *addr) {
+    uint32_t v;
+    unsigned int n = 2;
+    if (lpm->slots == NULL) {
+        return false;
+    }
+    v = lpm->slots[((unsigned int)addr[0] << 8) | addr[1]];
+    while (LPM_IS_NODE(v)) {
+        v = LPM_NODE(lpm, v)[addr[n++]];
+    }
+    return v == LPM_HIT;
+}
+
+void ip_lpm_contains_batch(const struct ip_lpm *lpm, const uint8_t *addrs, size_t count, bool *results) {
+    size_t addr_len = lpm->address_bits / 8;
+    size_t done, k;
+
+    if (lpm->slots == NULL) {
+        memset(results, 0, count * sizeof(bool));
+        return;
+    }
+    for (done = 0; done < count; done += LPM_BATCH) {
+        size_t group = (count - done < LPM_BATCH) ? (count - done) : LPM_BATCH;
+        const uint8_t *addr = addrs + done * addr_len;
+        const uint32_t *slot[LPM_BATCH];
+        uint32_t v[LPM_BATCH];
+        unsigned int n = 2;
+        bool walking = false;
+
+        // one level of every walk at a time: ask for all the slots first,
+        // then read them, so the cache misses overlap instead of queueing.
+        for (k = 0; k < group; ++k) {
+            const uint8_t *a = addr + k * addr_len;
+            slot[k] = lpm->slots + (((unsigned int)a[0] << 8) | a[1]);
+            LPM_PREFETCH(slot[k]);
+        }
+        for (k = 0; k < group; ++k) {
+            v[k] = *slot[k];
+            walking |= LPM_IS_NODE(v[k]);
+        }
+        while (walking) {
+            for (k = 0; k < group; ++k) {
+                if (LPM_IS_NODE(v[k])) {
+                    slot[k] = LPM_NODE(lpm, v[k]) + addr[k * addr_len + n];
+                    LPM_PREFETCH(slot[k]);
+                }
+            }
+            walking = false;
+            for (k = 0; k < group; ++k) {
+                if (LPM_IS_NODE(v[k])) {
+                    v[k] = *slot[k];
+                    walking |= LPM_IS_NODE(v[k]);
+                }
+            }
+            n++;
+        }
+        for (k = 0; k < group; ++k) {
+            results[done + k] = (v[k] == LPM_HIT);
+        }
+    }
+}
+
+size_t ip_lpm_memory(const struct ip_lpm *lpm) {
+    if (lpm->slots == NULL) {
+        return 0;
+    }
+    return (LPM_ROOT_SLOTS + lpm->node_capacity * LPM_NODE_SLOTS) * sizeof(uint32_t);
+}
+
+const uint32_t * ip_lpm_slots(const struct ip_lpm *lpm, size_t *count) {
+    *count = lpm->slots ? LPM_ROOT_SLOTS + lpm->node_count * LPM_NODE_SLOTS : 0;
+    return lpm->slots;
+}
+
+/* Walked from the root, every node must hang under exactly one slot and
+ * be no deeper than the address is long, so no walk can loop or run off
+ * the end of an address. Nodes nothing points to are never read.
+ */
+static bool lpm_slots_valid(unsigned int address_bits, const uint32_t *slots, size_t node_count) {
+    unsigned int max_depth = (address_bits - 16) / 8;
+    uint8_t *depth = (uint8_t *) calloc(node_count + 1, 1);
+    size_t *queue = (size_t *) malloc((node_count + 1) * sizeof(size_t));
+    size_t head = 0, tail = 0;
+    bool valid = true;
+    size_t n;
+
+    // node 0 here is the root, the rest are shifted by one.
+    queue[tail++] = 0;
+    while (head < tail && valid) {
+        size_t node = queue[head++];
+        const uint32_t *slot = (node == 0) ? slots : slots + LPM_ROOT_SLOTS + (node - 1) * LPM_NODE_SLOTS;
+        size_t size = (node == 0) ? LPM_ROOT_SLOTS : LPM_NODE_SLOTS;
+        for (n = 0; n < size; ++n) {
+            size_t child;
+            if (LPM_IS_NODE(slot[n]) == false) {
+                continue;
+            }
+            child = (size_t)slot[n] - 1;
+            if (child > node_count || depth[child] != 0 || depth[node] + 1u > max_depth) {
+                valid = false;
+                break;
+            }
+            depth[child] = depth[node] + 1;
+            queue[tail++] = child;
+        }
+    }
+    free(queue);
+    free(depth);
+    return valid;
+}
+
+struct ip_lpm * ip_lpm_create_view(unsigned int address_bits, const uint32_t *slots, size_t count) {
+    struct ip_lpm *lpm;
+    size_t node_count;
+
+    if (address_bits != 32 && address_bits != 128) {
+        return NULL;
+    }
+    if (count == 0) {
+        return ip_lpm_create(address_bits);  /* an empty list is written as no slots */
+    }
+    if (count < LPM_ROOT_SLOTS || (count - LPM_ROOT_SLOTS) % LPM_NODE_SLOTS != 0) {
+        return NULL;
+    }
+    node_count = (count - LPM_ROOT_SLOTS) / LPM_NODE_SLOTS;
+    if (lpm_slots_valid(address_bits, slots, node_count) == false) {
+        return NULL;
+    }
+    lpm = (struct ip_lpm *) calloc(1, sizeof(*lpm));
+    lpm->address_bits = address_bits;
+    lpm->slots = (uint32_t *) slots;
+    lpm->node_count = node_count;
+    lpm->node_capacity = node_count;
+    lpm->borrowed = true;
+    return lpm;
+}
@@ -0,0 +1,40 @@
+#ifndef __IP_LPM_H__
+#define __IP_LPM_H__ 1
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/* A set of IPv4 or IPv6 networks, as a multibit trie in one flat array:
+ * 16 bits on the first level and 8 on each one after, so an IPv4 lookup
+ * is at most 3 reads and an IPv6 one at most 15. Addresses are in network
+ * byte order. The root is only allocated with the first network.
+ */
+struct ip_lpm;
+
+/* |address_bits| is 32 or 128. */
+struct ip_lpm * ip_lpm_create(unsigned int address_bits);
+void ip_lpm_destroy(struct ip_lpm *lpm);
+
+/* Adds the network, or with |member| false takes it out again. */
+void ip_lpm_assign(struct ip_lpm *lpm, const uint8_t *addr, unsigned int prefix_len, bool member);
+bool ip_lpm_contains(const struct ip_lpm *lpm, const uint8_t *addr);
+/* |count| addresses packed one after another. The walks are interleaved,
+ * so their cache misses overlap.
+ */
+void ip_lpm_contains_batch(const struct ip_lpm *lpm, const uint8_t *addrs, size_t count, bool *results);
+
+/* Bytes the table takes. */
+size_t ip_lpm_memory(const struct ip_lpm *lpm);
+
+/* The whole table as one array of |*count| slots, to be written out;
+ * none while the table is empty.
+ */
+const uint32_t * ip_lpm_slots(const struct ip_lpm *lpm, size_t *count);
+/* A table over slots from ip_lpm_slots, read in place, e.g. from a mapped
+ * file; they are only copied on the first ip_lpm_assign. NULL if they
+ * don't make a table.
+ */
+struct ip_lpm * ip_lpm_create_view(unsigned int address_bits, const uint32_t *slots, size_t count);
+
+#endif // __IP_LPM_H__
@@ -807,9 +807,9 @@ local_recv_cb(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf0)
                 // SSR beg
                 memset(&server_info, 0, sizeof(struct server_info_t));
                 if (server_env->hostname) {
-                    strcpy(server_info.host, server_env->hostname);
+                    server_info.host = server_env->hostname;
                 } else {
-                    strcpy(server_info.host, server_env->host);
+                    server_info.host = server_env->host;
                 }
                 if (verbose) {
                     LOGI("struct server_info_t host %s", server_info.host);
@@ -1880,7 +1880,7 @@ int ssr_local_main_loop(const struct server_config *config, void(*feedback_state
     if (config->udp) {
         LOGI("udprelay enabled");
         udp_server = udprelay_begin(loop, config->listen_host, port, (union sockaddr_universal *)listen_ctx->servers[0].addr_udp,
-                      &tunnel_addr, 0, listen_ctx->timeout, listen_ctx->servers[0].cipher, listen_ctx->servers[0].protocol_name, listen_ctx->servers[0].protocol_param);
+                      &tunnel_addr, 0, listen_ctx->timeout, 0, listen_ctx->servers[0].cipher, listen_ctx->servers[0].protocol_name, listen_ctx->servers[0].protocol_param);
     }
 
 #ifdef HAVE_LAUNCHD
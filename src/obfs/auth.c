@@ -50,11 +50,11 @@ void
 auth_simple_local_data_init(auth_simple_local_data* local)
 {
     local->has_sent_header = 0;
-    local->recv_buffer = buffer_create(16384);
+    local->recv_buffer = buffer_create(0);  /* both grow on demand */
     local->recv_id = 1;
     local->pack_id = 1;
     local->salt = "";
-    local->user_key = buffer_create(SSR_BUFF_SIZE);
+    local->user_key = buffer_create(0);
     local->hmac = 0;
     local->hash = 0;
     local->hash_len = 0;
@@ -85,6 +85,7 @@ void auth_simple_new_obfs(struct obfs_t *obfs) {
     obfs->get_server_info = get_server_info;
     obfs->set_server_info = set_server_info;
     obfs->dispose = auth_simple_dispose;
+    obfs->shrink = auth_simple_shrink;
 
     obfs->client_pre_encrypt = auth_simple_client_pre_encrypt;
     obfs->client_post_decrypt = auth_simple_client_post_decrypt;
@@ -104,6 +105,7 @@ void auth_sha1_new_obfs(struct obfs_t *obfs) {
     obfs->get_server_info = get_server_info;
     obfs->set_server_info = set_server_info;
     obfs->dispose = auth_simple_dispose;
+    obfs->shrink = auth_simple_shrink;
 
     obfs->client_pre_encrypt = auth_sha1_client_pre_encrypt;
     obfs->client_post_decrypt = auth_sha1_client_post_decrypt;
@@ -120,6 +122,7 @@ void auth_sha1_v2_new_obfs(struct obfs_t *obfs) {
     obfs->get_server_info = get_server_info;
     obfs->set_server_info = set_server_info;
     obfs->dispose = auth_simple_dispose;
+    obfs->shrink = auth_simple_shrink;
 
     obfs->client_pre_encrypt = auth_sha1_v2_client_pre_encrypt;
     obfs->client_post_decrypt = auth_sha1_v2_client_post_decrypt;
@@ -141,6 +144,7 @@ struct obfs_t * auth_sha1_v4_new_obfs(void) {
     obfs->get_server_info = get_server_info;
     obfs->set_server_info = set_server_info;
     obfs->dispose = auth_simple_dispose;
+    obfs->shrink = auth_simple_shrink;
 
     obfs->client_pre_encrypt = auth_sha1_v4_client_pre_encrypt;
     obfs->client_post_decrypt = auth_sha1_v4_client_post_decrypt;
@@ -163,6 +167,7 @@ struct obfs_t * auth_aes128_md5_new_obfs(void) {
     obfs->get_server_info = get_server_info;
     obfs->set_server_info = set_server_info;
     obfs->dispose = auth_simple_dispose;
+    obfs->shrink = auth_simple_shrink;
 
     obfs->client_pre_encrypt = auth_aes128_sha1_client_pre_encrypt;
     obfs->client_post_decrypt = auth_aes128_sha1_client_post_decrypt;
@@ -232,6 +237,13 @@ auth_simple_dispose(struct obfs_t *obfs)
     dispose_obfs(obfs);
 }
 
+void
+auth_simple_shrink(struct obfs_t *obfs)
+{
+    auth_simple_local_data *local = (auth_simple_local_data*)obfs->l_data;
+    buffer_shrink(local->recv_buffer);
+}
+
 static size_t
 auth_simple_pack_data(const uint8_t *data, size_t datalength, uint8_t *outdata)
 {
@@ -318,11 +330,12 @@ auth_simple_client_post_decrypt(struct obfs_t *obfs, char **pplaindata, int data
     char * buffer;
     char *plaindata = *pplaindata;
     auth_simple_local_data *local = (auth_simple_local_data*)obfs->l_data;
-    uint8_t * recv_buffer = (uint8_t *)local->recv_buffer->buffer;
-    if (local->recv_buffer->len + datalength > 16384) {
+    uint8_t * recv_buffer;
+    if (local->recv_buffer->len > 16384) {
         return -1;
     }
     buffer_concatenate(local->recv_buffer, (uint8_t *)plaindata, datalength);
+    recv_buffer = local->recv_buffer->buffer;  /* it may have moved */
 
     out_buffer = (char*)malloc((size_t)local->recv_buffer->len);
     buffer = out_buffer;
@@ -450,12 +463,12 @@ auth_sha1_client_post_decrypt(struct obfs_t *obfs, char **pplaindata, int datale
     char * out_buffer;
     char *plaindata = *pplaindata;
     auth_simple_local_data *local = (auth_simple_local_data*)obfs->l_data;
-    uint8_t * recv_buffer = (uint8_t *)local->recv_buffer->buffer;
-    if (local->recv_buffer->len + datalength > 16384) {
+    uint8_t * recv_buffer;
+    if (local->recv_buffer->len > 16384) {
         return -1;
     }
-    memmove(recv_buffer + local->recv_buffer->len, plaindata, datalength);
-    local->recv_buffer->len += datalength;
+    buffer_concatenate(local->recv_buffer, (uint8_t *)plaindata, datalength);
+    recv_buffer = local->recv_buffer->buffer;  /* it may have moved */
 
     out_buffer = (char*)malloc((size_t)local->recv_buffer->len);
     buffer = out_buffer;
@@ -599,12 +612,12 @@ auth_sha1_v2_client_post_decrypt(struct obfs_t *obfs, char **pplaindata, int dat
     char * out_buffer;
     char *plaindata = *pplaindata;
     auth_simple_local_data *local = (auth_simple_local_data*)obfs->l_data;
-    uint8_t * recv_buffer = (uint8_t *)local->recv_buffer->buffer;
-    if (local->recv_buffer->len + datalength > 16384) {
+    uint8_t * recv_buffer;
+    if (local->recv_buffer->len > 16384) {
         return -1;
     }
-    memmove(recv_buffer + local->recv_buffer->len, plaindata, datalength);
-    local->recv_buffer->len += datalength;
+    buffer_concatenate(local->recv_buffer, (uint8_t *)plaindata, datalength);
+    recv_buffer = local->recv_buffer->buffer;  /* it may have moved */
 
     out_buffer = (char*)malloc((size_t)local->recv_buffer->len);
     buffer = out_buffer;
@@ -766,12 +779,12 @@ auth_sha1_v4_client_post_decrypt(struct obfs_t *obfs, char **pplaindata, int dat
     char * out_buffer;
     char *plaindata = *pplaindata;
     auth_simple_local_data *local = (auth_simple_local_data*)obfs->l_data;
-    uint8_t * recv_buffer = (uint8_t *)local->recv_buffer->buffer;
-    if (local->recv_buffer->len + datalength > 16384) {
+    uint8_t * recv_buffer;
+    if (local->recv_buffer->len > 16384) {
         return -1;
     }
-    memmove(recv_buffer + local->recv_buffer->len, plaindata, datalength);
-    local->recv_buffer->len += datalength;
+    buffer_concatenate(local->recv_buffer, (uint8_t *)plaindata, datalength);
+    recv_buffer = local->recv_buffer->buffer;  /* it may have moved */
 
     out_buffer = (char*)malloc((size_t)local->recv_buffer->len);
     buffer = out_buffer;
@@ -1224,12 +1237,12 @@ auth_aes128_sha1_client_post_decrypt(struct obfs_t *obfs, char **pplaindata, int
     char *plaindata = *pplaindata;
     auth_simple_local_data *local = (auth_simple_local_data*)obfs->l_data;
     //struct server_info_t *server = (struct server_info_t *)&obfs->server;
-    uint8_t * recv_buffer = (uint8_t *)local->recv_buffer->buffer;
-    if (local->recv_buffer->len + datalength > 16384) {
+    uint8_t * recv_buffer;
+    if (local->recv_buffer->len > 16384) {
         return -1;
     }
-    memmove(recv_buffer + local->recv_buffer->len, plaindata, datalength);
-    local->recv_buffer->len += datalength;
+    buffer_concatenate(local->recv_buffer, (uint8_t *)plaindata, datalength);
+    recv_buffer = local->recv_buffer->buffer;  /* it may have moved */
 
     key_len = local->user_key->len + 4;
     key = (uint8_t*)malloc((size_t)key_len);
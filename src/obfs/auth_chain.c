@@ -10,10 +10,12 @@
 #include "base64.h"
 #include "encrypt.h"
 #include "ssrbuffer.h"
+#include "users.h"
 #include "obfs.h"
 #include "auth_chain.h"
 
 void auth_chain_a_dispose(struct obfs_t *obfs);
+void auth_chain_a_shrink(struct obfs_t *obfs);
 void * auth_chain_a_init_data(void);
 size_t auth_chain_a_get_overhead(struct obfs_t *obfs);
 void auth_chain_a_set_server_info(struct obfs_t *obfs, struct server_info_t *server);
@@ -25,6 +27,8 @@ ssize_t auth_chain_a_client_udp_post_decrypt(struct obfs_t *obfs, char **pplaind
 
 struct buffer_t * auth_chain_a_server_pre_encrypt(struct obfs_t *obfs, const struct buffer_t *buf);
 struct buffer_t * auth_chain_a_server_post_decrypt(struct obfs_t *obfs, struct buffer_t *buf, bool *need_feedback);
+bool auth_chain_a_server_udp_pre_encrypt(struct obfs_t *obfs, struct buffer_t *buf);
+bool auth_chain_a_server_udp_post_decrypt(struct obfs_t *obfs, struct buffer_t *buf, uint32_t *uid);
 
 #if defined(_MSC_VER) && (_MSC_VER < 1800)
 
@@ -156,22 +160,56 @@ void shift128plus_init_from_bin_datalen(struct shift128plus_ctx *ctx, const uint
     }
 }
 
+#define AUTH_CHAIN_D_MAX_DATA_SIZE_LIST_LIMIT_SIZE 64
+#define AUTH_CHAIN_DATA_SIZE_LIMIT 1440
+#define AUTH_CHAIN_KEY_SIZE_MAX 64
+
+/*
+ * Sorted packet size list of auth_chain_b..f. pos[n] is the index of the
+ * first item not less than n, so looking up a size is a single read
+ * instead of a binary search. All items are below AUTH_CHAIN_DATA_SIZE_LIMIT.
+ */
+struct auth_chain_data_size_list {
+    size_t length;
+    int list[AUTH_CHAIN_D_MAX_DATA_SIZE_LIST_LIMIT_SIZE];
+    uint8_t pos[AUTH_CHAIN_DATA_SIZE_LIMIT];
+};
+
+enum auth_chain_data_size_kind {
+    auth_chain_data_size_b = 0,
+    auth_chain_data_size_b2,
+    auth_chain_data_size_c,
+    auth_chain_data_size_d,
+    auth_chain_data_size_f,
+    auth_chain_data_size_max,
+};
+
 struct auth_chain_global_data {
     uint8_t local_client_id[4];
     uint32_t connection_id;
+
+    // The data size lists depend on the server key only (and the key change
+    // period for auth_chain_f), they are built by the first connection and
+    // read by all the following ones.
+    uint8_t key[AUTH_CHAIN_KEY_SIZE_MAX];
+    uint16_t key_len;
+    bool data_size_ready[auth_chain_data_size_max];
+    uint64_t data_size_epoch[auth_chain_data_size_max];
+    struct auth_chain_data_size_list data_size[auth_chain_data_size_max];
 };
 
+typedef void (*auth_chain_data_size_builder)(struct obfs_t *obfs, struct auth_chain_data_size_list *sizes, const void *param);
+
 struct auth_chain_b_context {
-    int    *data_size_list;
-    size_t  data_size_list_length;
-    int    *data_size_list2;
-    size_t  data_size_list2_length;
+    const struct auth_chain_data_size_list *data_size_list;
+    const struct auth_chain_data_size_list *data_size_list2;
+    struct auth_chain_data_size_list *own_lists; // only when they can't be shared
     void *subclass_context;
 };
 
 struct auth_chain_c_context {
-    int    *data_size_list0;
-    size_t  data_size_list0_length;
+    const struct auth_chain_data_size_list *data_size_list0;
+    struct auth_chain_data_size_list *own_list; // only when it can't be shared
     void *subclass_context;
 };
 
@@ -208,11 +246,11 @@ struct auth_chain_a_context {
 void auth_chain_a_context_init(struct obfs_t *obfs, struct auth_chain_a_context *local) {
     local->obfs = obfs;
     local->has_sent_header = 0;
-    local->recv_buffer = buffer_create(16384);
+    local->recv_buffer = buffer_create(0);  /* both grow on demand */
     local->recv_id = 1;
     local->pack_id = 1;
     local->salt = "";
-    local->user_key = buffer_create(SSR_BUFF_SIZE);
+    local->user_key = buffer_create(0);
     memset(&local->random_client, 0, sizeof(local->random_client));
     memset(&local->random_server, 0, sizeof(local->random_server));
     local->encrypt_ctx = NULL;
@@ -230,7 +268,7 @@ int data_size_list_compare(const void *a, const void *b) {
 }
 
 void * auth_chain_a_init_data(void) {
-    struct auth_chain_global_data *global = (struct auth_chain_global_data*)malloc(sizeof(struct auth_chain_global_data));
+    struct auth_chain_global_data *global = (struct auth_chain_global_data*)calloc(1, sizeof(struct auth_chain_global_data));
     rand_bytes(global->local_client_id, 4);
     rand_bytes((uint8_t*)(&global->connection_id), 4);
     global->connection_id &= 0xFFFFFF;
@@ -254,6 +292,7 @@ struct obfs_t * auth_chain_a_new_obfs(void) {
     obfs->get_server_info = get_server_info;
     obfs->set_server_info = auth_chain_a_set_server_info;
     obfs->dispose = auth_chain_a_dispose;
+    obfs->shrink = auth_chain_a_shrink;
 
     obfs->client_pre_encrypt = auth_chain_a_client_pre_encrypt;
     obfs->client_post_decrypt = auth_chain_a_client_post_decrypt;
@@ -262,6 +301,8 @@ struct obfs_t * auth_chain_a_new_obfs(void) {
 
     obfs->server_pre_encrypt = auth_chain_a_server_pre_encrypt;
     obfs->server_post_decrypt = auth_chain_a_server_post_decrypt;
+    obfs->server_udp_pre_encrypt = auth_chain_a_server_udp_pre_encrypt;
+    obfs->server_udp_post_decrypt = auth_chain_a_server_udp_post_decrypt;
 
     return obfs;
 }
@@ -270,8 +311,18 @@ size_t auth_chain_a_get_overhead(struct obfs_t *obfs) {
     return 4;
 }
 
+void auth_chain_a_shrink(struct obfs_t *obfs) {
+    struct auth_chain_a_context *local = (struct auth_chain_a_context*)obfs->l_data;
+    buffer_shrink(local->recv_buffer);
+}
+
 void auth_chain_a_dispose(struct obfs_t *obfs) {
     struct auth_chain_a_context *local = (struct auth_chain_a_context*)obfs->l_data;
+    if (obfs->server.user) {
+        assert(obfs->server.user->connections_active > 0);
+        obfs->server.user->connections_active--;
+        obfs->server.user = NULL;
+    }
     buffer_release(local->recv_buffer);
     buffer_release(local->user_key);
     if (local->cipher) {
@@ -343,23 +394,71 @@ struct buffer_t * auth_chain_a_rnd_data(struct obfs_t * obfs,
     return ret;
 }
 
-size_t auth_chain_find_pos(int *arr, size_t length, int key) {
-    size_t low = 0;
-    size_t high = length - 1;
-    size_t middle = -1;
+static size_t auth_chain_data_size_find_pos(const struct auth_chain_data_size_list *sizes, int key) {
+    if (key >= AUTH_CHAIN_DATA_SIZE_LIMIT) {
+        return sizes->length;
+    }
+    return sizes->pos[max(key, 0)];
+}
+
+static void auth_chain_data_size_generate(struct auth_chain_data_size_list *sizes, size_t length, struct shift128plus_ctx *random) {
+    size_t i;
+    sizes->length = length;
+    for (i = 0; i < length; i++) {
+        sizes->list[i] = shift128plus_next(random) % 2340 % 2040 % 1440;
+    }
+}
 
-    if (key > arr[high]) {
-        return length;
+static void auth_chain_data_size_sort(struct auth_chain_data_size_list *sizes) {
+    size_t i = 0;
+    int n;
+    // stdlib qsort
+    qsort(sizes->list, sizes->length, sizeof(sizes->list[0]), data_size_list_compare);
+    for (n = 0; n < AUTH_CHAIN_DATA_SIZE_LIMIT; ++n) {
+        while (i < sizes->length && sizes->list[i] < n) {
+            ++i;
+        }
+        sizes->pos[n] = (uint8_t)i;
     }
-    while (low < high) {
-        middle = (low + high) / 2;
-        if (key > arr[middle]) {
-            low = middle + 1;
-        } else if (key <= arr[middle]) {
-            high = middle;
+}
+
+/*
+ * Returns the list(s) of |kind| for this connection. They are built once
+ * into the protocol global data and shared; a private copy is only made
+ * when there is no global data or it was set up for another key.
+ */
+static const struct auth_chain_data_size_list *
+auth_chain_data_size_acquire(struct obfs_t *obfs, enum auth_chain_data_size_kind kind, size_t count,
+                             uint64_t epoch, auth_chain_data_size_builder builder, const void *param,
+                             struct auth_chain_data_size_list **own)
+{
+    struct server_info_t *server = &obfs->server;
+    struct auth_chain_global_data *global = (struct auth_chain_global_data *)server->g_data;
+    struct auth_chain_data_size_list *sizes;
+
+    assert(kind + count <= auth_chain_data_size_max);
+    if (global && server->key && server->key_len <= sizeof(global->key)) {
+        if (global->key_len == 0) {
+            memcpy(global->key, server->key, server->key_len);
+            global->key_len = server->key_len;
+        }
+        if (global->key_len == server->key_len &&
+            memcmp(global->key, server->key, server->key_len) == 0)
+        {
+            sizes = &global->data_size[kind];
+            if (global->data_size_ready[kind] == false || global->data_size_epoch[kind] != epoch) {
+                builder(obfs, sizes, param);
+                global->data_size_ready[kind] = true;
+                global->data_size_epoch[kind] = epoch;
+            }
+            return sizes;
         }
     }
-    return low;
+
+    sizes = (struct auth_chain_data_size_list *) calloc(count, sizeof(*sizes));
+    builder(obfs, sizes, param);
+    *own = sizes;
+    return sizes;
 }
 
 unsigned int udp_get_rand_len(struct shift128plus_ctx *random, uint8_t last_hash[16]) {
@@ -633,7 +732,7 @@ ssize_t auth_chain_a_client_post_decrypt(struct obfs_t *obfs, char **pplaindata,
     uint8_t * buffer;
     char error = 0;
 
-    if (local->recv_buffer->len + datalength > 16384) {
+    if (local->recv_buffer->len > 16384) {
         return -1;
     }
     buffer_concatenate(local->recv_buffer, (uint8_t *)plaindata, datalength);
@@ -849,6 +948,118 @@ ssize_t auth_chain_a_client_udp_post_decrypt(struct obfs_t *obfs, char **pplaind
     return (ssize_t)outlength;
 }
 
+// The reply to auth_chain_a_client_udp_post_decrypt(), keyed with the user
+// that sent the request, see auth_chain_a_server_udp_post_decrypt().
+bool auth_chain_a_server_udp_pre_encrypt(struct obfs_t *obfs, struct buffer_t *buf) {
+    struct server_info_t *server = (struct server_info_t *)&obfs->server;
+    struct auth_chain_a_context *local = (struct auth_chain_a_context*)obfs->l_data;
+    uint8_t auth_data[7];
+    uint8_t rnd_data[128];
+    uint8_t hash[16];
+    int rand_len;
+    char password[256] = {0};
+
+    if (server->user) {
+        buffer_replace(local->user_key, server->user->key);
+    } else {
+        buffer_store(local->user_key, server->key, server->key_len);
+    }
+
+    rand_bytes(auth_data, sizeof(auth_data));
+    {
+        BUFFER_CONSTANT_INSTANCE(_msg, auth_data, sizeof(auth_data));
+        BUFFER_CONSTANT_INSTANCE(_key, server->key, server->key_len);
+        ss_md5_hmac_with_key(hash, _msg, _key);
+    }
+    rand_len = (int) udp_get_rand_len(&local->random_server, hash);
+    rand_bytes(rnd_data, (size_t)rand_len);
+
+    std_base64_encode(local->user_key->buffer, (int)local->user_key->len, (unsigned char *)password);
+    std_base64_encode(hash, 16, (unsigned char *)(password + strlen(password)));
+
+    {
+        struct buffer_t *ret = cipher_simple_update_data(password, "rc4", true, buf);
+        buffer_replace(buf, ret);
+        buffer_release(ret);
+    }
+    buffer_concatenate(buf, rnd_data, (size_t)rand_len);
+    buffer_concatenate(buf, auth_data, sizeof(auth_data));
+    ss_md5_hmac_with_key(hash, buf, local->user_key);
+    buffer_concatenate(buf, hash, 1);
+
+    return true;
+}
+
+// The request of auth_chain_a_client_udp_pre_encrypt(). The uid at the end is
+// masked with the HMAC of the 3 bytes before it, unknown uids fall back to
+// the server password like the TCP side does.
+bool auth_chain_a_server_udp_post_decrypt(struct obfs_t *obfs, struct buffer_t *buf, uint32_t *uid) {
+    struct server_info_t *server = (struct server_info_t *)&obfs->server;
+    struct auth_chain_a_context *local = (struct auth_chain_a_context*)obfs->l_data;
+    struct server_user *user;
+    uint8_t *data = buf->buffer;
+    size_t datalength = buf->len;
+    uint8_t md5data[16];
+    uint8_t hash[16];
+    uint32_t uid_num;
+    int rand_len;
+    size_t outlength;
+    char password[256] = {0};
+
+    if (uid) { *uid = 0; }
+    if (datalength <= 8) {
+        return false;
+    }
+
+    {
+        BUFFER_CONSTANT_INSTANCE(_msg, data + datalength - 8, 3);
+        BUFFER_CONSTANT_INSTANCE(_key, server->key, server->key_len);
+        ss_md5_hmac_with_key(md5data, _msg, _key);
+    }
+    uid_num = *((uint32_t *)(data + datalength - 5));
+    uid_num = uid_num ^ (*((uint32_t *)md5data));
+
+    // as on TCP, the server password only when there is no users table.
+    user = server_users_find(server->users, uid_num);
+    if (user) {
+        buffer_replace(local->user_key, user->key);
+    } else if (server_users_count(server->users) == 0) {
+        buffer_store(local->user_key, server->key, server->key_len);
+    } else {
+        return false;
+    }
+    {
+        BUFFER_CONSTANT_INSTANCE(_msg, data, datalength - 1);
+        if (user) {
+            ss_md5_hmac_with_ctx(hash, _msg, user->hmac);
+        } else {
+            ss_md5_hmac_with_key(hash, _msg, local->user_key);
+        }
+    }
+    if (*hash != data[datalength - 1]) {
+        return false;
+    }
+
+    rand_len = (int)udp_get_rand_len(&local->random_client, md5data);
+    if (datalength < (size_t)rand_len + 8) {
+        return false;
+    }
+    outlength = datalength - rand_len - 8;
+
+    std_base64_encode(local->user_key->buffer, (int)local->user_key->len, (unsigned char *)password);
+    std_base64_encode(md5data, 16, (unsigned char *)(password + strlen(password)));
+
+    {
+        BUFFER_CONSTANT_INSTANCE(in_obj, data, outlength);
+        struct buffer_t *ret = cipher_simple_update_data(password, "rc4", false, in_obj);
+        buffer_replace(buf, ret);
+        buffer_release(ret);
+    }
+
+    if (uid && user) { *uid = uid_num; }
+    return true;
+}
+
 struct buffer_t * auth_chain_a_server_pre_encrypt(struct obfs_t *obfs, const struct buffer_t *buf) {
     struct server_info_t *server = (struct server_info_t *)&obfs->server;
     struct auth_chain_a_context *local = (struct auth_chain_a_context*)obfs->l_data;
@@ -901,6 +1112,7 @@ struct buffer_t * auth_chain_a_server_post_decrypt(struct obfs_t *obfs, struct b
         uint32_t connection_id = 0;
         int time_diff;
         uint8_t *password = NULL;
+        struct server_user *user = NULL;
 
         if (len>=12 || len==7 || len==8) {
             size_t recv_len = min(len, 12);
@@ -912,7 +1124,8 @@ struct buffer_t * auth_chain_a_server_post_decrypt(struct obfs_t *obfs, struct b
             }
             buffer_release(mac_key);
             if (memcmp(md5data, local->recv_buffer->buffer+4, recv_len-4) != 0) {
-                return out_buf;
+                buffer_release(out_buf);
+                return NULL;
             }
         }
         if (local->recv_buffer->len < (12 + 24)) {
@@ -924,19 +1137,40 @@ struct buffer_t * auth_chain_a_server_post_decrypt(struct obfs_t *obfs, struct b
         uid = uid ^ (*((uint32_t *)(md5data + 8))); // TODO: ntohl
         local->user_id_num = uid;
 
-        buffer_store(local->user_key, server->key, server->key_len);
+        // Only a server without a users table takes the server password,
+        // an unknown uid would skip the limits and counters of every user.
+        user = server_users_find(server->users, uid);
+        if (user) {
+            if (user->max_connections && user->connections_active >= user->max_connections) {
+                buffer_release(out_buf);
+                return NULL;
+            }
+            buffer_replace(local->user_key, user->key);
+        } else if (server_users_count(server->users) == 0) {
+            buffer_store(local->user_key, server->key, server->key_len);
+        } else {
+            buffer_release(out_buf);
+            return NULL;
+        }
 
         {
             BUFFER_CONSTANT_INSTANCE(_msg, local->recv_buffer->buffer + 12, 20);
-            ss_md5_hmac_with_key(md5data, _msg, local->user_key);
+            if (user) {
+                ss_md5_hmac_with_ctx(md5data, _msg, user->hmac);
+            } else {
+                ss_md5_hmac_with_key(md5data, _msg, local->user_key);
+            }
         }
         if (memcmp(md5data, local->recv_buffer->buffer+32, 4) != 0) {
             // logging.error('%s data incorrect auth HMAC-MD5 from %s:%d, data %s' % (self.no_compatible_method, self.server_info.client, self.server_info.client_port, binascii.hexlify(self.recv_buf)))
-            return out_buf;
+            buffer_release(out_buf);
+            return NULL;
         }
 
         memcpy(local->last_server_hash, md5data, 16);
-        {
+        if (user) {
+            ss_aes_128_cbc_decrypt(16, local->recv_buffer->buffer+16, head, server_user_enc_key(user, local->salt));
+        } else {
             uint8_t enc_key[16 + 1] = { 0 };
             size_t b64len = (size_t) std_base64_encode_len((int) local->user_key->len);
             size_t salt_len = strlen(local->salt);
@@ -956,11 +1190,17 @@ struct buffer_t * auth_chain_a_server_post_decrypt(struct obfs_t *obfs, struct b
         time_diff = abs((int)time(NULL) - (int)utc_time);
         if (time_diff > local->max_time_dif) {
             // logging.info('%s: wrong timestamp, time_dif %d, data %s' % (self.no_compatible_method, time_dif, binascii.hexlify(head)))
-            return out_buf;
+            buffer_release(out_buf);
+            return NULL;
         }
 
         local->client_id = client_id;
         local->connection_id = connection_id;
+        if (user) {
+            server->user = user;
+            user->connections_active++;
+            user->connections_total++;
+        }
         {
             size_t b64len1 = (size_t) std_base64_encode_len((int) local->user_key->len);
             size_t b64len2 = (size_t) std_base64_encode_len((int) sizeof(local->last_client_hash));
@@ -998,11 +1238,7 @@ struct buffer_t * auth_chain_a_server_post_decrypt(struct obfs_t *obfs, struct b
         if (length >= 4096) {
             // logging.info(self.no_compatible_method + ': over size')
             buffer_reset(local->recv_buffer);
-            if (local->recv_id == 0) {
-                buffer_reset(out_buf);
-            } else {
-                buffer_release(out_buf); out_buf = NULL;
-            }
+            buffer_release(out_buf); out_buf = NULL;
             break;
         }
         if (length + 4 > local->recv_buffer->len) {
@@ -1015,11 +1251,7 @@ struct buffer_t * auth_chain_a_server_post_decrypt(struct obfs_t *obfs, struct b
         if (memcmp(client_hash, local->recv_buffer->buffer+length+2, 2) != 0) {
             // logging.info('%s: checksum error, data %s' % (self.no_compatible_method, binascii.hexlify(self.recv_buf[:length])))
             buffer_reset(local->recv_buffer);
-            if (local->recv_id == 0) {
-                buffer_reset(out_buf);
-            } else {
-                buffer_release(out_buf); out_buf = NULL;
-            }
+            buffer_release(out_buf); out_buf = NULL;
             break;
         }
 
@@ -1077,55 +1309,41 @@ void auth_chain_b_dispose(struct obfs_t *obfs) {
     struct auth_chain_b_context *auth_chain_b = (struct auth_chain_b_context *)auth_chain_a->subclass_context;
     auth_chain_a->subclass_context = NULL;
     if (auth_chain_b != NULL) {
-        if (auth_chain_b->data_size_list != NULL) {
-            free(auth_chain_b->data_size_list);
-            auth_chain_b->data_size_list = NULL;
-            auth_chain_b->data_size_list_length = 0;
-        }
-        if (auth_chain_b->data_size_list2 != NULL) {
-            free(auth_chain_b->data_size_list2);
-            auth_chain_b->data_size_list2 = NULL;
-            auth_chain_b->data_size_list2_length = 0;
+        if (auth_chain_b->own_lists != NULL) {
+            free(auth_chain_b->own_lists);
+            auth_chain_b->own_lists = NULL;
         }
         free(auth_chain_b);
     }
     auth_chain_a_dispose(obfs);
 }
 
-void auth_chain_b_init_data_size(struct obfs_t *obfs) {
-    size_t i = 0;
+static void auth_chain_b_build_data_size(struct obfs_t *obfs, struct auth_chain_data_size_list *sizes, const void *param) {
     struct server_info_t *server = &obfs->server;
-    struct auth_chain_a_context *auth_chain_a = (struct auth_chain_a_context *)obfs->l_data;
-    struct auth_chain_b_context *auth_chain_b = (struct auth_chain_b_context *)auth_chain_a->subclass_context;
+    struct shift128plus_ctx random = { 0 };
+    size_t length;
 
-    struct shift128plus_ctx *random = (struct shift128plus_ctx *) calloc(1, sizeof(struct shift128plus_ctx));
+    shift128plus_init_from_bin(&random, server->key, 16);
 
-    shift128plus_init_from_bin(random, server->key, 16);
-    auth_chain_b->data_size_list_length = shift128plus_next(random) % 8 + 4;
-    auth_chain_b->data_size_list = (int *)calloc(auth_chain_b->data_size_list_length, sizeof(auth_chain_b->data_size_list[0]));
-    for (i = 0; i < auth_chain_b->data_size_list_length; i++) {
-        auth_chain_b->data_size_list[i] = shift128plus_next(random) % 2340 % 2040 % 1440;
-    }
-    // stdlib qsort
-    qsort(auth_chain_b->data_size_list,
-        auth_chain_b->data_size_list_length,
-        sizeof(auth_chain_b->data_size_list[0]),
-        data_size_list_compare
-        );
+    length = shift128plus_next(&random) % 8 + 4;
+    auth_chain_data_size_generate(&sizes[0], length, &random);
+    auth_chain_data_size_sort(&sizes[0]);
 
-    auth_chain_b->data_size_list2_length = shift128plus_next(random) % 16 + 8;
-    auth_chain_b->data_size_list2 = (int *)calloc(auth_chain_b->data_size_list2_length, sizeof(auth_chain_b->data_size_list2[0]));
-    for (i = 0; i < auth_chain_b->data_size_list2_length; i++) {
-        auth_chain_b->data_size_list2[i] = shift128plus_next(random) % 2340 % 2040 % 1440;
-    }
-    // stdlib qsort
-    qsort(auth_chain_b->data_size_list2,
-        auth_chain_b->data_size_list2_length,
-        sizeof(auth_chain_b->data_size_list2[0]),
-        data_size_list_compare
-        );
+    length = shift128plus_next(&random) % 16 + 8;
+    auth_chain_data_size_generate(&sizes[1], length, &random);
+    auth_chain_data_size_sort(&sizes[1]);
+    (void)param;
+}
+
+void auth_chain_b_init_data_size(struct obfs_t *obfs) {
+    struct auth_chain_a_context *auth_chain_a = (struct auth_chain_a_context *)obfs->l_data;
+    struct auth_chain_b_context *auth_chain_b = (struct auth_chain_b_context *)auth_chain_a->subclass_context;
+    const struct auth_chain_data_size_list *sizes;
 
-    free(random);
+    sizes = auth_chain_data_size_acquire(obfs, auth_chain_data_size_b, 2, 0,
+        auth_chain_b_build_data_size, NULL, &auth_chain_b->own_lists);
+    auth_chain_b->data_size_list = &sizes[0];
+    auth_chain_b->data_size_list2 = &sizes[1];
 }
 
 void auth_chain_b_set_server_info(struct obfs_t *obfs, struct server_info_t *server) {
@@ -1137,6 +1355,8 @@ unsigned int auth_chain_b_get_rand_len(struct auth_chain_a_context *local, int d
     struct server_info_t *server = &local->obfs->server;
     uint16_t overhead = server->overhead;
     struct auth_chain_b_context *auth_chain_b = (struct auth_chain_b_context *)local->subclass_context;
+    const struct auth_chain_data_size_list *sizes = auth_chain_b->data_size_list;
+    const struct auth_chain_data_size_list *sizes2 = auth_chain_b->data_size_list2;
     size_t pos;
     size_t final_pos;
     size_t pos2;
@@ -1148,18 +1368,18 @@ unsigned int auth_chain_b_get_rand_len(struct auth_chain_a_context *local, int d
 
     shift128plus_init_from_bin_datalen(random, last_hash, 16, datalength);
 
-    pos = auth_chain_find_pos(auth_chain_b->data_size_list, auth_chain_b->data_size_list_length, datalength + overhead);
-    final_pos = pos + shift128plus_next(random) % auth_chain_b->data_size_list_length;
-    if (final_pos < auth_chain_b->data_size_list_length) {
-        return auth_chain_b->data_size_list[final_pos] - datalength - overhead;
+    pos = auth_chain_data_size_find_pos(sizes, datalength + overhead);
+    final_pos = pos + shift128plus_next(random) % sizes->length;
+    if (final_pos < sizes->length) {
+        return sizes->list[final_pos] - datalength - overhead;
     }
 
-    pos2 = auth_chain_find_pos(auth_chain_b->data_size_list2, auth_chain_b->data_size_list2_length, datalength + overhead);
-    final_pos2 = pos2 + shift128plus_next(random) % auth_chain_b->data_size_list2_length;
-    if (final_pos2 < auth_chain_b->data_size_list2_length) {
-        return auth_chain_b->data_size_list2[final_pos2] - datalength - overhead;
+    pos2 = auth_chain_data_size_find_pos(sizes2, datalength + overhead);
+    final_pos2 = pos2 + shift128plus_next(random) % sizes2->length;
+    if (final_pos2 < sizes2->length) {
+        return sizes2->list[final_pos2] - datalength - overhead;
     }
-    if (final_pos2 < pos2 + auth_chain_b->data_size_list2_length - 1) {
+    if (final_pos2 < pos2 + sizes2->length - 1) {
         return 0;
     }
 
@@ -1201,39 +1421,31 @@ void auth_chain_c_dispose(struct obfs_t *obfs) {
     struct auth_chain_c_context *auth_chain_c = (struct auth_chain_c_context *)auth_chain_a->subclass_context;
     auth_chain_a->subclass_context = NULL;
     if (auth_chain_c != NULL) {
-        if (auth_chain_c->data_size_list0 != NULL) {
-            free(auth_chain_c->data_size_list0);
-            auth_chain_c->data_size_list0 = NULL;
-            auth_chain_c->data_size_list0_length = 0;
+        if (auth_chain_c->own_list != NULL) {
+            free(auth_chain_c->own_list);
+            auth_chain_c->own_list = NULL;
         }
         free(auth_chain_c);
     }
     auth_chain_a_dispose(obfs);
 }
 
-void auth_chain_c_init_data_size(struct obfs_t *obfs) {
-    size_t i = 0;
+static void auth_chain_c_build_data_size(struct obfs_t *obfs, struct auth_chain_data_size_list *sizes, const void *param) {
     struct server_info_t *server = &obfs->server;
+    struct shift128plus_ctx random = { 0 };
 
+    shift128plus_init_from_bin(&random, server->key, 16);
+    auth_chain_data_size_generate(sizes, shift128plus_next(&random) % (8 + 16) + (4 + 8), &random);
+    auth_chain_data_size_sort(sizes);
+    (void)param;
+}
+
+void auth_chain_c_init_data_size(struct obfs_t *obfs) {
     struct auth_chain_a_context *auth_chain_a = (struct auth_chain_a_context *)obfs->l_data;
     struct auth_chain_c_context *auth_chain_c = (struct auth_chain_c_context *)auth_chain_a->subclass_context;
 
-    struct shift128plus_ctx *random = (struct shift128plus_ctx *) calloc(1, sizeof(struct shift128plus_ctx));
-
-    shift128plus_init_from_bin(random, server->key, 16);
-    auth_chain_c->data_size_list0_length = shift128plus_next(random) % (8 + 16) + (4 + 8);
-    auth_chain_c->data_size_list0 = (int *)malloc(auth_chain_c->data_size_list0_length * sizeof(int));
-    for (i = 0; i < auth_chain_c->data_size_list0_length; i++) {
-        auth_chain_c->data_size_list0[i] = shift128plus_next(random) % 2340 % 2040 % 1440;
-    }
-    // stdlib qsort
-    qsort(auth_chain_c->data_size_list0,
-        auth_chain_c->data_size_list0_length,
-        sizeof(int),
-        data_size_list_compare
-        );
-
-    free(random);
+    auth_chain_c->data_size_list0 = auth_chain_data_size_acquire(obfs, auth_chain_data_size_c, 1, 0,
+        auth_chain_c_build_data_size, NULL, &auth_chain_c->own_list);
 }
 
 void auth_chain_c_set_server_info(struct obfs_t *obfs, struct server_info_t *server) {
@@ -1245,6 +1457,7 @@ unsigned int auth_chain_c_get_rand_len(struct auth_chain_a_context *local, int d
     struct server_info_t *server = &local->obfs->server;
     uint16_t overhead = server->overhead;
     struct auth_chain_c_context *auth_chain_c = (struct auth_chain_c_context *)local->subclass_context;
+    const struct auth_chain_data_size_list *sizes = auth_chain_c->data_size_list0;
     int other_data_size = datalength + overhead;
     size_t pos;
     size_t final_pos;
@@ -1252,7 +1465,7 @@ unsigned int auth_chain_c_get_rand_len(struct auth_chain_a_context *local, int d
     // must init random in here to make sure output sync in server and client
     shift128plus_init_from_bin_datalen(random, last_hash, 16, datalength);
 
-    if (other_data_size >= auth_chain_c->data_size_list0[auth_chain_c->data_size_list0_length - 1]) {
+    if (other_data_size >= sizes->list[sizes->length - 1]) {
         if (datalength > 1440)
             return 0;
         if (datalength > 1300)
@@ -1264,10 +1477,10 @@ unsigned int auth_chain_c_get_rand_len(struct auth_chain_a_context *local, int d
         return shift128plus_next(random) % 1021;
     }
 
-    pos = auth_chain_find_pos(auth_chain_c->data_size_list0, auth_chain_c->data_size_list0_length, other_data_size);
+    pos = auth_chain_data_size_find_pos(sizes, other_data_size);
     // random select a size in the leftover data_size_list0
-    final_pos = pos + shift128plus_next(random) % (auth_chain_c->data_size_list0_length - pos);
-    return auth_chain_c->data_size_list0[final_pos] - other_data_size;
+    final_pos = pos + shift128plus_next(random) % (sizes->length - pos);
+    return sizes->list[final_pos] - other_data_size;
 }
 
 //============================= auth_chain_d ==================================
@@ -1286,52 +1499,41 @@ struct obfs_t * auth_chain_d_new_obfs(void) {
     return obfs;
 }
 
-#define AUTH_CHAIN_D_MAX_DATA_SIZE_LIST_LIMIT_SIZE 64
-
-void auth_chain_d_check_and_patch_data_size(struct obfs_t *obfs, struct shift128plus_ctx *random) {
-    struct auth_chain_a_context *auth_chain_a = (struct auth_chain_a_context *)obfs->l_data;
-    struct auth_chain_c_context *auth_chain_c = (struct auth_chain_c_context *)auth_chain_a->subclass_context;
-
-    while (auth_chain_c->data_size_list0[auth_chain_c->data_size_list0_length - 1] < 1300 &&
-        auth_chain_c->data_size_list0_length < AUTH_CHAIN_D_MAX_DATA_SIZE_LIST_LIMIT_SIZE)
+void auth_chain_d_check_and_patch_data_size(struct auth_chain_data_size_list *sizes, struct shift128plus_ctx *random) {
+    while (sizes->list[sizes->length - 1] < 1300 &&
+        sizes->length < AUTH_CHAIN_D_MAX_DATA_SIZE_LIST_LIMIT_SIZE)
     {
         uint64_t data = shift128plus_next(random) % 2340 % 2040 % 1440;
-        auth_chain_c->data_size_list0[auth_chain_c->data_size_list0_length] = (int) data;
+        sizes->list[sizes->length] = (int) data;
 
-        ++auth_chain_c->data_size_list0_length;
+        ++sizes->length;
     }
 }
 
-void auth_chain_d_init_data_size(struct obfs_t *obfs) {
-    size_t i = 0;
-    size_t old_len;
+static void auth_chain_d_build_data_size(struct obfs_t *obfs, struct auth_chain_data_size_list *sizes, const void *param) {
     struct server_info_t *server = &obfs->server;
+    struct shift128plus_ctx random = { 0 };
+    size_t old_len;
 
-    struct auth_chain_a_context *auth_chain_a = (struct auth_chain_a_context *)obfs->l_data;
-    struct auth_chain_c_context *auth_chain_c = (struct auth_chain_c_context *)auth_chain_a->subclass_context;
-
-    struct shift128plus_ctx *random = (struct shift128plus_ctx *)calloc(1, sizeof(struct shift128plus_ctx));
+    shift128plus_init_from_bin(&random, server->key, 16);
+    auth_chain_data_size_generate(sizes, shift128plus_next(&random) % (8 + 16) + (4 + 8), &random);
+    auth_chain_data_size_sort(sizes);
 
-    shift128plus_init_from_bin(random, server->key, 16);
-    auth_chain_c->data_size_list0_length = shift128plus_next(random) % (8 + 16) + (4 + 8);
-    auth_chain_c->data_size_list0 = (int *)malloc(AUTH_CHAIN_D_MAX_DATA_SIZE_LIST_LIMIT_SIZE * sizeof(int));
-    for (i = 0; i < auth_chain_c->data_size_list0_length; i++) {
-        auth_chain_c->data_size_list0[i] = shift128plus_next(random) % 2340 % 2040 % 1440;
-    }
-    // stdlib qsort
-    qsort(auth_chain_c->data_size_list0, auth_chain_c->data_size_list0_length,
-        sizeof(auth_chain_c->data_size_list0[0]), data_size_list_compare);
-
-    old_len = auth_chain_c->data_size_list0_length;
-    auth_chain_d_check_and_patch_data_size(obfs, random);
-    if (old_len != auth_chain_c->data_size_list0_length) {
+    old_len = sizes->length;
+    auth_chain_d_check_and_patch_data_size(sizes, &random);
+    if (old_len != sizes->length) {
         // if check_and_patch_data_size are work, re-sort again.
-        // stdlib qsort
-        qsort(auth_chain_c->data_size_list0, auth_chain_c->data_size_list0_length,
-            sizeof(auth_chain_c->data_size_list0[0]), data_size_list_compare);
+        auth_chain_data_size_sort(sizes);
     }
+    (void)param;
+}
 
-    free(random);
+void auth_chain_d_init_data_size(struct obfs_t *obfs) {
+    struct auth_chain_a_context *auth_chain_a = (struct auth_chain_a_context *)obfs->l_data;
+    struct auth_chain_c_context *auth_chain_c = (struct auth_chain_c_context *)auth_chain_a->subclass_context;
+
+    auth_chain_c->data_size_list0 = auth_chain_data_size_acquire(obfs, auth_chain_data_size_d, 1, 0,
+        auth_chain_d_build_data_size, NULL, &auth_chain_c->own_list);
 }
 
 void auth_chain_d_set_server_info(struct obfs_t *obfs, struct server_info_t *server) {
@@ -1346,19 +1548,20 @@ unsigned int auth_chain_d_get_rand_len(struct auth_chain_a_context *local, int d
 
     uint16_t overhead = server->overhead;
     struct auth_chain_c_context *auth_chain_c = (struct auth_chain_c_context *)local->subclass_context;
+    const struct auth_chain_data_size_list *sizes = auth_chain_c->data_size_list0;
 
     int other_data_size = datalength + overhead;
 
     // if other_data_size > the bigest item in data_size_list0, not padding any data
-    if (other_data_size >= auth_chain_c->data_size_list0[auth_chain_c->data_size_list0_length - 1]) {
+    if (other_data_size >= sizes->list[sizes->length - 1]) {
         return 0;
     }
 
     shift128plus_init_from_bin_datalen(random, last_hash, 16, datalength);
-    pos = auth_chain_find_pos(auth_chain_c->data_size_list0, auth_chain_c->data_size_list0_length, other_data_size);
+    pos = auth_chain_data_size_find_pos(sizes, other_data_size);
     // random select a size in the leftover data_size_list0
-    final_pos = pos + shift128plus_next(random) % (auth_chain_c->data_size_list0_length - pos);
-    return auth_chain_c->data_size_list0[final_pos] - other_data_size;
+    final_pos = pos + shift128plus_next(random) % (sizes->length - pos);
+    return sizes->list[final_pos] - other_data_size;
 }
 
 
@@ -1380,6 +1583,7 @@ unsigned int auth_chain_e_get_rand_len(struct auth_chain_a_context *local, int d
     struct server_info_t *server;
     uint16_t overhead;
     struct auth_chain_c_context *auth_chain_c;
+    const struct auth_chain_data_size_list *sizes;
     int other_data_size;
     size_t pos;
 
@@ -1389,17 +1593,18 @@ unsigned int auth_chain_e_get_rand_len(struct auth_chain_a_context *local, int d
 
     overhead = server->overhead;
     auth_chain_c = (struct auth_chain_c_context *)local->subclass_context;
+    sizes = auth_chain_c->data_size_list0;
 
     other_data_size = datalength + overhead;
 
     // if other_data_size > the bigest item in data_size_list0, not padding any data
-    if (other_data_size >= auth_chain_c->data_size_list0[auth_chain_c->data_size_list0_length - 1]) {
+    if (other_data_size >= sizes->list[sizes->length - 1]) {
         return 0;
     }
 
     // use the mini size in the data_size_list0
-    pos = auth_chain_find_pos(auth_chain_c->data_size_list0, auth_chain_c->data_size_list0_length, other_data_size);
-    return auth_chain_c->data_size_list0[pos] - other_data_size;
+    pos = auth_chain_data_size_find_pos(sizes, other_data_size);
+    return sizes->list[pos] - other_data_size;
 }
 
 
@@ -1418,50 +1623,46 @@ struct obfs_t * auth_chain_f_new_obfs(void) {
     return obfs;
 }
 
-static void auth_chain_f_init_data_size(struct obfs_t *obfs, const uint8_t *key_change_datetime_key_bytes) {
+static void auth_chain_f_build_data_size(struct obfs_t *obfs, struct auth_chain_data_size_list *sizes, const void *param) {
+    const uint8_t *key_change_datetime_key_bytes = (const uint8_t *)param;
     size_t i = 0;
     struct server_info_t *server = &obfs->server;
-    struct auth_chain_a_context *auth_chain_a = (struct auth_chain_a_context *)obfs->l_data;
-    struct auth_chain_c_context *auth_chain_c = (struct auth_chain_c_context *)auth_chain_a->subclass_context;
-    struct shift128plus_ctx *random = (struct shift128plus_ctx *)malloc(sizeof(struct shift128plus_ctx));
-    uint8_t *newKey = (uint8_t *)malloc(sizeof(uint8_t) * server->key_len);
-    size_t len;
+    struct shift128plus_ctx random = { 0 };
+    uint8_t newKey[16] = { 0 };
     size_t old_len;
 
-    memcpy(newKey, server->key, server->key_len);
+    memcpy(newKey, server->key, min(server->key_len, sizeof(newKey)));
     for (i = 0; i != 8; ++i) {
         newKey[i] ^= key_change_datetime_key_bytes[i];
     }
-    shift128plus_init_from_bin(random, newKey, server->key_len);
-    free(newKey);
-    newKey = NULL;
+    shift128plus_init_from_bin(&random, newKey, sizeof(newKey));
 
-    auth_chain_c->data_size_list0_length = shift128plus_next(random) % (8 + 16) + (4 + 8);
-    len = max(AUTH_CHAIN_D_MAX_DATA_SIZE_LIST_LIMIT_SIZE, auth_chain_c->data_size_list0_length);
-    auth_chain_c->data_size_list0 = (int *) calloc(len, sizeof(auth_chain_c->data_size_list0[0]));
-    for (i = 0; i < auth_chain_c->data_size_list0_length; i++) {
-        auth_chain_c->data_size_list0[i] = shift128plus_next(random) % 2340 % 2040 % 1440;
-    }
-    // stdlib qsort
-    qsort(auth_chain_c->data_size_list0,
-        auth_chain_c->data_size_list0_length,
-        sizeof(auth_chain_c->data_size_list0[0]),
-        data_size_list_compare
-        );
-
-    old_len = auth_chain_c->data_size_list0_length;
-    auth_chain_d_check_and_patch_data_size(obfs, random);
-    if (old_len != auth_chain_c->data_size_list0_length) {
+    auth_chain_data_size_generate(sizes, shift128plus_next(&random) % (8 + 16) + (4 + 8), &random);
+    auth_chain_data_size_sort(sizes);
+
+    old_len = sizes->length;
+    auth_chain_d_check_and_patch_data_size(sizes, &random);
+    if (old_len != sizes->length) {
         // if check_and_patch_data_size are work, re-sort again.
-        // stdlib qsort
-        qsort(auth_chain_c->data_size_list0,
-            auth_chain_c->data_size_list0_length,
-            sizeof(auth_chain_c->data_size_list0[0]),
-            data_size_list_compare
-            );
+        auth_chain_data_size_sort(sizes);
     }
+}
 
-    free(random);
+static void auth_chain_f_init_data_size(struct obfs_t *obfs, uint64_t key_change_datetime_key, const uint8_t *key_change_datetime_key_bytes) {
+    struct auth_chain_a_context *auth_chain_a = (struct auth_chain_a_context *)obfs->l_data;
+    struct auth_chain_c_context *auth_chain_c = (struct auth_chain_c_context *)auth_chain_a->subclass_context;
+    const struct auth_chain_data_size_list *sizes;
+
+    sizes = auth_chain_data_size_acquire(obfs, auth_chain_data_size_f, 1, key_change_datetime_key,
+        auth_chain_f_build_data_size, key_change_datetime_key_bytes, &auth_chain_c->own_list);
+
+    // The shared list is rebuilt when the key changes, while this connection
+    // must stick to the one it started with, so keep a private copy.
+    if (auth_chain_c->own_list == NULL) {
+        auth_chain_c->own_list = (struct auth_chain_data_size_list *) malloc(sizeof(*sizes));
+        memcpy(auth_chain_c->own_list, sizes, sizeof(*sizes));
+    }
+    auth_chain_c->data_size_list0 = auth_chain_c->own_list;
 }
 
 void auth_chain_f_set_server_info(struct obfs_t *obfs, struct server_info_t *server) {
@@ -1498,7 +1699,7 @@ void auth_chain_f_set_server_info(struct obfs_t *obfs, struct server_info_t *ser
         key_change_datetime_key_bytes[7 - i] = (uint8_t)((key_change_datetime_key >> (8 * i)) & 0xFF);
     }
 
-    auth_chain_f_init_data_size(obfs, key_change_datetime_key_bytes);
+    auth_chain_f_init_data_size(obfs, key_change_datetime_key, key_change_datetime_key_bytes);
 
     free(key_change_datetime_key_bytes);
     key_change_datetime_key_bytes = NULL;
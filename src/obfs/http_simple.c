@@ -47,11 +47,40 @@ static const char *request_path[] = {
 
 static int g_useragent_index = -1;
 
+#define HTTP_SIMPLE_HEADER_MAX  65536
+
+enum http_payload_state {
+    http_payload_before = 0,    /* no '%' seen yet */
+    http_payload_high,          /* '%' seen, waiting for the high nibble */
+    http_payload_low,           /* waiting for the low nibble */
+    http_payload_next,          /* one byte decoded, another '%' continues the run */
+    http_payload_after,         /* the run of "%XX" has ended */
+};
+
+/*
+ * Resumable scanner over the request header collected in recv_buffer.
+ * Every byte is examined exactly once however the header is fragmented,
+ * the percent-encoded payload is decoded on the fly.
+ */
+struct http_header_scanner {
+    size_t offset;          /* bytes of recv_buffer already scanned */
+    size_t line_begin;      /* offset of the line being scanned */
+    size_t host_begin;
+    size_t host_len;
+    int crlf_matched;       /* matched bytes of "\r\n\r\n" */
+    bool method_checked;
+    bool header_done;
+    enum http_payload_state payload_state;
+    uint8_t payload_high;
+    struct buffer_t *payload;
+};
+
 struct http_simple_local_data {
     int has_sent_header;
     int has_recv_header;
     struct buffer_t *encode_buffer;
     struct buffer_t *recv_buffer;
+    struct http_header_scanner scanner;
 };
 
 void http_simple_local_data_init(struct http_simple_local_data *local) {
@@ -59,6 +88,8 @@ void http_simple_local_data_init(struct http_simple_local_data *local) {
     local->has_recv_header = 0;
     local->encode_buffer = buffer_create(SSR_BUFF_SIZE);
     local->recv_buffer = buffer_create(SSR_BUFF_SIZE);
+    memset(&local->scanner, 0, sizeof(local->scanner));
+    local->scanner.payload = buffer_create(SSR_BUFF_SIZE);
 
     if (g_useragent_index == -1) {
         g_useragent_index = xorshift128plus() % (sizeof(g_useragent) / sizeof(*g_useragent));
@@ -101,6 +132,7 @@ void http_simple_dispose(struct obfs_t *obfs) {
     struct http_simple_local_data *local = (struct http_simple_local_data*)obfs->l_data;
     buffer_release(local->encode_buffer);
     buffer_release(local->recv_buffer);
+    buffer_release(local->scanner.payload);
     free(local);
     dispose_obfs(obfs);
 }
@@ -115,36 +147,80 @@ uint8_t from_hex(uint8_t ch) {
     return isdigit((int)ch) ? ch - '0' : (uint8_t)tolower((int)ch) - 'a' + 10;
 }
 
-struct buffer_t * get_data_from_http_header(const uint8_t *buf) {
-    struct buffer_t *ret = buffer_create(SSR_BUFF_SIZE);
-    const uint8_t *iter = (uint8_t *) strchr((char *)buf, '%');
-    uint8_t *target = ret->buffer;
-    while(iter) {
-        *target++ = from_hex(iter[1]) << 4 | from_hex(iter[2]);
-        iter += 3;
-        if (*iter != '%') {
-            break;
+static void http_header_scan_payload(struct http_header_scanner *scanner, uint8_t c) {
+    switch (scanner->payload_state) {
+    case http_payload_before:
+        if (c == '%') {
+            scanner->payload_state = http_payload_high;
+        }
+        break;
+    case http_payload_high:
+        scanner->payload_high = from_hex(c);
+        scanner->payload_state = http_payload_low;
+        break;
+    case http_payload_low:
+        {
+            uint8_t *target = scanner->payload->buffer + scanner->payload->len;
+            *target = (uint8_t)(scanner->payload_high << 4 | from_hex(c));
+            scanner->payload->len++;
         }
+        scanner->payload_state = http_payload_next;
+        break;
+    case http_payload_next:
+        scanner->payload_state = (c == '%') ? http_payload_high : http_payload_after;
+        break;
+    case http_payload_after:
+    default:
+        break;
     }
-    ret->len = target - ret->buffer;
-    return ret;
 }
 
-void get_host_from_http_header(const uint8_t *buf, char host_port[128]) {
+static void http_header_scan_line(struct http_header_scanner *scanner, const uint8_t *data, size_t end) {
     static const char *hoststr = "Host: ";
-    static const char *crlf = "\r\n";
-    struct buffer_t *ret = buffer_create(SSR_BUFF_SIZE);
-    const uint8_t *iter = (uint8_t *) strstr((char *)buf, hoststr);
-    if(iter) {
-        const uint8_t *end = NULL;
-        iter += strlen(hoststr);
-        end = (const uint8_t *) strstr((const char *)iter, crlf);
-        if (end) {
-            size_t len = end - iter;
-            memmove(host_port, iter, len);
-            host_port[len] = 0;
+    size_t host_str_len = strlen(hoststr);
+    size_t begin = scanner->line_begin;
+    if (scanner->host_len == 0 && (end - begin) > host_str_len &&
+        memcmp(data + begin, hoststr, host_str_len) == 0)
+    {
+        scanner->host_begin = begin + host_str_len;
+        scanner->host_len = end - scanner->host_begin;
+        if (data[end - 1] == '\r') {
+            scanner->host_len--;
+        }
+    }
+}
+
+/* Continue scanning |data| from where the previous call stopped.
+ * Returns true once the terminating CRLFCRLF has been seen. */
+static bool http_header_scan(struct http_header_scanner *scanner, const uint8_t *data, size_t len) {
+    size_t i;
+    if (scanner->header_done) {
+        return true;
+    }
+    // at most one decoded byte per three input bytes.
+    buffer_realloc(scanner->payload, scanner->payload->len + (len - scanner->offset) / 3 + 1);
+    for (i = scanner->offset; i < len; ++i) {
+        uint8_t c = data[i];
+        http_header_scan_payload(scanner, c);
+        if (c == '\n') {
+            http_header_scan_line(scanner, data, i);
+            scanner->line_begin = i + 1;
+        }
+        if (c == '\r') {
+            scanner->crlf_matched = (scanner->crlf_matched == 2) ? 3 : 1;
+        } else if (c == '\n' && (scanner->crlf_matched == 1 || scanner->crlf_matched == 3)) {
+            scanner->crlf_matched++;
+        } else {
+            scanner->crlf_matched = 0;
+        }
+        if (scanner->crlf_matched == 4) {
+            scanner->header_done = true;
+            ++i;
+            break;
         }
     }
+    scanner->offset = i;
+    return scanner->header_done;
 }
 
 void http_simple_encode_head(struct http_simple_local_data *local, const uint8_t *data, size_t datalength) {
@@ -362,68 +438,74 @@ bool match_http_header(struct buffer_t *buf) {
     return result;
 }
 
+static struct buffer_t * http_simple_not_match_return(struct http_simple_local_data *local) {
+    struct buffer_t *ret = buffer_clone(local->recv_buffer);
+    local->has_sent_header = true;
+    local->has_recv_header = true;
+    buffer_reset(local->recv_buffer);
+    return ret;
+}
+
 struct buffer_t * http_simple_server_decode(struct obfs_t *obfs, const struct buffer_t *buf, bool *need_decrypt, bool *need_feedback) {
     struct http_simple_local_data *local = (struct http_simple_local_data*)obfs->l_data;
-    static const char *crlfcrlf = "\r\n\r\n";
-    struct buffer_t *ret = buffer_create(SSR_BUFF_SIZE);
-    struct buffer_t *in_buf = NULL;
-    uint8_t *real_data = NULL;
-    size_t len = 0;
+    struct http_header_scanner *scanner = &local->scanner;
+    struct buffer_t *in_buf = local->recv_buffer;
+    struct buffer_t *ret = NULL;
     char host_port[128] = { 0 };
     do {
         if (need_decrypt) { *need_decrypt = true; }
         if (need_feedback) { *need_feedback = false; }
         if (local->has_recv_header) {
-            buffer_concatenate2(ret, buf);
+            ret = buffer_clone(buf);
             break;
         }
 
-        local->has_recv_header = true;
-
-        buffer_concatenate2(local->recv_buffer, buf);
-        in_buf = buffer_clone(local->recv_buffer);
+        // grow geometrically so that a trickling header is not copied over and over.
+        if (in_buf->capacity < in_buf->len + buf->len) {
+            buffer_realloc(in_buf, max(in_buf->capacity * 2, in_buf->len + buf->len));
+        }
+        buffer_concatenate2(in_buf, buf);
         if (in_buf->len <= 10) {
+            ret = buffer_create(SSR_BUFF_SIZE);
             break;
         }
-        if (match_http_header(in_buf) == false) {
-            // logging.debug('http_simple: not match begin')
-            buffer_reset(local->recv_buffer);
-            break;
+        if (scanner->method_checked == false) {
+            if (match_http_header(in_buf) == false) {
+                // logging.debug('http_simple: not match begin')
+                ret = http_simple_not_match_return(local);
+                break;
+            }
+            scanner->method_checked = true;
         }
-        if (in_buf->len > 65536) {
+        if (in_buf->len > HTTP_SIMPLE_HEADER_MAX) {
             // logging.warn('http_simple: over size')
-            buffer_reset(local->recv_buffer);
-            if (need_decrypt) { *need_decrypt = false; }
+            buffer_reset(in_buf);
             break;
         }
-        real_data = (uint8_t *) strstr((char *)in_buf->buffer, crlfcrlf);
-        if (real_data == NULL) {
+        if (http_header_scan(scanner, in_buf->buffer, in_buf->len) == false) {
+            ret = buffer_create(SSR_BUFF_SIZE);
             break;
         }
-        *real_data = 0;
-        real_data += strlen(crlfcrlf);
-
-        buffer_release(ret);
-        ret = get_data_from_http_header(in_buf->buffer);
-        get_host_from_http_header(in_buf->buffer, host_port);
 
+        if (scanner->host_len && scanner->host_len < sizeof(host_port)) {
+            memcpy(host_port, in_buf->buffer + scanner->host_begin, scanner->host_len);
+        }
         // TODO: check obfs_param
         // if host_port and self.server_info.obfs_param: 
         //     ....
 
-        len = (in_buf->buffer + in_buf->len - real_data);
-        if (len > 0) {
-            buffer_concatenate(ret, real_data, len);
-        }
-
-        if (ret->len < 13) {
-            // not_match_return
-            buffer_replace(ret, buf);
+        if (scanner->payload->len + (in_buf->len - scanner->offset) < 13) {
+            ret = http_simple_not_match_return(local);
             break;
         }
 
+        ret = scanner->payload;
+        scanner->payload = NULL;
+        buffer_concatenate(ret, in_buf->buffer + scanner->offset, in_buf->len - scanner->offset);
+
+        local->has_recv_header = true;
+        buffer_reset(in_buf);
     } while(0);
-    buffer_release(in_buf);
     return ret;
 }
 
@@ -21,17 +21,21 @@
 #define SSR_BUFF_SIZE 2048
 #endif // !SSR_BUFF_SIZE
 
+#define OBFS_MAX_IV_LEN 16  /* the longest IV of any stream cipher */
+
 struct buffer_t;
 struct cipher_env_t;
+struct server_users;
+struct server_user;
 
 struct server_info_t {
-    char host[256];
+    const char *host;  /* never NULL, owned by the configuration */
     uint16_t port;
     char *param;
     void *g_data;
     const uint8_t *iv;
     size_t iv_len;
-    uint8_t recv_iv[256];
+    uint8_t recv_iv[OBFS_MAX_IV_LEN];
     size_t recv_iv_len;
     uint8_t *key;
     uint16_t key_len;
@@ -40,6 +44,8 @@ struct server_info_t {
     uint16_t overhead;
     uint32_t buffer_size;
     struct cipher_env_t *cipher_env;
+    struct server_users *users;     /* multi-user table of the server, may be NULL */
+    struct server_user *user;       /* the user this connection authenticated as */
 };
 
 struct obfs_t {
@@ -52,6 +58,7 @@ struct obfs_t {
     struct server_info_t * (*get_server_info)(struct obfs_t *obfs);
     void (*set_server_info)(struct obfs_t *obfs, struct server_info_t *server);
     void (*dispose)(struct obfs_t *obfs);
+    void (*shrink)(struct obfs_t *obfs);  /* hand back idle memory, may be NULL */
 
     size_t (*client_pre_encrypt)(struct obfs_t *obfs, char **pplaindata, size_t datalength, size_t* capacity);
     ssize_t (*client_post_decrypt)(struct obfs_t *obfs, char **pplaindata, int datalength, size_t* capacity);
@@ -19,15 +19,37 @@
 
 BUFFER_CONSTANT_INSTANCE(tls_version, "\x03\x03", 2);
 
+#define TLS12_SESSION_SETS     128
+#define TLS12_SESSION_WAYS     4
+#define TLS12_SESSION_HELLOS   8
+
+/*
+ * Server side record of a client_id. It remembers the last few ClientHello
+ * random values of that client, so a captured hello can not be played back
+ * while its timestamp is still acceptable.
+ */
+struct tls12_ticket_session {
+    uint8_t client_id[32];
+    uint32_t last_seen;
+    uint32_t hello_count;
+    struct {
+        uint32_t utc_time;
+        uint8_t random[8];
+    } hellos[TLS12_SESSION_HELLOS];
+};
+
 struct tls12_ticket_auth_global_data {
     uint8_t local_client_id[32];
+    uint32_t startup_time;
+    // set associative, so both the memory and the lookup cost are bounded.
+    struct tls12_ticket_session sessions[TLS12_SESSION_SETS][TLS12_SESSION_WAYS];
 };
 
 struct tls12_ticket_auth_local_data {
     int handshake_status;
-    struct buffer_t *send_buffer;
     struct buffer_t *recv_buffer;
-    struct buffer_t *client_id;
+    struct buffer_t *client_id;  /* this and hmac_key only for the handshake */
+    struct buffer_t *hmac_key;  /* server key + client_id, built on first use */
     struct cstl_list *data_sent_buffer;
     uint32_t max_time_dif;
     int send_id;
@@ -35,6 +57,7 @@ struct tls12_ticket_auth_local_data {
 };
 
 void tls12_ticket_auth_dispose(struct obfs_t *obfs);
+void tls12_ticket_auth_shrink(struct obfs_t *obfs);
 
 struct buffer_t * tls12_ticket_auth_client_encode(struct obfs_t *obfs, const struct buffer_t *buf);
 struct buffer_t * tls12_ticket_auth_client_decode(struct obfs_t *obfs, const struct buffer_t *buf, bool *needsendback);
@@ -61,9 +84,9 @@ static int compare_element(const void *left, const void *right) {
 
 static void tls12_ticket_auth_local_data_init(struct tls12_ticket_auth_local_data* local) {
     local->handshake_status = 0;
-    local->send_buffer = buffer_create(SSR_BUFF_SIZE);
-    local->recv_buffer = buffer_create(SSR_BUFF_SIZE);
-    local->client_id = buffer_create(SSR_BUFF_SIZE);
+    local->recv_buffer = buffer_create(0);  /* all grow on demand */
+    local->client_id = buffer_create(0);
+    local->hmac_key = buffer_create(0);
     local->max_time_dif = 60 * 60 *24; // time dif (second) setting
     local->send_id = 0;
     local->fastauth = false;
@@ -71,8 +94,9 @@ static void tls12_ticket_auth_local_data_init(struct tls12_ticket_auth_local_dat
 }
 
 void * tls12_ticket_auth_init_data(void) {
-    struct tls12_ticket_auth_global_data *global = (struct tls12_ticket_auth_global_data*) malloc(sizeof(struct tls12_ticket_auth_global_data));
+    struct tls12_ticket_auth_global_data *global = (struct tls12_ticket_auth_global_data*) calloc(1, sizeof(struct tls12_ticket_auth_global_data));
     rand_bytes(global->local_client_id, sizeof(global->local_client_id));
+    global->startup_time = (uint32_t)time(NULL);
     return global;
 }
 
@@ -84,6 +108,7 @@ void tls12_ticket_auth_new_obfs(struct obfs_t * obfs) {
     obfs->get_server_info = get_server_info;
     obfs->set_server_info = set_server_info;
     obfs->dispose = tls12_ticket_auth_dispose;
+    obfs->shrink = tls12_ticket_auth_shrink;
 
     obfs->client_encode = tls12_ticket_auth_client_encode;
     obfs->client_decode = tls12_ticket_auth_client_decode;
@@ -106,29 +131,92 @@ size_t tls12_ticket_auth_get_overhead(struct obfs_t *obfs) {
 
 void tls12_ticket_auth_dispose(struct obfs_t *obfs) {
     struct tls12_ticket_auth_local_data *local = (struct tls12_ticket_auth_local_data*)obfs->l_data;
-    buffer_release(local->send_buffer);
     buffer_release(local->recv_buffer);
     buffer_release(local->client_id);
+    buffer_release(local->hmac_key);
     obj_list_destroy(local->data_sent_buffer);
     free(local);
     dispose_obfs(obfs);
 }
 
+void tls12_ticket_auth_shrink(struct obfs_t *obfs) {
+    struct tls12_ticket_auth_local_data *local = (struct tls12_ticket_auth_local_data*)obfs->l_data;
+    // both hellos are through (1|2|4|8 on the client, 1|4|8 on the server),
+    // nothing signs with the client_id any more.
+    if (local->handshake_status > 0 && (local->handshake_status & 12) == 12) {
+        buffer_reset(local->client_id);
+        buffer_shrink(local->client_id);
+        buffer_reset(local->hmac_key);
+        buffer_shrink(local->hmac_key);
+    }
+    buffer_shrink(local->recv_buffer);
+}
+
+// A connection only ever uses one client_id, so the HMAC key is built once.
 static void tls12_sha1_hmac(struct obfs_t *obfs,
                             const struct buffer_t *client_id,
                             const struct buffer_t *msg,
                             uint8_t digest[SHA1_BYTES])
 {
-    size_t id_size = client_id->len;
-    size_t key_size = obfs->server.key_len;
-    uint8_t *key = (uint8_t*)malloc(key_size + id_size);
-    memcpy(key, obfs->server.key, key_size);
-    memcpy(key + key_size, client_id->buffer, id_size);
-    {
-        BUFFER_CONSTANT_INSTANCE(_key, key, (key_size + id_size));
-        ss_sha1_hmac_with_key(digest, msg, _key);
+    struct tls12_ticket_auth_local_data *local = (struct tls12_ticket_auth_local_data*)obfs->l_data;
+    struct buffer_t *key = local->hmac_key;
+    if (key->len == 0) {
+        buffer_store(key, obfs->server.key, obfs->server.key_len);
+        buffer_concatenate2(key, client_id);
+    }
+    assert(key->len == obfs->server.key_len + client_id->len);
+    ss_sha1_hmac_with_key(digest, msg, key);
+}
+
+static struct tls12_ticket_session * tls12_ticket_session_find(struct tls12_ticket_auth_global_data *global, const uint8_t client_id[32], uint32_t now, uint32_t ttl) {
+    struct tls12_ticket_session *set = global->sessions[client_id[0] % TLS12_SESSION_SETS];
+    struct tls12_ticket_session *unused = NULL, *oldest = NULL, *victim;
+    size_t i;
+    for (i = 0; i < TLS12_SESSION_WAYS; ++i) {
+        struct tls12_ticket_session *s = &set[i];
+        bool alive = s->hello_count && (now - s->last_seen) <= ttl;
+        if (alive && memcmp(s->client_id, client_id, 32) == 0) {
+            return s;
+        }
+        if (alive == false) {
+            if (unused == NULL) { unused = s; }
+        } else if (oldest == NULL || s->last_seen < oldest->last_seen) {
+            oldest = s;
+        }
     }
-    free(key);
+    victim = unused ? unused : oldest;
+    memset(victim, 0, sizeof(*victim));
+    memcpy(victim->client_id, client_id, 32);
+    return victim;
+}
+
+/*
+ * Returns false if the hello was seen before, or is older than anything the
+ * session still remembers once it has been fully used.
+ */
+static bool tls12_ticket_session_accept(struct tls12_ticket_session *s, uint32_t now, uint32_t utc_time, const uint8_t *random) {
+    size_t i, oldest = 0;
+    size_t count = min((size_t)s->hello_count, (size_t)TLS12_SESSION_HELLOS);
+    for (i = 0; i < count; ++i) {
+        if (s->hellos[i].utc_time == utc_time && memcmp(s->hellos[i].random, random, 8) == 0) {
+            return false;
+        }
+        if ((int32_t)(s->hellos[i].utc_time - s->hellos[oldest].utc_time) < 0) {
+            oldest = i;
+        }
+    }
+    if (count == TLS12_SESSION_HELLOS) {
+        if ((int32_t)(utc_time - s->hellos[oldest].utc_time) < 0) {
+            return false;
+        }
+    } else {
+        oldest = count;
+    }
+    s->hellos[oldest].utc_time = utc_time;
+    memcpy(s->hellos[oldest].random, random, 8);
+    s->hello_count++;
+    s->last_seen = now;
+    return true;
 }
 
 struct buffer_t * tls12_ticket_auth_sni(const char *url0) {
@@ -273,7 +361,7 @@ struct buffer_t * tls12_ticket_auth_client_encode(struct obfs_t *obfs, const str
 #undef CSTR_DECL
 
         char *hosts = NULL;
-        char *param = NULL;
+        const char *param = NULL;
         char *phost[128] = { NULL };
         size_t host_num = 0;
         size_t pos;
@@ -595,10 +683,6 @@ struct buffer_t * tls12_ticket_auth_server_decode(struct obfs_t *obfs, const str
     struct tls12_ticket_auth_global_data *global = (struct tls12_ticket_auth_global_data*)obfs->server.g_data;
     struct buffer_t *result = NULL;
     BUFFER_CONSTANT_INSTANCE(empty_buf, "", 0);
-    struct buffer_t *buf_copy = NULL;
-    struct buffer_t *ogn_buf = NULL;
-    struct buffer_t *verifyid = NULL;
-    struct buffer_t *sessionid = NULL;
 
     if (need_decrypt) { *need_decrypt = true; }
     if (need_feedback) { *need_feedback = false; }
@@ -629,168 +713,152 @@ struct buffer_t * tls12_ticket_auth_server_decode(struct obfs_t *obfs, const str
         return result;
     }
     if ((local->handshake_status & 1) == 1) {
-        uint8_t *buf_ptr2 = NULL;
+        // ChangeCipherSpec b"\x14\x03\x03\x00\x01\x01" then Finished b"\x16\x03\x03" + length
+        static const uint8_t change_cipher_spec[] = { 0x14, 0x03, 0x03, 0x00, 0x01, 0x01 };
+        static const uint8_t finished[] = { 0x16, 0x03, 0x03, 0x00 };
         uint8_t hash[SHA1_BYTES + 1] = { 0 };
-        struct buffer_t *verify = NULL;
+        const uint8_t *iter;
         size_t verify_len = 0;
-        struct buffer_t *swap = buffer_create(SSR_BUFF_SIZE);
 
         buffer_concatenate2(local->recv_buffer, buf);
-        verify = buffer_clone(local->recv_buffer);
+        iter = local->recv_buffer->buffer;
 
         if (local->recv_buffer->len < 11) {
-            buffer_release(verify);
-            buffer_release(swap);
-            return NULL;
+            if (need_decrypt) { *need_decrypt = false; }
+            if (need_feedback) { *need_feedback = false; }
+            return buffer_create(1);
         }
-
-        // ChangeCipherSpec: b"\x14" + tls_version + b"\x00\x01\x01"
-        buffer_reset(swap);
-        {
-            BUFFER_CONSTANT_INSTANCE(const_buff1, "\x14", 1);
-            BUFFER_CONSTANT_INSTANCE(const_buff2, "\x00\x01\x01", 3);
-            buffer_concatenate2(swap, const_buff1);
-            buffer_concatenate2(swap, tls_version);
-            buffer_concatenate2(swap, const_buff2);
-        }
-        if (buffer_compare(local->recv_buffer, swap, swap->len) != 0) {
-            buffer_release(verify);
-            buffer_release(swap);
+        if (memcmp(iter, change_cipher_spec, sizeof(change_cipher_spec)) != 0) {
             return NULL;
         }
-
-        buf_ptr2 = local->recv_buffer->buffer + swap->len; // buf = buf[6:]
-
-        // Finished: b"\x16" + tls_version + b"\x00"
-        buffer_reset(swap);
-        {
-            BUFFER_CONSTANT_INSTANCE(const_buff1, "\x16", 1);
-            BUFFER_CONSTANT_INSTANCE(const_buff2, "\x00", 1);
-            buffer_concatenate2(swap, const_buff1);
-            buffer_concatenate2(swap, tls_version);
-            buffer_concatenate2(swap, const_buff2);
-        }
-        if (memcmp(buf_ptr2, swap->buffer, swap->len) != 0) {
-            buffer_release(verify);
-            buffer_release(swap);
+        if (memcmp(iter + sizeof(change_cipher_spec), finished, sizeof(finished)) != 0) {
             return NULL;
         }
 
-        verify_len = (size_t) ntohs(*((uint16_t *)(buf_ptr2+3))) + 1; // 11-10
-        if (verify->len < (verify_len + 10)) {
+        verify_len = (size_t) ntohs(*((uint16_t *)(iter + sizeof(change_cipher_spec) + 3))) + 1; // 11-10
+        if (local->recv_buffer->len < (verify_len + 10)) {
             if (need_decrypt) { *need_decrypt = false; }
             if (need_feedback) { *need_feedback = false; }
-            buffer_release(verify);
-            buffer_release(swap);
             return buffer_create(1);
         }
         {
-            BUFFER_CONSTANT_INSTANCE(pMsg, verify->buffer, verify_len);
+            BUFFER_CONSTANT_INSTANCE(pMsg, iter, verify_len);
             tls12_sha1_hmac(obfs, local->client_id, pMsg, hash);
         }
-        if (memcmp(hash, verify->buffer+verify_len, OBFS_HMAC_SHA1_LEN) != 0) {
-            buffer_release(verify);
-            buffer_release(swap);
+        if (memcmp(hash, iter + verify_len, OBFS_HMAC_SHA1_LEN) != 0) {
             return NULL;
         }
 
         verify_len = verify_len + OBFS_HMAC_SHA1_LEN;
-        buffer_store(local->recv_buffer, verify->buffer + verify_len, verify->len - verify_len);
-
-        buffer_release(verify);
-        buffer_release(swap);
+        buffer_shorten(local->recv_buffer, verify_len, local->recv_buffer->len - verify_len);
 
         local->handshake_status |= 4;
 
         return tls12_ticket_auth_server_decode(obfs, empty_buf, need_decrypt, need_feedback);
     }
     do {
+        // ClientHello: b"\x16\x03\x01" + length + b"\x01\x00" + length + tls_version
+        //              + verifyid(32) + sessionid_len(1) + sessionid, parsed in place.
         uint8_t sha1[SHA1_BYTES + 1] = { 0 };
+        const uint8_t *iter = NULL;
+        const uint8_t *verifyid = NULL;
         size_t header_len = 0;
         size_t msg_size = 0;
         size_t sessionid_len = 0;
         uint32_t utc_time = 0;
-        uint32_t time_dif = 0;
+        int32_t time_dif = 0;
+        uint32_t now = (uint32_t)time(NULL);
 
         buffer_concatenate2(local->recv_buffer, buf);
-        buf_copy = buffer_clone(local->recv_buffer);
-        ogn_buf = buffer_clone(local->recv_buffer);
-        if (buf_copy->len < 3) {
+        iter = local->recv_buffer->buffer;
+        if (local->recv_buffer->len < 3) {
             if (need_decrypt) { *need_decrypt = false; }
             if (need_feedback) { *need_feedback = false; }
             result = buffer_clone(empty_buf);
             break;
         }
-        if (memcmp(buf_copy->buffer, "\x16\x03\x01", 3) != 0) {
-            result = decode_error_return(obfs, ogn_buf, need_decrypt, need_feedback);
+        if (memcmp(iter, "\x16\x03\x01", 3) != 0) {
+            result = decode_error_return(obfs, local->recv_buffer, need_decrypt, need_feedback);
             break;
         }
-        buffer_shorten(buf_copy, 3, buf_copy->len - 3);
-        header_len = (size_t) ntohs(*((uint16_t *)buf_copy->buffer));
-        if (header_len > (buf_copy->len - sizeof(uint16_t))) {
+        if (local->recv_buffer->len < 5) {
+            if (need_decrypt) { *need_decrypt = false; }
+            if (need_feedback) { *need_feedback = false; }
+            result = buffer_clone(empty_buf);
+            break;
+        }
+        header_len = (size_t) ntohs(*((uint16_t *)(iter + 3)));
+        if (header_len > (local->recv_buffer->len - 5)) {
             if (need_decrypt) { *need_decrypt = false; }
             if (need_feedback) { *need_feedback = false; }
             result = buffer_clone(empty_buf);
             break;
         }
-        buffer_shorten(local->recv_buffer, header_len+5, local->recv_buffer->len - (header_len + 5));
         local->handshake_status = 1;
-        buffer_shorten(buf_copy, 2, header_len);
-        if (memcmp(buf_copy->buffer, "\x01\x00", 2) != 0) {
+        iter += 5;
+        if (header_len < 2 + 2 + 2 + 32 + 1 || memcmp(iter, "\x01\x00", 2) != 0) {
             // logging.info("tls_auth not client hello message")
-            result = decode_error_return(obfs, ogn_buf, need_decrypt, need_feedback);
+            result = decode_error_return(obfs, local->recv_buffer, need_decrypt, need_feedback);
             break;
         }
-        buffer_shorten(buf_copy, 2, buf_copy->len - 2);
-        msg_size = (size_t) ntohs(*((uint16_t *)buf_copy->buffer));
-        if (msg_size != buf_copy->len - 2) {
+        msg_size = (size_t) ntohs(*((uint16_t *)(iter + 2)));
+        if (msg_size != header_len - 4) {
             // logging.info("tls_auth wrong message size")
-            result = decode_error_return(obfs, ogn_buf, need_decrypt, need_feedback);
+            result = decode_error_return(obfs, local->recv_buffer, need_decrypt, need_feedback);
             break;
         }
-        buffer_shorten(buf_copy, 2, buf_copy->len - 2);
-        if (memcmp(buf_copy->buffer, tls_version->buffer, 2) != 0) {
+        if (memcmp(iter + 4, tls_version->buffer, 2) != 0) {
             // logging.info("tls_auth wrong tls version")
-            result = decode_error_return(obfs, ogn_buf, need_decrypt, need_feedback);
+            result = decode_error_return(obfs, local->recv_buffer, need_decrypt, need_feedback);
             break;
         }
-        buffer_shorten(buf_copy, 2, buf_copy->len - 2);
-        verifyid = buffer_create_from(buf_copy->buffer, 32);
-        buffer_shorten(buf_copy, 32, buf_copy->len - 32);
-        sessionid_len = (size_t) buf_copy->buffer[0];
-        if (sessionid_len < 32) {
+        verifyid = iter + 6;
+        sessionid_len = (size_t) verifyid[32];
+        if (sessionid_len < 32 || 6 + 32 + 1 + sessionid_len > header_len) {
             // logging.info("tls_auth wrong sessionid_len")
-            result = decode_error_return(obfs, ogn_buf, need_decrypt, need_feedback);
+            result = decode_error_return(obfs, local->recv_buffer, need_decrypt, need_feedback);
             break;
         }
-        sessionid = buffer_create_from(buf_copy->buffer + 1, sessionid_len);
-        buffer_shorten(buf_copy, sessionid_len + 1, buf_copy->len - (sessionid_len + 1));
-        buffer_replace(local->client_id, sessionid);
+        buffer_store(local->client_id, verifyid + 33, sessionid_len);
         {
-            BUFFER_CONSTANT_INSTANCE(pMsg, verifyid->buffer, 22);
+            BUFFER_CONSTANT_INSTANCE(pMsg, verifyid, 22);
             tls12_sha1_hmac(obfs, local->client_id, pMsg, sha1);
         }
-        utc_time = (uint32_t) ntohl(*(uint32_t *)verifyid->buffer);
-        time_dif = (uint32_t)(time(NULL) & 0xffffffff) - utc_time;
-        //if (obfs->server.param) {
-        //    // self.max_time_dif = int(self.server_info.obfs_param)
-        //    local->max_time_dif = obfs->server.param;
-        //}
-        //if self.max_time_dif > 0 and (time_dif < -self.max_time_dif or time_dif > self.max_time_dif \
-        //        or common.int32(utc_time - self.server_info.data.startup_time) < -self.max_time_dif / 2):
-        //    logging.info("tls_auth wrong time")
-        //    return self.decode_error_return(ogn_buf)
-        if (memcmp(sha1, verifyid->buffer+22, 10) != 0) {
+        if (memcmp(sha1, verifyid + 22, 10) != 0) {
             // logging.info("tls_auth wrong sha1")
-            result = decode_error_return(obfs, ogn_buf, need_decrypt, need_feedback);
+            result = decode_error_return(obfs, local->recv_buffer, need_decrypt, need_feedback);
+            break;
+        }
+        if (obfs->server.param && strlen(obfs->server.param)) {
+            // self.max_time_dif = int(self.server_info.obfs_param)
+            char *end = NULL;
+            long val = strtol(obfs->server.param, &end, 10);
+            if (end && *end == '\0' && val >= 0) {
+                local->max_time_dif = (uint32_t)val;
+            }
+        }
+        utc_time = (uint32_t) ntohl(*(uint32_t *)verifyid);
+        time_dif = (int32_t)(now - utc_time);
+        if (local->max_time_dif > 0 &&
+            (time_dif < -(int32_t)local->max_time_dif || time_dif > (int32_t)local->max_time_dif ||
+             (int32_t)(utc_time - global->startup_time) < -(int32_t)(local->max_time_dif / 2)))
+        {
+            // logging.info("tls_auth wrong time")
+            result = decode_error_return(obfs, local->recv_buffer, need_decrypt, need_feedback);
             break;
         }
-        //if self.server_info.data.client_data.get(verifyid[:22]):
-        //    logging.info("replay attack detect, id = %s" % (binascii.hexlify(verifyid)))
-        //    return self.decode_error_return(ogn_buf)
-        //self.server_info.data.client_data.sweep()
-        //self.server_info.data.client_data[verifyid[:22]] = sessionid
+        if (sessionid_len == 32) {
+            uint32_t ttl = local->max_time_dif ? local->max_time_dif : UINT32_MAX;
+            struct tls12_ticket_session *session = tls12_ticket_session_find(global, verifyid + 33, now, ttl);
+            if (tls12_ticket_session_accept(session, now, utc_time, verifyid + 4) == false) {
+                // logging.info("replay attack detect, id = %s" % (binascii.hexlify(verifyid)))
+                result = decode_error_return(obfs, local->recv_buffer, need_decrypt, need_feedback);
+                break;
+            }
+        }
+        buffer_shorten(local->recv_buffer, header_len + 5, local->recv_buffer->len - (header_len + 5));
         if (local->recv_buffer->len >= 11) {
+            // tls1.2_ticket_fastauth clients send Finished and data right behind the hello.
             result = tls12_ticket_auth_server_decode(obfs, empty_buf, need_decrypt, need_feedback);
             if (need_decrypt) { *need_decrypt = true; }
             if (need_feedback) { *need_feedback = true; }
@@ -802,10 +870,6 @@ struct buffer_t * tls12_ticket_auth_server_decode(struct obfs_t *obfs, const str
             break;
         }
     } while(0);
-    buffer_release(buf_copy);
-    buffer_release(ogn_buf);
-    buffer_release(verifyid);
-    buffer_release(sessionid);
     return result;
 }
 
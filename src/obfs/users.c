@@ -0,0 +1,155 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "users.h"
+#include "base64.h"
+#include "encrypt.h"
+#include "ssrbuffer.h"
+
+/*
+ * Open addressing hash table keyed by uid. It is kept at most half full,
+ * so a lookup during the handshake touches one or two slots.
+ */
+struct server_users {
+    struct server_user **slots;
+    size_t capacity;    /* power of two */
+    size_t count;
+};
+
+static size_t _uid_hash(uint32_t uid, size_t capacity) {
+    return (size_t)((uid * 2654435761u) & (uint32_t)(capacity - 1));
+}
+
+static void _server_user_destroy(struct server_user *user) {
+    if (user == NULL) {
+        return;
+    }
+    free(user->password);
+    free(user->protocol_param);
+    free(user->key_base64);
+    buffer_release(user->key);
+    ss_md5_hmac_ctx_release(user->hmac);
+    free(user);
+}
+
+static void _server_users_insert_slot(struct server_user **slots, size_t capacity, struct server_user *user) {
+    size_t i = _uid_hash(user->uid, capacity);
+    while (slots[i] != NULL) {
+        i = (i + 1) & (capacity - 1);
+    }
+    slots[i] = user;
+}
+
+static void _server_users_grow(struct server_users *users) {
+    size_t capacity = users->capacity * 2;
+    struct server_user **slots = (struct server_user **) calloc(capacity, sizeof(*slots));
+    size_t i;
+    for (i = 0; i < users->capacity; ++i) {
+        if (users->slots[i]) {
+            _server_users_insert_slot(slots, capacity, users->slots[i]);
+        }
+    }
+    free(users->slots);
+    users->slots = slots;
+    users->capacity = capacity;
+}
+
+struct server_users * server_users_create(size_t count_hint) {
+    struct server_users *users = (struct server_users *) calloc(1, sizeof(*users));
+    users->capacity = 16;
+    while (users->capacity < count_hint * 2) {
+        users->capacity *= 2;
+    }
+    users->slots = (struct server_user **) calloc(users->capacity, sizeof(users->slots[0]));
+    return users;
+}
+
+void server_users_destroy(struct server_users *users) {
+    size_t i;
+    if (users == NULL) {
+        return;
+    }
+    for (i = 0; i < users->capacity; ++i) {
+        _server_user_destroy(users->slots[i]);
+    }
+    free(users->slots);
+    free(users);
+}
+
+struct server_user * server_users_add(struct server_users *users, uint32_t uid, const char *password, const char *protocol_param) {
+    struct server_user *user;
+    size_t len;
+    if (users == NULL || password == NULL || strlen(password) == 0) {
+        return NULL;
+    }
+    if (server_users_find(users, uid) != NULL) {
+        return NULL;
+    }
+    if ((users->count + 1) * 2 > users->capacity) {
+        _server_users_grow(users);
+    }
+
+    len = strlen(password);
+    user = (struct server_user *) calloc(1, sizeof(*user));
+    user->uid = uid;
+    user->password = strdup(password);
+    if (protocol_param && strlen(protocol_param)) {
+        user->protocol_param = strdup(protocol_param);
+        user->max_connections = (unsigned int) strtoul(protocol_param, NULL, 10);
+    }
+    user->key = buffer_create_from((const uint8_t *)password, len);
+    user->key_base64 = (char *) calloc((size_t)std_base64_encode_len((int)len) + 1, sizeof(char));
+    std_base64_encode((const unsigned char *)password, (int)len, (unsigned char *)user->key_base64);
+    user->hmac = ss_md5_hmac_ctx_create((const uint8_t *)password, len);
+
+    _server_users_insert_slot(users->slots, users->capacity, user);
+    users->count++;
+    return user;
+}
+
+struct server_user * server_users_find(const struct server_users *users, uint32_t uid) {
+    size_t i;
+    if (users == NULL || users->count == 0) {
+        return NULL;
+    }
+    i = _uid_hash(uid, users->capacity);
+    while (users->slots[i] != NULL) {
+        if (users->slots[i]->uid == uid) {
+            return users->slots[i];
+        }
+        i = (i + 1) & (users->capacity - 1);
+    }
+    return NULL;
+}
+
+size_t server_users_count(const struct server_users *users) {
+    return users ? users->count : 0;
+}
+
+void server_users_traverse(const struct server_users *users, void(*fn)(struct server_user *user, void *p), void *p) {
+    size_t i;
+    if (users == NULL || fn == NULL) {
+        return;
+    }
+    for (i = 0; i < users->capacity; ++i) {
+        if (users->slots[i]) {
+            fn(users->slots[i], p);
+        }
+    }
+}
+
+/* AES key of the auth_chain header, EVP_BytesToKey(base64(key) + salt).
+ * The salt is fixed per protocol, so it is worked out on first use. */
+const uint8_t * server_user_enc_key(struct server_user *user, const char *salt) {
+    if (user->enc_key_salt == NULL || strcmp(user->enc_key_salt, salt) != 0) {
+        size_t b64len = strlen(user->key_base64);
+        size_t salt_len = strlen(salt);
+        uint8_t *key = (uint8_t *) calloc(b64len + salt_len + 1, sizeof(uint8_t));
+        memcpy(key, user->key_base64, b64len);
+        memcpy(key + b64len, salt, salt_len);
+        bytes_to_key_with_size(key, b64len + salt_len, user->enc_key, sizeof(user->enc_key));
+        free(key);
+        user->enc_key_salt = salt;
+    }
+    return user->enc_key;
+}
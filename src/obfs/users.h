@@ -0,0 +1,46 @@
+/*
+ * users.h - Define the multi-user table of shadowsocksR server
+ */
+
+#ifndef _OBFS_USERS_H
+#define _OBFS_USERS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+struct buffer_t;
+struct md5_hmac_ctx;
+
+struct server_user {
+    uint32_t uid;
+    char *password;
+    char *protocol_param;
+    unsigned int max_connections;   /* 0 for no limit */
+
+    // derived from the password once when the table is built
+    struct buffer_t *key;           /* user key of auth_chain, the password bytes */
+    char *key_base64;
+    struct md5_hmac_ctx *hmac;      /* HMAC-MD5 keyed with |key| */
+    uint8_t enc_key[16];
+    const char *enc_key_salt;
+
+    // only touched by the loop thread that owns the table, no locking needed
+    uint64_t bytes_up;
+    uint64_t bytes_down;
+    uint64_t connections_total;
+    uint32_t connections_active;
+};
+
+struct server_users;
+
+struct server_users * server_users_create(size_t count_hint);
+void server_users_destroy(struct server_users *users);
+struct server_user * server_users_add(struct server_users *users, uint32_t uid, const char *password, const char *protocol_param);
+struct server_user * server_users_find(const struct server_users *users, uint32_t uid);
+size_t server_users_count(const struct server_users *users);
+void server_users_traverse(const struct server_users *users, void(*fn)(struct server_user *user, void *p), void *p);
+
+const uint8_t * server_user_enc_key(struct server_user *user, const char *salt);
+
+#endif // _OBFS_USERS_H
@@ -11,11 +11,13 @@ static int verify_simple_pack_unit_size = 2000;
 typedef struct verify_simple_local_data {
     char * recv_buffer;
     int recv_buffer_size;
+    int recv_buffer_capacity;
 }verify_simple_local_data;
 
 void verify_simple_local_data_init(verify_simple_local_data* local) {
     local->recv_buffer = (char*)malloc(16384);
     local->recv_buffer_size = 0;
+    local->recv_buffer_capacity = 16384;
 }
 
 void verify_simple_new_obfs(struct obfs_t * obfs) {
@@ -88,13 +90,18 @@ size_t verify_simple_client_pre_encrypt(struct obfs_t *obfs, char **pplaindata,
 ssize_t verify_simple_client_post_decrypt(struct obfs_t *obfs, char **pplaindata, int datalength, size_t *capacity) {
     char *plaindata = *pplaindata;
     verify_simple_local_data *local = (verify_simple_local_data*)obfs->l_data;
-    uint8_t * recv_buffer = (uint8_t *)local->recv_buffer;
+    uint8_t * recv_buffer;
     char * out_buffer;
     char * buffer;
     int len;
 
-    if (local->recv_buffer_size + datalength > 16384)
+    if (local->recv_buffer_size > 16384)
         return -1;
+    if (local->recv_buffer_size + datalength > local->recv_buffer_capacity) {
+        local->recv_buffer_capacity = local->recv_buffer_size + datalength;
+        local->recv_buffer = (char*)realloc(local->recv_buffer, (size_t)local->recv_buffer_capacity);
+    }
+    recv_buffer = (uint8_t *)local->recv_buffer;
     memmove(recv_buffer + local->recv_buffer_size, plaindata, datalength);
     local->recv_buffer_size += datalength;
 
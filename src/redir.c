@@ -982,7 +982,7 @@ accept_cb(EV_P_ ev_io *w, int revents)
 //    }
     struct server_info_t server_info;
     memset(&server_info, 0, sizeof(struct server_info_t));
-    strcpy(server_info.host, server_env->host);
+    server_info.host = server_env->host;
     server_info.port = server_env->port;
     server_info.param = server_env->obfs_param;
     server_info.g_data = server_env->obfs_global;
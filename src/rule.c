@@ -30,6 +30,8 @@
 #endif
 
 #include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
 #ifdef __MINGW32__
@@ -38,8 +40,7 @@ extern void ss_error(const char *s);
 
 #include "rule.h"
 #include "ssrutils.h"
-
-static void free_rule(rule_t *);
+#include "uthash.h"
 
 rule_t *
 new_rule()
@@ -73,16 +74,101 @@ accept_rule_arg(rule_t *rule, const char *arg)
     return 1;
 }
 
-void
-add_rule(struct cork_dllist *rules, rule_t *rule)
+/* Characters a keyword can match on, anything else in a name is one more class. */
+#define RULE_ALPHABET 66
+
+static int
+char_class(unsigned char c)
 {
-    cork_dllist_add(rules, &rule->entries);
+    if (c >= 'a' && c <= 'z') return c - 'a';
+    if (c >= 'A' && c <= 'Z') return 26 + c - 'A';
+    if (c >= '0' && c <= '9') return 52 + c - '0';
+    if (c == '-') return 62;
+    if (c == '.') return 63;
+    if (c == '_') return 64;
+    return RULE_ALPHABET - 1;
+}
+
+struct rule_domain {
+    char *name;
+    rule_t *exact;
+    rule_t *suffix;
+    UT_hash_handle hh;
+};
+
+struct rule_keyword_node {
+    int32_t next[RULE_ALPHABET];  /* -1 for none until the links are built */
+    int32_t fail;
+    rule_t *match;  /* a keyword ending here or on the fail chain */
+};
+
+/* The name a pattern matches literally, with \. for a dot; NULL if it has
+ * anything a regular expression would read otherwise.
+ */
+static char *
+pattern_literal(const char *begin, const char *end)
+{
+    char *literal = malloc(end - begin + 1);
+    char *out     = literal;
+
+    while (begin < end) {
+        char c = *begin++;
+        if (c == '\\') {
+            if (begin == end || (*begin != '.' && *begin != '-')) {
+                break;
+            }
+            c = *begin++;
+        } else if (char_class((unsigned char)c) == RULE_ALPHABET - 1 || c == '.') {
+            break;
+        }
+        *out++ = c;
+    }
+    if (begin != end || out == literal) {
+        free(literal);
+        return NULL;
+    }
+    *out = '\0';
+    return literal;
+}
+
+static void
+classify_rule(rule_t *rule)
+{
+    static const char *suffix_prefixes[] = { "^(.*\\.)?", "(^|\\.)" };
+    const char *pattern = rule->pattern;
+    size_t len          = strlen(pattern);
+    bool anchored_end   = len > 1 && pattern[len - 1] == '$' && pattern[len - 2] != '\\';
+    size_t i;
+
+    rule->kind = rule_kind_regex;
+    if (anchored_end) {
+        for (i = 0; i < sizeof(suffix_prefixes) / sizeof(suffix_prefixes[0]); ++i) {
+            size_t n = strlen(suffix_prefixes[i]);
+            if (strncmp(pattern, suffix_prefixes[i], n) == 0) {
+                rule->literal = pattern_literal(pattern + n, pattern + len - 1);
+                rule->kind    = rule->literal ? rule_kind_suffix : rule_kind_regex;
+                return;
+            }
+        }
+        if (pattern[0] == '^') {
+            rule->literal = pattern_literal(pattern + 1, pattern + len - 1);
+            rule->kind    = rule->literal ? rule_kind_domain : rule_kind_regex;
+        }
+        return;
+    }
+    if (pattern[0] != '^') {
+        rule->literal = pattern_literal(pattern, pattern + len);
+        rule->kind    = rule->literal ? rule_kind_keyword : rule_kind_regex;
+    }
 }
 
 int
 init_rule(rule_t *rule)
 {
-    if (rule->pattern_re == NULL) {
+    if (rule->kind == rule_kind_regex && rule->literal == NULL) {
+        classify_rule(rule);
+    }
+    if (rule->kind == rule_kind_regex && rule->pattern_re == NULL) {
         const char *reerr;
         int reerroffset;
 
@@ -93,24 +179,210 @@ init_rule(rule_t *rule)
                  rule->pattern, reerr, reerroffset);
             return 0;
         }
+#ifdef PCRE_STUDY_JIT_COMPILE
+        rule->pattern_extra = pcre_study(rule->pattern_re, PCRE_STUDY_JIT_COMPILE, &reerr);
+#else
+        rule->pattern_extra = pcre_study(rule->pattern_re, 0, &reerr);
+#endif
     }
 
     return 1;
 }
 
+void
+rule_set_init(struct rule_set *set)
+{
+    memset(set, 0, sizeof(*set));
+    cork_dllist_init(&set->rules);
+}
+
+static int32_t
+keyword_node_new(struct rule_set *set)
+{
+    struct rule_keyword_node *node;
+    int i;
+
+    if (set->keyword_count == set->keyword_capacity) {
+        set->keyword_capacity = set->keyword_capacity ? set->keyword_capacity * 2 : 64;
+        set->keywords = realloc(set->keywords, set->keyword_capacity * sizeof(set->keywords[0]));
+    }
+    node = set->keywords + set->keyword_count;
+    for (i = 0; i < RULE_ALPHABET; ++i) {
+        node->next[i] = -1;
+    }
+    node->fail  = 0;
+    node->match = NULL;
+    return (int32_t)set->keyword_count++;
+}
+
+static void
+keyword_insert(struct rule_set *set, rule_t *rule)
+{
+    const unsigned char *c;
+    int32_t state;
+
+    if (set->keyword_count == 0) {
+        keyword_node_new(set);
+    }
+    state = 0;
+    for (c = (const unsigned char *)rule->literal; *c; ++c) {
+        int k = char_class(*c);
+        if (set->keywords[state].next[k] < 0) {
+            int32_t child = keyword_node_new(set);
+            set->keywords[state].next[k] = child;
+        }
+        state = set->keywords[state].next[k];
+    }
+    if (set->keywords[state].match == NULL) {
+        set->keywords[state].match = rule;
+    }
+}
+
+/* Once built, the missing transitions and matches are filled in from the
+ * fail links, so a keyword added after a lookup starts the trie over from
+ * the rules, which already hold the new one.
+ */
+static void
+keyword_add(struct rule_set *set, rule_t *rule)
+{
+    struct cork_dllist_item *curr;
+
+    if (set->keywords_ready == false) {
+        keyword_insert(set, rule);
+        return;
+    }
+    set->keyword_count  = 0;
+    set->keywords_ready = false;
+    for (curr = cork_dllist_start(&set->rules);
+         !cork_dllist_is_end(&set->rules, curr); curr = curr->next) {
+        rule_t *each = cork_container_of(curr, rule_t, entries);
+        if (each->kind == rule_kind_keyword) {
+            keyword_insert(set, each);
+        }
+    }
+}
+
+/* Breadth first, every missing transition is pointed to where the fail
+ * link would lead, so a lookup is one step per character.
+ */
+static void
+keyword_build(struct rule_set *set)
+{
+    struct rule_keyword_node *nodes = set->keywords;
+    int32_t *queue;
+    size_t head = 0, tail = 0;
+    int k;
+
+    if (set->keyword_count == 0 || set->keywords_ready) {
+        return;
+    }
+    queue = malloc(set->keyword_count * sizeof(queue[0]));
+    for (k = 0; k < RULE_ALPHABET; ++k) {
+        int32_t child = nodes[0].next[k];
+        if (child < 0) {
+            nodes[0].next[k] = 0;
+        } else if (child > 0) {
+            nodes[child].fail = 0;
+            queue[tail++]     = child;
+        }
+    }
+    while (head < tail) {
+        int32_t state = queue[head++];
+        int32_t fail  = nodes[state].fail;
+        if (nodes[state].match == NULL) {
+            nodes[state].match = nodes[fail].match;
+        }
+        for (k = 0; k < RULE_ALPHABET; ++k) {
+            int32_t child = nodes[state].next[k];
+            if (child < 0) {
+                nodes[state].next[k] = nodes[fail].next[k];
+            } else {
+                nodes[child].fail = nodes[fail].next[k];
+                queue[tail++]     = child;
+            }
+        }
+    }
+    free(queue);
+    set->keywords_ready = true;
+}
+
+void
+add_rule(struct rule_set *set, rule_t *rule)
+{
+    struct rule_domain *domain = NULL;
+
+    cork_dllist_add(&set->rules, &rule->entries);
+
+    switch (rule->kind) {
+    case rule_kind_domain:
+    case rule_kind_suffix:
+        HASH_FIND(hh, set->domains, rule->literal, strlen(rule->literal), domain);
+        if (domain == NULL) {
+            domain       = calloc(1, sizeof(*domain));
+            domain->name = rule->literal;
+            HASH_ADD_KEYPTR(hh, set->domains, domain->name, strlen(domain->name), domain);
+        }
+        if (rule->kind == rule_kind_domain) {
+            domain->exact = domain->exact ? domain->exact : rule;
+        } else {
+            domain->suffix = domain->suffix ? domain->suffix : rule;
+        }
+        break;
+    case rule_kind_keyword:
+        keyword_add(set, rule);
+        break;
+    default:
+        if (rule->pattern_re == NULL) {
+            break;  /* didn't compile, matches nothing */
+        }
+        set->regexes = realloc(set->regexes, (set->regex_count + 1) * sizeof(set->regexes[0]));
+        set->regexes[set->regex_count++] = rule;
+        break;
+    }
+}
+
 rule_t *
-lookup_rule(const struct cork_dllist *rules, const char *name, size_t name_len)
+lookup_rule(struct rule_set *set, const char *name, size_t name_len)
 {
-    struct cork_dllist_item *curr, *next;
+    struct rule_domain *domain = NULL;
+    size_t i;
 
     if (name == NULL) {
         name     = "";
         name_len = 0;
     }
 
-    cork_dllist_foreach_void(rules, curr, next) {
-        rule_t *rule = cork_container_of(curr, rule_t, entries);
-        if (pcre_exec(rule->pattern_re, NULL,
+    // the name itself, then each parent after a dot.
+    if (set->domains) {
+        HASH_FIND(hh, set->domains, name, name_len, domain);
+        if (domain && (domain->exact || domain->suffix)) {
+            return domain->exact ? domain->exact : domain->suffix;
+        }
+        for (i = 0; i < name_len; ++i) {
+            if (name[i] != '.') {
+                continue;
+            }
+            HASH_FIND(hh, set->domains, name + i + 1, name_len - i - 1, domain);
+            if (domain && domain->suffix) {
+                return domain->suffix;
+            }
+        }
+    }
+
+    if (set->keyword_count) {
+        int32_t state = 0;
+        keyword_build(set);
+        for (i = 0; i < name_len; ++i) {
+            state = set->keywords[state].next[char_class((unsigned char)name[i])];
+            if (set->keywords[state].match) {
+                return set->keywords[state].match;
+            }
+        }
+    }
+
+    for (i = 0; i < set->regex_count; ++i) {
+        rule_t *rule = set->regexes[i];
+        if (pcre_exec(rule->pattern_re, rule->pattern_extra,
                       name, (int)name_len, 0, 0, NULL, 0) >= 0)
             return rule;
     }
@@ -118,13 +390,6 @@ lookup_rule(const struct cork_dllist *rules, const char *name, size_t name_len)
     return NULL;
 }
 
-void
-remove_rule(rule_t *rule)
-{
-    cork_dllist_remove(&rule->entries);
-    free_rule(rule);
-}
-
 static void
 free_rule(rule_t *rule)
 {
@@ -132,7 +397,30 @@ free_rule(rule_t *rule)
         return;
 
     safe_free(rule->pattern);
+    safe_free(rule->literal);
+    if (rule->pattern_extra != NULL)
+        pcre_free_study(rule->pattern_extra);
     if (rule->pattern_re != NULL)
         pcre_free(rule->pattern_re);
     safe_free(rule);
 }
+
+void
+rule_set_free(struct rule_set *set)
+{
+    struct rule_domain *domain, *tmp;
+    struct cork_dllist_item *iter;
+
+    HASH_ITER(hh, set->domains, domain, tmp) {
+        HASH_DEL(set->domains, domain);
+        free(domain);
+    }
+    while ((iter = cork_dllist_head(&set->rules)) != NULL) {
+        rule_t *rule = cork_container_of(iter, rule_t, entries);
+        cork_dllist_remove(&rule->entries);
+        free_rule(rule);
+    }
+    free(set->keywords);
+    free(set->regexes);
+    rule_set_init(set);
+}
@@ -31,6 +31,7 @@
 #include "config.h"
 #endif
 
+#include <stdbool.h>
 #include <libcork/ds.h>
 
 //#ifdef HAVE_PCRE_H
@@ -39,19 +40,49 @@
 //#include <pcre/pcre.h>
 //#endif
 
+enum rule_kind {
+    rule_kind_regex,    /* anything else, left to PCRE */
+    rule_kind_domain,   /* ^example\.com$ */
+    rule_kind_suffix,   /* ^(.*\.)?example\.com$, the domain and its subdomains */
+    rule_kind_keyword,  /* example, anywhere in the name */
+};
+
 typedef struct rule {
     char *pattern;
 
     /* Runtime fields */
+    enum rule_kind kind;
+    char *literal;  /* the name a non-regex pattern stands for */
     pcre *pattern_re;
+    pcre_extra *pattern_extra;
 
     struct cork_dllist_item entries;
 } rule_t;
 
-void add_rule(struct cork_dllist *, rule_t *);
+struct rule_domain;
+struct rule_keyword_node;
+
+/* The rules of one list, sorted by kind when added: domains and suffixes
+ * go into a hash of names, keywords into an Aho-Corasick automaton, and
+ * only real regular expressions are run one after another.
+ */
+struct rule_set {
+    struct cork_dllist rules;  /* owns every rule, in the order added */
+    struct rule_domain *domains;
+    struct rule_keyword_node *keywords;
+    size_t keyword_count;  /* nodes in use */
+    size_t keyword_capacity;
+    bool keywords_ready;  /* fail links are built */
+    rule_t **regexes;
+    size_t regex_count;
+};
+
+void rule_set_init(struct rule_set *);
+void rule_set_free(struct rule_set *);
+
+void add_rule(struct rule_set *, rule_t *);
 int init_rule(rule_t *);
-rule_t *lookup_rule(const struct cork_dllist *, const char *, size_t);
-void remove_rule(rule_t *);
+rule_t *lookup_rule(struct rule_set *, const char *, size_t);
 rule_t *new_rule();
 int accept_rule_arg(rule_t *, const char *);
 
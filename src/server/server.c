@@ -19,22 +19,32 @@
 #include "ssrutils.h"
 #include "ws_tls_basic.h"
 #include "http_parser_wrapper.h"
+#include "tls_svr.h"
+#include "users.h"
+#include "stats.h"
 
 #ifndef SSR_MAX_CONN
 #define SSR_MAX_CONN 1024
 #endif
 
+#ifndef INIT_PKG_WAIT_MAX
+#define INIT_PKG_WAIT_MAX (128 * 1024)  /* bytes read before the obfs and protocol headers must be complete */
+#endif
+
 struct ssr_server_state {
     struct server_env_t *env;
 
     uv_signal_t *sigint_watcher;
     uv_signal_t *sigterm_watcher;
+    uv_timer_t *shrink_timer;
 
     bool shutting_down;
 
     uv_tcp_t *tcp_listener;
     struct udp_listener_ctx_t *udp_listener;
     struct cstl_map *resolved_ips;
+    struct tls_svr_env *tls_env;
+    struct stats_server *stats;
 };
 
 enum tunnel_stage {
@@ -45,8 +55,26 @@ enum tunnel_stage {
     tunnel_stage_resolve_host = 4,  /* Resolve the hostname             */
     tunnel_stage_connect_host,
     tunnel_stage_launch_streaming,
+    tunnel_stage_tls_handshake,
+    tunnel_stage_tls_handshake_sent,
     tunnel_stage_tls_client_feedback,
     tunnel_stage_streaming,  /* Stream between client and server */
+    tunnel_stage_max,
+};
+
+#define STAGE_NAME(stage) [tunnel_stage_##stage] = #stage
+static const char * const stage_names[tunnel_stage_max] = {
+    STAGE_NAME(initial),
+    STAGE_NAME(receipt_done),
+    STAGE_NAME(client_feedback),
+    STAGE_NAME(confirm_done),
+    STAGE_NAME(resolve_host),
+    STAGE_NAME(connect_host),
+    STAGE_NAME(launch_streaming),
+    STAGE_NAME(tls_handshake),
+    STAGE_NAME(tls_handshake_sent),
+    STAGE_NAME(tls_client_feedback),
+    STAGE_NAME(streaming),
 };
 
 struct server_ctx {
@@ -59,6 +87,16 @@ struct server_ctx {
     size_t _recv_buffer_size;
     size_t _recv_d_max_size;
     char *sec_websocket_key;
+    struct tls_svr_ctx *tls;
+    uint64_t started;   /* uv_now() of the accept */
+    uint64_t bytes_up;  /* plaintext payload from the client */
+    uint64_t bytes_down;  /* plaintext payload from the target */
+    uint64_t swept_bytes;  /* bytes_up + bytes_down at the last shrink sweep */
+    bool established;   /* has reached streaming */
+    uint64_t accepted;  /* uv_hrtime() of the accept in microseconds, 0 if not timed */
+    enum tunnel_stage timed_stage;  /* the stage stage_since is of */
+    uint64_t stage_since;
+    size_t init_waited;  /* bytes read while the headers were still incomplete */
 };
 
 struct address_timestamp {
@@ -71,11 +109,14 @@ void ssr_server_shutdown(struct ssr_server_state *state);
 
 void server_tunnel_initialize(uv_tcp_t *listener, unsigned int idle_timeout);
 void server_shutdown(struct server_env_t *env);
+static void shrink_timer_cb(uv_timer_t *handle);
 
 void signal_quit_cb(uv_signal_t *handle, int signum);
 void tunnel_incoming_connection_established_cb(uv_stream_t *server, int status);
 
 static void tunnel_dying(struct tunnel_ctx *tunnel, void *p);
+static void tunnel_stats_describe(struct tunnel_ctx *tunnel, struct stats_tunnel_info *info);
+static void tunnel_stage_clock(struct server_ctx *ctx);
 static void tunnel_timeout_expire_done(struct tunnel_ctx *tunnel, struct socket_ctx *socket);
 static void tunnel_outgoing_connected_done(struct tunnel_ctx *tunnel, struct socket_ctx *socket);
 static void tunnel_read_done(struct tunnel_ctx *tunnel, struct socket_ctx *socket);
@@ -97,13 +138,18 @@ static void do_connect_host_start(struct tunnel_ctx *tunnel, struct socket_ctx *
 static void do_connect_host_done(struct tunnel_ctx *tunnel, struct socket_ctx *socket);
 static void do_launch_streaming(struct tunnel_ctx *tunnel, struct socket_ctx *socket);
 
-static void do_tls_init_package(struct tunnel_ctx *tunnel, struct socket_ctx *socket);
+static void do_tls_handshake(struct tunnel_ctx *tunnel, struct socket_ctx *socket);
+static void do_tls_init_package(struct tunnel_ctx *tunnel, struct socket_ctx *socket, const uint8_t *indata, size_t len);
 static void do_tls_client_feedback(struct tunnel_ctx *tunnel);
 static void do_tls_launch_streaming(struct tunnel_ctx *tunnel, struct socket_ctx *socket);
 
 static int resolved_ips_compare_key(const void *left, const void *right);
 static void resolved_ips_destroy_object(void *obj);
 
+static const struct stats_provider server_stats_provider = {
+    stage_names, tunnel_stage_max, &tunnel_stats_describe,
+};
+
 void print_server_info(const struct server_config *config);
 static void svr_usage(void);
 
@@ -156,9 +202,11 @@ int main(int argc, char * const argv[]) {
             daemon_wrapper(argv[0], param);
         }
 
+        dump_info_async_start();
         print_server_info(config);
 
         ssr_server_run_loop(config);
+        dump_info_async_stop();
 
         err = 0;
     } while (0);
@@ -187,6 +235,15 @@ static int ssr_server_run_loop(struct server_config *config) {
     state = (struct ssr_server_state *) calloc(1, sizeof(*state));
     state->env = ssr_cipher_env_create(config, state);
     loop->data = state->env;
+    state->env->stats->started = uv_now(loop);
+
+    if (tls_svr_is_configured(config)) {
+        state->tls_env = tls_svr_env_create(config);
+        if (state->tls_env == NULL) {
+            return fprintf(stderr, "Error on loading TLS certificate \"%s\" or key \"%s\".\n",
+                config->over_tls_cert_file, config->over_tls_key_file);
+        }
+    }
 
     {
         union sockaddr_universal addr = { 0 };
@@ -200,6 +257,10 @@ static int ssr_server_run_loop(struct server_config *config) {
         addr.addr4.sin_addr.s_addr = htonl(INADDR_ANY);
         uv_tcp_bind(listener, &addr.addr, 0);
 
+        if (config->fast_open && tcp_fast_open_listen(listener, (int)config->fast_open_qlen) == false) {
+            pr_warn("TCP fast open is not supported by the system, disabled");
+        }
+
         error = uv_listen((uv_stream_t *)listener, SSR_MAX_CONN, tunnel_incoming_connection_established_cb);
 
         if (error != 0) {
@@ -207,9 +268,23 @@ static int ssr_server_run_loop(struct server_config *config) {
         }
         state->tcp_listener = listener;
 
+#if UDP_RELAY_ENABLE
+        if (config->udp) {
+            // NULL lets udp_create_local_listener take IPv4 and IPv6 at once.
+            const char *udp_host = (config->listen_host && strlen(config->listen_host)) ? config->listen_host : NULL;
+            state->udp_listener = udprelay_begin(loop, udp_host, config->listen_port,
+                state->env->users, 0, (int)config->idle_timeout, config->udp_max_associations,
+                state->env->cipher, config->protocol, config->protocol_param);
+        }
+#endif // UDP_RELAY_ENABLE
+
         state->resolved_ips = obj_map_create(resolved_ips_compare_key,
                                              resolved_ips_destroy_object,
                                              resolved_ips_destroy_object);
+
+        if (config->stats_port) {
+            state->stats = stats_server_create(loop, config->stats_port, state->env, &server_stats_provider);
+        }
     }
 
     {
@@ -223,6 +298,10 @@ static int ssr_server_run_loop(struct server_config *config) {
         uv_signal_start(state->sigterm_watcher, signal_quit_cb, SIGTERM);
     }
 
+    state->shrink_timer = (uv_timer_t *)calloc(1, sizeof(uv_timer_t));
+    uv_timer_init(loop, state->shrink_timer);
+    uv_timer_start(state->shrink_timer, shrink_timer_cb, SSR_SHRINK_INTERVAL, SSR_SHRINK_INTERVAL);
+
     r = uv_run(loop, UV_RUN_DEFAULT);
 
     {
@@ -230,9 +309,12 @@ static int ssr_server_run_loop(struct server_config *config) {
 
         free(state->sigint_watcher);
         free(state->sigterm_watcher);
+        free(state->shrink_timer);
 
         obj_map_destroy(state->resolved_ips);
 
+        tls_svr_env_destroy(state->tls_env);
+
         free(state);
     }
 
@@ -257,6 +339,7 @@ void ssr_server_shutdown(struct ssr_server_state *state) {
 
     uv_signal_stop(state->sigint_watcher);
     uv_signal_stop(state->sigterm_watcher);
+    uv_timer_stop(state->shrink_timer);
 
     if (state->tcp_listener) {
         uv_close((uv_handle_t *)state->tcp_listener, listener_close_done_cb);
@@ -264,10 +347,14 @@ void ssr_server_shutdown(struct ssr_server_state *state) {
 
 #if UDP_RELAY_ENABLE
     if (state->udp_listener) {
-        // udprelay_shutdown(state->udp_listener);
+        udprelay_shutdown(state->udp_listener);
+        state->udp_listener = NULL;
     }
 #endif // UDP_RELAY_ENABLE
 
+    stats_server_shutdown(state->stats);
+    state->stats = NULL;
+
     server_shutdown(state->env);
 
     pr_info("\n");
@@ -281,7 +368,18 @@ bool _init_done_cb(struct tunnel_ctx *tunnel, void *p) {
     ctx->env = env;
     ctx->init_pkg = buffer_create(SSR_BUFF_SIZE);
     ctx->_recv_buffer_size = TCP_BUF_SIZE_MAX;
+    ctx->started = uv_now(tunnel->listener->loop);
     tunnel->data = ctx;
+    stats_tunnel_accepted(env->stats, ctx->started);
+    stats_stage_left(env->stats, tunnel_stage_max, &ctx->stage_since);
+    ctx->accepted = ctx->stage_since;
+
+    {
+        struct ssr_server_state *state = (struct ssr_server_state *)env->data;
+        if (state->tls_env) {
+            ctx->tls = tls_svr_ctx_create(state->tls_env);
+        }
+    }
 
     tunnel_add_dying_cb(tunnel, &tunnel_dying, ctx);
     tunnel->tunnel_timeout_expire_done = &tunnel_timeout_expire_done;
@@ -316,6 +414,23 @@ void server_shutdown(struct server_env_t *env) {
     cstl_set_container_traverse(env->tunnel_set, &_do_shutdown_tunnel, NULL);
 }
 
+// a tunnel that moved nothing since the last sweep gives back its buffers.
+static void _do_shrink_tunnel(const void *obj, void *p) {
+    struct tunnel_ctx *tunnel = (struct tunnel_ctx *)obj;
+    struct server_ctx *ctx = (struct server_ctx *) tunnel->data;
+    uint64_t moved = ctx->bytes_up + ctx->bytes_down;
+    if (ctx->stage == tunnel_stage_streaming && moved == ctx->swept_bytes) {
+        tunnel_cipher_shrink(ctx->cipher);
+    }
+    ctx->swept_bytes = moved;
+    (void)p;
+}
+
+static void shrink_timer_cb(uv_timer_t *handle) {
+    struct server_env_t *env = (struct server_env_t *)handle->loop->data;
+    cstl_set_container_traverse(env->tunnel_set, &_do_shrink_tunnel, NULL);
+}
+
 void signal_quit_cb(uv_signal_t *handle, int signum) {
     struct server_env_t *env;
     ASSERT(handle);
@@ -353,14 +468,55 @@ static void tunnel_dying(struct tunnel_ctx *tunnel, void *p) {
     ASSERT(ctx = ctx2);
 
     cstl_set_container_remove(ctx->env->tunnel_set, tunnel);
+    if (ctx->established == false) {
+        ctx->env->stats->handshake_failures++;
+    }
     if (ctx->cipher) {
         tunnel_cipher_release(ctx->cipher);
     }
     buffer_release(ctx->init_pkg);
     if (ctx->sec_websocket_key) { free(ctx->sec_websocket_key); }
+    tls_svr_ctx_destroy(ctx->tls);
     free(ctx);
 }
 
+static void tunnel_stats_describe(struct tunnel_ctx *tunnel, struct stats_tunnel_info *info) {
+    struct server_ctx *ctx = (struct server_ctx *) tunnel->data;
+    struct server_user *user = ctx->cipher ? tunnel_cipher_server_user(ctx->cipher) : NULL;
+    info->stage = (size_t)ctx->stage;
+    info->started = ctx->started;
+    info->bytes_up = ctx->bytes_up;
+    info->bytes_down = ctx->bytes_down;
+    info->crypto_ns = ctx->cipher ? ctx->cipher->crypto_ns : 0;
+    if (user) {
+        info->has_user = true;
+        info->uid = user->uid;
+    }
+}
+
+/* Charges the time in the stage just left, if it changed. */
+static void tunnel_stage_clock(struct server_ctx *ctx) {
+    if (ctx->stage != ctx->timed_stage) {
+        stats_stage_left(ctx->env->stats, (size_t)ctx->timed_stage, &ctx->stage_since);
+        ctx->timed_stage = ctx->stage;
+    }
+}
+
+static void tunnel_enter_streaming(struct server_ctx *ctx) {
+    ctx->stage = tunnel_stage_streaming;
+    ctx->established = true;
+    ctx->env->stats->tunnels_established++;
+    tunnel_stage_clock(ctx);
+
+    // only the handshake needs these.
+    buffer_release(ctx->init_pkg);
+    ctx->init_pkg = NULL;
+    if (ctx->sec_websocket_key) {
+        free(ctx->sec_websocket_key);
+        ctx->sec_websocket_key = NULL;
+    }
+}
+
 static void do_next(struct tunnel_ctx *tunnel, struct socket_ctx *socket) {
     bool done = false;
     struct server_ctx *ctx = (struct server_ctx *)tunnel->data;
@@ -373,7 +529,16 @@ static void do_next(struct tunnel_ctx *tunnel, struct socket_ctx *socket) {
         ASSERT(incoming->wrstate == socket_stop);
         incoming->rdstate = socket_stop;
         if (config->over_tls_enable) {
-            do_tls_init_package(tunnel, incoming);
+            if (incoming->result < 0) {
+                tunnel_shutdown(tunnel);
+                break;
+            }
+            if (ctx->tls) {
+                tls_svr_ctx_feed(ctx->tls, (uint8_t *)incoming->buf->base, (size_t)incoming->result);
+                do_tls_handshake(tunnel, incoming);
+                break;
+            }
+            do_tls_init_package(tunnel, incoming, (uint8_t *)incoming->buf->base, (size_t)incoming->result);
             break;
         }
         do_init_package(tunnel, incoming);
@@ -409,6 +574,30 @@ static void do_next(struct tunnel_ctx *tunnel, struct socket_ctx *socket) {
     case tunnel_stage_launch_streaming:
         do_launch_streaming(tunnel, socket);
         break;
+    case tunnel_stage_tls_handshake:
+        ASSERT(incoming == socket);
+        ASSERT(incoming->rdstate == socket_done);
+        ASSERT(incoming->wrstate == socket_stop);
+        incoming->rdstate = socket_stop;
+        if (incoming->result < 0) {
+            tunnel_shutdown(tunnel);
+            break;
+        }
+        tls_svr_ctx_feed(ctx->tls, (uint8_t *)incoming->buf->base, (size_t)incoming->result);
+        do_tls_handshake(tunnel, incoming);
+        break;
+    case tunnel_stage_tls_handshake_sent:
+        ASSERT(incoming == socket);
+        ASSERT(incoming->rdstate == socket_stop);
+        ASSERT(incoming->wrstate == socket_done);
+        incoming->wrstate = socket_stop;
+        if (incoming->result < 0) {
+            pr_err("write error: %s", uv_strerror((int)incoming->result));
+            tunnel_shutdown(tunnel);
+            break;
+        }
+        do_tls_handshake(tunnel, incoming);
+        break;
     case tunnel_stage_tls_client_feedback:
         ASSERT(incoming == socket);
         ASSERT(incoming->wrstate == socket_done);
@@ -422,6 +611,7 @@ static void do_next(struct tunnel_ctx *tunnel, struct socket_ctx *socket) {
         UNREACHABLE();
         break;
     }
+    tunnel_stage_clock(ctx);
 }
 
 static void tunnel_timeout_expire_done(struct tunnel_ctx *tunnel, struct socket_ctx *socket) {
@@ -540,9 +730,10 @@ static void do_init_package(struct tunnel_ctx *tunnel, struct socket_ctx *incomi
             break;
         }
 
-        ASSERT(ctx->cipher == NULL);
-        ctx->cipher = tunnel_cipher_create(ctx->env, tcp_mss);
-        ctx->_tcp_mss = tcp_mss;
+        if (ctx->cipher == NULL) {
+            ctx->cipher = tunnel_cipher_create(ctx->env, tcp_mss);
+            ctx->_tcp_mss = tcp_mss;
+        }
 
         result = tunnel_cipher_server_decrypt(ctx->cipher, buf, &receipt, &confirm);
 
@@ -553,7 +744,22 @@ static void do_init_package(struct tunnel_ctx *tunnel, struct socket_ctx *incomi
             break;
         }
 
-        ASSERT(result /* && result->len!=0 */);
+        if (result == NULL) {
+            // the obfs or protocol plugin rejected the header.
+            tunnel_shutdown(tunnel);
+            break;
+        }
+        if (result->len == 0 && confirm == NULL) {
+            // the obfs header is still incomplete, keep on reading.
+            ctx->init_waited += buf->len;
+            if (ctx->init_waited > INIT_PKG_WAIT_MAX) {
+                tunnel_shutdown(tunnel);
+                break;
+            }
+            socket_read(incoming, true);
+            ctx->stage = tunnel_stage_initial;
+            break;
+        }
         buffer_replace(ctx->init_pkg, result);
 
         if (confirm) {
@@ -714,6 +920,9 @@ static void do_parse(struct tunnel_ctx *tunnel, struct socket_ctx *socket) {
             target = (*addr)->address;
             target.addr4.sin_port = htons(s5addr->port);
             ipFound = true;
+            ctx->env->stats->dns_cache_hits++;
+        } else {
+            ctx->env->stats->dns_cache_misses++;
         }
     }
 
@@ -852,10 +1061,63 @@ static void do_launch_streaming(struct tunnel_ctx *tunnel, struct socket_ctx *so
 
     socket_read(incoming, false);
     socket_read(outgoing, true);
-    ctx->stage = tunnel_stage_streaming;
+    tunnel_enter_streaming(ctx);
 }
 
-static void do_tls_init_package(struct tunnel_ctx *tunnel, struct socket_ctx *socket) {
+/*
+ * Drive the server side TLS handshake when ssr-server terminates TLS itself.
+ * Every flight produced by the engine is written out before reading again;
+ * once the handshake is over, the decrypted WebSocket upgrade request goes
+ * through the same path as the plain text one forwarded by a front proxy.
+ */
+static void do_tls_handshake(struct tunnel_ctx *tunnel, struct socket_ctx *socket) {
+    struct server_ctx *ctx = (struct server_ctx *) tunnel->data;
+    struct buffer_t *out = NULL;
+    struct buffer_t *plain = NULL;
+    enum tls_svr_status status;
+
+    ASSERT(socket == tunnel->incoming);
+    ASSERT(ctx->tls);
+
+    do {
+        status = tls_svr_ctx_handshake(ctx->tls);
+        if (status == tls_svr_status_error) {
+            tunnel_shutdown(tunnel);
+            break;
+        }
+
+        out = tls_svr_ctx_take_output(ctx->tls);
+        if (out) {
+            socket_write(socket, out->buffer, out->len);
+            ctx->stage = tunnel_stage_tls_handshake_sent;
+            break;
+        }
+
+        if (status == tls_svr_status_want_read) {
+            socket_read(socket, true);
+            ctx->stage = tunnel_stage_tls_handshake;
+            break;
+        }
+
+        plain = tls_svr_ctx_decrypt(ctx->tls);
+        if (plain == NULL) {
+            tunnel_shutdown(tunnel);
+            break;
+        }
+        if (plain->len == 0) {
+            socket_read(socket, true);
+            ctx->stage = tunnel_stage_tls_handshake;
+            break;
+        }
+
+        do_tls_init_package(tunnel, socket, plain->buffer, plain->len);
+    } while (0);
+
+    buffer_release(out);
+    buffer_release(plain);
+}
+
+static void do_tls_init_package(struct tunnel_ctx *tunnel, struct socket_ctx *socket, const uint8_t *indata, size_t len) {
     struct server_ctx *ctx = (struct server_ctx *) tunnel->data;
     struct server_config *config = ctx->env->config;
     struct buffer_t *receipt = NULL;
@@ -863,18 +1125,11 @@ static void do_tls_init_package(struct tunnel_ctx *tunnel, struct socket_ctx *so
     struct buffer_t *result = NULL;
     struct http_headers *hdrs = NULL;
     do {
-        uint8_t *indata = (uint8_t *)socket->buf->base;
-        size_t len = (size_t)socket->result;
         size_t tcp_mss = _update_tcp_mss(socket);
 
         ASSERT(socket == tunnel->incoming);
         ASSERT(config->over_tls_enable); (void)config;
 
-        if (socket->result < 0) {
-            tunnel_shutdown(tunnel);
-            break;
-        }
-
         ASSERT(ctx->cipher == NULL);
         ctx->cipher = tunnel_cipher_create(ctx->env, tcp_mss);
         ctx->_tcp_mss = tcp_mss;
@@ -923,7 +1178,19 @@ static void do_tls_client_feedback(struct tunnel_ctx *tunnel) {
 
     ASSERT(config->over_tls_enable); (void)config;
 
-    socket_write(incoming, tls_ok, strlen(tls_ok));
+    if (ctx->tls) {
+        struct buffer_t *out = NULL;
+        if (tls_svr_ctx_encrypt(ctx->tls, (uint8_t *)tls_ok, strlen(tls_ok)) == false ||
+            (out = tls_svr_ctx_take_output(ctx->tls)) == NULL)
+        {
+            tunnel_shutdown(tunnel);
+            return;
+        }
+        socket_write(incoming, out->buffer, out->len);
+        buffer_release(out);
+    } else {
+        socket_write(incoming, tls_ok, strlen(tls_ok));
+    }
 
     ctx->stage = tunnel_stage_tls_client_feedback;
 }
@@ -950,7 +1217,7 @@ static void do_tls_launch_streaming(struct tunnel_ctx *tunnel, struct socket_ctx
 
     socket_read(incoming, false);
     socket_read(outgoing, true);
-    ctx->stage = tunnel_stage_streaming;
+    tunnel_enter_streaming(ctx);
 }
 
 static uint8_t* tunnel_extract_data(struct socket_ctx *socket, void*(*allocator)(size_t size), size_t *size) {
@@ -974,7 +1241,13 @@ static uint8_t* tunnel_extract_data(struct socket_ctx *socket, void*(*allocator)
                 struct buffer_t *tmp = tunnel_tls_cipher_server_encrypt(cipher_ctx, src);
                 size_t frame_len = 0;
                 uint8_t *frame = websocket_build_frame(false, tmp->buffer, tmp->len, &malloc, &frame_len);
-                buf = buffer_create_from(frame, frame_len);
+                if (ctx->tls) {
+                    if (tls_svr_ctx_encrypt(ctx->tls, frame, frame_len)) {
+                        buf = tls_svr_ctx_take_output(ctx->tls);
+                    }
+                } else {
+                    buf = buffer_create_from(frame, frame_len);
+                }
                 free(frame);
                 buffer_release(tmp);
             } else {
@@ -984,11 +1257,24 @@ static uint8_t* tunnel_extract_data(struct socket_ctx *socket, void*(*allocator)
             struct buffer_t *receipt = NULL;
             struct buffer_t *confirm = NULL;
             if (config->over_tls_enable) {
-                size_t payload_len = 0;
-                uint8_t *payload = websocket_retrieve_payload(src->buffer, src->len, &malloc, &payload_len);
-                BUFFER_CONSTANT_INSTANCE(payload_buf, payload, payload_len);
-                buf = tunnel_tls_cipher_server_decrypt(cipher_ctx, payload_buf, &receipt, &confirm);
-                free(payload);
+                struct buffer_t *plain = NULL;
+                const struct buffer_t *frame = src;
+                if (ctx->tls) {
+                    tls_svr_ctx_feed(ctx->tls, src->buffer, src->len);
+                    plain = tls_svr_ctx_decrypt(ctx->tls);
+                    frame = plain;
+                }
+                if (frame && frame->len) {
+                    size_t payload_len = 0;
+                    uint8_t *payload = websocket_retrieve_payload(frame->buffer, frame->len, &malloc, &payload_len);
+                    BUFFER_CONSTANT_INSTANCE(payload_buf, payload, payload_len);
+                    buf = tunnel_tls_cipher_server_decrypt(cipher_ctx, payload_buf, &receipt, &confirm);
+                    free(payload);
+                } else if (frame) {
+                    // only part of a TLS record has arrived so far.
+                    buf = buffer_create(SSR_BUFF_SIZE);
+                }
+                buffer_release(plain);
             } else {
                 buf = tunnel_cipher_server_decrypt(cipher_ctx, src, &receipt, &confirm);
             }
@@ -1001,6 +1287,23 @@ static uint8_t* tunnel_extract_data(struct socket_ctx *socket, void*(*allocator)
 
     if (buf) {
         size_t len = buf->len;
+        struct server_user *user = tunnel_cipher_server_user(cipher_ctx);
+        struct ssr_stats *stats = ctx->env->stats;
+        // count plaintext both ways: what the target sent before it is
+        // encrypted, and what the client sent once it is decrypted.
+        uint64_t payload = (socket == tunnel->outgoing) ? (uint64_t)socket->result : (uint64_t)len;
+        if (socket == tunnel->outgoing) {
+            if (ctx->bytes_down == 0) {
+                stats_first_byte(stats, ctx->accepted);
+            }
+            ctx->bytes_down += payload;
+            stats->bytes_down += payload;
+            if (user) { user->bytes_down += payload; }
+        } else {
+            ctx->bytes_up += payload;
+            stats->bytes_up += payload;
+            if (user) { user->bytes_up += payload; }
+        }
         *size = len;
         result = (uint8_t *)allocator(len + 1);
         memcpy(result, buf->buffer, len);
@@ -1039,11 +1342,23 @@ void print_server_info(const struct server_config *config) {
     if (config->obfs_param && strlen(config->obfs_param)) {
         pr_info("obfs_param       %s", config->obfs_param);
     }
+    if (config->users && obj_list_size(config->users)) {
+        pr_info("users            %u", (unsigned int)obj_list_size(config->users));
+    }
+    if (config->fast_open) {
+        pr_info("fast open        yes");
+    }
     if (config->over_tls_enable) {
         pr_info(" ");
         pr_warn("over TLS         %s", config->over_tls_enable ? "yes" : "no");
         pr_info("over TLS domain  %s", config->over_tls_server_domain);
         pr_info("over TLS path    %s", config->over_tls_path);
+        if (tls_svr_is_configured(config)) {
+            pr_info("TLS certificate  %s", config->over_tls_cert_file);
+            pr_info("TLS ALPN         %s", config->over_tls_alpn ? config->over_tls_alpn : "");
+            pr_info("TLS tickets      %s", config->over_tls_session_tickets ? "yes" : "no");
+            pr_info("TLS record size  %u", config->over_tls_record_size);
+        }
         pr_info(" ");
     }
     pr_info("udp relay        %s\n", config->udp ? "yes" : "no");
@@ -0,0 +1,313 @@
+#include <mbedtls/config.h>
+#include <mbedtls/platform.h>
+
+#include <mbedtls/ssl.h>
+#include <mbedtls/ssl_ticket.h>
+#include <mbedtls/entropy.h>
+#include <mbedtls/ctr_drbg.h>
+#include <mbedtls/x509_crt.h>
+#include <mbedtls/pk.h>
+#include <mbedtls/error.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "dump_info.h"
+#include "ssr_executive.h"
+#include "ssrbuffer.h"
+#include "tls_svr.h"
+
+#ifndef min
+#define min(a, b) (((a) < (b)) ? (a) : (b))
+#endif
+
+#define TLS_SVR_ALPN_MAX        8
+#define TLS_SVR_RECORD_MIN      512
+#define TLS_SVR_TICKET_LIFETIME (24 * 60 * 60)
+#define TLS_SVR_PERS            "ssr-server"
+
+struct tls_svr_env {
+    mbedtls_ssl_config conf;
+    mbedtls_x509_crt cert;
+    mbedtls_pk_context pkey;
+    mbedtls_entropy_context entropy;
+    mbedtls_ctr_drbg_context ctr_drbg;
+    mbedtls_ssl_ticket_context ticket;
+    bool ticket_enabled;
+    char *alpn_storage;
+    const char *alpn_list[TLS_SVR_ALPN_MAX + 1];
+    size_t record_size;
+};
+
+struct tls_svr_ctx {
+    struct tls_svr_env *env; // __weak_ptr
+    mbedtls_ssl_context ssl;
+    struct buffer_t *input;  /* ciphertext from the peer, not consumed yet */
+    struct buffer_t *output; /* ciphertext waiting to be written to the peer */
+    uint8_t *plain;  /* what mbedtls_ssl_read fills, made on the first decrypt */
+    bool handshake_done;
+};
+
+static void tls_svr_print_error(const char *title, int err) {
+    char msg[128] = { 0 };
+    mbedtls_strerror(err, msg, sizeof(msg));
+    pr_err("%s: -0x%04x %s", title, (unsigned int)(-err), msg);
+}
+
+static void tls_svr_env_parse_alpn(struct tls_svr_env *env, const char *alpn) {
+    size_t count = 0;
+    char *iter;
+    if (alpn == NULL || strlen(alpn) == 0) {
+        return;
+    }
+    env->alpn_storage = strdup(alpn);
+    iter = env->alpn_storage;
+    while (iter && *iter && count < TLS_SVR_ALPN_MAX) {
+        char *delim = strchr(iter, ',');
+        if (delim) {
+            *delim = '\0';
+        }
+        while (*iter == ' ') {
+            ++iter;
+        }
+        if (*iter) {
+            env->alpn_list[count++] = iter;
+        }
+        iter = delim ? (delim + 1) : NULL;
+    }
+    env->alpn_list[count] = NULL;
+}
+
+bool tls_svr_is_configured(const struct server_config *config) {
+    return config && config->over_tls_enable &&
+        config->over_tls_cert_file && strlen(config->over_tls_cert_file) &&
+        config->over_tls_key_file && strlen(config->over_tls_key_file);
+}
+
+struct tls_svr_env * tls_svr_env_create(const struct server_config *config) {
+    struct tls_svr_env *env = NULL;
+    bool success = false;
+    int err;
+
+    if (tls_svr_is_configured(config) == false) {
+        return NULL;
+    }
+
+    env = (struct tls_svr_env *) calloc(1, sizeof(*env));
+    mbedtls_ssl_config_init(&env->conf);
+    mbedtls_x509_crt_init(&env->cert);
+    mbedtls_pk_init(&env->pkey);
+    mbedtls_entropy_init(&env->entropy);
+    mbedtls_ctr_drbg_init(&env->ctr_drbg);
+    mbedtls_ssl_ticket_init(&env->ticket);
+
+    do {
+        err = mbedtls_ctr_drbg_seed(&env->ctr_drbg, mbedtls_entropy_func, &env->entropy,
+            (const unsigned char *)TLS_SVR_PERS, strlen(TLS_SVR_PERS));
+        if (err != 0) {
+            tls_svr_print_error("TLS random generator seeding failed", err);
+            break;
+        }
+
+        err = mbedtls_x509_crt_parse_file(&env->cert, config->over_tls_cert_file);
+        if (err != 0) {
+            tls_svr_print_error("TLS certificate loading failed", err);
+            break;
+        }
+
+        err = mbedtls_pk_parse_keyfile(&env->pkey, config->over_tls_key_file, NULL);
+        if (err != 0) {
+            tls_svr_print_error("TLS private key loading failed", err);
+            break;
+        }
+
+        err = mbedtls_ssl_config_defaults(&env->conf, MBEDTLS_SSL_IS_SERVER,
+            MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT);
+        if (err != 0) {
+            tls_svr_print_error("TLS configuration failed", err);
+            break;
+        }
+        mbedtls_ssl_conf_rng(&env->conf, mbedtls_ctr_drbg_random, &env->ctr_drbg);
+
+        err = mbedtls_ssl_conf_own_cert(&env->conf, &env->cert, &env->pkey);
+        if (err != 0) {
+            tls_svr_print_error("TLS certificate binding failed", err);
+            break;
+        }
+
+        tls_svr_env_parse_alpn(env, config->over_tls_alpn);
+        if (env->alpn_list[0]) {
+            err = mbedtls_ssl_conf_alpn_protocols(&env->conf, env->alpn_list);
+            if (err != 0) {
+                tls_svr_print_error("TLS ALPN setting failed", err);
+                break;
+            }
+        }
+
+        if (config->over_tls_session_tickets) {
+            err = mbedtls_ssl_ticket_setup(&env->ticket, mbedtls_ctr_drbg_random, &env->ctr_drbg,
+                MBEDTLS_CIPHER_AES_256_GCM, TLS_SVR_TICKET_LIFETIME);
+            if (err != 0) {
+                tls_svr_print_error("TLS session ticket setup failed", err);
+                break;
+            }
+            mbedtls_ssl_conf_session_tickets_cb(&env->conf,
+                mbedtls_ssl_ticket_write, mbedtls_ssl_ticket_parse, &env->ticket);
+            env->ticket_enabled = true;
+        }
+
+        env->record_size = config->over_tls_record_size;
+        if (env->record_size < TLS_SVR_RECORD_MIN) {
+            env->record_size = TLS_SVR_RECORD_MIN;
+        }
+        if (env->record_size > MBEDTLS_SSL_MAX_CONTENT_LEN) {
+            env->record_size = MBEDTLS_SSL_MAX_CONTENT_LEN;
+        }
+
+        success = true;
+    } while (0);
+
+    if (success == false) {
+        tls_svr_env_destroy(env);
+        env = NULL;
+    }
+    return env;
+}
+
+void tls_svr_env_destroy(struct tls_svr_env *env) {
+    if (env == NULL) {
+        return;
+    }
+    mbedtls_ssl_ticket_free(&env->ticket);
+    mbedtls_ssl_config_free(&env->conf);
+    mbedtls_ctr_drbg_free(&env->ctr_drbg);
+    mbedtls_entropy_free(&env->entropy);
+    mbedtls_pk_free(&env->pkey);
+    mbedtls_x509_crt_free(&env->cert);
+    object_safe_free((void **)&env->alpn_storage);
+    free(env);
+}
+
+static int _tls_svr_bio_send(void *p, const unsigned char *buf, size_t len) {
+    struct tls_svr_ctx *ctx = (struct tls_svr_ctx *)p;
+    buffer_concatenate(ctx->output, buf, len);
+    return (int)len;
+}
+
+static int _tls_svr_bio_recv(void *p, unsigned char *buf, size_t len) {
+    struct tls_svr_ctx *ctx = (struct tls_svr_ctx *)p;
+    size_t avail = ctx->input->len;
+    if (avail == 0) {
+        return MBEDTLS_ERR_SSL_WANT_READ;
+    }
+    len = min(len, avail);
+    memcpy(buf, ctx->input->buffer, len);
+    buffer_shorten(ctx->input, len, avail - len);
+    return (int)len;
+}
+
+struct tls_svr_ctx * tls_svr_ctx_create(struct tls_svr_env *env) {
+    struct tls_svr_ctx *ctx;
+    int err;
+    if (env == NULL) {
+        return NULL;
+    }
+    ctx = (struct tls_svr_ctx *) calloc(1, sizeof(*ctx));
+    ctx->env = env;
+    ctx->input = buffer_create(SSR_BUFF_SIZE);
+    ctx->output = buffer_create(SSR_BUFF_SIZE);
+    mbedtls_ssl_init(&ctx->ssl);
+    err = mbedtls_ssl_setup(&ctx->ssl, &env->conf);
+    if (err != 0) {
+        tls_svr_print_error("TLS session setup failed", err);
+        tls_svr_ctx_destroy(ctx);
+        return NULL;
+    }
+    mbedtls_ssl_set_bio(&ctx->ssl, ctx, _tls_svr_bio_send, _tls_svr_bio_recv, NULL);
+    return ctx;
+}
+
+void tls_svr_ctx_destroy(struct tls_svr_ctx *ctx) {
+    if (ctx == NULL) {
+        return;
+    }
+    mbedtls_ssl_free(&ctx->ssl);
+    buffer_release(ctx->input);
+    buffer_release(ctx->output);
+    free(ctx->plain);
+    free(ctx);
+}
+
+void tls_svr_ctx_feed(struct tls_svr_ctx *ctx, const uint8_t *data, size_t len) {
+    if (ctx && data && len) {
+        buffer_concatenate(ctx->input, data, len);
+    }
+}
+
+enum tls_svr_status tls_svr_ctx_handshake(struct tls_svr_ctx *ctx) {
+    int err;
+    if (ctx->handshake_done) {
+        return tls_svr_status_done;
+    }
+    err = mbedtls_ssl_handshake(&ctx->ssl);
+    if (err == 0) {
+        ctx->handshake_done = true;
+        return tls_svr_status_done;
+    }
+    if (err == MBEDTLS_ERR_SSL_WANT_READ || err == MBEDTLS_ERR_SSL_WANT_WRITE) {
+        return tls_svr_status_want_read;
+    }
+    tls_svr_print_error("TLS handshake failed", err);
+    return tls_svr_status_error;
+}
+
+struct buffer_t * tls_svr_ctx_decrypt(struct tls_svr_ctx *ctx) {
+    struct buffer_t *result = buffer_create(SSR_BUFF_SIZE);
+    ASSERT(ctx->handshake_done);
+    if (ctx->plain == NULL) {
+        ctx->plain = (uint8_t *) malloc(MBEDTLS_SSL_MAX_CONTENT_LEN);
+    }
+    while (true) {
+        int n = mbedtls_ssl_read(&ctx->ssl, ctx->plain, MBEDTLS_SSL_MAX_CONTENT_LEN);
+        if (n > 0) {
+            buffer_concatenate(result, ctx->plain, (size_t)n);
+            continue;
+        }
+        if (n == MBEDTLS_ERR_SSL_WANT_READ || n == MBEDTLS_ERR_SSL_WANT_WRITE) {
+            break;
+        }
+        if (n != 0 && n != MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY) {
+            tls_svr_print_error("TLS read failed", n);
+        }
+        buffer_release(result); result = NULL;
+        break;
+    }
+    return result;
+}
+
+bool tls_svr_ctx_encrypt(struct tls_svr_ctx *ctx, const uint8_t *data, size_t len) {
+    size_t offset = 0;
+    ASSERT(ctx->handshake_done);
+    while (offset < len) {
+        size_t chunk = min(len - offset, ctx->env->record_size);
+        int n = mbedtls_ssl_write(&ctx->ssl, data + offset, chunk);
+        if (n < 0) {
+            tls_svr_print_error("TLS write failed", n);
+            return false;
+        }
+        offset += (size_t)n;
+    }
+    return true;
+}
+
+struct buffer_t * tls_svr_ctx_take_output(struct tls_svr_ctx *ctx) {
+    struct buffer_t *result;
+    if (ctx == NULL || ctx->output->len == 0) {
+        return NULL;
+    }
+    result = ctx->output;
+    ctx->output = buffer_create(SSR_BUFF_SIZE);
+    return result;
+}
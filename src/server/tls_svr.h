@@ -0,0 +1,45 @@
+#ifndef __TLS_SVR_H__
+#define __TLS_SVR_H__ 1
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+struct server_config;
+struct buffer_t;
+
+/* Shared by all connections of one listener: certificate, key, RNG, ticket keys. */
+struct tls_svr_env;
+
+/* One TLS session on top of an already accepted TCP connection.
+ * The engine never touches the socket itself. Ciphertext read from the
+ * peer is handed in with tls_svr_ctx_feed(), ciphertext to be sent is
+ * collected with tls_svr_ctx_take_output() and written by the tunnel.
+ */
+struct tls_svr_ctx;
+
+enum tls_svr_status {
+    tls_svr_status_error = -1,
+    tls_svr_status_want_read = 0,
+    tls_svr_status_done = 1,
+};
+
+bool tls_svr_is_configured(const struct server_config *config);
+
+struct tls_svr_env * tls_svr_env_create(const struct server_config *config);
+void tls_svr_env_destroy(struct tls_svr_env *env);
+
+struct tls_svr_ctx * tls_svr_ctx_create(struct tls_svr_env *env);
+void tls_svr_ctx_destroy(struct tls_svr_ctx *ctx);
+
+void tls_svr_ctx_feed(struct tls_svr_ctx *ctx, const uint8_t *data, size_t len);
+enum tls_svr_status tls_svr_ctx_handshake(struct tls_svr_ctx *ctx);
+
+/* Decrypt everything fed so far. Returns NULL on fatal error or peer close. */
+struct buffer_t * tls_svr_ctx_decrypt(struct tls_svr_ctx *ctx);
+/* Encrypt |data| in records of at most the configured record size. */
+bool tls_svr_ctx_encrypt(struct tls_svr_ctx *ctx, const uint8_t *data, size_t len);
+/* Pending ciphertext for the peer, NULL if there is nothing to send. */
+struct buffer_t * tls_svr_ctx_take_output(struct tls_svr_ctx *ctx);
+
+#endif // __TLS_SVR_H__
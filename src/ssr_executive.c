@@ -40,6 +40,8 @@
 #include "obfs.h"
 #include "crc32.h"
 #include "cstl_lib.h"
+#include "users.h"
+#include "stats.h"
 
 const char * ssr_strerror(enum ssr_error err) {
 #define SSR_ERR_GEN(_, name, errmsg) case (name): return errmsg;
@@ -53,6 +55,19 @@ const char * ssr_strerror(enum ssr_error err) {
 
 void init_obfs(struct server_env_t *env, const char *protocol, const char *obfs);
 
+static void server_user_config_destroy(void *ptr) {
+    struct server_user_config *user = *((struct server_user_config **)ptr);
+    if (user) {
+        object_safe_free((void **)&user->password);
+        object_safe_free((void **)&user->protocol_param);
+        free(user);
+    }
+}
+
+static void server_config_destroy(void *ptr) {
+    config_release(*((struct server_config **)ptr));
+}
+
 void object_safe_free(void **obj) {
     if (obj && *obj) {
         free(*obj);
@@ -73,8 +88,65 @@ struct server_config * config_create(void) {
     config = (struct server_config *) calloc(1, sizeof(*config));
     string_safe_assign(&config->listen_host, DEFAULT_BIND_HOST);
     string_safe_assign(&config->method, DEFAULT_METHOD);
+    string_safe_assign(&config->over_tls_alpn, DEFAULT_TLS_ALPN);
+    config->over_tls_session_tickets = true;
+    config->over_tls_record_size = DEFAULT_TLS_RECORD_SIZE;
     config->listen_port = DEFAULT_BIND_PORT;
     config->idle_timeout = DEFAULT_IDLE_TIMEOUT;
+    config->connection_pool_max_idle = DEFAULT_POOL_MAX_IDLE;
+    config->first_data_wait = DEFAULT_FIRST_DATA_WAIT;
+    config->fast_open_qlen = DEFAULT_FAST_OPEN_QLEN;
+    config->weight = 1;
+    string_safe_assign(&config->server_policy, DEFAULT_SERVER_POLICY);
+    config->users = obj_list_create(NULL, server_user_config_destroy);
+    config->servers = obj_list_create(NULL, server_config_destroy);
+
+    return config;
+}
+
+/* All the settings of |src| but neither its users nor its more servers. */
+struct server_config * config_clone(const struct server_config *src) {
+    struct server_config *config;
+
+    config = (struct server_config *) calloc(1, sizeof(*config));
+    *config = *src;
+    config->listen_host = NULL;
+    config->remote_host = NULL;
+    config->password = NULL;
+    config->method = NULL;
+    config->protocol = NULL;
+    config->protocol_param = NULL;
+    config->obfs = NULL;
+    config->obfs_param = NULL;
+    config->over_tls_server_domain = NULL;
+    config->over_tls_path = NULL;
+    config->over_tls_root_cert_file = NULL;
+    config->over_tls_cert_file = NULL;
+    config->over_tls_key_file = NULL;
+    config->over_tls_alpn = NULL;
+    config->remarks = NULL;
+    config->server_policy = NULL;
+    config->acl = NULL;
+
+    string_safe_assign(&config->listen_host, src->listen_host);
+    string_safe_assign(&config->remote_host, src->remote_host);
+    string_safe_assign(&config->password, src->password);
+    string_safe_assign(&config->method, src->method);
+    string_safe_assign(&config->protocol, src->protocol);
+    string_safe_assign(&config->protocol_param, src->protocol_param);
+    string_safe_assign(&config->obfs, src->obfs);
+    string_safe_assign(&config->obfs_param, src->obfs_param);
+    string_safe_assign(&config->over_tls_server_domain, src->over_tls_server_domain);
+    string_safe_assign(&config->over_tls_path, src->over_tls_path);
+    string_safe_assign(&config->over_tls_root_cert_file, src->over_tls_root_cert_file);
+    string_safe_assign(&config->over_tls_cert_file, src->over_tls_cert_file);
+    string_safe_assign(&config->over_tls_key_file, src->over_tls_key_file);
+    string_safe_assign(&config->over_tls_alpn, src->over_tls_alpn);
+    string_safe_assign(&config->remarks, src->remarks);
+    string_safe_assign(&config->server_policy, src->server_policy);
+    string_safe_assign(&config->acl, src->acl);
+    config->users = obj_list_create(NULL, server_user_config_destroy);
+    config->servers = obj_list_create(NULL, server_config_destroy);
 
     return config;
 }
@@ -94,7 +166,14 @@ void config_release(struct server_config *cf) {
     object_safe_free((void **)&cf->over_tls_server_domain);
     object_safe_free((void **)&cf->over_tls_path);
     object_safe_free((void **)&cf->over_tls_root_cert_file);
+    object_safe_free((void **)&cf->over_tls_cert_file);
+    object_safe_free((void **)&cf->over_tls_key_file);
+    object_safe_free((void **)&cf->over_tls_alpn);
     object_safe_free((void **)&cf->remarks);
+    object_safe_free((void **)&cf->server_policy);
+    object_safe_free((void **)&cf->acl);
+    obj_list_destroy(cf->users);
+    obj_list_destroy(cf->servers);
 
     object_safe_free((void **)&cf);
 }
@@ -107,6 +186,31 @@ void config_change_for_server(struct server_config *config) {
     config->remote_port = 0;
 }
 
+void config_add_server(struct server_config *config, struct server_config *server) {
+    if (config == NULL || server == NULL) {
+        return;
+    }
+    obj_list_insert(config->servers, obj_list_size(config->servers), &server, sizeof(server));
+}
+
+void config_add_user(struct server_config *config, uint32_t uid, const char *password, const char *protocol_param) {
+    struct server_user_config *user;
+    if (config == NULL || password == NULL || strlen(password) == 0) {
+        return;
+    }
+    user = (struct server_user_config *) calloc(1, sizeof(*user));
+    user->uid = uid;
+    string_safe_assign(&user->password, password);
+    string_safe_assign(&user->protocol_param, protocol_param);
+    obj_list_insert(config->users, obj_list_size(config->users), &user, sizeof(user));
+}
+
+static void server_users_add_from_config(const void *elem, void *p) {
+    const struct server_user_config *user = *((const struct server_user_config **)elem);
+    struct server_users *users = (struct server_users *)p;
+    server_users_add(users, user->uid, user->password, user->protocol_param);
+}
+
 int tunnel_ctx_compare_for_c_set(const void *left, const void *right) {
     struct tunnel_ctx *l = *(struct tunnel_ctx **)left;
     struct tunnel_ctx *r = *(struct tunnel_ctx **)right;
@@ -131,7 +235,14 @@ struct server_env_t * ssr_cipher_env_create(struct server_config *config, void *
     // init obfs
     init_obfs(env, config->protocol, config->obfs);
 
+    if (config->users && obj_list_size(config->users) > 0) {
+        env->users = server_users_create(obj_list_size(config->users));
+        obj_list_for_each(config->users, server_users_add_from_config, env->users);
+    }
+
     env->tunnel_set = cstl_set_container_create(tunnel_ctx_compare_for_c_set, NULL);
+    env->stats = (struct ssr_stats *) calloc(1, sizeof(struct ssr_stats));
+    env->stats->port = config->listen_port;
     
     return env;
 }
@@ -143,8 +254,10 @@ void ssr_cipher_env_release(struct server_env_t *env) {
     object_safe_free(&env->protocol_global);
     object_safe_free(&env->obfs_global);
     cipher_env_release(env->cipher);
+    server_users_destroy(env->users);
 
     cstl_set_container_destroy(env->tunnel_set);
+    object_safe_free((void **)&env->stats);
     
     object_safe_free((void **)&env);
 }
@@ -275,13 +388,14 @@ void init_obfs(struct server_env_t *env, const char *protocol, const char *obfs)
 }
 
 struct tunnel_cipher_ctx * tunnel_cipher_create(struct server_env_t *env, size_t tcp_mss) {
-    struct server_info_t server_info = { {0}, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+    struct server_info_t server_info = { "", 0, 0, 0, 0, 0, {0}, 0, 0, 0, 0, 0, 0, 0, 0 };
 
     struct server_config *config = env->config;
 
     struct tunnel_cipher_ctx *tc = (struct tunnel_cipher_ctx *) calloc(1, sizeof(struct tunnel_cipher_ctx));
 
     tc->env = env;
+    tc->stats = env->stats;
 
     // init server cipher
     if (cipher_env_enc_method(env->cipher) > ss_cipher_table) {
@@ -291,7 +405,7 @@ struct tunnel_cipher_ctx * tunnel_cipher_create(struct server_env_t *env, size_t
     // SSR beg
 
     if (config->remote_host && strlen(config->remote_host)) {
-        strcpy(server_info.host, config->remote_host);
+        server_info.host = config->remote_host;
     }
     server_info.port = config->remote_port;
     server_info.iv = enc_ctx_get_iv(tc->e_ctx);
@@ -313,6 +427,7 @@ struct tunnel_cipher_ctx * tunnel_cipher_create(struct server_env_t *env, size_t
     {
         server_info.param = config->protocol_param;
         server_info.g_data = env->protocol_global;
+        server_info.users = env->users;
 
         tc->protocol = new_obfs_instance(config->protocol);
         if (tc->protocol) {
@@ -362,6 +477,25 @@ void tunnel_cipher_release(struct tunnel_cipher_ctx *tc) {
     free(tc);
 }
 
+void tunnel_cipher_shrink(struct tunnel_cipher_ctx *tc) {
+    if (tc == NULL) {
+        return;
+    }
+    if (tc->protocol && tc->protocol->shrink) {
+        tc->protocol->shrink(tc->protocol);
+    }
+    if (tc->obfs && tc->obfs->shrink) {
+        tc->obfs->shrink(tc->obfs);
+    }
+}
+
+struct server_user * tunnel_cipher_server_user(struct tunnel_cipher_ctx *tc) {
+    if (tc == NULL || tc->protocol == NULL) {
+        return NULL;
+    }
+    return tc->protocol->get_server_info(tc->protocol)->user;
+}
+
 bool tunnel_cipher_client_need_feedback(struct tunnel_cipher_ctx *tc) {
     bool protocol = false;
     bool obfs = false;
@@ -377,27 +511,57 @@ bool tunnel_cipher_client_need_feedback(struct tunnel_cipher_ctx *tc) {
     return (protocol || obfs);
 }
 
+/* Times the steps of one call in every STATS_CRYPTO_SAMPLE while timing is on. */
+struct cipher_clock {
+    struct tunnel_cipher_ctx *tc;
+    uint64_t last;  /* uv_hrtime() of the last lap, 0 if this call isn't timed */
+};
+
+static void cipher_clock_start(struct cipher_clock *clock, struct tunnel_cipher_ctx *tc) {
+    clock->tc = tc;
+    clock->last = 0;
+    if (tc->stats && tc->stats->timing && (tc->calls++ % STATS_CRYPTO_SAMPLE) == 0) {
+        clock->last = uv_hrtime();
+    }
+}
+
+static void cipher_clock_lap(struct cipher_clock *clock, enum stats_crypto_step step) {
+    struct stats_timing *timing;
+    uint64_t now;
+    if (clock->last == 0 || (timing = clock->tc->stats->timing) == NULL) {
+        return;
+    }
+    now = uv_hrtime();
+    stats_histogram_record(&timing->crypto[step], now - clock->last);
+    clock->tc->crypto_ns += (now - clock->last) * STATS_CRYPTO_SAMPLE;
+    clock->last = now;
+}
+
 // insert shadowsocks header
 enum ssr_error tunnel_cipher_client_encrypt(struct tunnel_cipher_ctx *tc, struct buffer_t *buf) {
     int err;
     struct obfs_t *obfs_plugin;
     struct server_env_t *env = tc->env;
+    struct cipher_clock clock;
     // SSR beg
     struct obfs_t *protocol_plugin = tc->protocol;
-    ASSERT(buf->capacity >= SSR_BUFF_SIZE);
+    cipher_clock_start(&clock, tc);
     if (protocol_plugin && protocol_plugin->client_pre_encrypt) {
         buf->len = (size_t)protocol_plugin->client_pre_encrypt(
             tc->protocol, (char **)&buf->buffer, (int)buf->len, &buf->capacity);
+        cipher_clock_lap(&clock, stats_crypto_protocol);
     }
     err = ss_encrypt(env->cipher, buf, tc->e_ctx, SSR_BUFF_SIZE);
     if (err != 0) {
         return ssr_error_invalid_password;
     }
+    cipher_clock_lap(&clock, stats_crypto_cipher);
 
     obfs_plugin = tc->obfs;
     if (obfs_plugin && obfs_plugin->client_encode) {
         struct buffer_t *tmp = obfs_plugin->client_encode(tc->obfs, buf);
         buffer_replace(buf, tmp); buffer_release(tmp);
+        cipher_clock_lap(&clock, stats_crypto_obfs);
     }
     // SSR end
     return ssr_ok;
@@ -407,12 +571,12 @@ enum ssr_error tunnel_cipher_client_decrypt(struct tunnel_cipher_ctx *tc, struct
 {
     struct obfs_t *protocol_plugin;
     struct server_env_t *env = tc->env;
+    struct cipher_clock clock;
 
     // SSR beg
     struct obfs_t *obfs_plugin = tc->obfs;
 
-    ASSERT(buf->len <= SSR_BUFF_SIZE);
-
+    cipher_clock_start(&clock, tc);
     if (obfs_plugin && obfs_plugin->client_decode) {
         bool needsendback = 0;
         struct buffer_t *result = obfs_plugin->client_decode(tc->obfs, buf, &needsendback);
@@ -426,12 +590,14 @@ enum ssr_error tunnel_cipher_client_decrypt(struct tunnel_cipher_ctx *tc, struct
             ASSERT(feedback);
             *feedback = sendback;
         }
+        cipher_clock_lap(&clock, stats_crypto_obfs);
     }
     if (buf->len > 0) {
         int err = ss_decrypt(env->cipher, buf, tc->d_ctx, SSR_BUFF_SIZE);
         if (err != 0) {
             return ssr_error_invalid_password;
         }
+        cipher_clock_lap(&clock, stats_crypto_cipher);
     }
     protocol_plugin = tc->protocol;
     if (protocol_plugin && protocol_plugin->client_post_decrypt) {
@@ -441,6 +607,7 @@ enum ssr_error tunnel_cipher_client_decrypt(struct tunnel_cipher_ctx *tc, struct
             return ssr_error_client_post_decrypt;
         }
         buf->len = (size_t)len;
+        cipher_clock_lap(&clock, stats_crypto_protocol);
     }
     // SSR end
     return ssr_ok;
@@ -452,9 +619,12 @@ struct buffer_t * tunnel_cipher_server_encrypt(struct tunnel_cipher_ctx *tc, con
     struct obfs_t *obfs = tc->obfs;
     struct obfs_t *protocol = tc->protocol;
     struct buffer_t *ret = NULL;
+    struct cipher_clock clock;
+    cipher_clock_start(&clock, tc);
     do {
         if (protocol && protocol->server_pre_encrypt) {
             ret = protocol->server_pre_encrypt(protocol, buf);
+            cipher_clock_lap(&clock, stats_crypto_protocol);
         } else {
             ret = buffer_clone(buf);
         }
@@ -467,9 +637,11 @@ struct buffer_t * tunnel_cipher_server_encrypt(struct tunnel_cipher_ctx *tc, con
             buffer_release(ret); ret = NULL;
             break;
         }
+        cipher_clock_lap(&clock, stats_crypto_cipher);
         if (obfs && obfs->server_encode) {
             struct buffer_t *tmp = obfs->server_encode(obfs, ret);
             buffer_release(ret); ret = tmp;
+            cipher_clock_lap(&clock, stats_crypto_obfs);
         }
     } while (0);
     return ret;
@@ -487,17 +659,20 @@ tunnel_cipher_server_decrypt(struct tunnel_cipher_ctx *tc,
     struct obfs_t *obfs = tc->obfs;
     struct obfs_t *protocol = tc->protocol;
     struct buffer_t *ret = NULL;
+    struct cipher_clock clock;
     BUFFER_CONSTANT_INSTANCE(empty, "", 0);
 
     if (receipt) { *receipt = NULL; }
     if (confirm) { *confirm = NULL; }
 
+    cipher_clock_start(&clock, tc);
     if (obfs && obfs->server_decode) {
         bool need_feedback = false;
         ret = obfs->server_decode(obfs, buf, &need_decrypt, &need_feedback);
         if (ret == NULL) {
             return NULL;
         }
+        cipher_clock_lap(&clock, stats_crypto_obfs);
         if (need_feedback) {
             if (receipt) {
                 *receipt = obfs->server_encode(obfs, empty);
@@ -517,20 +692,23 @@ tunnel_cipher_server_decrypt(struct tunnel_cipher_ctx *tc,
         }
         */
         if (protocol && protocol->server.recv_iv[0] == 0) {
-            size_t iv_len = protocol->server.iv_len;
+            size_t iv_len = min(protocol->server.iv_len, sizeof(protocol->server.recv_iv));
             memmove(protocol->server.recv_iv, ret->buffer, iv_len);
             protocol->server.recv_iv_len = iv_len;
         }
 
         err = ss_decrypt(env->cipher, ret, tc->d_ctx, max(SSR_BUFF_SIZE, ret->capacity));
         if (err != 0) {
+            buffer_release(ret);
             return NULL;
         }
+        cipher_clock_lap(&clock, stats_crypto_cipher);
     }
     if (protocol && protocol->server_post_decrypt) {
         bool feedback = false;
         struct buffer_t *tmp = protocol->server_post_decrypt(protocol, ret, &feedback);
         buffer_release(ret); ret = tmp;
+        cipher_clock_lap(&clock, stats_crypto_protocol);
         if (feedback) {
             if (confirm) {
                 *confirm  = tunnel_cipher_server_encrypt(tc, empty);
@@ -548,7 +726,6 @@ enum ssr_error tunnel_tls_cipher_client_encrypt(struct tunnel_cipher_ctx *tc, st
 #else
     int err;
     struct server_env_t *env = tc->env;
-    ASSERT(buf->capacity >= SSR_BUFF_SIZE);
     err = ss_encrypt(env->cipher, buf, tc->e_ctx, SSR_BUFF_SIZE);
     if (err != 0) {
         return ssr_error_invalid_password;
@@ -562,7 +739,6 @@ enum ssr_error tunnel_tls_cipher_client_decrypt(struct tunnel_cipher_ctx *tc, st
     return ssr_ok;
 #else
     struct server_env_t *env = tc->env;
-    // ASSERT(buf->len <= SSR_BUFF_SIZE);
     if (feedback) { *feedback = NULL; }
     if (buf->len > 0) {
         int err = ss_decrypt(env->cipher, buf, tc->d_ctx, SSR_BUFF_SIZE);
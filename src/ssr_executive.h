@@ -13,6 +13,16 @@ struct cipher_env_t;
 struct obfs_t;
 struct tunnel_ctx;
 struct cstl_set;
+struct cstl_list;
+struct server_users;
+struct server_user;
+
+/* One entry of the "users" table, auth_chain_* protocols only. */
+struct server_user_config {
+    uint32_t uid;
+    char *password;
+    char *protocol_param;
+};
 
 struct server_config {
     char *listen_host;
@@ -29,9 +39,27 @@ struct server_config {
     char *over_tls_server_domain;
     char *over_tls_path;
     char *over_tls_root_cert_file;
+    char *over_tls_cert_file;
+    char *over_tls_key_file;
+    char *over_tls_alpn;
+    bool over_tls_session_tickets;
+    unsigned int over_tls_record_size;
     bool udp;
+    unsigned int udp_max_associations; /* UDP relay flows tracked at once, 0 for the default */
     unsigned int idle_timeout; /* Connection idle timeout in ms. */
+    unsigned int connection_pool_size; /* ssr-client pre-connected sockets, 0 to disable */
+    unsigned int connection_pool_max_idle; /* in ms, keep below the server's idle timeout */
+    bool socks5_optimistic_reply; /* ssr-client replies to SOCKS5 before connecting upstream */
+    unsigned int first_data_wait; /* in ms, how long to wait for data to send with the init package */
+    bool fast_open;
+    unsigned int fast_open_qlen; /* ssr-server pending fast open requests */
+    unsigned int weight; /* share of this server in ssr-client round robin */
+    char *server_policy; /* how ssr-client picks from several servers */
+    char *acl; /* ssr-client rules file, which requests skip the server */
+    unsigned short stats_port; /* 127.0.0.1 port of the stats endpoint, 0 for none */
+    struct cstl_list *servers; /* list of struct server_config *, more servers for ssr-client */
     char *remarks;
+    struct cstl_list *users; /* list of struct server_user_config * */
 };
 
 #if !defined(_LOCAL_H)
@@ -46,6 +74,14 @@ struct server_env_t {
 
     void *protocol_global;
     void *obfs_global;
+
+    struct server_users *users;
+
+    struct remote_resolver *resolver; /* ssr-client only, owned by its run loop */
+    struct upstream_pool *pool; /* ssr-client only, owned by its run loop */
+    struct upstream_balancer *balancer; /* ssr-client only, on the top level server */
+    struct acl_router *router; /* ssr-client only, NULL without "acl" */
+    struct ssr_stats *stats; /* counters of the loop, shown by the stats endpoint */
 };
 #endif // _LOCAL_H
 
@@ -55,6 +91,9 @@ struct tunnel_cipher_ctx {
     struct enc_ctx *d_ctx;
     struct obfs_t *protocol; // __strong_ptr
     struct obfs_t *obfs; // __strong_ptr
+    struct ssr_stats *stats; // __weak_ptr, where the timed calls are counted
+    uint32_t calls;
+    uint64_t crypto_ns;  /* time in the calls, estimated from the timed ones */
 };
 
 #define SSR_ERR_MAP(V)                                                         \
@@ -84,14 +123,23 @@ void string_safe_assign(char **target, const char *value);
 #define DEFAULT_BIND_PORT     1080
 #define DEFAULT_IDLE_TIMEOUT  (60 * MILLISECONDS_PER_SECOND)
 #define DEFAULT_METHOD        "rc4-md5"
+#define DEFAULT_TLS_ALPN      "http/1.1"
+#define DEFAULT_TLS_RECORD_SIZE (16 * 1024)
+#define DEFAULT_POOL_MAX_IDLE (20 * MILLISECONDS_PER_SECOND)
+#define DEFAULT_FIRST_DATA_WAIT 10
+#define DEFAULT_FAST_OPEN_QLEN 256
+#define DEFAULT_SERVER_POLICY "latency"
 
 #if !defined(TCP_BUF_SIZE_MAX)
 #define TCP_BUF_SIZE_MAX 32 * 1024
 #endif
 
 struct server_config * config_create(void);
+struct server_config * config_clone(const struct server_config *src);
 void config_release(struct server_config *cf);
 void config_change_for_server(struct server_config *config);
+void config_add_server(struct server_config *config, struct server_config *server);
+void config_add_user(struct server_config *config, uint32_t uid, const char *password, const char *protocol_param);
 
 int tunnel_ctx_compare_for_c_set(const void *left, const void *right);
 
@@ -126,6 +174,11 @@ void obj_map_traverse(struct cstl_map *map, void(*fn)(const void *key, const voi
 
 struct tunnel_cipher_ctx * tunnel_cipher_create(struct server_env_t *env, size_t tcp_mss);
 void tunnel_cipher_release(struct tunnel_cipher_ctx *tc);
+/* Lets the plugins give back what they hold beyond pending data. */
+void tunnel_cipher_shrink(struct tunnel_cipher_ctx *tc);
+
+#define SSR_SHRINK_INTERVAL 10000  /* ms between the sweeps over idle tunnels */
+struct server_user * tunnel_cipher_server_user(struct tunnel_cipher_ctx *tc);
 bool tunnel_cipher_client_need_feedback(struct tunnel_cipher_ctx *tc);
 enum ssr_error tunnel_cipher_client_encrypt(struct tunnel_cipher_ctx *tc, struct buffer_t *buf);
 enum ssr_error tunnel_cipher_client_decrypt(struct tunnel_cipher_ctx *tc, struct buffer_t *buf, struct buffer_t **feedback);
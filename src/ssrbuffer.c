@@ -115,6 +115,20 @@ size_t buffer_realloc(struct buffer_t *ptr, size_t capacity) {
     return real_capacity;
 }
 
+// gives back the capacity beyond the content, all of it for an empty buffer.
+void buffer_shrink(struct buffer_t *ptr) {
+    uint8_t *smaller;
+    if (ptr == NULL || ptr->buffer == NULL || ptr->capacity == ptr->len) {
+        return;
+    }
+    smaller = (uint8_t *) realloc(ptr->buffer, ptr->len + 1);
+    if (smaller) {
+        ptr->buffer = smaller;
+        ptr->buffer[ptr->len] = 0;
+        ptr->capacity = ptr->len;
+    }
+}
+
 size_t buffer_store(struct buffer_t *ptr, const uint8_t *data, size_t size) {
     size_t result = 0;
     if (ptr==NULL) {
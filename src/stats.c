@@ -0,0 +1,531 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <uv.h>
+
+#include "common.h"
+#include "dump_info.h"
+#include "ssrbuffer.h"
+#include "ssr_executive.h"
+#include "sockaddr_universal.h"
+#include "tunnel.h"
+#include "users.h"
+#include "stats.h"
+
+#define STATS_REQUEST_MAX 2048
+#define STATS_LINE_MAX    1024
+
+struct stats_conn {
+    uv_tcp_t tcp;
+    uv_write_t write_req;
+    struct stats_server *server;
+    struct stats_conn *prev;
+    struct stats_conn *next;
+    char request[STATS_REQUEST_MAX];
+    size_t request_len;
+    struct buffer_t *response;
+    bool closing;
+};
+
+struct stats_server {
+    uv_tcp_t tcp;
+    struct server_env_t *env;
+    const struct stats_provider *provider;
+    struct stats_conn *conns;  /* open requests, closed on shutdown */
+    struct stats_timing *timing;  /* lent to env->stats while running */
+    bool shutting_down;
+};
+
+static void stats_listen_cb(uv_stream_t *listener, int status);
+static void stats_conn_close(struct stats_conn *conn);
+
+uint64_t stats_recent_accepts(const struct ssr_stats *stats, uint64_t now) {
+    uint64_t second = now / 1000;
+    uint64_t count = 0;
+    size_t n;
+    for (n = 0; n < STATS_RATE_WINDOW; ++n) {
+        if (stats->accepts[n].second + STATS_RATE_WINDOW > second) {
+            count += stats->accepts[n].count;
+        }
+    }
+    return count;
+}
+
+/* The highest value that lands in bucket |index|. */
+static uint64_t histogram_bucket_value(size_t index) {
+    unsigned int msb;
+    uint64_t sub;
+    if (index < STATS_HIST_SUB) {
+        return (uint64_t)index;
+    }
+    msb = (unsigned int)(index / STATS_HIST_SUB) + 3;
+    sub = (uint64_t)(index % STATS_HIST_SUB) + STATS_HIST_SUB;
+    return ((sub + 1) << (msb - 4)) - 1;
+}
+
+uint64_t stats_histogram_quantile(const struct stats_histogram *h, double q) {
+    double target = q * (double)h->count;
+    uint64_t rank = (uint64_t)target;
+    uint64_t seen = 0;
+    size_t n;
+    if (h->count == 0) {
+        return 0;
+    }
+    if ((double)rank < target || rank == 0) {
+        rank++;
+    }
+    for (n = 0; n < STATS_HIST_BUCKETS; ++n) {
+        seen += h->buckets[n];
+        if (seen >= rank) {
+            return histogram_bucket_value(n);
+        }
+    }
+    return histogram_bucket_value(STATS_HIST_BUCKETS - 1);
+}
+
+struct stats_server * stats_server_create(uv_loop_t *loop, uint16_t port,
+    struct server_env_t *env, const struct stats_provider *provider)
+{
+    struct stats_server *server = (struct stats_server *) calloc(1, sizeof(*server));
+    struct sockaddr_in addr;
+    int err;
+
+    server->env = env;
+    server->provider = provider;
+    VERIFY(0 == uv_tcp_init(loop, &server->tcp));
+    server->tcp.data = server;
+
+    uv_ip4_addr("127.0.0.1", port, &addr);
+    err = uv_tcp_bind(&server->tcp, (const struct sockaddr *)&addr, 0);
+    if (err == 0) {
+        err = uv_listen((uv_stream_t *)&server->tcp, 16, stats_listen_cb);
+    }
+    if (err != 0) {
+        pr_err("stats endpoint on 127.0.0.1:%hu: %s", port, uv_strerror(err));
+        stats_server_shutdown(server);
+        return NULL;
+    }
+    pr_info("stats on         127.0.0.1:%hu", port);
+
+    if (env->stats->timing == NULL) {
+        server->timing = (struct stats_timing *) calloc(1, sizeof(struct stats_timing));
+        server->timing->stage_count = provider->stage_count;
+        server->timing->stages = (struct stats_histogram *) calloc(provider->stage_count, sizeof(struct stats_histogram));
+        env->stats->timing = server->timing;
+    }
+    return server;
+}
+
+static void stats_server_close_done_cb(uv_handle_t *handle) {
+    struct stats_server *server = (struct stats_server *)handle->data;
+    if (server->timing) {
+        free(server->timing->stages);
+        free(server->timing);
+    }
+    free(server);
+}
+
+void stats_server_shutdown(struct stats_server *server) {
+    if (server == NULL || server->shutting_down) {
+        return;
+    }
+    server->shutting_down = true;
+    if (server->timing && server->env->stats->timing == server->timing) {
+        server->env->stats->timing = NULL;  /* the tunnels still open stop timing */
+    }
+    while (server->conns) {
+        stats_conn_close(server->conns);
+    }
+    uv_close((uv_handle_t *)&server->tcp, stats_server_close_done_cb);
+}
+
+static void out(struct buffer_t *buf, const char *format, ...) {
+    char line[STATS_LINE_MAX];
+    va_list ap;
+    int len;
+    va_start(ap, format);
+    len = vsnprintf(line, sizeof(line), format, ap);
+    va_end(ap);
+    if (len > 0) {
+        buffer_concatenate(buf, (const uint8_t *)line, min((size_t)len, sizeof(line) - 1));
+    }
+}
+
+/* Host names come from the clients, keep them from breaking the JSON. */
+static const char * json_escape(const char *src, char *dst, size_t size) {
+    size_t n = 0;
+    for (; *src && n + 7 < size; ++src) {
+        unsigned char c = (unsigned char)*src;
+        if (c == '"' || c == '\\') {
+            dst[n++] = '\\';
+            dst[n++] = (char)c;
+        } else if (c < 0x20 || c >= 0x7f) {
+            n += (size_t)sprintf(dst + n, "\\u%04x", c);
+        } else {
+            dst[n++] = (char)c;
+        }
+    }
+    dst[n] = '\0';
+    return dst;
+}
+
+static void address_text(const union sockaddr_universal *addr, char *text, size_t size) {
+    char ip[INET6_ADDRSTRLEN + 1] = { 0 };
+    text[0] = '\0';
+    if (addr->addr.sa_family == AF_INET) {
+        uv_ip4_name(&addr->addr4, ip, sizeof(ip));
+        snprintf(text, size, "%s:%hu", ip, ntohs(addr->addr4.sin_port));
+    } else if (addr->addr.sa_family == AF_INET6) {
+        uv_ip6_name(&addr->addr6, ip, sizeof(ip));
+        snprintf(text, size, "[%s]:%hu", ip, ntohs(addr->addr6.sin6_port));
+    }
+}
+
+struct stats_walk {
+    const struct stats_provider *provider;
+    uint64_t now;
+    uint64_t *stage_counts;
+    size_t active;
+    struct buffer_t *buf;  /* the JSON tunnel list, NULL to only count */
+};
+
+static void stats_walk_tunnel(const void *obj, void *p) {
+    struct tunnel_ctx *tunnel = (struct tunnel_ctx *)obj;
+    struct stats_walk *walk = (struct stats_walk *)p;
+    struct stats_tunnel_info info = { 0 };
+    union sockaddr_universal peer = { 0 };
+    char peer_text[INET6_ADDRSTRLEN + 16];
+    char target[0x100 + 8] = { 0 };
+    char escaped[sizeof(target) * 6];
+    int len = sizeof(peer);
+
+    walk->provider->describe(tunnel, &info);
+    if (info.stage < walk->provider->stage_count) {
+        walk->stage_counts[info.stage]++;
+    }
+    if (walk->buf == NULL) {
+        walk->active++;
+        return;
+    }
+
+    uv_tcp_getpeername(&tunnel->incoming->handle.tcp, &peer.addr, &len);
+    address_text(&peer, peer_text, sizeof(peer_text));
+    if (socks5_address_to_string(tunnel->desired_addr, target, sizeof(target) - 8)) {
+        sprintf(target + strlen(target), ":%hu", tunnel->desired_addr->port);
+    }
+    out(walk->buf, "%s\n    {\"peer\":\"%s\",\"target\":\"%s\",\"stage\":\"%s\",\"age_ms\":%llu,"
+        "\"bytes_up\":%llu,\"bytes_down\":%llu,\"crypto_us\":%llu",
+        walk->active ? "," : "", peer_text, json_escape(target, escaped, sizeof(escaped)),
+        (info.stage < walk->provider->stage_count) ? walk->provider->stage_names[info.stage] : "",
+        (unsigned long long)(walk->now - info.started),
+        (unsigned long long)info.bytes_up, (unsigned long long)info.bytes_down,
+        (unsigned long long)(info.crypto_ns / 1000));
+    if (info.has_user) {
+        out(walk->buf, ",\"uid\":%u", (unsigned int)info.uid);
+    }
+    out(walk->buf, "}");
+    walk->active++;
+}
+
+struct metrics_users {
+    struct buffer_t *buf;
+    const char *family;
+};
+
+static void metrics_user(struct server_user *user, void *p) {
+    struct metrics_users *m = (struct metrics_users *)p;
+    unsigned int uid = (unsigned int)user->uid;
+    if (strcmp(m->family, "ssr_user_bytes_total") == 0) {
+        out(m->buf, "%s{uid=\"%u\",direction=\"up\"} %llu\n", m->family, uid, (unsigned long long)user->bytes_up);
+        out(m->buf, "%s{uid=\"%u\",direction=\"down\"} %llu\n", m->family, uid, (unsigned long long)user->bytes_down);
+    } else if (strcmp(m->family, "ssr_user_connections_total") == 0) {
+        out(m->buf, "%s{uid=\"%u\"} %llu\n", m->family, uid, (unsigned long long)user->connections_total);
+    } else {
+        out(m->buf, "%s{uid=\"%u\"} %u\n", m->family, uid, (unsigned int)user->connections_active);
+    }
+}
+
+static void json_user(struct server_user *user, void *p) {
+    struct buffer_t *buf = (struct buffer_t *)p;
+    out(buf, "%s\n    {\"uid\":%u,\"bytes_up\":%llu,\"bytes_down\":%llu,"
+        "\"connections_total\":%llu,\"connections_active\":%u}",
+        (buf->buffer[buf->len - 1] == '[') ? "" : ",", (unsigned int)user->uid,
+        (unsigned long long)user->bytes_up, (unsigned long long)user->bytes_down,
+        (unsigned long long)user->connections_total, (unsigned int)user->connections_active);
+}
+
+#define METRIC(buf, name, type, help) \
+    out((buf), "# HELP " name " " help "\n# TYPE " name " " type "\n")
+
+static const struct {
+    double q;
+    const char *text;
+} quantiles[] = { { 0.5, "0.5" }, { 0.99, "0.99" }, { 0.999, "0.999" } };
+
+static const char * const crypto_step_names[stats_crypto_step_max] = { "cipher", "protocol", "obfs" };
+
+/* One summary, |label| like `stage="x"` or empty, values scaled to seconds. */
+static void metrics_summary(struct buffer_t *buf, const char *name, const char *label,
+    const struct stats_histogram *h, double to_seconds)
+{
+    const char *comma = label[0] ? "," : "";
+    size_t n;
+    for (n = 0; n < sizeof(quantiles) / sizeof(quantiles[0]); ++n) {
+        out(buf, "%s{%s%squantile=\"%s\"} %.9f\n", name, label, comma, quantiles[n].text,
+            (double)stats_histogram_quantile(h, quantiles[n].q) * to_seconds);
+    }
+    if (label[0]) {
+        out(buf, "%s_sum{%s} %.9f\n%s_count{%s} %llu\n", name, label, (double)h->sum * to_seconds,
+            name, label, (unsigned long long)h->count);
+    } else {
+        out(buf, "%s_sum %.9f\n%s_count %llu\n", name, (double)h->sum * to_seconds,
+            name, (unsigned long long)h->count);
+    }
+}
+
+static void json_latency(struct buffer_t *buf, const char *name, const struct stats_histogram *h) {
+    out(buf, "\"%s\": {\"count\": %llu, \"p50\": %llu, \"p99\": %llu, \"p999\": %llu}", name,
+        (unsigned long long)h->count,
+        (unsigned long long)stats_histogram_quantile(h, 0.5),
+        (unsigned long long)stats_histogram_quantile(h, 0.99),
+        (unsigned long long)stats_histogram_quantile(h, 0.999));
+}
+
+static struct buffer_t * stats_metrics(struct stats_server *server, uint64_t now) {
+    const struct ssr_stats *stats = server->env->stats;
+    const struct stats_provider *provider = server->provider;
+    struct buffer_t *buf = buffer_create(SSR_BUFF_SIZE);
+    struct stats_walk walk = { 0 };
+    size_t suppressed, dropped;
+    size_t n;
+
+    walk.provider = provider;
+    walk.now = now;
+    walk.stage_counts = (uint64_t *) calloc(provider->stage_count, sizeof(uint64_t));
+    cstl_set_container_traverse(server->env->tunnel_set, stats_walk_tunnel, &walk);
+
+    METRIC(buf, "ssr_uptime_seconds", "gauge", "Seconds since the loop started.");
+    out(buf, "ssr_uptime_seconds %llu\n", (unsigned long long)((now - stats->started) / 1000));
+    METRIC(buf, "ssr_tunnels_total", "counter", "Tunnels accepted.");
+    out(buf, "ssr_tunnels_total{port=\"%hu\"} %llu\n", stats->port, (unsigned long long)stats->tunnels_total);
+    METRIC(buf, "ssr_tunnels_established_total", "counter", "Tunnels that reached streaming.");
+    out(buf, "ssr_tunnels_established_total{port=\"%hu\"} %llu\n", stats->port, (unsigned long long)stats->tunnels_established);
+    METRIC(buf, "ssr_handshake_failures_total", "counter", "Tunnels closed before streaming.");
+    out(buf, "ssr_handshake_failures_total{port=\"%hu\"} %llu\n", stats->port, (unsigned long long)stats->handshake_failures);
+    METRIC(buf, "ssr_tunnels_recent", "gauge", "Tunnels accepted in the last minute.");
+    out(buf, "ssr_tunnels_recent{port=\"%hu\"} %llu\n", stats->port, (unsigned long long)stats_recent_accepts(stats, now));
+    METRIC(buf, "ssr_tunnels_active", "gauge", "Open tunnels by stage.");
+    for (n = 0; n < provider->stage_count; ++n) {
+        out(buf, "ssr_tunnels_active{stage=\"%s\"} %llu\n", provider->stage_names[n], (unsigned long long)walk.stage_counts[n]);
+    }
+    METRIC(buf, "ssr_bytes_total", "counter", "Payload bytes, up from the clients and down to them.");
+    out(buf, "ssr_bytes_total{port=\"%hu\",direction=\"up\"} %llu\n", stats->port, (unsigned long long)stats->bytes_up);
+    out(buf, "ssr_bytes_total{port=\"%hu\",direction=\"down\"} %llu\n", stats->port, (unsigned long long)stats->bytes_down);
+    METRIC(buf, "ssr_dns_cache_hits_total", "counter", "Host names found in the DNS cache.");
+    out(buf, "ssr_dns_cache_hits_total %llu\n", (unsigned long long)stats->dns_cache_hits);
+    METRIC(buf, "ssr_dns_cache_misses_total", "counter", "Host names that had to be looked up.");
+    out(buf, "ssr_dns_cache_misses_total %llu\n", (unsigned long long)stats->dns_cache_misses);
+    dump_info_counters(&suppressed, &dropped);
+    METRIC(buf, "ssr_log_lines_suppressed_total", "counter", "Log lines held back by the rate limit.");
+    out(buf, "ssr_log_lines_suppressed_total %llu\n", (unsigned long long)suppressed);
+    METRIC(buf, "ssr_log_lines_dropped_total", "counter", "Log lines lost to a full queue.");
+    out(buf, "ssr_log_lines_dropped_total %llu\n", (unsigned long long)dropped);
+    if (server->env->users) {
+        // each family whole, one pass over the users per family.
+        struct metrics_users m = { buf, "ssr_user_bytes_total" };
+        METRIC(buf, "ssr_user_bytes_total", "counter", "Payload bytes of each user.");
+        server_users_traverse(server->env->users, metrics_user, &m);
+        m.family = "ssr_user_connections_total";
+        METRIC(buf, "ssr_user_connections_total", "counter", "Connections of each user.");
+        server_users_traverse(server->env->users, metrics_user, &m);
+        m.family = "ssr_user_connections_active";
+        METRIC(buf, "ssr_user_connections_active", "gauge", "Open connections of each user.");
+        server_users_traverse(server->env->users, metrics_user, &m);
+    }
+    if (stats->timing) {
+        const struct stats_timing *timing = stats->timing;
+        char label[64];
+        METRIC(buf, "ssr_stage_duration_seconds", "summary", "Time tunnels spent in each stage before moving on.");
+        for (n = 0; n < timing->stage_count && n < provider->stage_count; ++n) {
+            snprintf(label, sizeof(label), "stage=\"%s\"", provider->stage_names[n]);
+            metrics_summary(buf, "ssr_stage_duration_seconds", label, &timing->stages[n], 1e-6);
+        }
+        METRIC(buf, "ssr_first_byte_seconds", "summary", "Time from the accept to the first byte back.");
+        metrics_summary(buf, "ssr_first_byte_seconds", "", &timing->first_byte, 1e-6);
+        METRIC(buf, "ssr_crypto_call_seconds", "summary", "Time of one cipher, protocol or obfs call, sampled.");
+        for (n = 0; n < stats_crypto_step_max; ++n) {
+            snprintf(label, sizeof(label), "step=\"%s\"", crypto_step_names[n]);
+            metrics_summary(buf, "ssr_crypto_call_seconds", label, &timing->crypto[n], 1e-9);
+        }
+    }
+
+    free(walk.stage_counts);
+    return buf;
+}
+
+static struct buffer_t * stats_json(struct stats_server *server, uint64_t now) {
+    const struct ssr_stats *stats = server->env->stats;
+    const struct stats_provider *provider = server->provider;
+    struct buffer_t *buf = buffer_create(SSR_BUFF_SIZE);
+    struct stats_walk walk = { 0 };
+    size_t suppressed, dropped;
+    size_t n;
+
+    walk.provider = provider;
+    walk.now = now;
+    walk.stage_counts = (uint64_t *) calloc(provider->stage_count, sizeof(uint64_t));
+
+    out(buf, "{\n  \"uptime_seconds\": %llu,\n  \"port\": %hu,\n",
+        (unsigned long long)((now - stats->started) / 1000), stats->port);
+    out(buf, "  \"bytes\": {\"up\": %llu, \"down\": %llu},\n",
+        (unsigned long long)stats->bytes_up, (unsigned long long)stats->bytes_down);
+    out(buf, "  \"dns_cache\": {\"hits\": %llu, \"misses\": %llu},\n",
+        (unsigned long long)stats->dns_cache_hits, (unsigned long long)stats->dns_cache_misses);
+    dump_info_counters(&suppressed, &dropped);
+    out(buf, "  \"log_lines\": {\"suppressed\": %llu, \"dropped\": %llu},\n",
+        (unsigned long long)suppressed, (unsigned long long)dropped);
+    out(buf, "  \"users\": [");
+    if (server->env->users) {
+        server_users_traverse(server->env->users, json_user, buf);
+    }
+    out(buf, "],\n  \"live\": [");
+    walk.buf = buf;
+    cstl_set_container_traverse(server->env->tunnel_set, stats_walk_tunnel, &walk);
+    out(buf, "],\n  \"stages\": {");
+    for (n = 0; n < provider->stage_count; ++n) {
+        out(buf, "%s\"%s\": %llu", n ? ", " : "", provider->stage_names[n], (unsigned long long)walk.stage_counts[n]);
+    }
+    out(buf, "},\n");
+    if (stats->timing) {
+        const struct stats_timing *timing = stats->timing;
+        out(buf, "  \"stage_latency_us\": {");
+        for (n = 0; n < timing->stage_count && n < provider->stage_count; ++n) {
+            out(buf, "%s\n    ", n ? "," : "");
+            json_latency(buf, provider->stage_names[n], &timing->stages[n]);
+        }
+        out(buf, "},\n  ");
+        json_latency(buf, "first_byte_us", &timing->first_byte);
+        out(buf, ",\n  \"crypto_call_ns\": {");
+        for (n = 0; n < stats_crypto_step_max; ++n) {
+            out(buf, "%s", n ? ", " : "");
+            json_latency(buf, crypto_step_names[n], &timing->crypto[n]);
+        }
+        out(buf, "},\n");
+    }
+    out(buf, "  \"tunnels\": {\"active\": %llu, \"total\": %llu, \"established\": %llu, "
+        "\"handshake_failures\": %llu, \"recent\": %llu}\n}\n",
+        (unsigned long long)walk.active, (unsigned long long)stats->tunnels_total,
+        (unsigned long long)stats->tunnels_established, (unsigned long long)stats->handshake_failures,
+        (unsigned long long)stats_recent_accepts(stats, now));
+
+    free(walk.stage_counts);
+    return buf;
+}
+
+static void stats_conn_close_done_cb(uv_handle_t *handle) {
+    struct stats_conn *conn = (struct stats_conn *)handle->data;
+    buffer_release(conn->response);
+    free(conn);
+}
+
+static void stats_conn_close(struct stats_conn *conn) {
+    struct stats_server *server = conn->server;
+    if (conn->closing) {
+        return;  /* the write of a request cut off by the shutdown */
+    }
+    conn->closing = true;
+    if (conn->prev) {
+        conn->prev->next = conn->next;
+    } else {
+        server->conns = conn->next;
+    }
+    if (conn->next) {
+        conn->next->prev = conn->prev;
+    }
+    uv_close((uv_handle_t *)&conn->tcp, stats_conn_close_done_cb);
+}
+
+static void stats_write_done_cb(uv_write_t *req, int status) {
+    stats_conn_close((struct stats_conn *)req->data);
+    (void)status;
+}
+
+static void stats_respond(struct stats_conn *conn) {
+    struct stats_server *server = conn->server;
+    uint64_t now = uv_now(server->tcp.loop);
+    const char *status = "200 OK";
+    const char *type = "text/plain; version=0.0.4";
+    struct buffer_t *body = NULL;
+    char header[256];
+    char path[64] = { 0 };
+    uv_buf_t buf;
+
+    sscanf(conn->request, "GET %63[^? \r\n]", path);
+    if (strcmp(path, "/metrics") == 0) {
+        body = stats_metrics(server, now);
+    } else if (strcmp(path, "/stats") == 0) {
+        body = stats_json(server, now);
+        type = "application/json";
+    } else {
+        body = buffer_create(64);
+        out(body, "try /metrics or /stats\n");
+        status = "404 Not Found";
+        type = "text/plain";
+    }
+    sprintf(header, "HTTP/1.0 %s\r\nContent-Type: %s\r\nContent-Length: %u\r\nConnection: close\r\n\r\n",
+        status, type, (unsigned int)body->len);
+    buffer_insert(body, 0, (const uint8_t *)header, strlen(header));
+    conn->response = body;
+
+    buf = uv_buf_init((char *)body->buffer, (unsigned int)body->len);
+    conn->write_req.data = conn;
+    if (uv_write(&conn->write_req, (uv_stream_t *)&conn->tcp, &buf, 1, stats_write_done_cb) != 0) {
+        stats_conn_close(conn);
+    }
+}
+
+static void stats_alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+    struct stats_conn *conn = (struct stats_conn *)handle->data;
+    *buf = uv_buf_init(conn->request + conn->request_len,
+        (unsigned int)(sizeof(conn->request) - 1 - conn->request_len));
+    (void)suggested_size;
+}
+
+static void stats_read_cb(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
+    struct stats_conn *conn = (struct stats_conn *)stream->data;
+    (void)buf;
+    if (nread < 0) {
+        stats_conn_close(conn);
+        return;
+    }
+    conn->request_len += (size_t)nread;
+    conn->request[conn->request_len] = '\0';
+    if (strstr(conn->request, "\r\n\r\n") || conn->request_len == sizeof(conn->request) - 1) {
+        uv_read_stop(stream);
+        stats_respond(conn);
+    }
+}
+
+static void stats_listen_cb(uv_stream_t *listener, int status) {
+    struct stats_server *server = (struct stats_server *)listener->data;
+    struct stats_conn *conn;
+
+    if (status != 0 || server->shutting_down) {
+        return;
+    }
+    conn = (struct stats_conn *) calloc(1, sizeof(*conn));
+    conn->server = server;
+    VERIFY(0 == uv_tcp_init(listener->loop, &conn->tcp));
+    conn->tcp.data = conn;
+    conn->next = server->conns;
+    if (server->conns) {
+        server->conns->prev = conn;
+    }
+    server->conns = conn;
+
+    if (uv_accept(listener, (uv_stream_t *)&conn->tcp) != 0
+        || uv_read_start((uv_stream_t *)&conn->tcp, stats_alloc_cb, stats_read_cb) != 0) {
+        stats_conn_close(conn);
+    }
+}
@@ -0,0 +1,159 @@
+#ifndef __SSR_STATS_H__
+#define __SSR_STATS_H__ 1
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <uv.h>
+
+struct server_env_t;
+struct tunnel_ctx;
+
+#define STATS_RATE_WINDOW 60  /* seconds the connection rate is counted over */
+
+#define STATS_HIST_SUB      16  /* buckets per power of two, about 6% apart */
+#define STATS_HIST_BUCKETS  (STATS_HIST_SUB * 40)
+#define STATS_CRYPTO_SAMPLE 16  /* one cipher call in this many is timed */
+
+/* Log-linear buckets in the manner of HdrHistogram: values below
+ * STATS_HIST_SUB exactly, then STATS_HIST_SUB buckets per power of two,
+ * up to 2^43. The unit is up to the caller.
+ */
+struct stats_histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint32_t buckets[STATS_HIST_BUCKETS];
+};
+
+static inline void stats_histogram_record(struct stats_histogram *h, uint64_t value) {
+    size_t index;
+    if (value < STATS_HIST_SUB) {
+        index = (size_t)value;
+    } else {
+        unsigned int msb = 0;
+#if defined(__GNUC__)
+        msb = 63u - (unsigned int)__builtin_clzll(value);
+#else
+        uint64_t v = value;
+        while (v >>= 1) { ++msb; }
+#endif
+        index = STATS_HIST_SUB * (msb - 3) + (size_t)(value >> (msb - 4)) - STATS_HIST_SUB;
+        if (index >= STATS_HIST_BUCKETS) {
+            index = STATS_HIST_BUCKETS - 1;
+        }
+    }
+    h->buckets[index]++;
+    h->count++;
+    h->sum += value;
+}
+
+/* The value at or below which a |q| (0..1) share of the records fall. */
+uint64_t stats_histogram_quantile(const struct stats_histogram *h, double q);
+
+enum stats_crypto_step {
+    stats_crypto_cipher,    /* ss_encrypt, ss_decrypt */
+    stats_crypto_protocol,  /* the protocol plugin */
+    stats_crypto_obfs,      /* the obfs plugin */
+    stats_crypto_step_max,
+};
+
+/* Latencies, kept only while the stats endpoint is on. */
+struct stats_timing {
+    size_t stage_count;
+    struct stats_histogram *stages;  /* microseconds in each stage, by the stage left */
+    struct stats_histogram first_byte;  /* microseconds from the accept to the first byte back */
+    struct stats_histogram crypto[stats_crypto_step_max];  /* nanoseconds per timed call */
+};
+
+/* Counters of one loop. Only the loop thread touches them and the endpoint
+ * runs on that same loop, so the hot path pays a plain increment, no lock
+ * and no atomic.
+ */
+struct ssr_stats {
+    uint64_t started;  /* uv_now() when the loop started */
+    uint16_t port;  /* the port tunnels come in on */
+    uint64_t tunnels_total;
+    uint64_t tunnels_established;  /* reached streaming */
+    uint64_t handshake_failures;  /* closed before streaming */
+    uint64_t bytes_up;  /* payload from the clients */
+    uint64_t bytes_down;  /* payload back to them */
+    uint64_t dns_cache_hits;
+    uint64_t dns_cache_misses;
+    struct {
+        uint64_t second;
+        uint32_t count;
+    } accepts[STATS_RATE_WINDOW];  /* tunnels accepted, by the second */
+    struct stats_timing *timing;  /* NULL unless the endpoint is on */
+};
+
+static inline void stats_tunnel_accepted(struct ssr_stats *stats, uint64_t now) {
+    uint64_t second = now / 1000;
+    size_t slot = (size_t)(second % STATS_RATE_WINDOW);
+    if (stats->accepts[slot].second != second) {
+        stats->accepts[slot].second = second;
+        stats->accepts[slot].count = 0;
+    }
+    stats->accepts[slot].count++;
+    stats->tunnels_total++;
+}
+
+/* Tunnels accepted in the last STATS_RATE_WINDOW seconds. */
+uint64_t stats_recent_accepts(const struct ssr_stats *stats, uint64_t now);
+
+/* A tunnel left stage |from|, entered at |*since| (uv_hrtime() in
+ * microseconds, 0 for not known), which is moved on to now. Costs nothing
+ * but the test while timing is off.
+ */
+static inline void stats_stage_left(struct ssr_stats *stats, size_t from, uint64_t *since) {
+    struct stats_timing *timing = stats->timing;
+    uint64_t now;
+    if (timing == NULL) {
+        *since = 0;
+        return;
+    }
+    now = uv_hrtime() / 1000;
+    if (*since && from < timing->stage_count) {
+        stats_histogram_record(&timing->stages[from], now - *since);
+    }
+    *since = now;
+}
+
+/* The first byte came back for a tunnel accepted at |accepted|, in
+ * microseconds as above.
+ */
+static inline void stats_first_byte(struct ssr_stats *stats, uint64_t accepted) {
+    if (stats->timing && accepted) {
+        stats_histogram_record(&stats->timing->first_byte, uv_hrtime() / 1000 - accepted);
+    }
+}
+
+/* One live tunnel, as told by the client or server that owns it. */
+struct stats_tunnel_info {
+    size_t stage;  /* index into stage_names */
+    uint64_t started;  /* uv_now() when accepted */
+    uint64_t bytes_up;
+    uint64_t bytes_down;
+    uint64_t crypto_ns;  /* estimated from the timed calls */
+    bool has_user;
+    uint32_t uid;
+};
+
+struct stats_provider {
+    const char * const *stage_names;
+    size_t stage_count;
+    void (*describe)(struct tunnel_ctx *tunnel, struct stats_tunnel_info *info);
+};
+
+/* Serves GET /metrics in the Prometheus text format and GET /stats as JSON,
+ * with the live tunnels, on 127.0.0.1:|port| of the loop of |env|. Turns
+ * on the timing of |env| for as long as it runs.
+ */
+struct stats_server;
+
+/* NULL if the port can't be listened on. */
+struct stats_server * stats_server_create(uv_loop_t *loop, uint16_t port,
+    struct server_env_t *env, const struct stats_provider *provider);
+/* Closes the listener and any open request; frees itself when they are closed. */
+void stats_server_shutdown(struct stats_server *server);
+
+#endif // __SSR_STATS_H__
@@ -23,6 +23,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <uv.h>
+#if !defined(_WIN32)
+#include <unistd.h>
+#endif
 #include "common.h"
 #include "tunnel.h"
 #include "dump_info.h"
@@ -31,10 +34,17 @@
 #define ARRAY_SIZE(arr) (sizeof(arr) / sizeof(*(arr)))
 #endif
 
+#if defined(__linux__) && !defined(TCP_FASTOPEN_CONNECT)
+#define TCP_FASTOPEN_CONNECT 30  /* Linux 4.11, older C libraries lack it */
+#endif
+
+static bool fast_open_connect_unsupported = false;
+
 static bool tunnel_is_dead(struct tunnel_ctx *tunnel);
 static void tunnel_add_ref(struct tunnel_ctx *tunnel);
 static void tunnel_release(struct tunnel_ctx *tunnel);
 static void socket_timer_expire_cb(uv_timer_t *handle);
+static void socket_read_deadline_cb(uv_timer_t *handle);
 static void socket_timer_start(struct socket_ctx *c);
 static void socket_timer_stop(struct socket_ctx *c);
 static void socket_connect_done_cb(uv_connect_t *req, int status);
@@ -44,6 +54,8 @@ static void socket_getaddrinfo_done_cb(uv_getaddrinfo_t *req, int status, struct
 static void socket_write_done_cb(uv_write_t *req, int status);
 static void socket_close(struct socket_ctx *c);
 static void socket_close_done_cb(uv_handle_t *handle);
+static void socket_reconnect_close_done_cb(uv_handle_t *handle);
+static void socket_detached_close_done_cb(uv_handle_t *handle);
 
 int uv_stream_fd(const uv_tcp_t *handle) {
 #if defined(_WIN32)
@@ -87,6 +99,54 @@ size_t _update_tcp_mss(struct socket_ctx *socket) {
     return _tcp_mss;
 }
 
+bool tcp_fast_open_listen(uv_tcp_t *listener, int queue_length) {
+#if defined(TCP_FASTOPEN)
+    uv_os_fd_t fd;
+    if (uv_fileno((uv_handle_t *)listener, &fd) != 0) {
+        return false;
+    }
+#if defined(__APPLE__)
+    queue_length = 1;  /* Darwin only takes it as an on/off switch */
+#endif
+#if defined(WIN32) || defined(_WIN32)
+    return setsockopt((SOCKET)fd, IPPROTO_TCP, TCP_FASTOPEN, (char *)&queue_length, sizeof(queue_length)) == 0;
+#else
+    return setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &queue_length, sizeof(queue_length)) == 0;
+#endif
+#else
+    (void)listener; (void)queue_length;
+    return false;
+#endif
+}
+
+/* With TCP_FASTOPEN_CONNECT the SYN is held back until the first write, so
+ * the init package goes out in it. The kernel falls back to a plain
+ * handshake by itself if the server has no cookie for us or refuses.
+ */
+static void socket_fast_open_prepare(struct socket_ctx *c) {
+#if defined(TCP_FASTOPEN_CONNECT)
+    int on = 1;
+    int fd = socket(c->addr.addr.sa_family, SOCK_STREAM, IPPROTO_TCP);
+    if (fd < 0) {
+        return;
+    }
+    if (setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &on, sizeof(on)) != 0) {
+        pr_warn("TCP fast open is not supported by the system, disabled");
+        fast_open_connect_unsupported = true;
+        close(fd);
+        return;
+    }
+    if (uv_tcp_open(&c->handle.tcp, fd) != 0) {
+        close(fd);
+    }
+#else
+    if (fast_open_connect_unsupported == false) {
+        pr_warn("TCP fast open connect is not supported on this platform, disabled");
+        fast_open_connect_unsupported = true;
+    }
+#endif
+}
+
 static bool tunnel_is_dead(struct tunnel_ctx *tunnel) {
     return (tunnel->terminated != false);
 }
@@ -163,6 +223,54 @@ void tunnel_initialize(uv_tcp_t *listener, unsigned int idle_timeout, tunnel_ini
     }
 }
 
+/* A socket that belongs to no tunnel yet, e.g. a pre-connected one kept in a pool.
+ * Its handle callbacks are up to the caller until tunnel_attach_outgoing().
+ */
+struct socket_ctx * socket_detached_create(uv_loop_t *loop, unsigned int idle_timeout) {
+    struct socket_ctx *c = (struct socket_ctx *) calloc(1, sizeof(*c));
+    c->rdstate = socket_stop;
+    c->wrstate = socket_stop;
+    c->idle_timeout = idle_timeout;
+    VERIFY(0 == uv_timer_init(loop, &c->timer_handle));
+    VERIFY(0 == uv_tcp_init(loop, &c->handle.tcp));
+    return c;
+}
+
+void socket_detached_release(struct socket_ctx *c) {
+    ASSERT(c->tunnel == NULL);
+    c->timer_handle.data = c;
+    c->handle.handle.data = c;
+    uv_close((uv_handle_t *)&c->timer_handle, socket_detached_close_done_cb);
+}
+
+static void socket_detached_close_done_cb(uv_handle_t *handle) {
+    struct socket_ctx *c = (struct socket_ctx *) handle->data;
+    if (handle == (uv_handle_t *)&c->timer_handle) {
+        uv_close(&c->handle.handle, socket_detached_close_done_cb);
+    } else {
+        free(c);
+    }
+}
+
+/* Replace the not yet used outgoing socket of |tunnel| with an already
+ * connected one, c->addr must be the address it is connected to.
+ */
+void tunnel_attach_outgoing(struct tunnel_ctx *tunnel, struct socket_ctx *c) {
+    struct socket_ctx *unused = tunnel->outgoing;
+    ASSERT(c->tunnel == NULL);
+    ASSERT(unused->rdstate == socket_stop && unused->wrstate == socket_stop);
+    c->tunnel = tunnel;
+    c->rdstate = socket_stop;
+    c->wrstate = socket_stop;
+    c->result = 0;
+    c->handle.handle.data = NULL;
+    c->timer_handle.data = NULL;
+    tunnel->outgoing = c;
+
+    unused->tunnel = NULL;
+    socket_detached_release(unused);
+}
+
 void tunnel_add_dying_cb(struct tunnel_ctx *tunnel, tunnel_dying_cb cb, void *p) {
     bool done = false;
     int i;
@@ -290,6 +398,9 @@ static void socket_timer_expire_cb(uv_timer_t *handle) {
 /* Assumes that c->t.sa contains a valid AF_INET or AF_INET6 address. */
 int socket_connect(struct socket_ctx *c) {
     ASSERT(c->addr.addr.sa_family == AF_INET || c->addr.addr.sa_family == AF_INET6);
+    if (c->fast_open && fast_open_connect_unsupported == false) {
+        socket_fast_open_prepare(c);
+    }
     socket_timer_start(c);
     return uv_tcp_connect(&c->t.connect_req,
         &c->handle.tcp,
@@ -314,6 +425,10 @@ static void socket_connect_done_cb(uv_connect_t *req, int status) {
 
     if (status < 0 /*status == UV_ECANCELED || status == UV_ECONNREFUSED*/) {
         socket_dump_error_info("connect failed", c);
+        if (tunnel->tunnel_outgoing_connect_failed &&
+            tunnel->tunnel_outgoing_connect_failed(tunnel, c)) {
+            return;  /* Another address is being tried. */
+        }
         tunnel_shutdown(tunnel);
         return;  /* Handle has been closed. */
     }
@@ -322,6 +437,32 @@ static void socket_connect_done_cb(uv_connect_t *req, int status) {
     tunnel->tunnel_outgoing_connected_done(tunnel, c);
 }
 
+/* A socket that failed to connect can't be reused portably, so close it
+ * and connect again to c->addr with a fresh handle.
+ */
+void socket_reconnect(struct socket_ctx *c) {
+    struct tunnel_ctx *tunnel = c->tunnel;
+    ASSERT(c->rdstate == socket_stop && c->wrstate == socket_stop);
+    c->handle.handle.data = c;
+    tunnel_add_ref(tunnel);
+    uv_close(&c->handle.handle, socket_reconnect_close_done_cb);
+}
+
+static void socket_reconnect_close_done_cb(uv_handle_t *handle) {
+    struct socket_ctx *c = (struct socket_ctx *) handle->data;
+    struct tunnel_ctx *tunnel = c->tunnel;
+
+    if (tunnel_is_dead(tunnel) == false) {
+        VERIFY(0 == uv_tcp_init(tunnel->listener->loop, &c->handle.tcp));
+        c->result = socket_connect(c);
+        if (c->result != 0) {
+            socket_dump_error_info("connect failed", c);
+            tunnel_shutdown(tunnel);
+        }
+    }
+    tunnel_release(tunnel);
+}
+
 void socket_read(struct socket_ctx *c, bool check_timeout) {
     ASSERT(c->rdstate == socket_stop);
     VERIFY(0 == uv_read_start(&c->handle.stream, socket_alloc_cb, socket_read_done_cb));
@@ -374,6 +515,37 @@ static void socket_read_done_cb(uv_stream_t *handle, ssize_t nread, const uv_buf
     c->buf = NULL;
 }
 
+/* Like socket_read() but gives up quietly after |timeout| ms. In that case
+ * tunnel_read_done is called with c->result == 0 and no data.
+ */
+void socket_read_within(struct socket_ctx *c, unsigned int timeout) {
+    ASSERT(c->rdstate == socket_stop);
+    VERIFY(0 == uv_read_start(&c->handle.stream, socket_alloc_cb, socket_read_done_cb));
+    c->rdstate = socket_busy;
+    VERIFY(0 == uv_timer_start(&c->timer_handle, socket_read_deadline_cb, timeout, 0));
+}
+
+static void socket_read_deadline_cb(uv_timer_t *handle) {
+    struct socket_ctx *c;
+    struct tunnel_ctx *tunnel;
+
+    c = CONTAINER_OF(handle, struct socket_ctx, timer_handle);
+    tunnel = c->tunnel;
+
+    if (tunnel_is_dead(tunnel)) {
+        return;
+    }
+
+    uv_read_stop(&c->handle.stream);
+    ASSERT(c->rdstate == socket_busy);
+    c->rdstate = socket_done;
+    c->result = 0;
+    c->buf = NULL;
+
+    ASSERT(tunnel->tunnel_read_done);
+    tunnel->tunnel_read_done(tunnel, c);
+}
+
 void socket_read_stop(struct socket_ctx *c) {
     uv_read_stop(&c->handle.stream);
     c->rdstate = socket_stop;
@@ -521,8 +693,11 @@ static void socket_close(struct socket_ctx *c) {
     c->timer_handle.data = c;
     c->handle.handle.data = c;
 
-    tunnel_add_ref(tunnel);
-    uv_close(&c->handle.handle, socket_close_done_cb);
+    if (uv_is_closing(&c->handle.handle) == 0) {
+        /* Not in the middle of socket_reconnect(). */
+        tunnel_add_ref(tunnel);
+        uv_close(&c->handle.handle, socket_close_done_cb);
+    }
     tunnel_add_ref(tunnel);
     uv_close((uv_handle_t *)&c->timer_handle, socket_close_done_cb);
 }
@@ -538,10 +713,14 @@ static void socket_close_done_cb(uv_handle_t *handle) {
 }
 
 void socket_dump_error_info(const char *title, struct socket_ctx *socket) {
+    static const char fmt[] = "%s about %s \"%s\": %s";
     struct tunnel_ctx *tunnel = socket->tunnel;
     int error = (int)socket->result;
     char addr[256] = { 0 };
     const char *from = NULL;
+    if (pr_suppressed(fmt)) {
+        return;  /* a flood of them, skip the lookup too */
+    }
     if (socket == tunnel->outgoing) {
         socks5_address_to_string(tunnel->desired_addr, addr, sizeof(addr));
         from = "_server_";
@@ -552,5 +731,5 @@ void socket_dump_error_info(const char *title, struct socket_ctx *socket) {
         universal_address_to_string(&tmp, addr, sizeof(addr));
         from = "_client_";
     }
-    pr_err("%s about %s \"%s\": %s", title, from, addr, uv_strerror(error));
+    pr_err(fmt, title, from, addr, uv_strerror(error));
 }
@@ -19,6 +19,7 @@ struct socket_ctx {
     enum socket_state rdstate;
     enum socket_state wrstate;
     unsigned int idle_timeout;
+    bool fast_open;  /* Connect with TCP fast open when the system allows. */
     struct tunnel_ctx *tunnel;  /* Backlink to owning tunnel context. */
     ssize_t result;
     union {
@@ -56,6 +57,7 @@ struct tunnel_ctx {
 
     void(*tunnel_timeout_expire_done)(struct tunnel_ctx *tunnel, struct socket_ctx *socket);
     void(*tunnel_outgoing_connected_done)(struct tunnel_ctx *tunnel, struct socket_ctx *socket);
+    bool(*tunnel_outgoing_connect_failed)(struct tunnel_ctx *tunnel, struct socket_ctx *socket);
     void(*tunnel_read_done)(struct tunnel_ctx *tunnel, struct socket_ctx *socket);
     void(*tunnel_getaddrinfo_done)(struct tunnel_ctx *tunnel, struct socket_ctx *socket);
     void(*tunnel_write_done)(struct tunnel_ctx *tunnel, struct socket_ctx *socket);
@@ -71,17 +73,24 @@ struct tunnel_ctx {
 int uv_stream_fd(const uv_tcp_t *handle);
 uint16_t get_socket_port(const uv_tcp_t *tcp);
 size_t _update_tcp_mss(struct socket_ctx *socket);
+bool tcp_fast_open_listen(uv_tcp_t *listener, int queue_length);
 
 typedef bool(*tunnel_init_done_cb)(struct tunnel_ctx *tunnel, void *p);
 void tunnel_initialize(uv_tcp_t *lx, unsigned int idle_timeout, tunnel_init_done_cb init_done_cb, void *p);
 
+struct socket_ctx * socket_detached_create(uv_loop_t *loop, unsigned int idle_timeout);
+void socket_detached_release(struct socket_ctx *c);
+void tunnel_attach_outgoing(struct tunnel_ctx *tunnel, struct socket_ctx *c);
+
 typedef void(*tunnel_dying_cb)(struct tunnel_ctx *tunnel, void *p);
 void tunnel_add_dying_cb(struct tunnel_ctx *tunnel, tunnel_dying_cb cb, void *p);
 
 void tunnel_shutdown(struct tunnel_ctx *tunnel);
 void tunnel_traditional_streaming(struct tunnel_ctx *tunnel, struct socket_ctx *socket);
 int socket_connect(struct socket_ctx *c);
+void socket_reconnect(struct socket_ctx *c);
 void socket_read(struct socket_ctx *c, bool check_timeout);
+void socket_read_within(struct socket_ctx *c, unsigned int timeout);
 void socket_read_stop(struct socket_ctx *c);
 void socket_getaddrinfo(struct socket_ctx *c, const char *hostname);
 void socket_write(struct socket_ctx *c, const void *data, size_t len);
@@ -0,0 +1,274 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sodium.h>
+
+#include "sockaddr_universal.h"
+#include "udp_nat.h"
+
+#define UDP_NAT_WHEEL_SLOTS     64
+#define UDP_NAT_TICKS_PER_IDLE  32  /* so an idle timeout never wraps the wheel */
+#define UDP_NAT_MIN_BUCKETS     64
+
+struct udp_nat {
+    struct udp_nat_entry **buckets;
+    size_t mask;  /* bucket count - 1, a power of two */
+    size_t count;
+    size_t capacity;
+    uint64_t idle_timeout;
+    uint64_t tick;  /* in ms */
+    uint64_t current;  /* the last tick the wheel has looked at */
+    struct udp_nat_link wheel[UDP_NAT_WHEEL_SLOTS];
+    uint8_t hash_key[crypto_shorthash_KEYBYTES];
+};
+
+#define entry_of_link(link) \
+    ((struct udp_nat_entry *)((char *)(link) - offsetof(struct udp_nat_entry, wheel)))
+
+static void link_init(struct udp_nat_link *link) {
+    link->prev = link;
+    link->next = link;
+}
+
+static void link_remove(struct udp_nat_link *link) {
+    link->prev->next = link->next;
+    link->next->prev = link->prev;
+    link_init(link);
+}
+
+static void link_append(struct udp_nat_link *head, struct udp_nat_link *link) {
+    link->prev = head->prev;
+    link->next = head;
+    head->prev->next = link;
+    head->prev = link;
+}
+
+static void link_move_all(struct udp_nat_link *from, struct udp_nat_link *to) {
+    link_init(to);
+    if (from->next != from) {
+        to->next = from->next;
+        to->prev = from->prev;
+        to->next->prev = to;
+        to->prev->next = to;
+        link_init(from);
+    }
+}
+
+/* Keyed with a secret, so that peers can't pile their flows on one bucket. */
+static uint64_t nat_hash(const struct udp_nat *nat, const uint8_t *key, size_t key_len) {
+    uint8_t out[crypto_shorthash_BYTES];
+    uint64_t hash;
+    crypto_shorthash(out, key, (unsigned long long)key_len, nat->hash_key);
+    memcpy(&hash, out, sizeof(hash));
+    return hash;
+}
+
+struct udp_nat * udp_nat_create(size_t capacity, uint64_t idle_timeout, uint64_t now) {
+    struct udp_nat *nat;
+    size_t n;
+
+    nat = (struct udp_nat *) calloc(1, sizeof(*nat));
+    nat->capacity = capacity ? capacity : 1;
+    nat->mask = UDP_NAT_MIN_BUCKETS - 1;
+    nat->buckets = (struct udp_nat_entry **) calloc(UDP_NAT_MIN_BUCKETS, sizeof(nat->buckets[0]));
+    nat->idle_timeout = idle_timeout;
+    nat->tick = (idle_timeout + UDP_NAT_TICKS_PER_IDLE - 1) / UDP_NAT_TICKS_PER_IDLE;
+    if (nat->tick == 0) {
+        nat->tick = 1;
+    }
+    nat->current = now / nat->tick;
+    for (n = 0; n < UDP_NAT_WHEEL_SLOTS; ++n) {
+        link_init(&nat->wheel[n]);
+    }
+    randombytes_buf(nat->hash_key, sizeof(nat->hash_key));
+    return nat;
+}
+
+void udp_nat_destroy(struct udp_nat *nat) {
+    if (nat == NULL) {
+        return;
+    }
+    free(nat->buckets);
+    free(nat);
+}
+
+size_t udp_nat_key_build(uint8_t key[UDP_NAT_KEY_MAX], const struct sockaddr *addr, const void *extra, size_t extra_len) {
+    size_t len = 0;
+    if (addr->sa_family == AF_INET6) {
+        const struct sockaddr_in6 *addr6 = (const struct sockaddr_in6 *)addr;
+        key[len++] = 6;
+        memcpy(key + len, &addr6->sin6_port, 2);
+        len += 2;
+        memcpy(key + len, &addr6->sin6_addr, 16);
+        len += 16;
+    } else {
+        const struct sockaddr_in *addr4 = (const struct sockaddr_in *)addr;
+        key[len++] = 4;
+        memcpy(key + len, &addr4->sin_port, 2);
+        len += 2;
+        memcpy(key + len, &addr4->sin_addr, 4);
+        len += 4;
+    }
+    if (extra && extra_len) {
+        if (extra_len > UDP_NAT_KEY_MAX - len) {
+            extra_len = UDP_NAT_KEY_MAX - len;
+        }
+        memcpy(key + len, extra, extra_len);
+        len += extra_len;
+    }
+    return len;
+}
+
+void udp_nat_entry_set_key(struct udp_nat_entry *entry, const uint8_t *key, size_t key_len) {
+    if (key_len > UDP_NAT_KEY_MAX) {
+        key_len = UDP_NAT_KEY_MAX;
+    }
+    memcpy(entry->key, key, key_len);
+    entry->key_len = (uint16_t) key_len;
+    link_init(&entry->wheel);
+}
+
+struct udp_nat_entry * udp_nat_find(const struct udp_nat *nat, const uint8_t *key, size_t key_len) {
+    uint64_t hash = nat_hash(nat, key, key_len);
+    size_t i = (size_t)hash & nat->mask;
+    struct udp_nat_entry *entry;
+
+    while ((entry = nat->buckets[i]) != NULL) {
+        if (entry->hash == hash && entry->key_len == key_len && memcmp(entry->key, key, key_len) == 0) {
+            return entry;
+        }
+        i = (i + 1) & nat->mask;
+    }
+    return NULL;
+}
+
+static void bucket_place(struct udp_nat *nat, struct udp_nat_entry *entry) {
+    size_t i = (size_t)entry->hash & nat->mask;
+    while (nat->buckets[i] != NULL) {
+        i = (i + 1) & nat->mask;
+    }
+    nat->buckets[i] = entry;
+}
+
+static void nat_grow(struct udp_nat *nat) {
+    struct udp_nat_entry **old = nat->buckets;
+    size_t n, old_count = nat->mask + 1;
+
+    nat->mask = old_count * 2 - 1;
+    nat->buckets = (struct udp_nat_entry **) calloc(old_count * 2, sizeof(nat->buckets[0]));
+    for (n = 0; n < old_count; ++n) {
+        if (old[n]) {
+            bucket_place(nat, old[n]);
+        }
+    }
+    free(old);
+}
+
+static void wheel_add(struct udp_nat *nat, struct udp_nat_entry *entry) {
+    uint64_t t = (entry->last_active + nat->idle_timeout) / nat->tick;
+    if (t <= nat->current) {
+        t = nat->current + 1;
+    }
+    link_append(&nat->wheel[t % UDP_NAT_WHEEL_SLOTS], &entry->wheel);
+}
+
+bool udp_nat_insert(struct udp_nat *nat, struct udp_nat_entry *entry, uint64_t now) {
+    if (nat->count >= nat->capacity) {
+        return false;
+    }
+    // at most 3/4 full, probes stay short.
+    if ((nat->count + 1) * 4 > (nat->mask + 1) * 3) {
+        nat_grow(nat);
+    }
+    entry->hash = nat_hash(nat, entry->key, entry->key_len);
+    bucket_place(nat, entry);
+    entry->in_table = true;
+    nat->count++;
+
+    entry->last_active = now;
+    wheel_add(nat, entry);
+    return true;
+}
+
+void udp_nat_remove(struct udp_nat *nat, struct udp_nat_entry *entry) {
+    size_t i, j;
+
+    if (entry->in_table == false) {
+        return;
+    }
+    link_remove(&entry->wheel);
+
+    i = (size_t)entry->hash & nat->mask;
+    while (nat->buckets[i] != entry) {
+        i = (i + 1) & nat->mask;
+    }
+    // backward shift, so lookups never need tombstones.
+    for (j = (i + 1) & nat->mask; nat->buckets[j] != NULL; j = (j + 1) & nat->mask) {
+        size_t k = (size_t)nat->buckets[j]->hash & nat->mask;
+        bool stays = (i <= j) ? (i < k && k <= j) : (i < k || k <= j);
+        if (stays == false) {
+            nat->buckets[i] = nat->buckets[j];
+            i = j;
+        }
+    }
+    nat->buckets[i] = NULL;
+    entry->in_table = false;
+    nat->count--;
+}
+
+size_t udp_nat_count(const struct udp_nat *nat) {
+    return nat->count;
+}
+
+uint64_t udp_nat_tick(const struct udp_nat *nat) {
+    return nat->tick;
+}
+
+struct udp_nat_entry * udp_nat_oldest(const struct udp_nat *nat) {
+    size_t n;
+    for (n = 1; n <= UDP_NAT_WHEEL_SLOTS; ++n) {
+        const struct udp_nat_link *slot = &nat->wheel[(nat->current + n) % UDP_NAT_WHEEL_SLOTS];
+        if (slot->next != slot) {
+            return entry_of_link(slot->next);
+        }
+    }
+    return NULL;
+}
+
+void udp_nat_expire(struct udp_nat *nat, uint64_t now, bool all,
+                    void(*expired_cb)(struct udp_nat_entry *entry, void *p), void *p)
+{
+    uint64_t target = now / nat->tick;
+    size_t n;
+
+    if (all) {
+        for (n = 0; n < UDP_NAT_WHEEL_SLOTS; ++n) {
+            struct udp_nat_link *slot = &nat->wheel[n];
+            while (slot->next != slot) {
+                struct udp_nat_entry *entry = entry_of_link(slot->next);
+                udp_nat_remove(nat, entry);
+                expired_cb(entry, p);
+            }
+        }
+        return;
+    }
+
+    // after a long stall each slot is looked at once.
+    if (target > nat->current + UDP_NAT_WHEEL_SLOTS) {
+        nat->current = target - UDP_NAT_WHEEL_SLOTS;
+    }
+    while (nat->current < target) {
+        struct udp_nat_link due;
+        nat->current++;
+        link_move_all(&nat->wheel[nat->current % UDP_NAT_WHEEL_SLOTS], &due);
+        while (due.next != &due) {
+            struct udp_nat_entry *entry = entry_of_link(due.next);
+            link_remove(&entry->wheel);
+            if (entry->last_active + nat->idle_timeout <= now) {
+                udp_nat_remove(nat, entry);
+                expired_cb(entry, p);
+            } else {
+                wheel_add(nat, entry);
+            }
+        }
+    }
+}
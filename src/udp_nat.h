@@ -0,0 +1,58 @@
+#ifndef __UDP_NAT_H__
+#define __UDP_NAT_H__ 1
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+struct sockaddr;
+
+/* Address family, port and IP, then up to a SOCKS5 address header. */
+#define UDP_NAT_KEY_MAX (1 + 2 + 16 + 1 + 1 + 255 + 2)
+
+struct udp_nat_link {
+    struct udp_nat_link *prev;
+    struct udp_nat_link *next;
+};
+
+/* Embedded in whatever the table keeps track of. */
+struct udp_nat_entry {
+    uint64_t hash;
+    uint64_t last_active; /* in ms, set by the owner on traffic */
+    struct udp_nat_link wheel;
+    bool in_table;
+    uint16_t key_len;
+    uint8_t key[UDP_NAT_KEY_MAX];
+};
+
+/* The associations of a UDP relay, keyed on binary address tuples. An
+ * open addressing hash finds them, and a timer wheel with a slot per
+ * 1/32 of the idle timeout finds the idle ones. Traffic only updates
+ * last_active, an entry is looked at again when the wheel comes around.
+ */
+struct udp_nat;
+
+struct udp_nat * udp_nat_create(size_t capacity, uint64_t idle_timeout, uint64_t now);
+/* Entries still in it are left alone. */
+void udp_nat_destroy(struct udp_nat *nat);
+
+size_t udp_nat_key_build(uint8_t key[UDP_NAT_KEY_MAX], const struct sockaddr *addr, const void *extra, size_t extra_len);
+
+void udp_nat_entry_set_key(struct udp_nat_entry *entry, const uint8_t *key, size_t key_len);
+struct udp_nat_entry * udp_nat_find(const struct udp_nat *nat, const uint8_t *key, size_t key_len);
+/* false when the table is at its capacity. */
+bool udp_nat_insert(struct udp_nat *nat, struct udp_nat_entry *entry, uint64_t now);
+void udp_nat_remove(struct udp_nat *nat, struct udp_nat_entry *entry);
+
+size_t udp_nat_count(const struct udp_nat *nat);
+uint64_t udp_nat_tick(const struct udp_nat *nat);
+/* The entry the wheel would look at first, the least recently used or close to it. */
+struct udp_nat_entry * udp_nat_oldest(const struct udp_nat *nat);
+
+/* Takes the entries idle for the timeout out of the table and hands them
+ * to |expired_cb|, or with |all| every entry.
+ */
+void udp_nat_expire(struct udp_nat *nat, uint64_t now, bool all,
+                    void(*expired_cb)(struct udp_nat_entry *entry, void *p), void *p);
+
+#endif // __UDP_NAT_H__
@@ -20,6 +20,10 @@
  * <http://www.gnu.org/licenses/>.
  */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE /* sendmmsg() */
+#endif
+
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <fcntl.h>
@@ -59,7 +63,7 @@
 
 #include "ssrutils.h"
 #include "netutils.h"
-#include "cache.h"
+#include "udp_nat.h"
 #include "udprelay.h"
 #include "encrypt.h"
 #include "sockaddr_universal.h"
@@ -69,19 +73,13 @@
 #include "obfs/obfs.h"
 
 #ifdef MODULE_REMOTE
-#include "resolv.h"
+#include "users.h"
 #endif
 
 #include "common.h"
 #include "sockaddr_universal.h"
 #include "ssr_executive.h"
 
-#ifdef MODULE_REMOTE
-#define MAX_UDP_CONN_NUM 512
-#else
-#define MAX_UDP_CONN_NUM 256
-#endif
-
 #if defined(MODULE_REMOTE) && defined(MODULE_LOCAL)
 #error "MODULE_REMOTE and MODULE_LOCAL should not be both defined"
 #endif
@@ -98,6 +96,18 @@
 
 #define DEFAULT_PACKET_SIZE MAX_UDP_PACKET_SIZE // 1492 - 1 - 28 - 2 - 64 = 1397, the default MTU for UDP relay
 
+#define UDP_RECV_BUF_SIZE 65536 /* one datagram, libuv reads no less per chunk */
+#if UV_VERSION_HEX >= 0x012800
+#define UDP_RECV_BATCH 8 /* datagrams per recvmmsg() */
+#else
+#define UDP_RECV_BATCH 1
+#endif
+#define UDP_SEND_BATCH 32 /* datagrams per sendmmsg() */
+#define UDP_PACKET_SLOTS 64
+#define UDP_PACKET_SLOT_SIZE 2048 /* a datagram of the usual MTU and the relay headers */
+
+#define UDP_DEFAULT_MAX_ASSOCIATIONS (64 * 1024)
+
 size_t
 get_sockaddr_len(struct sockaddr *addr)
 {
@@ -109,56 +119,65 @@ get_sockaddr_len(struct sockaddr *addr)
     return 0;
 }
 
+struct udp_send_ctx_t;
+
+struct udp_tx_entry_t {
+    uv_udp_t *io;
+    struct buffer_t *buf;
+    union sockaddr_universal addr;
+};
+
 struct udp_listener_ctx_t {
     uv_udp_t io;
     int timeout;
-    struct cstl_set *connections;
+    int ref_count; /* the handles, its associations and queued sends */
+    struct udp_nat *nat; /* struct udp_remote_ctx_t by client address */
+    uv_timer_t expiry; /* runs while there are associations */
+    struct buffer_t *spare_packets[UDP_PACKET_SLOTS];
+    size_t spare_count;
+    struct udp_send_ctx_t *spare_sends;
+    struct udp_tx_entry_t tx_batch[UDP_SEND_BATCH];
+    size_t tx_count;
+    uv_check_t tx_flusher; /* sends the batch once the loop is done polling */
+    char *recv_buf; /* shared by the listener and its associations */
 #ifdef MODULE_LOCAL
     union sockaddr_universal remote_addr;
     struct ss_host_port tunnel_addr;
 #endif
-//#ifdef MODULE_REMOTE
-//    struct uv_loop_s *loop;
-//#endif
     struct cipher_env_t *cipher_env;
     // SSR
     struct obfs_t *protocol_plugin;
     void *protocol_global;
-};
-
 #ifdef MODULE_REMOTE
-struct query_ctx {
-    struct resolv_query *query;
-    struct sockaddr_storage src_addr;
-    struct buffer_t *buf;
-    int addr_header_len;
-    char addr_header[384];
-    struct udp_listener_ctx_t *server_ctx;
-    struct udp_remote_ctx_t *remote_ctx;
-};
+    char *protocol;
+    struct server_info_t server_info;
 #endif
+};
 
 struct udp_remote_ctx_t {
     uv_udp_t io;
-    uv_timer_t watcher;
+    struct udp_nat_entry nat;
     int addr_header_len;
     char addr_header[384];
     struct sockaddr_storage src_addr;
 #ifdef MODULE_REMOTE
     struct sockaddr_storage dst_addr;
+    struct obfs_t *protocol; /* knows the user to answer as */
+    uv_getaddrinfo_t resolve_req;
+    bool resolving;
+    struct buffer_t *pending; /* the first datagram, while resolving */
 #endif
+    bool io_open;
+    bool closing;
     struct udp_listener_ctx_t *server_ctx;
     int ref_count;
 };
 
 static void udp_listener_recv_cb(uv_udp_t* handle, ssize_t nread, const uv_buf_t* buf0, const struct sockaddr* addr, unsigned flags);
 static void udp_remote_recv_cb(uv_udp_t* handle, ssize_t nread, const uv_buf_t* buf0, const struct sockaddr* addr, unsigned flags);
-static void udp_remote_timeout_cb(uv_timer_t* handle);
 
-#ifdef MODULE_REMOTE
-static void query_resolve_cb(struct sockaddr *addr, void *data);
-#endif
 static void udp_remote_shutdown(struct udp_remote_ctx_t *ctx);
+static void udp_listener_release(struct udp_listener_ctx_t *server_ctx);
 
 #ifdef ANDROID
 extern int log_tx_rx;
@@ -167,26 +186,182 @@ extern uint64_t rx;
 extern int vpn;
 #endif
 
-//extern int verbose;
-#ifdef MODULE_REMOTE
-extern uint64_t tx;
-extern uint64_t rx;
-#endif
-
 static size_t packet_size                            = DEFAULT_PACKET_SIZE;
 static size_t buf_size                               = DEFAULT_PACKET_SIZE * 2;
 
-static void udp_uv_alloc_buffer(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
-    char *tmp = (char *) calloc(suggested_size, sizeof(char));
-    *buf = uv_buf_init(tmp, (unsigned int)suggested_size);
+static void udp_listener_alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+    struct udp_listener_ctx_t *server_ctx = CONTAINER_OF(handle, struct udp_listener_ctx_t, io);
+    *buf = uv_buf_init(server_ctx->recv_buf, UDP_RECV_BATCH * UDP_RECV_BUF_SIZE);
+    (void)suggested_size;
+}
+
+static void udp_remote_alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+    struct udp_remote_ctx_t *remote_ctx = CONTAINER_OF(handle, struct udp_remote_ctx_t, io);
+    struct udp_listener_ctx_t *server_ctx = remote_ctx->server_ctx;
+    *buf = uv_buf_init(server_ctx->recv_buf, UDP_RECV_BATCH * UDP_RECV_BUF_SIZE);
+    (void)suggested_size;
 }
 
-static void udp_uv_release_buffer(uv_buf_t *buf) {
-    if (buf->base) {
-        free(buf->base);
-        buf->base = NULL;
+/* Packets come from slots made up front, a fresh one is only needed when
+ * more than UDP_PACKET_SLOTS are in flight.
+ */
+static struct buffer_t * udp_packet_get(struct udp_listener_ctx_t *server_ctx) {
+    if (server_ctx->spare_count > 0) {
+        return server_ctx->spare_packets[--server_ctx->spare_count];
     }
-    buf->len = 0;
+    return buffer_create(UDP_PACKET_SLOT_SIZE);
+}
+
+static void udp_packet_put(struct udp_listener_ctx_t *server_ctx, struct buffer_t *buf) {
+    if (buf == NULL) {
+        return;
+    }
+    // one grown for a jumbo datagram isn't worth keeping.
+    if (server_ctx->spare_count < UDP_PACKET_SLOTS && buf->capacity <= 2 * UDP_PACKET_SLOT_SIZE) {
+        buf->len = 0;
+        server_ctx->spare_packets[server_ctx->spare_count++] = buf;
+    } else {
+        buffer_release(buf);
+    }
+}
+
+struct udp_send_ctx_t {
+    uv_udp_send_t req;
+    struct udp_listener_ctx_t *server_ctx;
+    struct buffer_t *buf;
+    struct udp_send_ctx_t *next; /* in spare_sends */
+};
+
+static void udp_send_ctx_put(struct udp_listener_ctx_t *server_ctx, struct udp_send_ctx_t *ctx) {
+    ctx->buf = NULL;
+    ctx->next = server_ctx->spare_sends;
+    server_ctx->spare_sends = ctx;
+}
+
+static void udp_packet_send_done_cb(uv_udp_send_t *req, int status) {
+    struct udp_send_ctx_t *ctx = CONTAINER_OF(req, struct udp_send_ctx_t, req);
+    struct udp_listener_ctx_t *server_ctx = ctx->server_ctx;
+    (void)status;
+    udp_packet_put(server_ctx, ctx->buf);
+    udp_send_ctx_put(server_ctx, ctx);
+    udp_listener_release(server_ctx);
+}
+
+/* Sends right away when the socket has room, which is the usual case, and
+ * only queues a request otherwise. Takes over |buf| either way.
+ */
+static void udp_packet_send_now(struct udp_listener_ctx_t *server_ctx, uv_udp_t *io, struct buffer_t *buf, const struct sockaddr *addr) {
+    uv_buf_t tmp = uv_buf_init((char *)buf->buffer, (unsigned int)buf->len);
+    struct udp_send_ctx_t *ctx;
+    int err;
+
+    err = uv_udp_try_send(io, &tmp, 1, addr);
+    if (err != UV_EAGAIN) {
+        if (err < 0) {
+            LOGE("[udp] sendto: %s", uv_strerror(err));
+        }
+        udp_packet_put(server_ctx, buf);
+        return;
+    }
+
+    ctx = server_ctx->spare_sends;
+    if (ctx) {
+        server_ctx->spare_sends = ctx->next;
+    } else {
+        ctx = (struct udp_send_ctx_t *) calloc(1, sizeof(*ctx));
+    }
+    ctx->server_ctx = server_ctx;
+    ctx->buf = buf;
+    err = uv_udp_send(&ctx->req, io, &tmp, 1, addr, udp_packet_send_done_cb);
+    if (err != 0) {
+        LOGE("[udp] sendto: %s", uv_strerror(err));
+        udp_packet_put(server_ctx, buf);
+        udp_send_ctx_put(server_ctx, ctx);
+        return;
+    }
+    server_ctx->ref_count++;
+}
+
+#if defined(__linux__)
+/* The entries from |first| on that go out of the same socket, in one
+ * sendmmsg(). Returns how many entries were taken care of.
+ */
+static size_t udp_tx_send_run(struct udp_listener_ctx_t *server_ctx, size_t first) {
+    struct udp_tx_entry_t *batch = server_ctx->tx_batch + first;
+    struct mmsghdr msgs[UDP_SEND_BATCH];
+    struct iovec iov[UDP_SEND_BATCH];
+    uv_udp_t *io = batch[0].io;
+    size_t count, n;
+    int sent = 0;
+    uv_os_fd_t fd;
+
+    for (count = 0; first + count < server_ctx->tx_count && batch[count].io == io; ++count) {
+        iov[count].iov_base = batch[count].buf->buffer;
+        iov[count].iov_len = batch[count].buf->len;
+        memset(&msgs[count], 0, sizeof(msgs[0]));
+        msgs[count].msg_hdr.msg_name = &batch[count].addr;
+        msgs[count].msg_hdr.msg_namelen = (socklen_t) get_sockaddr_len(&batch[count].addr.addr);
+        msgs[count].msg_hdr.msg_iov = iov + count;
+        msgs[count].msg_hdr.msg_iovlen = 1;
+    }
+
+    // behind what libuv has queued already, or they'd go out of order.
+    if (io->send_queue_count == 0 && uv_fileno((uv_handle_t *)io, &fd) == 0) {
+        do {
+            sent = sendmmsg(fd, msgs, (unsigned int)count, 0);
+        } while (sent < 0 && errno == EINTR);
+        if (sent < 0) {
+            sent = 0;
+        }
+    }
+
+    // what didn't make it goes one by one, to be queued or have its error logged.
+    for (n = 0; n < count; ++n) {
+        if ((int)n < sent) {
+            udp_packet_put(server_ctx, batch[n].buf);
+        } else {
+            udp_packet_send_now(server_ctx, io, batch[n].buf, &batch[n].addr.addr);
+        }
+    }
+    return count;
+}
+#else
+static size_t udp_tx_send_run(struct udp_listener_ctx_t *server_ctx, size_t first) {
+    struct udp_tx_entry_t *entry = server_ctx->tx_batch + first;
+    udp_packet_send_now(server_ctx, entry->io, entry->buf, &entry->addr.addr);
+    return 1;
+}
+#endif
+
+static void udp_tx_flush(struct udp_listener_ctx_t *server_ctx) {
+    size_t n = 0;
+    while (n < server_ctx->tx_count) {
+        n += udp_tx_send_run(server_ctx, n);
+    }
+    server_ctx->tx_count = 0;
+    uv_check_stop(&server_ctx->tx_flusher);
+}
+
+static void udp_tx_flush_cb(uv_check_t *handle) {
+    udp_tx_flush(CONTAINER_OF(handle, struct udp_listener_ctx_t, tx_flusher));
+}
+
+/* Datagrams sent while handling one round of reads go out together, right
+ * after it. Takes over |buf|.
+ */
+static void udp_packet_send(struct udp_listener_ctx_t *server_ctx, uv_udp_t *io, struct buffer_t *buf, const struct sockaddr *addr) {
+    struct udp_tx_entry_t *entry;
+
+    if (server_ctx->tx_count == UDP_SEND_BATCH) {
+        udp_tx_flush(server_ctx);
+    }
+    if (server_ctx->tx_count == 0) {
+        uv_check_start(&server_ctx->tx_flusher, udp_tx_flush_cb);
+    }
+    entry = server_ctx->tx_batch + server_ctx->tx_count++;
+    entry->io = io;
+    entry->buf = buf;
+    memcpy(&entry->addr, addr, get_sockaddr_len((struct sockaddr *)addr));
 }
 
 #if defined(MODULE_REMOTE) && defined(SO_BROADCAST)
@@ -404,11 +579,19 @@ get_addr_str(const struct sockaddr *sa)
     return s;
 }
 
+static void udp_socket_init(uv_loop_t *loop, uv_udp_t *udp) {
+#if UDP_RECV_BATCH > 1
+    uv_udp_init_ex(loop, udp, AF_UNSPEC | UV_UDP_RECVMMSG);
+#else
+    uv_udp_init(loop, udp);
+#endif
+}
+
 int udp_create_remote_socket(bool ipv6, uv_loop_t *loop, uv_udp_t *udp) {
     int err = 0;
     union sockaddr_universal addr = { 0 };
 
-    uv_udp_init(loop, udp);
+    udp_socket_init(loop, udp);
 
     if (ipv6) {
         // Try to bind IPv6 first
@@ -449,7 +632,7 @@ udp_create_local_listener(const char *host, uint16_t port, uv_loop_t *loop, uv_u
         return -1;
     }
 
-    uv_udp_init(loop, udp);
+    udp_socket_init(loop, udp);
 
     rp = result;
 
@@ -490,31 +673,60 @@ udp_create_local_listener(const char *host, uint16_t port, uv_loop_t *loop, uv_u
     return server_sock;
 }
 
+static void udp_remote_release(struct udp_remote_ctx_t *ctx) {
+    --ctx->ref_count;
+    if (ctx->ref_count <= 0) {
 #ifdef MODULE_REMOTE
-struct query_ctx * new_query_ctx(char *buf, size_t len) {
-    struct query_ctx *ctx = calloc(1, sizeof(struct query_ctx));
-    ctx->buf = buffer_create_from((uint8_t *)buf, len);
-    return ctx;
-}
-
-static void close_and_free_query(struct query_ctx *ctx) {
-    if (ctx != NULL) {
-        if (ctx->query != NULL) {
-            resolv_cancel(ctx->query);
-            ctx->query = NULL;
+        if (ctx->pending) {
+            udp_packet_put(ctx->server_ctx, ctx->pending);
         }
-        buffer_release(ctx->buf);
+        if (ctx->protocol) {
+            free_obfs_instance(ctx->protocol);
+        }
+#endif
+        udp_listener_release(ctx->server_ctx);
         free(ctx);
     }
 }
 
+static void udp_remote_close_done_cb(uv_handle_t* handle) {
+    udp_remote_release((struct udp_remote_ctx_t *)handle->data);
+}
+
+static void udp_remote_close(struct udp_remote_ctx_t *ctx) {
+    if (ctx->closing) {
+        return;
+    }
+    ctx->closing = true;
+
+    if (ctx->io_open) {
+        // a batched datagram must not outlive the socket.
+        udp_tx_flush(ctx->server_ctx);
+        uv_udp_recv_stop(&ctx->io);
+        ctx->io.data = ctx;
+        uv_close((uv_handle_t *)&ctx->io, udp_remote_close_done_cb);
+        ++ctx->ref_count;
+    }
+#ifdef MODULE_REMOTE
+    if (ctx->resolving) {
+        // the callback still runs, with UV_EAI_CANCELED.
+        uv_cancel((uv_req_t *)&ctx->resolve_req);
+    }
 #endif
+    udp_remote_release(ctx);
+}
 
-static void udp_remote_close_done_cb(uv_handle_t* handle) {
-    struct udp_remote_ctx_t *ctx = (struct udp_remote_ctx_t *)handle->data;
-    --ctx->ref_count;
-    if (ctx->ref_count <= 0) {
-        free(ctx);
+static void udp_remote_expired_cb(struct udp_nat_entry *entry, void *p) {
+    struct udp_remote_ctx_t *ctx = CONTAINER_OF(entry, struct udp_remote_ctx_t, nat);
+    (void)p;
+    udp_remote_close(ctx);
+}
+
+static void udp_listener_expiry_cb(uv_timer_t* handle) {
+    struct udp_listener_ctx_t *server_ctx = CONTAINER_OF(handle, struct udp_listener_ctx_t, expiry);
+    udp_nat_expire(server_ctx->nat, uv_now(handle->loop), false, udp_remote_expired_cb, NULL);
+    if (udp_nat_count(server_ctx->nat) == 0) {
+        uv_timer_stop(handle);
     }
 }
 
@@ -522,150 +734,130 @@ static void udp_remote_shutdown(struct udp_remote_ctx_t *ctx) {
     if (ctx == NULL) {
         return;
     }
-    cstl_set_container_remove(ctx->server_ctx->connections, ctx);
-
-    ctx->watcher.data = ctx;
-    uv_timer_stop(&ctx->watcher);
-    uv_close((uv_handle_t *)&ctx->watcher, udp_remote_close_done_cb);
-    ++ctx->ref_count;
-
-    uv_udp_recv_stop(&ctx->io);
-    ctx->io.data = ctx;
-    uv_close((uv_handle_t *)&ctx->io, udp_remote_close_done_cb);
-    ++ctx->ref_count;
+    udp_nat_remove(ctx->server_ctx->nat, &ctx->nat);
+    udp_remote_close(ctx);
 }
 
-static void udp_remote_timeout_cb(uv_timer_t* handle) {
-    struct udp_remote_ctx_t *remote_ctx
-        = CONTAINER_OF(handle, struct udp_remote_ctx_t, watcher);
+static struct udp_remote_ctx_t *
+udp_remote_find(struct udp_listener_ctx_t *server_ctx, const uint8_t *key, size_t key_len)
+{
+    struct udp_nat_entry *entry = udp_nat_find(server_ctx->nat, key, key_len);
+    return entry ? CONTAINER_OF(entry, struct udp_remote_ctx_t, nat) : NULL;
+}
 
-    LOGI("[udp] connection timeout");
+/* One association per |key|, so replies find their way back and the socket
+ * is reused for as long as the flow lasts. With the table full, the flow
+ * idle the longest makes room.
+ */
+static struct udp_remote_ctx_t *
+udp_remote_create(struct udp_listener_ctx_t *server_ctx, const uint8_t *key, size_t key_len, const struct sockaddr_storage *src_addr)
+{
+    struct udp_remote_ctx_t *remote_ctx;
+    uint64_t now = uv_now(server_ctx->io.loop);
 
-    udp_remote_shutdown(remote_ctx);
-}
+    remote_ctx = (struct udp_remote_ctx_t *) calloc(1, sizeof(struct udp_remote_ctx_t));
 
-#ifdef MODULE_REMOTE
+    remote_ctx->server_ctx = server_ctx;
+    remote_ctx->src_addr = *src_addr;
+    remote_ctx->ref_count = 1;
+    server_ctx->ref_count++;
 
-static void udp_remote_send_done_cb(uv_udp_send_t* req, int status) {
-    struct udp_remote_ctx_t *remote_ctx = (struct udp_remote_ctx_t *)req->data;
-    free(req);
-    if (status < 0) {
-        SS_ERROR("[udp] sendto_remote");
-        udp_remote_shutdown(remote_ctx);
-    } else {
-        /*
-        // Add to conn cache
-        char *key = hash_key(AF_UNSPEC, &remote_ctx->src_addr);
-        cache_insert(remote_ctx->server_ctx->conn_cache, key, HASH_KEY_LEN, (void *)remote_ctx);
-        // ev_io_start(EV_A_ & remote_ctx->io);
-        //ev_timer_start(EV_A_ & remote_ctx->watcher);
-        */
+    udp_nat_entry_set_key(&remote_ctx->nat, key, key_len);
+    while (udp_nat_insert(server_ctx->nat, &remote_ctx->nat, now) == false) {
+        struct udp_nat_entry *oldest = udp_nat_oldest(server_ctx->nat);
+        udp_remote_shutdown(CONTAINER_OF(oldest, struct udp_remote_ctx_t, nat));
     }
-}
-
-static void query_resolve_cb(struct sockaddr *addr, void *data) {
-    struct query_ctx *query_ctx = (struct query_ctx *)data;
-    struct uv_loop_s *loop = query_ctx->server_ctx->io.loop;
-    /*
-    if (verbose) {
-        LOGI("[udp] udns resolved");
+    if (udp_nat_count(server_ctx->nat) == 1) {
+        uint64_t tick = udp_nat_tick(server_ctx->nat);
+        uv_timer_start(&server_ctx->expiry, udp_listener_expiry_cb, tick, tick);
     }
-    */
-    query_ctx->query = NULL;
-
-    if (addr == NULL) {
-        LOGE("[udp] udns returned an error");
-    } else {
-        struct udp_remote_ctx_t *remote_ctx = query_ctx->remote_ctx;
-        int cache_hit            = 0;
-
-        /*
-        // Lookup in the conn cache
-        if (remote_ctx == NULL) {
-            char *key = hash_key(AF_UNSPEC, &query_ctx->src_addr);
-            cache_lookup(query_ctx->server_ctx->conn_cache, key, HASH_KEY_LEN, (void *)&remote_ctx);
-        }
-        */
+    return remote_ctx;
+}
 
-        if (remote_ctx == NULL) {
-            remote_ctx = calloc(1, sizeof(struct udp_remote_ctx_t));
-            bool ipv6 = (addr->sa_family == AF_INET6);
-            int remotefd = udp_create_remote_socket(ipv6, loop, &remote_ctx->io);
-            if (remotefd != -1) {
-                // setnonblocking(remotefd);
+static int udp_remote_open(struct udp_remote_ctx_t *remote_ctx, bool ipv6) {
+    int err = udp_create_remote_socket(ipv6, remote_ctx->server_ctx->io.loop, &remote_ctx->io);
+    remote_ctx->io_open = true;
+    if (err == 0) {
+#ifdef MODULE_REMOTE
+        uv_os_fd_t fd;
+        if (uv_fileno((uv_handle_t *)&remote_ctx->io, &fd) == 0) {
 #ifdef SO_BROADCAST
-                set_broadcast(remotefd);
+            set_broadcast((int)fd);
 #endif
 #ifdef SO_NOSIGPIPE
-                set_nosigpipe(remotefd);
+            set_nosigpipe((int)fd);
 #endif
-#ifdef IP_TOS
-                // Set QoS flag
-                int tos = 46;
-                setsockopt(remotefd, IPPROTO_IP, IP_TOS, &tos, sizeof(tos));
-#endif
-#ifdef SET_INTERFACE
-                if (query_ctx->server_ctx->iface) {
-                    if (setinterface(remotefd, query_ctx->server_ctx->iface) == -1)
-                        SS_ERROR("setinterface");
-                }
-#endif
-                // remote_ctx                  = new_udp_remote(remotefd, query_ctx->server_ctx);
-                remote_ctx->src_addr        = query_ctx->src_addr;
-                remote_ctx->server_ctx      = query_ctx->server_ctx;
-                remote_ctx->addr_header_len = query_ctx->addr_header_len;
-                memcpy(remote_ctx->addr_header, query_ctx->addr_header,
-                       query_ctx->addr_header_len);
-            } else {
-                SS_ERROR("[udp] bind() error");
-            }
-        } else {
-            cache_hit = 1;
         }
+#endif
+        uv_udp_recv_start(&remote_ctx->io, udp_remote_alloc_cb, udp_remote_recv_cb);
+    }
+    return err;
+}
 
-        if (remote_ctx != NULL) {
-            memcpy(&remote_ctx->dst_addr, addr, sizeof(struct sockaddr_storage));
-#if 0
-            size_t addr_len = get_sockaddr_len(addr);
-            int s           = sendto(remote_ctx->fd, query_ctx->buf->buffer, query_ctx->buf->len,
-                                     0, addr, addr_len);
+#ifdef MODULE_REMOTE
 
-            if (s == -1) {
-                SS_ERROR("[udp] sendto_remote");
-                if (!cache_hit) {
-                    udp_remote_shutdown(remote_ctx);
-                }
-            } else {
-                if (!cache_hit) {
-                    // Add to conn cache
-                    char *key = hash_key(AF_UNSPEC, &remote_ctx->src_addr);
-                    cache_insert(query_ctx->server_ctx->conn_cache, key, HASH_KEY_LEN, (void *)remote_ctx);
-                    ev_io_start(EV_A_ & remote_ctx->io);
-                    ev_timer_start(EV_A_ & remote_ctx->watcher);
-                }
-            }
-#else
-            uv_udp_send_t *req = (uv_udp_send_t *)calloc(1, sizeof(uv_udp_send_t));
-            req->data = remote_ctx;
-            uv_buf_t tmp = uv_buf_init(query_ctx->buf->buffer, (unsigned int)query_ctx->buf->len);
-            uv_udp_send(req, &remote_ctx->io, &tmp, 1, (const struct sockaddr *)&remote_ctx->dst_addr, udp_remote_send_done_cb);
-#endif
-        }
+/* A protocol instance of its own, so the reply is keyed with the user who
+ * sent the request. false if that user is at its connection limit.
+ */
+static bool udp_remote_set_user(struct udp_remote_ctx_t *remote_ctx, uint32_t uid) {
+    struct udp_listener_ctx_t *server_ctx = remote_ctx->server_ctx;
+    struct obfs_t *protocol = new_obfs_instance(server_ctx->protocol);
+    struct server_user *user;
+
+    if (protocol == NULL) {
+        return true;
     }
+    protocol->set_server_info(protocol, &server_ctx->server_info);
+    remote_ctx->protocol = protocol;
 
-    // clean up
-    close_and_free_query(query_ctx);
+    user = server_users_find(server_ctx->server_info.users, uid);
+    if (user) {
+        if (user->max_connections && user->connections_active >= user->max_connections) {
+            return false;
+        }
+        user->connections_active++;
+        user->connections_total++;
+        protocol->server.user = user;
+    }
+    return true;
 }
 
-#endif
+static void udp_remote_resolve_done_cb(uv_getaddrinfo_t *req, int status, struct addrinfo *ai) {
+    struct udp_remote_ctx_t *remote_ctx = CONTAINER_OF(req, struct udp_remote_ctx_t, resolve_req);
+    struct udp_listener_ctx_t *server_ctx = remote_ctx->server_ctx;
+    struct buffer_t *pending = remote_ctx->pending;
+
+    remote_ctx->resolving = false;
+    remote_ctx->pending = NULL;
+
+    do {
+        if (remote_ctx->closing) {
+            break;
+        }
+        if (status < 0 || ai == NULL) {
+            LOGE("[udp] resolve: %s", uv_strerror(status));
+            udp_remote_shutdown(remote_ctx);
+            break;
+        }
+        memcpy(&remote_ctx->dst_addr, ai->ai_addr, ai->ai_addrlen);
+        if (udp_remote_open(remote_ctx, (ai->ai_family == AF_INET6)) != 0) {
+            SS_ERROR("[udp] bind() error");
+            udp_remote_shutdown(remote_ctx);
+            break;
+        }
+        if (pending) {
+            udp_packet_send(server_ctx, &remote_ctx->io, pending, (const struct sockaddr *)&remote_ctx->dst_addr);
+            pending = NULL;
+        }
+    } while (0);
 
-static void udp_send_done_cb(uv_udp_send_t* req, int status) {
-    //struct udp_listener_ctx_t *server_ctx = (struct udp_listener_ctx_t *)req->data;
-    struct buffer_t *buf = (struct buffer_t *)req->data;
-    buffer_release(buf);
-    free(req);
+    udp_packet_put(server_ctx, pending);
+    uv_freeaddrinfo(ai);
+    udp_remote_release(remote_ctx);
 }
 
+#endif
+
 static void
 udp_remote_recv_cb(uv_udp_t* handle, ssize_t nread, const uv_buf_t* buf0, const struct sockaddr* addr, unsigned flags)
 {
@@ -673,11 +865,11 @@ udp_remote_recv_cb(uv_udp_t* handle, ssize_t nread, const uv_buf_t* buf0, const
     struct udp_listener_ctx_t *server_ctx = remote_ctx->server_ctx;
     struct buffer_t *buf = NULL;
     int err;
+#ifdef MODULE_LOCAL
     int len;
+#endif
     size_t remote_src_addr_len;
 
-    uv_timer_stop(&remote_ctx->watcher);
-
     // server has been closed
     if (server_ctx == NULL) {
         LOGE("[udp] invalid server");
@@ -685,23 +877,23 @@ udp_remote_recv_cb(uv_udp_t* handle, ssize_t nread, const uv_buf_t* buf0, const
         return;
     }
 
-    if (nread == -1) {
+    if (nread == 0) {
+        // nothing more to read for now
+        return;
+    } else if (nread < 0) {
         // error on recv, simply drop that packet
-        LOGE("[udp] remote_recv_recvfrom");
-        goto CLEAN_UP;
-    } else if (nread > (ssize_t) packet_size) {
+        LOGE("[udp] remote_recv_recvfrom: %s", uv_strerror((int)nread));
+        return;
+    } else if (nread > (ssize_t) packet_size || (flags & UV_UDP_PARTIAL)) {
         LOGE("[udp] remote_recv_recvfrom fragmentation");
-        goto CLEAN_UP;
+        return;
     }
 
-    buf = buffer_create(max((size_t)buf_size, (size_t)nread));
-    memcpy(buf->buffer, buf0->base, (size_t)nread);
-    buf->len = (size_t)nread;
-
-    udp_uv_release_buffer((uv_buf_t *)buf0);
+    buf = udp_packet_get(server_ctx);
+    buffer_store(buf, (uint8_t *)buf0->base, (size_t)nread);
 
 #ifdef MODULE_LOCAL
-    err = ss_decrypt_all(server_ctx->cipher_env, buf, buf_size);
+    err = ss_decrypt_all(server_ctx->cipher_env, buf, buf->len);
     if (err) {
         // drop the packet silently
         goto CLEAN_UP;
@@ -714,11 +906,10 @@ udp_remote_recv_cb(uv_udp_t* handle, ssize_t nread, const uv_buf_t* buf0, const
             buf->len = (ssize_t) protocol_plugin->client_udp_post_decrypt(protocol_plugin, (char **)&buf->buffer, buf->len, &buf->capacity);
             if ((ssize_t)buf->len < 0) {
                 LOGE("client_udp_post_decrypt");
-                udp_remote_shutdown(remote_ctx);
-                return;
+                goto CLEAN_UP;
             }
             if (buf->len == 0) {
-                return;
+                goto CLEAN_UP;
             }
         }
     }
@@ -767,7 +958,7 @@ udp_remote_recv_cb(uv_udp_t* handle, ssize_t nread, const uv_buf_t* buf0, const
         buf->len -= len;
         memmove(buf->buffer, buf->buffer + len, buf->len);
     } else {
-        buffer_realloc(buf, max(buf->len + 3, buf_size));
+        buffer_realloc(buf, buf->len + 3);
         memmove(buf->buffer + 3, buf->buffer, buf->len);
         memset(buf->buffer, 0, 3);
         buf->len += 3;
@@ -777,25 +968,25 @@ udp_remote_recv_cb(uv_udp_t* handle, ssize_t nread, const uv_buf_t* buf0, const
 #endif
 
 #ifdef MODULE_REMOTE
-
-    rx += buf->len;
-
-    char addr_header_buf[512] = { 0 };
-    char *addr_header   = remote_ctx->addr_header;
-    size_t addr_header_len = remote_ctx->addr_header_len;
-
-    if (remote_ctx->dst_addr.ss_family == AF_INET || remote_ctx->dst_addr.ss_family == AF_INET6) {
-        addr_header_len = construct_udprealy_header((const struct sockaddr_storage *)addr, addr_header_buf);
-        addr_header     = addr_header_buf;
+    {
+        // the header of where the reply came from, not of what was asked for.
+        char addr_header[512] = { 0 };
+        size_t addr_header_len = construct_udprealy_header((const struct sockaddr_storage *)addr, addr_header);
+        if (addr_header_len == 0) {
+            goto CLEAN_UP;
+        }
+        buffer_insert(buf, 0, (const uint8_t *)addr_header, addr_header_len);
     }
 
-    // Construct packet
-    buffer_realloc(buf, max(buf->len + addr_header_len, buf_size));
-    memmove(buf->buffer + addr_header_len, buf->buffer, buf->len);
-    memcpy(buf->buffer, addr_header, addr_header_len);
-    buf->len += addr_header_len;
+    // SSR beg
+    if (remote_ctx->protocol && remote_ctx->protocol->server_udp_pre_encrypt) {
+        if (remote_ctx->protocol->server_udp_pre_encrypt(remote_ctx->protocol, buf) == false) {
+            goto CLEAN_UP;
+        }
+    }
+    // SSR end
 
-    int err = ss_decrypt_all(server_ctx->cipher_env, buf, buf_size);
+    err = ss_encrypt_all(server_ctx->cipher_env, buf, buf->len);
     if (err) {
         // drop the packet silently
         goto CLEAN_UP;
@@ -852,22 +1043,15 @@ udp_remote_recv_cb(uv_udp_t* handle, ssize_t nread, const uv_buf_t* buf0, const
     close(src_fd);
 
 #else
-    {
-    uv_buf_t tmp;
-    uv_udp_send_t *req = (uv_udp_send_t *)calloc(1, sizeof(uv_udp_send_t));
-    req->data = buf;
-    tmp = uv_buf_init((char *)buf->buffer, (unsigned int) buf->len);
-    uv_udp_send(req, &server_ctx->io, &tmp, 1, (const struct sockaddr *)&remote_ctx->src_addr, udp_send_done_cb);
-    }
-    udp_remote_shutdown(remote_ctx);
+    // the association lives on as long as either side keeps talking.
+    remote_ctx->nat.last_active = uv_now(handle->loop);
+    udp_packet_send(server_ctx, &server_ctx->io, buf, (const struct sockaddr *)&remote_ctx->src_addr);
     return;
 #endif
 
 CLEAN_UP:
 
-    udp_remote_shutdown(remote_ctx);
-
-    buffer_release(buf);
+    udp_packet_put(server_ctx, buf);
 }
 
 static void 
@@ -880,13 +1064,22 @@ udp_listener_recv_cb(uv_udp_t* handle, ssize_t nread, const uv_buf_t* buf0, cons
     unsigned int offset;
     char addr_header[512] = { 0 };
     int addr_header_len   = 0;
+#ifdef MODULE_LOCAL
     uint8_t frag = 0;
+#endif
 
     char host[257] = { 0 };
     char port[65]  = { 0 };
 
     struct udp_remote_ctx_t *remote_ctx = NULL;
+    uint8_t key[UDP_NAT_KEY_MAX];
+    size_t key_len;
+#ifdef MODULE_LOCAL
     const struct sockaddr *remote_addr;
+#else
+    struct sockaddr_storage dst_addr = { 0 };
+    uint32_t uid = 0;
+#endif
     int err;
 
     if (NULL == addr) {
@@ -898,7 +1091,7 @@ udp_listener_recv_cb(uv_udp_t* handle, ssize_t nread, const uv_buf_t* buf0, cons
 
     src_addr = *(struct sockaddr_storage *)addr;
 
-    buf = buffer_create(max((size_t)buf_size, (size_t)nread));
+    buf = udp_packet_get(server_ctx);
 
     src_addr_len = sizeof(src_addr);
     offset    = 0;
@@ -945,24 +1138,30 @@ udp_listener_recv_cb(uv_udp_t* handle, ssize_t nread, const uv_buf_t* buf0, cons
         // simply drop that packet
         LOGE("[udp] server_recv_recvfrom");
         goto CLEAN_UP;
-    } else if (nread > (ssize_t) packet_size) {
+    } else if (nread > (ssize_t) packet_size || (flags & UV_UDP_PARTIAL)) {
         LOGE("[udp] server_recv_recvfrom fragmentation");
         goto CLEAN_UP;
     }
 
     buffer_store(buf, (uint8_t *)buf0->base, nread);
-
-    udp_uv_release_buffer((uv_buf_t *)buf0);
 #endif
 
 #ifdef MODULE_REMOTE
-    tx += buf->len;
-
-    int err = ss_decrypt_all(server_ctx->cipher_env, buf, buf_size);
+    err = ss_decrypt_all(server_ctx->cipher_env, buf, buf->len);
     if (err) {
         // drop the packet silently
         goto CLEAN_UP;
     }
+
+    // SSR beg
+    if (server_ctx->protocol_plugin) {
+        struct obfs_t *protocol_plugin = server_ctx->protocol_plugin;
+        if (protocol_plugin->server_udp_post_decrypt == NULL
+            || protocol_plugin->server_udp_post_decrypt(protocol_plugin, buf, &uid) == false) {
+            goto CLEAN_UP;
+        }
+    }
+    // SSR end
 #endif
 
     /*
@@ -1072,7 +1271,7 @@ udp_listener_recv_cb(uv_udp_t* handle, ssize_t nread, const uv_buf_t* buf0, cons
         addr_header_len += 2;
 
         // reconstruct the buffer
-        buffer_realloc(buf, max(buf->len + addr_header_len, buf_size));
+        buffer_realloc(buf, buf->len + addr_header_len);
         memmove(buf->buffer + addr_header_len, buf->buffer, buf->len);
         memcpy(buf->buffer, addr_header, addr_header_len);
         buf->len += addr_header_len;
@@ -1095,18 +1294,13 @@ udp_listener_recv_cb(uv_udp_t* handle, ssize_t nread, const uv_buf_t* buf0, cons
     }
 #else
     // MODULE_REMOTE
-    char host[257] = { 0 };
-    char port[64] = { 0 };
-    struct sockaddr_storage dst_addr = { 0 };
-
-    int addr_header_len = udprelay_parse_header(buf->buffer + offset, buf->len - offset, host, port, &dst_addr);
+    addr_header_len = udprelay_parse_header((const char *)(buf->buffer + offset), buf->len - offset,
+                                            host, port, &dst_addr);
     if (addr_header_len == 0) {
         // error in parse header
         goto CLEAN_UP;
     }
-
-    char *addr_header = buf->buffer + offset;
-
+    memcpy(addr_header, buf->buffer + offset, (size_t) addr_header_len);
 #endif
 
 #ifdef MODULE_LOCAL
@@ -1120,32 +1314,18 @@ udp_listener_recv_cb(uv_udp_t* handle, ssize_t nread, const uv_buf_t* buf0, cons
 
     remote_addr = &server_ctx->remote_addr.addr;
 
-    {
-        bool ipv6;
-        int remotefd;
-        remote_ctx = (struct udp_remote_ctx_t *) calloc(1, sizeof(struct udp_remote_ctx_t));
-
+    key_len = udp_nat_key_build(key, (struct sockaddr *)&src_addr, NULL, 0);
+    remote_ctx = udp_remote_find(server_ctx, key, key_len);
+    if (remote_ctx == NULL) {
         // Bind to any port
-        ipv6 = (remote_addr->sa_family == AF_INET6);
-        remotefd = udp_create_remote_socket(ipv6, server_ctx->io.loop, &remote_ctx->io);
-        if (remotefd < 0) {
+        remote_ctx = udp_remote_create(server_ctx, key, key_len, &src_addr);
+        if (udp_remote_open(remote_ctx, (remote_addr->sa_family == AF_INET6)) != 0) {
             LOGE("[udp] udprelay bind() error");
+            udp_remote_shutdown(remote_ctx);
             goto CLEAN_UP;
         }
-
-        // Init remote_ctx
-        remote_ctx->server_ctx = server_ctx;
-        remote_ctx->src_addr        = src_addr;
-        remote_ctx->addr_header_len = addr_header_len;
-        memcpy(remote_ctx->addr_header, addr_header, (size_t) addr_header_len);
-
-        uv_timer_init(server_ctx->io.loop, &remote_ctx->watcher);
-
-        cstl_set_container_add(server_ctx->connections, (void *)remote_ctx);
-
-        uv_udp_recv_start(&remote_ctx->io, udp_uv_alloc_buffer, udp_remote_recv_cb);
-        uv_timer_start(&remote_ctx->watcher, udp_remote_timeout_cb, (uint64_t)server_ctx->timeout, 0);
     }
+    remote_ctx->nat.last_active = uv_now(handle->loop);
 
     buffer_shorten(buf, offset, buf->len - offset);
 
@@ -1169,13 +1349,7 @@ udp_listener_recv_cb(uv_udp_t* handle, ssize_t nread, const uv_buf_t* buf0, cons
         LOGE("[udp] server_recv_sendto fragmentation");
         goto CLEAN_UP;
     }
-    {
-    uv_buf_t tmp;
-    uv_udp_send_t *req = (uv_udp_send_t *)calloc(1, sizeof(uv_udp_send_t));
-    req->data = buf;
-    tmp = uv_buf_init((char *)buf->buffer, (unsigned int) buf->len);
-    uv_udp_send(req, &remote_ctx->io, &tmp, 1, remote_addr, udp_send_done_cb);
-    }
+    udp_packet_send(server_ctx, &remote_ctx->io, buf, remote_addr);
     return;
 #if !defined(MODULE_TUNNEL) && !defined(MODULE_REDIR)
 #ifdef ANDROID
@@ -1186,122 +1360,69 @@ udp_listener_recv_cb(uv_udp_t* handle, ssize_t nread, const uv_buf_t* buf0, cons
 
 #else
 
-    int cache_hit  = 0;
-    int need_query = 0;
-
     if (buf->len - addr_header_len > packet_size) {
         LOGE("[udp] server_recv_sendto fragmentation");
         goto CLEAN_UP;
     }
 
-    if (remote_ctx != NULL) {
-        cache_hit = 1;
-        // detect destination mismatch
-        if (remote_ctx->addr_header_len != addr_header_len
-            || memcmp(addr_header, remote_ctx->addr_header, addr_header_len) != 0) {
-            if (dst_addr.ss_family != AF_INET && dst_addr.ss_family != AF_INET6) {
-                need_query = 1;
-            }
-        } else {
-            memcpy(&dst_addr, &remote_ctx->dst_addr, sizeof(struct sockaddr_storage));
-        }
-    } else {
-        if (dst_addr.ss_family == AF_INET || dst_addr.ss_family == AF_INET6) {
-            remote_ctx = calloc(1, sizeof(struct udp_remote_ctx_t));
+    {
+        // the client address and the destination header, one socket per pair.
+        key_len = udp_nat_key_build(key, (struct sockaddr *)&src_addr, addr_header, (size_t) addr_header_len);
+        remote_ctx = udp_remote_find(server_ctx, key, key_len);
+        if (remote_ctx == NULL) {
+            remote_ctx = udp_remote_create(server_ctx, key, key_len, &src_addr);
+            remote_ctx->addr_header_len = addr_header_len;
+            memcpy(remote_ctx->addr_header, addr_header, (size_t) addr_header_len);
 
-            bool ipv6 = (dst_addr.ss_family == AF_INET6);
-            int remotefd = udp_create_remote_socket(ipv6, server_ctx->io.loop, &remote_ctx->io);
-            if (remotefd != -1) {
-                // setnonblocking(remotefd);
-#ifdef SO_BROADCAST
-                set_broadcast(remotefd);
-#endif
-#ifdef SO_NOSIGPIPE
-                set_nosigpipe(remotefd);
-#endif
-#ifdef IP_TOS
-                // Set QoS flag
-                int tos = 46;
-                setsockopt(remotefd, IPPROTO_IP, IP_TOS, &tos, sizeof(tos));
-#endif
-#ifdef SET_INTERFACE
-                if (server_ctx->iface) {
-                    if (setinterface(remotefd, server_ctx->iface) == -1)
-                        SS_ERROR("setinterface");
+            if (udp_remote_set_user(remote_ctx, uid) == false) {
+                LOGE("[udp] user %u has too many connections", uid);
+                udp_remote_shutdown(remote_ctx);
+                goto CLEAN_UP;
+            }
+            if (dst_addr.ss_family == AF_INET || dst_addr.ss_family == AF_INET6) {
+                remote_ctx->dst_addr = dst_addr;
+                if (udp_remote_open(remote_ctx, (dst_addr.ss_family == AF_INET6)) != 0) {
+                    SS_ERROR("[udp] bind() error");
+                    udp_remote_shutdown(remote_ctx);
+                    goto CLEAN_UP;
                 }
-#endif
-                remote_ctx->src_addr        = src_addr;
-                remote_ctx->server_ctx      = server_ctx;
-                remote_ctx->addr_header_len = addr_header_len;
-                memcpy(remote_ctx->addr_header, addr_header, addr_header_len);
-                memcpy(&remote_ctx->dst_addr, &dst_addr, sizeof(struct sockaddr_storage));
             } else {
-                SS_ERROR("[udp] bind() error");
-                goto CLEAN_UP;
+                struct addrinfo hints;
+                memset(&hints, 0, sizeof(struct addrinfo));
+                hints.ai_family   = AF_UNSPEC;
+                hints.ai_socktype = SOCK_DGRAM;
+                hints.ai_protocol = IPPROTO_UDP;
+
+                err = uv_getaddrinfo(server_ctx->io.loop, &remote_ctx->resolve_req,
+                                     udp_remote_resolve_done_cb, host, port, &hints);
+                if (err != 0) {
+                    LOGE("[udp] unable to resolve %s: %s", host, uv_strerror(err));
+                    udp_remote_shutdown(remote_ctx);
+                    goto CLEAN_UP;
+                }
+                remote_ctx->resolving = true;
+                remote_ctx->ref_count++;
             }
         }
     }
+    remote_ctx->nat.last_active = uv_now(handle->loop);
 
-    if (remote_ctx != NULL && !need_query) {
-        /*
-        size_t addr_len = get_sockaddr_len((struct sockaddr *)&dst_addr);
-        int s           = sendto(remote_ctx->fd, buf->buffer + addr_header_len,
-                                 buf->len - addr_header_len, 0,
-                                 (struct sockaddr *)&dst_addr, addr_len);
+    buffer_shorten(buf, (size_t) addr_header_len, buf->len - addr_header_len);
 
-        if (s == -1) {
-            SS_ERROR("[udp] sendto_remote");
-            if (!cache_hit) {
-                udp_remote_shutdown(remote_ctx);
-            }
-        } else {
-            if (!cache_hit) {
-                // Add to conn cache
-                remote_ctx->af = dst_addr.ss_family;
-                char *key = hash_key(remote_ctx->af, &remote_ctx->src_addr);
-                cache_insert(server_ctx->conn_cache, key, HASH_KEY_LEN, (void *)remote_ctx);
-
-                ev_io_start(EV_A_ & remote_ctx->io);
-                ev_timer_start(EV_A_ & remote_ctx->watcher);
-            }
+    if (remote_ctx->resolving) {
+        // the first datagram waits for the name, later ones are dropped.
+        if (remote_ctx->pending == NULL) {
+            remote_ctx->pending = buf;
+            return;
         }
-        */
-        remote_ctx->dst_addr;
-        uv_udp_send_t *req = (uv_udp_send_t *)calloc(1, sizeof(uv_udp_send_t));
-        req->data = remote_ctx;
-        uv_buf_t tmp = uv_buf_init(buf->buffer + addr_header_len, (unsigned int)buf->len - addr_header_len);
-        uv_udp_send(req, &remote_ctx->io, &tmp, 1, (const struct sockaddr *)&remote_ctx->dst_addr, udp_remote_send_done_cb);
-    } else {
-        struct addrinfo hints;
-        memset(&hints, 0, sizeof(struct addrinfo));
-        hints.ai_family   = AF_UNSPEC;
-        hints.ai_socktype = SOCK_DGRAM;
-        hints.ai_protocol = IPPROTO_UDP;
-
-        struct query_ctx *query_ctx = new_query_ctx(buf->buffer + addr_header_len,
-                                                    buf->len - addr_header_len);
-        query_ctx->server_ctx      = server_ctx;
-        query_ctx->addr_header_len = addr_header_len;
-        query_ctx->src_addr        = src_addr;
-        memcpy(query_ctx->addr_header, addr_header, addr_header_len);
-
-        if (need_query) {
-            query_ctx->remote_ctx = remote_ctx;
-        }
-
-        struct resolv_query *query = 
-            resolv_query(host, query_resolve_cb, NULL, query_ctx, htons(atoi(port)));
-        if (query == NULL) {
-            SS_ERROR("[udp] unable to create DNS query");
-            close_and_free_query(query_ctx);
-            goto CLEAN_UP;
-        }
-        query_ctx->query = query;
+        goto CLEAN_UP;
     }
+    udp_packet_send(server_ctx, &remote_ctx->io, buf, (const struct sockaddr *)&remote_ctx->dst_addr);
+    return;
 #endif
 
 CLEAN_UP:
-    buffer_release(buf);
+    udp_packet_put(server_ctx, buf);
 }
 
 struct udp_listener_ctx_t *
@@ -1310,12 +1431,20 @@ udprelay_begin(uv_loop_t *loop, const char *server_host, uint16_t server_port,
     const union sockaddr_universal *remote_addr,
     const struct ss_host_port *tunnel_addr,
 #endif
-    int mtu, int timeout, struct cipher_env_t *cipher_env,
+#ifdef MODULE_REMOTE
+    struct server_users *users,
+#endif
+    int mtu, int timeout, size_t max_associations, struct cipher_env_t *cipher_env,
     const char *protocol, const char *protocol_param)
 {
     struct udp_listener_ctx_t *server_ctx;
     int serverfd;
-    struct server_info_t server_info = { 0 };
+#ifdef MODULE_REMOTE
+    struct server_info_t *server_info;
+#else
+    struct server_info_t server_info_local = { 0 };
+    struct server_info_t *server_info = &server_info_local;
+#endif
 
     // Initialize MTU
     if (mtu > 0) {
@@ -1335,65 +1464,114 @@ udprelay_begin(uv_loop_t *loop, const char *server_host, uint16_t server_port,
     }
 
     server_ctx->cipher_env = cipher_env;
-#ifdef MODULE_REMOTE
-    //server_ctx->loop = loop;
-#endif
     server_ctx->timeout    = max(timeout, MIN_UDP_TIMEOUT);
-    server_ctx->connections = cstl_set_container_create(tunnel_ctx_compare_for_c_set, NULL);
+    server_ctx->ref_count  = 1;
+    server_ctx->nat        = udp_nat_create(max_associations ? max_associations : UDP_DEFAULT_MAX_ASSOCIATIONS,
+                                            (uint64_t)server_ctx->timeout, uv_now(loop));
+    uv_timer_init(loop, &server_ctx->expiry);
+    server_ctx->recv_buf   = (char *) malloc(UDP_RECV_BATCH * UDP_RECV_BUF_SIZE);
+    while (server_ctx->spare_count < UDP_PACKET_SLOTS) {
+        server_ctx->spare_packets[server_ctx->spare_count++] = buffer_create(UDP_PACKET_SLOT_SIZE);
+    }
+    uv_check_init(loop, &server_ctx->tx_flusher);
 #ifdef MODULE_LOCAL
     server_ctx->remote_addr     = *remote_addr;
+    if (tunnel_addr) {
+        server_ctx->tunnel_addr = *tunnel_addr;
+    }
+#endif
     //SSR beg
     server_ctx->protocol_plugin = new_obfs_instance(protocol);
     if (server_ctx->protocol_plugin) {
         server_ctx->protocol_global = server_ctx->protocol_plugin->init_data();
     }
+#ifdef MODULE_REMOTE
+    // each association makes a protocol instance of its own from these.
+    string_safe_assign(&server_ctx->protocol, protocol);
+    server_info = &server_ctx->server_info;
+    server_info->users = users;
+#endif
 
-    strcpy(server_info.host, server_host);
-    server_info.port = server_port;
-    server_info.g_data = server_ctx->protocol_global;
-    server_info.param = (char *)protocol_param;
-    server_info.key = enc_get_key(cipher_env);
-    server_info.key_len = (uint16_t) enc_get_key_len(cipher_env);
+    server_info->host = server_host ? server_host : "";
+    server_info->port = server_port;
+    server_info->g_data = server_ctx->protocol_global;
+    server_info->param = (char *)protocol_param;
+    server_info->key = enc_get_key(cipher_env);
+    server_info->key_len = (uint16_t) enc_get_key_len(cipher_env);
+    server_info->cipher_env = cipher_env;
 
     if (server_ctx->protocol_plugin) {
-        server_ctx->protocol_plugin->set_server_info(server_ctx->protocol_plugin, &server_info);
+        server_ctx->protocol_plugin->set_server_info(server_ctx->protocol_plugin, server_info);
+#ifdef MODULE_REMOTE
+        if (server_ctx->protocol_plugin->server_udp_post_decrypt == NULL) {
+            LOGE("[udp] protocol \"%s\" does not relay UDP, every datagram will be dropped", protocol);
+        }
+#endif
     }
     //SSR end
-    if (tunnel_addr) {
-        server_ctx->tunnel_addr = *tunnel_addr;
-    }
-#endif
 
-    uv_udp_recv_start(&server_ctx->io, udp_uv_alloc_buffer, udp_listener_recv_cb);
+    uv_udp_recv_start(&server_ctx->io, udp_listener_alloc_cb, udp_listener_recv_cb);
     
     return server_ctx;
 }
 
-static void udp_local_listener_close_done_cb(uv_handle_t* handle) {
-    struct udp_listener_ctx_t *server_ctx = CONTAINER_OF(handle, struct udp_listener_ctx_t, io);
-    cstl_set_container_destroy(server_ctx->connections);
+static void udp_listener_release(struct udp_listener_ctx_t *server_ctx) {
+    if (--server_ctx->ref_count > 0) {
+        return;
+    }
+    while (server_ctx->spare_count > 0) {
+        buffer_release(server_ctx->spare_packets[--server_ctx->spare_count]);
+    }
+    while (server_ctx->spare_sends) {
+        struct udp_send_ctx_t *ctx = server_ctx->spare_sends;
+        server_ctx->spare_sends = ctx->next;
+        free(ctx);
+    }
+    free(server_ctx->recv_buf);
+    udp_nat_destroy(server_ctx->nat);
 
-#ifdef MODULE_LOCAL
     // SSR beg
     if (server_ctx->protocol_plugin) {
         free_obfs_instance(server_ctx->protocol_plugin);
         server_ctx->protocol_plugin = NULL;
     }
-    // SSR end
+    object_safe_free(&server_ctx->protocol_global);
+#ifdef MODULE_REMOTE
+    object_safe_free((void **)&server_ctx->protocol);
 #endif
+    // SSR end
 
     free(server_ctx);
 }
 
-void connection_release(const void *obj, void *p) {
-    (void)p;
-    udp_remote_shutdown((struct udp_remote_ctx_t *)obj);
+static void udp_local_listener_close_done_cb(uv_handle_t* handle) {
+    struct udp_listener_ctx_t *server_ctx = CONTAINER_OF(handle, struct udp_listener_ctx_t, io);
+    udp_listener_release(server_ctx);
+}
+
+static void udp_tx_flusher_close_done_cb(uv_handle_t* handle) {
+    struct udp_listener_ctx_t *server_ctx = CONTAINER_OF(handle, struct udp_listener_ctx_t, tx_flusher);
+    udp_listener_release(server_ctx);
+}
+
+static void udp_expiry_close_done_cb(uv_handle_t* handle) {
+    struct udp_listener_ctx_t *server_ctx = CONTAINER_OF(handle, struct udp_listener_ctx_t, expiry);
+    udp_listener_release(server_ctx);
 }
 
 void udprelay_shutdown(struct udp_listener_ctx_t *server_ctx) {
     if (server_ctx == NULL) {
         return;
     }
-    cstl_set_container_traverse(server_ctx->connections, &connection_release, NULL);
+    // closes every association, they let go of server_ctx once closed.
+    udp_nat_expire(server_ctx->nat, 0, true, udp_remote_expired_cb, NULL);
+    server_ctx->ref_count++;
+    uv_timer_stop(&server_ctx->expiry);
+    uv_close((uv_handle_t *)&server_ctx->expiry, udp_expiry_close_done_cb);
+    udp_tx_flush(server_ctx);
+    server_ctx->ref_count++;
+    uv_close((uv_handle_t *)&server_ctx->tx_flusher, udp_tx_flusher_close_done_cb);
+    // or the rest of a recvmmsg() batch is still handed over.
+    uv_udp_recv_stop(&server_ctx->io);
     uv_close((uv_handle_t *)&server_ctx->io, udp_local_listener_close_done_cb);
 }
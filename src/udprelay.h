@@ -28,6 +28,7 @@
 struct ss_host_port;
 struct udp_listener_ctx_t;
 struct cipher_env_t;
+struct server_users;
 union sockaddr_universal;
 
 struct udp_listener_ctx_t * udprelay_begin(uv_loop_t *loop, const char *server_host, uint16_t server_port,
@@ -35,7 +36,10 @@ struct udp_listener_ctx_t * udprelay_begin(uv_loop_t *loop, const char *server_h
     const union sockaddr_universal *remote_addr,
     const struct ss_host_port *tunnel_addr,
 #endif
-    int mtu, int timeout, struct cipher_env_t *cipher_env,
+#ifdef MODULE_REMOTE
+    struct server_users *users,
+#endif
+    int mtu, int timeout, size_t max_associations, struct cipher_env_t *cipher_env,
     const char *protocol, const char *protocol_param);
 
 void udprelay_shutdown(struct udp_listener_ctx_t *server_ctx);